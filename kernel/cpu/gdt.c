@@ -9,9 +9,15 @@
 #include <system.h>
 #include <logging.h>
 #include <tss.h>
+#include <smp.h>
 
 static void write_tss(int32_t, uint16_t, uint32_t);
-tss_entry_t tss_entry;
+
+extern void sysenter_entry(void);
+
+#define MSR_SYSENTER_CS  0x174
+#define MSR_SYSENTER_ESP 0x175
+#define MSR_SYSENTER_EIP 0x176
 
 /*
  * Global Descriptor Table Entry
@@ -36,14 +42,26 @@ struct gdt_ptr {
 	unsigned int base;
 } __attribute__((packed));
 
-struct gdt_entry	gdt[6];
-struct gdt_ptr		gp;
+#define GDT_ENTRIES 7
+
+/*
+ * Every processor gets its own table, so that it can have its own
+ * TSS and its own per-CPU segment behind the same selectors.
+ */
+static struct {
+	struct gdt_entry entries[GDT_ENTRIES];
+	struct gdt_ptr   pointer;
+	tss_entry_t      tss;
+} gdts[MAX_CPUS];
+
+/* The table gdt_set_gate() writes to */
+static int gdt_cpu = 0;
 
 /**
  * (ASM) gdt_flush
- * Reloads the segment registers
+ * Loads a GDT and reloads the segment registers
  */
-extern void gdt_flush(void);
+extern void gdt_flush(struct gdt_ptr * pointer);
 
 /**
  * Set a GDT descriptor
@@ -62,6 +80,7 @@ gdt_set_gate(
 		unsigned char access,
 		unsigned char gran
 		) {
+	struct gdt_entry * gdt = gdts[gdt_cpu].entries;
 	/* Base Address */
 	gdt[num].base_low =		(base & 0xFFFF);
 	gdt[num].base_middle =	(base >> 16) & 0xFF;
@@ -75,15 +94,43 @@ gdt_set_gate(
 	gdt[num].access = access;
 }
 
+static void wrmsr(uint32_t msr, uint32_t value) {
+	asm volatile ("wrmsr" : : "c"(msr), "a"(value), "d"(0));
+}
+
+static int cpu_has_sep(void) {
+	uint32_t eax = 1, ebx, ecx, edx;
+	asm volatile ("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+	return (edx & (1 << 11)) ? 1 : 0;
+}
+
 /*
- * gdt_install
- * Install the kernel's GDTs
+ * Set up SYSENTER for this processor. It loads its stack pointer
+ * from an MSR which can't follow the current process around, so
+ * point it at the TSS's esp0 instead and let sysenter_entry load
+ * the real one from there.
+ */
+static void sysenter_install(void) {
+	if (!cpu_has_sep()) {
+		debug_print(WARNING, "No SYSENTER on processor %d; system calls will all use int 0x7F", gdt_cpu);
+		return;
+	}
+	wrmsr(MSR_SYSENTER_CS,  0x08);
+	wrmsr(MSR_SYSENTER_ESP, (uintptr_t)&gdts[gdt_cpu].tss.esp0);
+	wrmsr(MSR_SYSENTER_EIP, (uintptr_t)&sysenter_entry);
+}
+
+/*
+ * gdt_install_cpu
+ * Install the GDT for a processor, and point its %gs at `cpu`
  */
 void
-gdt_install(void) {
+gdt_install_cpu(cpu_t * cpu) {
+	gdt_cpu = cpu->id;
+	cpu->self = cpu;
 	/* GDT pointer and limits */
-	gp.limit = (sizeof(struct gdt_entry) * 6) - 1;
-	gp.base = (unsigned int)&gdt;
+	gdts[gdt_cpu].pointer.limit = (sizeof(struct gdt_entry) * GDT_ENTRIES) - 1;
+	gdts[gdt_cpu].pointer.base  = (unsigned int)&gdts[gdt_cpu].entries;
 	/* NULL */
 	gdt_set_gate(0, 0, 0, 0, 0);
 	/* Code segment */
@@ -95,13 +142,26 @@ gdt_install(void) {
 	/* User data */
 	gdt_set_gate(4, 0, 0xFFFFFFFF, 0xF2, 0xCF);
 	write_tss(5, 0x10, 0x0);
+	/* Per-CPU data */
+	gdt_set_gate(6, (uintptr_t)cpu, sizeof(cpu_t) - 1, 0x92, 0x40);
 	/* Go go go */
-	gdt_flush();
+	gdt_flush(&gdts[gdt_cpu].pointer);
 	tss_flush();
+	sysenter_install();
+}
+
+/*
+ * gdt_install
+ * Install the kernel's GDTs (on the bootstrap processor)
+ */
+void
+gdt_install(void) {
+	cpus[0].id = 0;
+	gdt_install_cpu(&cpus[0]);
 }
 
 /**
- * Write a TSS (we only do this once)
+ * Write a TSS (once per processor)
  */
 static void
 write_tss(
@@ -109,28 +169,29 @@ write_tss(
 		uint16_t ss0,
 		uint32_t esp0
 		) {
-	uintptr_t base  = (uintptr_t)&tss_entry;
-	uintptr_t limit = base + sizeof(tss_entry);
+	tss_entry_t * tss_entry = &gdts[gdt_cpu].tss;
+	uintptr_t base  = (uintptr_t)tss_entry;
+	uintptr_t limit = base + sizeof(tss_entry_t);
 
 	/* Add the TSS descriptor to the GDT */
 	gdt_set_gate(num, base, limit, 0xE9, 0x00);
 
-	memset(&tss_entry, 0x0, sizeof(tss_entry));
+	memset(tss_entry, 0x0, sizeof(tss_entry_t));
 
-	tss_entry.ss0    = ss0;
-	tss_entry.esp0   = esp0;
+	tss_entry->ss0    = ss0;
+	tss_entry->esp0   = esp0;
 	/* Zero out the descriptors */
-	tss_entry.cs     = 0x0b;
-	tss_entry.ss     =
-		tss_entry.ds =
-		tss_entry.es =
-		tss_entry.fs =
-		tss_entry.gs = 0x13;
-	tss_entry.iomap_base = sizeof(tss_entry);
+	tss_entry->cs     = 0x0b;
+	tss_entry->ss     =
+		tss_entry->ds =
+		tss_entry->es =
+		tss_entry->fs =
+		tss_entry->gs = 0x13;
+	tss_entry->iomap_base = sizeof(tss_entry_t);
 }
 
 /**
- * Set the kernel stack.
+ * Set the kernel stack for this processor.
  *
  * @param stack Pointer to a the stack pointer for the kernel.
  */
@@ -138,6 +199,6 @@ void
 set_kernel_stack(
 		uintptr_t stack
 		) {
-	tss_entry.esp0 = stack;
+	gdts[this_cpu()->id].tss.esp0 = stack;
 }
 
@@ -8,6 +8,9 @@
  */
 #include <system.h>
 #include <logging.h>
+#include <smp.h>
+#include <process.h>
+#include <trace.h>
 
 extern void _irq0(void);
 extern void _irq1(void);
@@ -87,6 +90,10 @@ void irq_install(void) {
 }
 
 void irq_ack(size_t irq_no) {
+	if (ioapic_active) {
+		lapic_eoi();
+		return;
+	}
 	if (irq_no >= 8) {
 		outportb(0xA0, 0x20);
 	}
@@ -101,10 +108,12 @@ void irq_handler(struct regs *r) {
 	} else {
 		handler = irq_routines[r->int_no - 32];
 	}
+	TRACE(TRACE_IRQ, r->int_no - 32, 0);
 	if (handler) {
 		handler(r);
 	} else {
 		irq_ack(r->int_no - 32);
 	}
+	check_reschedule();
 	IRQ_RES;
 }
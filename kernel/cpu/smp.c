@@ -0,0 +1,817 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2014 Kevin Lange
+ *
+ * Multiprocessor support
+ *
+ * Finds the processors and the I/O APIC in the ACPI MADT, routes
+ * the legacy interrupts through the I/O APIC and starts the other
+ * processors with INIT-SIPI-SIPI. Every processor schedules from
+ * its own ready queue (see process.c) and gets its ticks from its
+ * local APIC timer; the bootstrap processor keeps the PIT.
+ *
+ * With a TSC to measure time against, the local APIC timers run in
+ * one-shot mode, so that they can also go off between ticks for
+ * sleepers that are due then (timer_alarm()).
+ *
+ * Without a MADT, or with `nosmp` on the command line, we stay on
+ * the PIC with a single processor.
+ */
+#include <system.h>
+#include <process.h>
+#include <logging.h>
+#include <args.h>
+#include <smp.h>
+#include <profile.h>
+
+cpu_t cpus[MAX_CPUS];
+int   cpu_count = 1;
+int   ioapic_active = 0;
+
+/* The kernel lock; the bootstrap processor holds it from the start */
+static volatile uint8_t kernel_lock = 1;
+static volatile int     kernel_lock_owner = 0;
+
+/* Processors that still have to acknowledge a TLB shootdown */
+static volatile int tlb_pending = 0;
+
+/* Local APIC registers */
+#define LAPIC_ID            0x020
+#define LAPIC_TPR           0x080
+#define LAPIC_EOI           0x0B0
+#define LAPIC_SVR           0x0F0
+#define LAPIC_ICR_LOW       0x300
+#define LAPIC_ICR_HIGH      0x310
+#define LAPIC_TIMER         0x320
+#define LAPIC_LINT0         0x350
+#define LAPIC_LINT1         0x360
+#define LAPIC_ERROR         0x370
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE  0x3E0
+
+#define LAPIC_ENABLE        0x100
+#define LAPIC_MASKED        0x10000
+#define LAPIC_PERIODIC      0x20000
+#define LAPIC_EXTINT        0x700
+#define LAPIC_NMI           0x400
+#define LAPIC_ICR_PENDING   0x1000
+#define LAPIC_ICR_INIT      0x4500
+#define LAPIC_ICR_STARTUP   0x4600
+
+/* I/O APIC redirection entries */
+#define IOAPIC_VERSION      0x01
+#define IOAPIC_REDIRECT     0x10
+#define IOAPIC_ACTIVE_LOW   (1 << 13)
+#define IOAPIC_LEVEL        (1 << 15)
+#define IOAPIC_MASKED       (1 << 16)
+
+/* Where the firmware tables are mapped while we read them */
+#define ACPI_WINDOW         0xFF400000
+#define ACPI_WINDOW_PAGES   16
+
+/* Must match AP_TRAMPOLINE in start.s */
+#define AP_TRAMPOLINE       0x8000
+
+static uintptr_t lapic_base = 0;
+static uintptr_t ioapic_base = 0;
+static uint32_t  ioapic_gsi_base = 0;
+static uint32_t  lapic_ticks = 0; /* Timer counts per scheduler tick */
+static int       lapic_oneshot = 0;
+
+/* ISA interrupt overrides from the MADT */
+static uint32_t  irq_gsi[16];
+static uint16_t  irq_flags[16];
+
+static uint8_t   lapic_ids[MAX_CPUS];
+static int       lapic_count = 0;
+
+static volatile int ap_booting = 0;
+
+static void lapic_timer_arm(cpu_t * cpu);
+
+extern void idt_load(void);
+extern void _isr64(void);
+extern void _isr65(void);
+extern void _isr_tlb(void);
+extern void _isr_fpu(void);
+extern void _isr_spurious(void);
+
+extern char ap_trampoline[];
+extern char ap_trampoline_end[];
+extern char ap_cr3[];
+extern char ap_cr4[];
+extern char ap_stack[];
+extern char ap_entry[];
+
+#define TRAMPOLINE_FIELD(field) (*(uint32_t *)(AP_TRAMPOLINE + ((uintptr_t)field - (uintptr_t)ap_trampoline)))
+
+struct acpi_rsdp {
+	char     signature[8];
+	uint8_t  checksum;
+	char     oem[6];
+	uint8_t  revision;
+	uint32_t rsdt;
+} __attribute__((packed));
+
+struct acpi_header {
+	char     signature[4];
+	uint32_t length;
+	uint8_t  revision;
+	uint8_t  checksum;
+	char     oem[6];
+	char     oem_table[8];
+	uint32_t oem_revision;
+	uint32_t creator;
+	uint32_t creator_revision;
+} __attribute__((packed));
+
+struct acpi_madt {
+	struct acpi_header header;
+	uint32_t lapic;
+	uint32_t flags;
+	uint8_t  entries[];
+} __attribute__((packed));
+
+/*
+ * Spin locks for data that is touched without the kernel lock
+ */
+void spin_lock_irq(uint8_t volatile * lock, uint32_t * flags) {
+	asm volatile ("pushf\npop %0\ncli" : "=r"(*flags) :: "memory");
+	while (__sync_lock_test_and_set(lock, 0x01)) {
+		while (*lock) {
+			asm volatile ("pause");
+		}
+	}
+}
+
+void spin_unlock_irq(uint8_t volatile * lock, uint32_t flags) {
+	__sync_lock_release(lock);
+	if (flags & 0x200) {
+		IRQ_RES;
+	}
+}
+
+static inline uint32_t lapic_read(uint32_t reg) {
+	return *(volatile uint32_t *)(lapic_base + reg);
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+	*(volatile uint32_t *)(lapic_base + reg) = value;
+}
+
+static uint32_t ioapic_read(uint32_t reg) {
+	*(volatile uint32_t *)ioapic_base = reg;
+	return *(volatile uint32_t *)(ioapic_base + 0x10);
+}
+
+static void ioapic_write(uint32_t reg, uint32_t value) {
+	*(volatile uint32_t *)ioapic_base = reg;
+	*(volatile uint32_t *)(ioapic_base + 0x10) = value;
+}
+
+void lapic_eoi(void) {
+	lapic_write(LAPIC_EOI, 0);
+}
+
+/*
+ * Send an interrupt to another processor.
+ */
+static void lapic_ipi(uint8_t lapic_id, uint32_t command) {
+	uint32_t flags;
+	asm volatile ("pushf\npop %0\ncli" : "=r"(flags));
+	lapic_write(LAPIC_ICR_HIGH, (uint32_t)lapic_id << 24);
+	lapic_write(LAPIC_ICR_LOW, command);
+	while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) {
+		asm volatile ("pause");
+	}
+	if (flags & 0x200) {
+		IRQ_RES;
+	}
+}
+
+static void tlb_check(cpu_t * cpu);
+static void fpu_check(cpu_t * cpu);
+
+/*
+ * Take the kernel lock, unless this processor already has it.
+ * Called with interrupts disabled on the way in to the kernel.
+ */
+void kernel_enter(void) {
+	cpu_t * cpu = this_cpu();
+	if (cpu->halted) {
+		/* Woken up from the idle task's hlt */
+		cpu->halted = 0;
+		cpu->idle_wakeups++;
+		cpu->idle_usec += timer_usec() - cpu->halted_at;
+	}
+	if (kernel_lock_owner == cpu->id) {
+		return;
+	}
+	while (__sync_lock_test_and_set(&kernel_lock, 0x01)) {
+		while (kernel_lock) {
+			/* Whoever has it may be waiting for us to flush */
+			tlb_check(cpu);
+			fpu_check(cpu);
+			asm volatile ("pause");
+		}
+	}
+	kernel_lock_owner = cpu->id;
+}
+
+/*
+ * Let go of the kernel lock (on the way out to user mode, or to halt).
+ */
+void kernel_leave(void) {
+	if (kernel_lock_owner != this_cpu()->id) {
+		return;
+	}
+	kernel_lock_owner = -1;
+	__sync_lock_release(&kernel_lock);
+}
+
+static void tlb_check(cpu_t * cpu) {
+	if (__sync_lock_test_and_set(&cpu->tlb_flush, 0)) {
+		asm volatile (
+				"movl %%cr3, %%eax\n"
+				"movl %%eax, %%cr3\n"
+				::: "%eax");
+		__sync_fetch_and_sub(&tlb_pending, 1);
+	}
+}
+
+void tlb_shootdown_handler(void) {
+	tlb_check(this_cpu());
+	lapic_eoi();
+}
+
+/*
+ * Make the other processors running in `dir` drop their TLBs,
+ * and wait until they have. The caller holds the kernel lock.
+ */
+void tlb_shootdown(page_directory_t * dir) {
+	if (cpu_count < 2) {
+		return;
+	}
+	uint32_t flags;
+	asm volatile ("pushf\npop %0\ncli" : "=r"(flags));
+	cpu_t * me = this_cpu();
+	for (int i = 0; i < cpu_count; ++i) {
+		cpu_t * cpu = &cpus[i];
+		if (cpu == me || !cpu->online) continue;
+		if (dir != kernel_directory && cpu->directory != dir) continue;
+		__sync_fetch_and_add(&tlb_pending, 1);
+		cpu->tlb_flush = 1;
+		lapic_ipi(cpu->lapic_id, TLB_VECTOR);
+	}
+	while (tlb_pending) {
+		asm volatile ("pause");
+	}
+	if (flags & 0x200) {
+		IRQ_RES;
+	}
+}
+
+static void fpu_check(cpu_t * cpu) {
+	if (cpu->fpu_flush) {
+		fpu_flush();
+		__sync_lock_release(&cpu->fpu_flush);
+	}
+}
+
+void fpu_flush_handler(void) {
+	fpu_check(this_cpu());
+	lapic_eoi();
+}
+
+/*
+ * Have `cpu` save the FPU context it is holding back to its
+ * owner, and wait until it has. The caller holds the kernel lock.
+ */
+void fpu_shootdown(cpu_t * cpu) {
+	uint32_t flags;
+	asm volatile ("pushf\npop %0\ncli" : "=r"(flags));
+	cpu->fpu_flush = 1;
+	lapic_ipi(cpu->lapic_id, FPU_VECTOR);
+	while (cpu->fpu_flush) {
+		asm volatile ("pause");
+	}
+	if (flags & 0x200) {
+		IRQ_RES;
+	}
+}
+
+/*
+ * Get another processor to look at its ready queue.
+ */
+void smp_reschedule(cpu_t * cpu) {
+	if (cpu_count < 2 || cpu == this_cpu() || !cpu->online) {
+		return;
+	}
+	lapic_ipi(cpu->lapic_id, RESCHEDULE_VECTOR);
+}
+
+/* Local APIC timer ticks and alarms */
+static void lapic_tick(struct regs * r) {
+	lapic_eoi();
+	if (!lapic_oneshot) {
+		profile_tick(r);
+		sched_tick((r->cs & 0x3) == 0x3);
+		return;
+	}
+
+	cpu_t * cpu = this_cpu();
+	uint64_t now = timer_usec();
+	int tick = 0;
+	if (cpu->id && !cpu->tickless && now >= cpu->next_tick) {
+		cpu->next_tick = now + SUBTICKS_PER_TICK / TIMER_HZ;
+		tick = 1;
+	}
+	if (cpu->alarm && now >= cpu->alarm) {
+		cpu->alarm = 0;
+		timer_update();
+		wakeup_sleepers(now / SUBTICKS_PER_TICK, now % SUBTICKS_PER_TICK);
+	}
+	lapic_timer_arm(cpu);
+
+	if (tick) {
+		profile_tick(r);
+		sched_tick((r->cs & 0x3) == 0x3);
+	} else {
+		check_reschedule();
+	}
+}
+
+/* Reschedule requests */
+static void lapic_reschedule(struct regs * r) {
+	lapic_eoi();
+	switch_task(1);
+}
+
+/*
+ * Map the firmware table at `physical` into the ACPI window.
+ */
+static void * acpi_map(uintptr_t physical, size_t length) {
+	uintptr_t base = physical & 0xFFFFF000;
+	uint32_t pages = (physical + length - base + 0xFFF) / 0x1000;
+	if (pages > ACPI_WINDOW_PAGES) {
+		debug_print(WARNING, "ACPI table at 0x%x is too large (%d bytes)", physical, length);
+		return NULL;
+	}
+	for (uint32_t i = 0; i < pages; ++i) {
+		/* Not dma_frame(); this memory belongs to the firmware and isn't ours to mark */
+		page_t * page = get_page(ACPI_WINDOW + i * 0x1000, 1, kernel_directory);
+		page->present = 1;
+		page->rw      = 0;
+		page->user    = 0;
+		page->frame   = base / 0x1000 + i;
+		invalidate_tables_at(ACPI_WINDOW + i * 0x1000);
+	}
+	return (void *)(ACPI_WINDOW + physical - base);
+}
+
+static int acpi_checksum(void * table, size_t length) {
+	uint8_t sum = 0;
+	for (size_t i = 0; i < length; ++i) {
+		sum += ((uint8_t *)table)[i];
+	}
+	return sum == 0;
+}
+
+static int signature_is(char * signature, char * expected) {
+	for (size_t i = 0; expected[i]; ++i) {
+		if (signature[i] != expected[i]) return 0;
+	}
+	return 1;
+}
+
+static uintptr_t find_rsdp_in(uintptr_t start, uintptr_t end) {
+	/* Low memory is identity-mapped */
+	for (uintptr_t p = start; p < end; p += 16) {
+		struct acpi_rsdp * rsdp = (struct acpi_rsdp *)p;
+		if (signature_is(rsdp->signature, "RSD PTR ") && acpi_checksum(rsdp, 20)) {
+			return p;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Find the MADT, and return its physical address and length.
+ */
+static uintptr_t find_madt(uint32_t * length) {
+	/* The first kilobyte of the EBDA, then the BIOS area */
+	uintptr_t ebda = (uintptr_t)(*(uint16_t *)acpi_map(0x40E, 2)) << 4;
+	uintptr_t rsdp_phys = 0;
+	if (ebda >= 0x80000 && ebda < 0xA0000) {
+		rsdp_phys = find_rsdp_in(ebda, ebda + 0x400);
+	}
+	if (!rsdp_phys) {
+		rsdp_phys = find_rsdp_in(0xE0000, 0x100000);
+	}
+	if (!rsdp_phys) {
+		return 0;
+	}
+
+	uintptr_t rsdt_phys = ((struct acpi_rsdp *)rsdp_phys)->rsdt;
+	struct acpi_header * rsdt = acpi_map(rsdt_phys, sizeof(struct acpi_header));
+	uint32_t rsdt_length = rsdt->length;
+	rsdt = acpi_map(rsdt_phys, rsdt_length);
+	if (!rsdt || !signature_is(rsdt->signature, "RSDT") || !acpi_checksum(rsdt, rsdt_length)) {
+		return 0;
+	}
+
+	uint32_t count = (rsdt_length - sizeof(struct acpi_header)) / 4;
+	for (uint32_t i = 0; i < count; ++i) {
+		/* The window only holds one table at a time */
+		uint32_t table = *(uint32_t *)acpi_map(rsdt_phys + sizeof(struct acpi_header) + i * 4, 4);
+		struct acpi_header * header = acpi_map(table, sizeof(struct acpi_header));
+		if (signature_is(header->signature, "APIC")) {
+			*length = header->length;
+			return table;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Collect the processors, the I/O APIC and the interrupt overrides.
+ */
+static int parse_madt(void) {
+	for (int i = 0; i < 16; ++i) {
+		irq_gsi[i]   = i;
+		irq_flags[i] = 0;
+	}
+
+	uint32_t length = 0;
+	uintptr_t madt_phys = find_madt(&length);
+	if (!madt_phys) {
+		debug_print(NOTICE, "No ACPI MADT; staying on one processor");
+		return 0;
+	}
+	struct acpi_madt * madt = acpi_map(madt_phys, length);
+	if (!madt || !acpi_checksum(madt, length)) {
+		debug_print(WARNING, "Bad ACPI MADT");
+		return 0;
+	}
+
+	lapic_base = madt->lapic;
+	uint8_t * entry = madt->entries;
+	while (entry + 2 <= (uint8_t *)madt + length && entry[1] >= 2) {
+		switch (entry[0]) {
+			case 0: /* Processor */
+				if ((*(uint32_t *)&entry[4] & 1) && lapic_count < MAX_CPUS) {
+					lapic_ids[lapic_count++] = entry[3];
+				}
+				break;
+			case 1: /* I/O APIC */
+				if (!ioapic_base) {
+					ioapic_base     = *(uint32_t *)&entry[4];
+					ioapic_gsi_base = *(uint32_t *)&entry[8];
+				}
+				break;
+			case 2: /* Interrupt source override */
+				if (entry[2] == 0 && entry[3] < 16) {
+					irq_gsi[entry[3]]   = *(uint32_t *)&entry[4];
+					irq_flags[entry[3]] = *(uint16_t *)&entry[8];
+				}
+				break;
+		}
+		entry += entry[1];
+	}
+
+	/* Done with the window */
+	for (int i = 0; i < ACPI_WINDOW_PAGES; ++i) {
+		page_t * page = get_page(ACPI_WINDOW + i * 0x1000, 0, kernel_directory);
+		if (page) memset(page, 0, sizeof(page_t));
+	}
+	invalidate_page_tables();
+
+	debug_print(NOTICE, "MADT: %d processor%s, local APIC at 0x%x, I/O APIC at 0x%x", lapic_count, lapic_count == 1 ? "" : "s", lapic_base, ioapic_base);
+	return lapic_base && ioapic_base;
+}
+
+/*
+ * Identity-map a page of APIC registers, uncached.
+ */
+static void map_mmio(uintptr_t physical) {
+	page_t * page = get_page(physical, 1, kernel_directory);
+	dma_frame(page, 1, 1, physical);
+	page->writethrough = 1;
+	page->cachedisable = 1;
+	invalidate_tables_at(physical);
+}
+
+static void lapic_setup(void) {
+	lapic_write(LAPIC_TPR, 0);
+	lapic_write(LAPIC_LINT0, LAPIC_MASKED);
+	lapic_write(LAPIC_LINT1, LAPIC_NMI);
+	lapic_write(LAPIC_ERROR, LAPIC_MASKED);
+	lapic_write(LAPIC_SVR, LAPIC_ENABLE | SPURIOUS_VECTOR);
+}
+
+/*
+ * Set the one-shot timer for whichever comes first: this
+ * processor's next tick (the bootstrap processor has the PIT
+ * for that) or its alarm.
+ */
+static void lapic_timer_arm(cpu_t * cpu) {
+	uint64_t when = cpu->alarm;
+	if (cpu->id && !cpu->tickless && (!when || cpu->next_tick < when)) {
+		when = cpu->next_tick;
+	}
+	if (!when) {
+		lapic_write(LAPIC_TIMER_INITIAL, 0);
+		return;
+	}
+	uint64_t now = timer_usec();
+	uint64_t usec = (when > now) ? when - now : 0;
+	uint64_t count = usec * lapic_ticks / (SUBTICKS_PER_TICK / TIMER_HZ);
+	if (count < 1) count = 1;
+	if (count > 0xFFFFFFFF) count = 0xFFFFFFFF;
+	lapic_write(LAPIC_TIMER_INITIAL, (uint32_t)count);
+}
+
+static void lapic_timer_start(void) {
+	cpu_t * cpu = this_cpu();
+	lapic_write(LAPIC_TIMER_DIVIDE, 0x3); /* By 16 */
+	if (lapic_oneshot) {
+		lapic_write(LAPIC_TIMER, LAPIC_TIMER_VECTOR);
+		cpu->next_tick = timer_usec() + SUBTICKS_PER_TICK / TIMER_HZ;
+		lapic_timer_arm(cpu);
+	} else {
+		lapic_write(LAPIC_TIMER, LAPIC_PERIODIC | LAPIC_TIMER_VECTOR);
+		lapic_write(LAPIC_TIMER_INITIAL, lapic_ticks);
+	}
+}
+
+/*
+ * Have the local APIC timer go off at `usec` (see timer_usec()).
+ */
+void lapic_alarm(uint64_t usec) {
+	if (!lapic_oneshot) return;
+	uint32_t flags;
+	asm volatile ("pushf\npop %0\ncli" : "=r"(flags));
+	cpu_t * cpu = this_cpu();
+	if (!cpu->alarm || usec < cpu->alarm) {
+		cpu->alarm = usec;
+		lapic_timer_arm(cpu);
+	}
+	if (flags & 0x200) IRQ_RES;
+}
+
+static void ioapic_mask_all(void) {
+	uint32_t pins = ((ioapic_read(IOAPIC_VERSION) >> 16) & 0xFF) + 1;
+	for (uint32_t pin = 0; pin < pins; ++pin) {
+		ioapic_write(IOAPIC_REDIRECT + pin * 2, IOAPIC_MASKED);
+	}
+}
+
+/*
+ * Send the ISA interrupts to the bootstrap processor through the
+ * I/O APIC, at the same vectors the PIC used, and mask the PIC.
+ */
+static void ioapic_install(void) {
+	uint32_t pins = ((ioapic_read(IOAPIC_VERSION) >> 16) & 0xFF) + 1;
+	ioapic_mask_all();
+
+	for (int irq = 0; irq < 16; ++irq) {
+		if (irq == 2) continue; /* The cascade */
+		uint32_t pin = irq_gsi[irq] - ioapic_gsi_base;
+		if (irq_gsi[irq] < ioapic_gsi_base || pin >= pins) continue;
+
+		uint32_t low = 32 + irq;
+		if ((irq_flags[irq] & 0x3) == 0x3) {
+			low |= IOAPIC_ACTIVE_LOW;
+		}
+		if (((irq_flags[irq] >> 2) & 0x3) == 0x3) {
+			low |= IOAPIC_LEVEL;
+		}
+		ioapic_write(IOAPIC_REDIRECT + pin * 2 + 1, (uint32_t)cpus[0].lapic_id << 24);
+		ioapic_write(IOAPIC_REDIRECT + pin * 2, low);
+	}
+
+	outportb(0x21, 0xFF);
+	outportb(0xA1, 0xFF);
+	ioapic_active = 1;
+}
+
+static void ioapic_mask_irq(int irq, int masked) {
+	uint32_t reg = IOAPIC_REDIRECT + (irq_gsi[irq] - ioapic_gsi_base) * 2;
+	uint32_t low = ioapic_read(reg);
+	ioapic_write(reg, masked ? (low | IOAPIC_MASKED) : (low & ~IOAPIC_MASKED));
+}
+
+/* Back to the PIC, if the I/O APIC doesn't work out */
+static void ioapic_uninstall(void) {
+	ioapic_mask_all();
+	ioapic_active = 0;
+	lapic_write(LAPIC_LINT0, LAPIC_EXTINT);
+	outportb(0x21, 0x00);
+	outportb(0xA1, 0x00);
+}
+
+/*
+ * Dynamic ticks
+ *
+ * A processor with nothing to run doesn't need a tick. The idle
+ * task stops it before halting, leaving the local APIC timer set
+ * only for the next sleeper, and switch_next() starts it again
+ * once there is something to run. The bootstrap processor masks
+ * the PIT, and looks after sleepers further out than its alarm.
+ */
+void tick_stop(void) {
+	cpu_t * cpu = this_cpu();
+	if (!lapic_oneshot || cpu->tickless) return;
+	cpu->tickless = 1;
+	if (!cpu->id) {
+		ioapic_mask_irq(0, 1);
+		uint64_t next = sleep_next_wakeup();
+		if (next) {
+			lapic_alarm(next);
+		}
+	}
+	lapic_timer_arm(cpu);
+}
+
+void tick_restart(void) {
+	cpu_t * cpu = this_cpu();
+	if (!cpu->tickless) return;
+	cpu->tickless = 0;
+	timer_update();
+	if (!cpu->id) {
+		ioapic_mask_irq(0, 0);
+	} else {
+		cpu->next_tick = timer_usec() + SUBTICKS_PER_TICK / TIMER_HZ;
+		lapic_timer_arm(cpu);
+	}
+}
+
+/* PIT ticks since boot; only moves when the PIT interrupts */
+static unsigned long ticks_now(void) {
+	unsigned long a, b;
+	do {
+		a = *(volatile unsigned long *)&timer_ticks * TIMER_HZ + *(volatile unsigned long *)&timer_subticks / (SUBTICKS_PER_TICK / TIMER_HZ);
+		b = *(volatile unsigned long *)&timer_ticks * TIMER_HZ + *(volatile unsigned long *)&timer_subticks / (SUBTICKS_PER_TICK / TIMER_HZ);
+	} while (a != b);
+	return a;
+}
+
+/*
+ * Busy-wait `count` timer ticks, or give up if the timer isn't ticking.
+ */
+static int wait_ticks(unsigned long count, volatile int * until) {
+	unsigned long start = ticks_now();
+	for (uint32_t spins = 0; spins < 0x10000000; ++spins) {
+		if (ticks_now() - start >= count) return 0;
+		if (until && *until) return 0;
+		asm volatile ("pause");
+	}
+	return -1;
+}
+
+/*
+ * Count local APIC timer ticks over a few PIT ticks.
+ */
+static int lapic_calibrate(void) {
+	lapic_write(LAPIC_TIMER_DIVIDE, 0x3);
+	lapic_write(LAPIC_TIMER, LAPIC_MASKED);
+
+	/* Line up with a tick */
+	if (wait_ticks(1, NULL)) {
+		return 0;
+	}
+	lapic_write(LAPIC_TIMER_INITIAL, 0xFFFFFFFF);
+	if (wait_ticks(10, NULL)) {
+		return 0;
+	}
+	uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT);
+	lapic_write(LAPIC_TIMER_INITIAL, 0);
+
+	lapic_ticks = elapsed / 10;
+	debug_print(NOTICE, "Local APIC timer: %d counts per tick", lapic_ticks);
+	return lapic_ticks != 0;
+}
+
+/*
+ * Application processors start here, on their idle task's stack.
+ */
+static void ap_main(void) {
+	cpu_t * cpu = &cpus[ap_booting];
+	gdt_install_cpu(cpu);
+	idt_load();
+	current_directory = kernel_directory;
+
+	lapic_setup();
+	lapic_timer_start();
+	cpu->online = 1;
+
+	kernel_enter();
+	current_process = cpu->idle_task;
+	set_kernel_stack(cpu->idle_task->image.stack);
+	/* Make the first FPU use trap, so it loads the right context */
+	switch_fpu();
+
+	debug_print(NOTICE, "Processor %d (local APIC %d) is up", cpu->id, cpu->lapic_id);
+	switch_next();
+}
+
+static int boot_ap(uint8_t lapic_id) {
+	cpu_t * cpu = &cpus[cpu_count];
+	cpu->id       = cpu_count;
+	cpu->lapic_id = lapic_id;
+	cpu->online   = 0;
+	if (!cpu->ready_queue) {
+		cpu->ready_queue = list_create();
+	}
+	if (!cpu->idle_task) {
+		cpu->idle_task = spawn_kidle();
+	}
+
+	TRAMPOLINE_FIELD(ap_stack) = cpu->idle_task->image.stack;
+	ap_booting = cpu->id;
+
+	lapic_ipi(lapic_id, LAPIC_ICR_INIT);
+	wait_ticks(1, NULL);
+	for (int attempt = 0; attempt < 2 && !cpu->online; ++attempt) {
+		lapic_ipi(lapic_id, LAPIC_ICR_STARTUP | (AP_TRAMPOLINE >> 12));
+		wait_ticks(attempt ? 100 : 2, &cpu->online);
+	}
+
+	if (!cpu->online) {
+		debug_print(WARNING, "Processor with local APIC %d did not start", lapic_id);
+		return 0;
+	}
+	cpu_count++;
+	return 1;
+}
+
+void smp_install(void) {
+	if (args_present("nosmp")) {
+		return;
+	}
+	if (!parse_madt()) {
+		return;
+	}
+
+	map_mmio(lapic_base);
+	map_mmio(ioapic_base);
+
+	idt_set_gate(LAPIC_TIMER_VECTOR, _isr64, 0x08, 0x8E);
+	idt_set_gate(RESCHEDULE_VECTOR, _isr65, 0x08, 0x8E);
+	idt_set_gate(TLB_VECTOR, _isr_tlb, 0x08, 0x8E);
+	idt_set_gate(FPU_VECTOR, _isr_fpu, 0x08, 0x8E);
+	idt_set_gate(SPURIOUS_VECTOR, _isr_spurious, 0x08, 0x8E);
+	isrs_install_handler(LAPIC_TIMER_VECTOR, lapic_tick);
+	isrs_install_handler(RESCHEDULE_VECTOR, lapic_reschedule);
+
+	IRQ_OFF;
+	cpus[0].lapic_id = lapic_read(LAPIC_ID) >> 24;
+	cpus[0].online   = 1;
+	lapic_setup();
+	ioapic_install();
+	IRQ_RES;
+
+	if (!lapic_calibrate()) {
+		debug_print(WARNING, "The timer doesn't tick through the I/O APIC; staying on one processor");
+		IRQ_OFF;
+		ioapic_uninstall();
+		IRQ_RES;
+		return;
+	}
+
+	if (timer_precise) {
+		/* Our own timer is free for alarms */
+		lapic_oneshot = 1;
+		IRQ_OFF;
+		lapic_timer_start();
+		IRQ_RES;
+	}
+
+	if (lapic_count < 2) {
+		return;
+	}
+
+	/* Borrow a page of low memory for the trampoline */
+	size_t size = (uintptr_t)ap_trampoline_end - (uintptr_t)ap_trampoline;
+	uint8_t * saved = malloc(0x1000);
+	memcpy(saved, (void *)AP_TRAMPOLINE, 0x1000);
+	memcpy((void *)AP_TRAMPOLINE, ap_trampoline, size);
+
+	uint32_t cr4;
+	asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+	TRAMPOLINE_FIELD(ap_cr3)   = kernel_directory->physical_address;
+	TRAMPOLINE_FIELD(ap_cr4)   = cr4;
+	TRAMPOLINE_FIELD(ap_entry) = (uintptr_t)&ap_main;
+
+	for (int i = 0; i < lapic_count && cpu_count < MAX_CPUS; ++i) {
+		if (lapic_ids[i] == cpus[0].lapic_id) continue;
+		boot_ap(lapic_ids[i]);
+	}
+
+	memcpy((void *)AP_TRAMPOLINE, saved, 0x1000);
+	free(saved);
+
+	debug_print(NOTICE, "%d processors online", cpu_count);
+}
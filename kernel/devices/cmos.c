@@ -123,7 +123,7 @@ uint32_t secs_of_month(int months, int year) {
 	return days * 86400;
 }
 
-int gettimeofday(struct timeval * t, void *z) {
+static uint32_t read_cmos(void) {
 	uint16_t values[128];
 	cmos_dump(values);
 
@@ -135,8 +135,25 @@ int gettimeofday(struct timeval * t, void *z) {
 					(from_bcd(values[2])) * 60 +
 					from_bcd(values[0]) +
 					0;
-	t->tv_sec = time;
-	t->tv_usec = 0;
+	return time;
+}
+
+/*
+ * Wall clock seconds at uptime zero. The CMOS is only read once;
+ * after that the time of day follows the timer.
+ */
+uint32_t boot_time(void) {
+	static uint32_t boot = 0;
+	if (!boot) {
+		boot = read_cmos() - (uint32_t)(timer_usec() / 1000000);
+	}
+	return boot;
+}
+
+int gettimeofday(struct timeval * t, void *z) {
+	uint64_t usec = timer_usec();
+	t->tv_sec  = boot_time() + (uint32_t)(usec / 1000000);
+	t->tv_usec = (uint32_t)(usec % 1000000);
 	return 0;
 }
 
@@ -12,13 +12,15 @@
  * for the current process will be loaded or the FPU
  * will be reset for the new process.
  *
- * FPU states are per kernel thread.
+ * FPU states are per kernel thread. Each processor keeps
+ * track of whose context it is holding; a thread which moves
+ * to another processor has its context sent after it when it
+ * next uses the FPU (fpu_shootdown()).
  *
  */
 #include <system.h>
 #include <logging.h>
-
-process_t * fpu_thread = NULL;
+#include <smp.h>
 
 /**
  * Set the FPU control word
@@ -51,23 +53,25 @@ void disable_fpu(void) {
 	asm volatile ("mov %0, %%cr0" :: "r"(t));
 }
 
-/* Temporary aligned buffer for copying around FPU contexts */
-uint8_t saves[512] __attribute__((aligned(16)));
+/* Aligned buffers for copying around FPU contexts, one per processor */
+static uint8_t saves[MAX_CPUS][512] __attribute__((aligned(16)));
 
 /**
  * Restore the FPU for a process
  */
 void restore_fpu(process_t * proc) {
-	memcpy(&saves,(uint8_t *)&proc->thread.fp_regs,512);
-	asm volatile ("fxrstor %0" : "=m"(saves));
+	uint8_t * buf = saves[this_cpu()->id];
+	memcpy(buf,(uint8_t *)&proc->thread.fp_regs,512);
+	asm volatile ("fxrstor (%0)" :: "r"(buf) : "memory");
 }
 
 /**
  * Save the FPU for a process
  */
 void save_fpu(process_t * proc) {
-	asm volatile ("fxsave %0" : "=m"(saves));
-	memcpy((uint8_t *)&proc->thread.fp_regs,&saves,512);
+	uint8_t * buf = saves[this_cpu()->id];
+	asm volatile ("fxsave (%0)" :: "r"(buf) : "memory");
+	memcpy((uint8_t *)&proc->thread.fp_regs,buf,512);
 }
 
 /**
@@ -78,21 +82,46 @@ void init_fpu(void) {
 	set_fpu_cw(0x37F);
 }
 
+/**
+ * Give the context this processor is holding back to its owner.
+ * Called from an interrupt, without the kernel lock, when the
+ * owner wants to use the FPU on another processor.
+ */
+void fpu_flush(void) {
+	cpu_t * cpu = this_cpu();
+	if (!cpu->fpu_owner) return;
+	asm volatile ("clts");
+	save_fpu(cpu->fpu_owner);
+	cpu->fpu_saves++;
+	cpu->fpu_owner = NULL;
+	disable_fpu();
+}
+
 /**
  * Kernel trap for FPU usage when FPU is disabled
  */
 void invalid_op(struct regs * r) {
+	cpu_t * cpu = this_cpu();
+	process_t * fpu_thread = (process_t *)current_process;
 	/* First, turn the FPU on */
 	enable_fpu();
-	if (fpu_thread == current_process) {
-		/* If this is the tread that last used the FPU, do nothing */
+	if (cpu->fpu_owner == fpu_thread) {
+		/* If this is the thread that last used the FPU, its context is still loaded */
+		cpu->fpu_reloads_avoided++;
 		return;
 	}
-	if (fpu_thread) {
+	if (cpu->fpu_owner) {
 		/* If there is a thread that was using the FPU, save its state */
-		save_fpu(fpu_thread);
+		save_fpu(cpu->fpu_owner);
+		cpu->fpu_saves++;
 	}
-	fpu_thread = (process_t *)current_process;
+	for (int i = 0; i < cpu_count; ++i) {
+		if (&cpus[i] != cpu && cpus[i].fpu_owner == fpu_thread) {
+			/* We moved here from another processor, which is still holding our context */
+			fpu_shootdown(&cpus[i]);
+		}
+	}
+	cpu->fpu_owner = fpu_thread;
 	if (!fpu_thread->thread.fpu_enabled) {
 		/*
 		 * If the FPU has not been used in this thread previously,
@@ -104,13 +133,34 @@ void invalid_op(struct regs * r) {
 	}
 	/* Otherwise we restore the context for this thread. */
 	restore_fpu(fpu_thread);
+	cpu->fpu_restores++;
 }
 
-/* Called during a context switch; disable the FPU */
+/*
+ * Called during a context switch; disable the FPU. The context
+ * stays loaded until another thread uses the FPU, so switching
+ * between threads that don't (or back to the same one) costs
+ * no saves at all.
+ */
 void switch_fpu(void) {
+	cpu_t * cpu = this_cpu();
+	if (cpu->fpu_owner && cpu->fpu_owner == current_process) {
+		cpu->fpu_deferred++;
+	}
 	disable_fpu();
 }
 
+/*
+ * A process is going away; forget any context it left loaded.
+ */
+void fpu_release(process_t * proc) {
+	for (int i = 0; i < cpu_count; ++i) {
+		if (cpus[i].fpu_owner == proc) {
+			cpus[i].fpu_owner = NULL;
+		}
+	}
+}
+
 /* Enable the FPU context handling */
 void fpu_install(void) {
 	isrs_install_handler(6, &invalid_op);
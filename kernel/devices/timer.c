@@ -1,13 +1,29 @@
 /* vim: tabstop=4 shiftwidth=4 noexpandtab
  * This file is part of ToaruOS and is released under the terms
  * of the NCSA / University of Illinois License - see LICENSE.md
- * Copyright (C) 2011-2013 Kevin Lange
+ * Copyright (C) 2011-2014 Kevin Lange
  *
  * Programmable Interrupt Timer
+ *
+ * The PIT interrupts at TIMER_HZ to drive the scheduler on the
+ * bootstrap processor. Time itself is read from the TSC, which
+ * is calibrated against the PIT at boot; sleeps that end between
+ * two ticks are woken by a one-shot local APIC timer (timer_alarm).
+ * Without a TSC we fall back to counting PIT interrupts.
+ *
+ * While there is nothing to run, the tick is stopped altogether
+ * (see tick_stop() in smp.c).
+ *
+ * The same clock is published in the time page (see time_page.h),
+ * which every process can read without a system call.
  */
 #include <system.h>
 #include <logging.h>
 #include <process.h>
+#include <smp.h>
+#include <mem.h>
+#include <time_page.h>
+#include <profile.h>
 
 #define PIT_A 0x40
 #define PIT_B 0x41
@@ -18,9 +34,14 @@
 #define PIT_SCALE 1193180
 #define PIT_SET 0x36
 
+/* Channel 2, low then high byte, interrupt on terminal count */
+#define PIT_ONESHOT_C 0xB0
+#define PIT_GATE 0x61
+#define PIT_GATE_OUT 0x20
+
 #define TIMER_IRQ 0
 
-#define SUBTICKS_PER_TICK 100
+#define TSC_CALIBRATE_US 10000
 
 /*
  * Set the phase (in hertz) for the Programmable
@@ -37,10 +58,119 @@ timer_phase(
 }
 
 /*
- * Internal timer counters
+ * Internal timer counters; seconds and microseconds
+ * since boot as of the last PIT interrupt.
  */
 unsigned long timer_ticks = 0;
-unsigned char timer_subticks = 0;
+unsigned long timer_subticks = 0;
+
+int timer_precise = 0;
+
+static uint64_t tsc_base = 0;
+static uint32_t tsc_mhz  = 0; /* TSC counts per microsecond */
+static uint32_t tsc_mult = 0; /* Nanoseconds per TSC count << TIME_PAGE_SHIFT */
+static volatile uint64_t pit_usec = 0;
+
+static uint64_t rdtsc(void) {
+	uint32_t lo, hi;
+	asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+static int cpu_has_tsc(void) {
+	uint32_t eax = 1, ebx, ecx, edx;
+	asm volatile ("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+	return (edx & (1 << 4)) ? 1 : 0;
+}
+
+/*
+ * Count TSC cycles while PIT channel 2 counts down.
+ */
+static void tsc_calibrate(void) {
+	if (!cpu_has_tsc()) {
+		debug_print(NOTICE, "No TSC; timer resolution is one tick");
+		return;
+	}
+
+	uint32_t count = PIT_SCALE / (1000000 / TSC_CALIBRATE_US);
+
+	/* Gate channel 2 on, with the speaker off */
+	outportb(PIT_GATE, (inportb(PIT_GATE) & ~0x02) | 0x01);
+	outportb(PIT_CONTROL, PIT_ONESHOT_C);
+	outportb(PIT_C, count & PIT_MASK);
+	outportb(PIT_C, (count >> 8) & PIT_MASK);
+
+	uint64_t start = rdtsc();
+	for (uint32_t spins = 0; !(inportb(PIT_GATE) & PIT_GATE_OUT); ++spins) {
+		if (spins > 0x10000000) {
+			debug_print(WARNING, "PIT channel 2 never finished counting; not using the TSC");
+			return;
+		}
+	}
+	uint64_t end = rdtsc();
+
+	tsc_mhz = (uint32_t)((end - start) / TSC_CALIBRATE_US);
+	uint64_t mult = ((uint64_t)TSC_CALIBRATE_US * 1000 << TIME_PAGE_SHIFT) / (end - start);
+	if (!tsc_mhz || mult > 0xFFFFFFFF) {
+		/* Too slow to be worth using */
+		tsc_mhz = 0;
+		return;
+	}
+	tsc_mult = (uint32_t)mult;
+	tsc_base = start;
+	timer_precise = 1;
+	debug_print(NOTICE, "TSC runs at %d MHz", tsc_mhz);
+}
+
+/*
+ * Microseconds since boot.
+ */
+uint64_t timer_usec(void) {
+	if (timer_precise) {
+		return time_page_ns(tsc_mult, rdtsc() - tsc_base) / 1000;
+	}
+	uint64_t a, b;
+	do {
+		a = pit_usec;
+		b = pit_usec;
+	} while (a != b);
+	return a;
+}
+
+/*
+ * Bring timer_ticks and timer_subticks up to date.
+ */
+void timer_update(void) {
+	uint64_t now = timer_usec();
+	timer_ticks    = now / SUBTICKS_PER_TICK;
+	timer_subticks = now % SUBTICKS_PER_TICK;
+}
+
+/*
+ * Publish the clock in the time page. With a TSC, everything in it
+ * stays the same after boot; without one, it follows the tick.
+ */
+static void time_page_update(void) {
+	if (!time_page) return;
+	time_page->seq++;
+	asm volatile ("" ::: "memory");
+	time_page->tsc_mult  = timer_precise ? tsc_mult : 0;
+	time_page->tsc_base  = tsc_base;
+	time_page->coarse_ns = pit_usec * 1000;
+	time_page->boot_time = boot_time();
+	asm volatile ("" ::: "memory");
+	time_page->seq++;
+}
+
+/*
+ * Wake the processor at `usec` (as returned by timer_usec()),
+ * if that is before its next tick would.
+ */
+void timer_alarm(uint64_t usec) {
+	if (timer_precise) {
+		lapic_alarm(usec);
+	}
+}
 
 /*
  * IRQ handler for when the timer fires
@@ -49,24 +179,22 @@ void
 timer_handler(
 		struct regs *r
 		) {
-	if (++timer_subticks == SUBTICKS_PER_TICK) {
-		timer_ticks++;
-		timer_subticks = 0;
+	pit_usec += SUBTICKS_PER_TICK / TIMER_HZ;
+	timer_update();
+	if (!timer_precise) {
+		time_page_update();
 	}
 	irq_ack(TIMER_IRQ);
 
 	wakeup_sleepers(timer_ticks, timer_subticks);
-	switch_task(1);
+	profile_tick(r);
+	sched_tick((r->cs & 0x3) == 0x3);
 }
 
 void relative_time(unsigned long seconds, unsigned long subseconds, unsigned long * out_seconds, unsigned long * out_subseconds) {
-	if (subseconds + timer_subticks > SUBTICKS_PER_TICK) {
-		*out_seconds    = timer_ticks + seconds + 1;
-		*out_subseconds = (subseconds + timer_subticks) - SUBTICKS_PER_TICK;
-	} else {
-		*out_seconds    = timer_ticks + seconds;
-		*out_subseconds = timer_subticks + subseconds;
-	}
+	uint64_t when = timer_usec() + subseconds;
+	*out_seconds    = when / SUBTICKS_PER_TICK + seconds;
+	*out_subseconds = when % SUBTICKS_PER_TICK;
 }
 
 /*
@@ -74,7 +202,8 @@ void relative_time(unsigned long seconds, unsigned long subseconds, unsigned lon
  */
 void timer_install(void) {
 	debug_print(NOTICE,"Initializing interval timer");
+	tsc_calibrate();
+	time_page_update();
 	irq_install_handler(TIMER_IRQ, timer_handler);
-	timer_phase(100); /* 100Hz */
+	timer_phase(TIMER_HZ);
 }
-
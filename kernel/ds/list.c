@@ -10,9 +10,21 @@
 
 #ifdef _KERNEL_
 #	include <system.h>
+#	include <slab.h>
+
+static kmem_cache_t * node_cache = NULL;
+
+static node_t * list_node_alloc(void) {
+	if (!node_cache) {
+		node_cache = kmem_cache_create("node_t", sizeof(node_t), NULL);
+	}
+	return kmem_cache_alloc(node_cache);
+}
 #else
 #	include <stddef.h>
 #	include <stdlib.h>
+
+#	define list_node_alloc() malloc(sizeof(node_t))
 #endif
 
 void list_destroy(list_t * list) {
@@ -55,7 +67,7 @@ void list_append(list_t * list, node_t * node) {
 
 node_t * list_insert(list_t * list, void * item) {
 	/* Insert an item into a list */
-	node_t * node = malloc(sizeof(node_t));
+	node_t * node = list_node_alloc();
 	node->value = item;
 	node->next  = NULL;
 	node->prev  = NULL;
@@ -92,7 +104,7 @@ void list_append_after(list_t * list, node_t * before, node_t * node) {
 }
 
 node_t * list_insert_after(list_t * list, node_t * before, void * item) {
-	node_t * node = malloc(sizeof(node_t));
+	node_t * node = list_node_alloc();
 	node->value = item;
 	node->next  = NULL;
 	node->prev  = NULL;
@@ -128,7 +140,7 @@ void list_append_before(list_t * list, node_t * after, node_t * node) {
 }
 
 node_t * list_insert_before(list_t * list, node_t * after, void * item) {
-	node_t * node = malloc(sizeof(node_t));
+	node_t * node = list_node_alloc();
 	node->value = item;
 	node->next  = NULL;
 	node->prev  = NULL;
@@ -15,12 +15,23 @@
 #include <process.h>
 #include <logging.h>
 #include <hashmap.h>
+#include <slab.h>
 
 tree_t    * fs_tree = NULL; /* File system mountpoint tree */
 fs_node_t * fs_root = NULL; /* Pointer to the root mount fs_node (must be some form of filesystem, even ramdisk) */
 
 hashmap_t * fs_types = NULL;
 
+static kmem_cache_t * fs_node_cache = NULL;
+
+/*
+ * Allocate a (zeroed) file system node. Nodes are freed
+ * with free(), usually from close_fs().
+ */
+fs_node_t * fs_node_alloc(void) {
+	return kmem_cache_alloc(fs_node_cache);
+}
+
 
 static struct dirent * readdir_mapper(fs_node_t *node, uint32_t index) {
 	tree_node_t * d = (tree_node_t *)node->device;
@@ -481,6 +492,8 @@ char *canonicalize_path(char *cwd, char *input) {
 }
 
 void vfs_install(void) {
+	fs_node_cache = kmem_cache_create("fs_node_t", sizeof(fs_node_t), NULL);
+
 	/* Initialize the mountpoint tree */
 	fs_tree = tree_create();
 
@@ -709,7 +722,7 @@ fs_node_t *get_mount_point(char * path, unsigned int path_depth, char **outpath,
 	*outdepth = _tree_depth;
 
 	if (last) {
-		fs_node_t * last_clone = malloc(sizeof(fs_node_t));
+		fs_node_t * last_clone = fs_node_alloc();
 		memcpy(last_clone, last, sizeof(fs_node_t));
 		return last_clone;
 	}
@@ -749,7 +762,7 @@ fs_node_t *kopen(char *filename, uint32_t flags) {
 	/* If strlen(path) == 1, then path = "/"; return root */
 	if (path_len == 1) {
 		/* Clone the root file system node */
-		fs_node_t *root_clone = malloc(sizeof(fs_node_t));
+		fs_node_t *root_clone = fs_node_alloc();
 		memcpy(root_clone, fs_root, sizeof(fs_node_t));
 
 		/* Free the path */
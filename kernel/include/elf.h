@@ -89,6 +89,7 @@ typedef struct {
 	Elf32_Addr p_vaddr;
 	Elf32_Addr p_paddr;
 	Elf32_Word p_filesz;
+	Elf32_Word p_memsz;
 	Elf32_Word p_flags;
 	Elf32_Word p_align;
 } Elf32_Phdr;
@@ -104,6 +105,11 @@ typedef struct {
 #define PT_LOPROC  0x70000000
 #define PT_HIPROC  0x7FFFFFFF
 
+/* p_flags values */
+#define PF_X       0x1
+#define PF_W       0x2
+#define PF_R       0x4
+
 
 /** Section Header */
 typedef struct {
@@ -126,6 +126,7 @@ int create_file_fs(char *name, uint16_t permission);
 fs_node_t *kopen(char *filename, uint32_t flags);
 char *canonicalize_path(char *cwd, char *input);
 fs_node_t *clone_fs(fs_node_t * source);
+fs_node_t *fs_node_alloc(void);
 int ioctl_fs(fs_node_t *node, int request, void * argp);
 int chmod_fs(fs_node_t *node, int mode);
 int unlink_fs(char * name);
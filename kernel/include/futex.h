@@ -0,0 +1 @@
+../../toolchain/patches/newlib/toaru/sys/futex.h
\ No newline at end of file
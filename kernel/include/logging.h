@@ -15,6 +15,8 @@ extern void * debug_file;
 extern void _debug_print(char * title, int line_no, log_type_t level, char *fmt, ...);
 extern void (*debug_hook)(void *, char *);
 extern void (*debug_video_crash)(char **);
+extern void klogd_install(void);
+extern uint32_t log_read(uint32_t offset, uint32_t size, uint8_t * buffer);
 
 #ifndef MODULE_NAME
 #define MODULE_NAME __FILE__
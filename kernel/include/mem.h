@@ -6,10 +6,36 @@
 #define __MEM_H
 
 #include <types.h>
+#include <task.h>
 
 
+#define KERNEL_HEAP_INIT 0x00800000
+#define KERNEL_HEAP_END  0x20000000
+
 extern uintptr_t heap_end;
 
+/* Per-frame metadata */
+#define FRAME_OWNER_NONE   0 /* Free */
+#define FRAME_OWNER_KERNEL 1 /* Kernel heap, page tables, boot regions */
+#define FRAME_OWNER_USER   2 /* Mapped into user address spaces */
+#define FRAME_OWNER_SHM    3 /* Backing a shared memory chunk */
+#define FRAME_OWNER_DMA    4 /* Directly-mapped device or reserved memory */
+
+#define FRAME_FLAG_PINNED  0x01 /* Never returned to the allocator */
+
+typedef struct {
+	uint16_t refcount; /* Mappings / owners holding this frame */
+	uint8_t  flags;
+	uint8_t  owner;
+} frame_t;
+
+extern frame_t * frame_table;
+extern uint32_t nframes;
+
+extern void frame_ref(uint32_t frame);
+extern int frame_release(uint32_t frame);
+extern void frame_set_owner(uint32_t frame, uint8_t owner);
+
 extern void set_frame(uintptr_t frame_addr);
 extern void clear_frame(uintptr_t frame_addr);
 extern uint32_t test_frame(uintptr_t frame_addr);
@@ -17,4 +43,22 @@ extern uint32_t first_frame(void);
 
 extern uintptr_t map_to_physical(uintptr_t virtual);
 
+/*
+ * 4MB pages (PSE). A large page's page table is kept filled in with
+ * the equivalent 4KB entries, so everything that walks page tables
+ * still works; only the directory entry is different.
+ */
+#define LARGE_PAGE_SIZE 0x400000
+#define PAGE_DIR_LARGE  0x80 /* physical_tables[] entry maps a 4MB page */
+
+extern int large_pages;
+extern uint32_t alloc_large_frames(uint8_t owner);
+extern int map_large(page_directory_t * dir, uintptr_t address);
+extern void unmap_large(page_directory_t * dir, uintptr_t address);
+extern void map_physical(uintptr_t address, uintptr_t physical, size_t size, int is_kernel);
+
+/* The kernel's view of the time page (see time_page.h) */
+struct time_page;
+extern struct time_page * time_page;
+
 #endif
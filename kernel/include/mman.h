@@ -0,0 +1 @@
+../../toolchain/patches/newlib/toaru/sys/mman.h
\ No newline at end of file
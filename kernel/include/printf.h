@@ -4,6 +4,7 @@
 #include <fs.h>
 
 extern size_t vasprintf(char * buf, const char *fmt, va_list args);
+extern size_t vsnprintf(char * buf, size_t size, const char *fmt, va_list args);
 extern int    sprintf(char *buf, const char *fmt, ...);
 extern int    fprintf(fs_node_t * device, char *fmt, ...);
 
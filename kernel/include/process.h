@@ -8,6 +8,7 @@
 #include <tree.h>
 #include <signal.h>
 #include <task.h>
+#include <smp.h>
 
 #define KERNEL_STACK_SIZE 0x8000
 
@@ -47,7 +48,6 @@ typedef struct image {
 	uintptr_t stack;       /* Process kernel stack */
 	uintptr_t user_stack;  /* User stack */
 	uintptr_t start;
-	uintptr_t shm_heap;
 	volatile uint8_t lock;
 } image_t;
 
@@ -65,6 +65,8 @@ typedef struct descriptor_table {
 /* Signal Table */
 typedef struct signal_table {
 	uintptr_t functions[NUMSIGNALS+1];
+	uint32_t  masks[NUMSIGNALS+1];     /* Also blocked while the handler runs */
+	int       flags[NUMSIGNALS+1];     /* SA_* */
 } sig_table_t;
 
 /* Portable process struct */
@@ -94,21 +96,55 @@ typedef struct process {
 	uint8_t       running;
 	struct regs * syscall_registers; /* Registers at interrupt */
 	list_t *      wait_queue;
-	list_t *      shm_mappings;      /* Shared memory chunk mappings */
 	list_t *      signal_queue;      /* Queued signals */
-	thread_t      signal_state;
-	char *        signal_kstack;
+	uint32_t      blocked;           /* Signals held in the queue instead of delivered */
+	thread_t      signal_state;      /* Sleep a handler was run from */
+	uintptr_t     signal_kstack;     /* Kernel stack top below that sleep, while the handler runs */
+	uintptr_t     signal_kstack_prev; /* ... and what it was before the handler */
+	uintptr_t     signal_frame;      /* The handler's signal frame, until it returns or is left */
 	node_t        sched_node;
 	node_t        sleep_node;
 	node_t *      timed_sleep_node;
 	uint8_t       is_tasklet;
 	volatile uint8_t sleep_interrupted;
+	int           cpu;               /* Processor it last ran on */
+	int           nice;              /* NICE_MIN (most favored) to NICE_MAX */
+	uint64_t      vruntime;          /* Weighted time spent running, in microseconds */
+	int *         futex_addr;        /* Futex word we are waiting on */
+	int *         clear_tid;         /* Zeroed and woken through when this thread exits */
+	struct process * vfork_parent;   /* Whose address space we are borrowing until exec or exit */
+	struct process * vfork_child;    /* Who is borrowing ours */
+
+	/* Accounting */
+	uint32_t      utime;             /* Timer ticks spent in user mode */
+	uint32_t      stime;             /* ... and in the kernel */
+	uint32_t      cutime;            /* The same for reaped children */
+	uint32_t      cstime;
+	uint32_t      nvcsw;             /* Switched away while blocking */
+	uint32_t      nivcsw;            /* Switched away while still ready (preempted or yielding) */
+	uint32_t      runs;              /* Times it was picked to run */
+	uint64_t      run_usec;          /* Time on a processor */
+	uint64_t      run_start;         /* When it was last picked */
+	uint64_t      wait_usec;         /* Time spent waiting in ready queues */
+	uint64_t      ready_at;          /* When it last joined a ready queue; 0 if it isn't on one */
+	uint32_t      wait_max;          /* Longest single wait, in microseconds */
 } process_t;
 
+/* Nice levels */
+#define NICE_MIN -20
+#define NICE_MAX 19
+
+/* Scheduler tuning, in microseconds of virtual runtime */
+#define SCHED_TICK_US        10000 /* One timer tick */
+#define SCHED_WAKEUP_BONUS   20000 /* How far ahead of the queue a waking process may start */
+#define SCHED_WAKEUP_PREEMPT 10000 /* How far behind the running process it must be to preempt it */
+
 typedef struct {
-	unsigned long end_tick;
-	unsigned long end_subtick;
+	unsigned long end_tick;     /* Seconds */
+	unsigned long end_subtick;  /* Microseconds */
 	process_t * process;
+	uint32_t expires;           /* Timer wheel slot, in milliseconds since boot */
+	int level;                  /* Timer wheel level */
 } sleeper_t;
 
 extern void initialize_process_tree(void);
@@ -118,6 +154,7 @@ extern process_t * spawn_init(void);
 extern process_t * spawn_kidle(void);
 extern void set_process_environment(process_t * proc, page_directory_t * directory);
 extern void make_process_ready(process_t * proc);
+
 extern uint8_t process_available(void);
 extern process_t * next_ready_process(void);
 extern uint32_t process_append_fd(process_t * proc, fs_node_t * node);
@@ -126,12 +163,19 @@ extern void delete_process(process_t * proc);
 process_t * process_get_parent(process_t * process);
 extern uint32_t process_move_fd(process_t * proc, int src, int dest);
 extern int process_is_ready(process_t * proc);
+extern void sched_tick(int user);
+extern void sched_account(process_t * prev, process_t * next);
+extern void check_reschedule(void);
+extern void process_set_nice(process_t * proc, int nice);
 
 extern void wakeup_sleepers(unsigned long seconds, unsigned long subseconds);
 extern void sleep_until(process_t * process, unsigned long seconds, unsigned long subseconds);
+extern uint64_t sleep_next_wakeup(void);
+
+extern int futex_wait(int * addr, int val);
+extern int futex_wake(int * addr, int count);
+extern void futex_exit(process_t * proc);
 
-extern volatile process_t * current_process;
-extern process_t * kernel_idle_task;
 extern list_t * process_list;
 
 typedef void (*tasklet_t) (void *, char *);
@@ -139,6 +183,7 @@ extern int create_kernel_tasklet(tasklet_t tasklet, char * name, void * argp);
 
 extern void release_directory(page_directory_t * dir);
 extern void release_directory_for_exec(page_directory_t * dir);
+extern void vfork_release(process_t * proc);
 
 extern void cleanup_process(process_t * proc, int retval);
 extern void reap_process(process_t * proc);
@@ -0,0 +1,23 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ *
+ * Sampling profiler
+ *
+ * While it is on, every scheduler tick records where the processor
+ * was (and, optionally, the frame-pointer call chain that got it
+ * there), for /proc/profile.
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <types.h>
+
+struct regs;
+
+extern void profile_install(void);
+extern void profile_start(int callgraph);
+extern void profile_stop(void);
+extern void profile_tick(struct regs * r);
+extern uint32_t profile_read(uint32_t offset, uint32_t size, uint8_t * buffer);
+
+#endif
@@ -0,0 +1 @@
+../../toolchain/patches/newlib/toaru/sys/resource.h
\ No newline at end of file
@@ -12,13 +12,14 @@
 /* Types */
 struct shm_node;
 
-typedef struct {
+typedef struct shm_chunk {
 	struct shm_node * parent;
 	volatile uint8_t lock;
 	int32_t ref_count;
 
 	uint32_t num_frames;
 	uintptr_t *frames;
+	uint8_t large; /* Frames come in aligned 4MB blocks and are mapped with large pages */
 } shm_chunk_t;
 
 typedef struct shm_node {
@@ -26,20 +27,18 @@ typedef struct shm_node {
 	shm_chunk_t * chunk;
 } shm_node_t;
 
-typedef struct {
-	shm_chunk_t * chunk;
-	uint8_t volatile lock;
-
-	uint32_t num_vaddrs;
-	uintptr_t *vaddrs;
-} shm_mapping_t;
-
 /* Syscalls */
 extern void * shm_obtain(char * path, size_t * size);
+extern void * shm_obtain_large(char * path, size_t * size);
 extern int    shm_release(char * path);
 
 /* Other exposed functions */
 extern void shm_install(void);
 extern void shm_release_all(process_t * proc);
 
+/* Anonymous chunks backing shared mmap() regions; frames are filled on demand */
+extern shm_chunk_t * shm_chunk_anonymous(size_t size);
+extern void shm_chunk_ref(shm_chunk_t * chunk);
+extern void shm_chunk_release(shm_chunk_t * chunk);
+
 #endif
@@ -5,9 +5,28 @@
 #define SIGNAL_H
 
 #include <types.h>
-void return_from_signal_handler(void);
-void fix_signal_stacks(void);
-
 #include <signal_defs.h>
 
+/* Can't be blocked, caught or ignored */
+#define SIG_UNBLOCKABLE ((1UL << SIGKILL) | (1UL << SIGSTOP))
+
+/* Matches the C library's struct sigaction */
+struct sigaction {
+	int       sa_flags;
+	uint32_t  sa_mask;
+	uintptr_t sa_handler;
+};
+
+struct regs;
+struct process;
+
+void deliver_signals(struct regs * r);
+void return_from_signal_handler(struct regs * r);
+void signal_interrupted_sleep(void);
+void signal_check_fatal(void);
+uintptr_t signal_kernel_stack(struct process * proc);
+void signal_exec_reset(struct process * proc);
+int signal_action(uint32_t signum, struct sigaction * act, struct sigaction * oldact);
+int signal_mask(int how, uint32_t * set, uint32_t * oldset);
+
 #endif
@@ -0,0 +1,37 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ *
+ * Object caches for frequently allocated kernel structures.
+ */
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <types.h>
+
+typedef struct kmem_cache {
+	char *   name;
+	size_t   size;               /* Object size, rounded up for alignment */
+	void  (* ctor)(void *);      /* Prepares each object as it is handed out; NULL to zero it */
+	uint32_t per_slab;           /* Objects in each page */
+
+	volatile uint8_t lock;
+	void *   free_list;          /* Free objects, linked through their first word */
+
+	/* Statistics */
+	uint32_t slabs;              /* Pages owned by the cache */
+	uint32_t active;             /* Objects handed out */
+	uint32_t allocs;
+	uint32_t hits;               /* Allocations served without growing the cache */
+	uint32_t frees;
+
+	struct kmem_cache * next;
+} kmem_cache_t;
+
+extern kmem_cache_t * kmem_caches;
+
+extern kmem_cache_t * kmem_cache_create(char * name, size_t size, void (*ctor)(void *));
+extern void * kmem_cache_alloc(kmem_cache_t * cache);
+extern void kmem_cache_free(kmem_cache_t * cache, void * obj);
+extern int kmem_cache_object(void * ptr);
+
+#endif
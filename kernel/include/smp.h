@@ -0,0 +1,113 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ *
+ * Multiprocessor support
+ *
+ * Each processor has a cpu_t, which it finds through %gs:
+ * every processor has its own copy of the GDT in which the
+ * per-CPU segment (PERCPU_SELECTOR) starts at its cpu_t.
+ *
+ * Kernel code still expects to be the only thing running, so
+ * only one processor at a time is allowed in the kernel: the
+ * kernel lock is taken on the way in from an interrupt, fault or
+ * system call and released on the way back out to user mode.
+ */
+
+#ifndef SMP_H
+#define SMP_H
+
+#include <types.h>
+#include <task.h>
+#include <list.h>
+
+#define MAX_CPUS 8
+
+/* Descriptor for the per-CPU segment in every GDT */
+#define PERCPU_SELECTOR 0x30
+
+/* Interrupt vectors used by the local APICs */
+#define LAPIC_TIMER_VECTOR  64
+#define RESCHEDULE_VECTOR   65
+#define TLB_VECTOR          66
+#define FPU_VECTOR          67
+#define SPURIOUS_VECTOR     0xFF
+
+/* Ready queue wait histogram: under 10us, 100us, ... 1s, and over */
+#define SCHED_WAIT_BUCKETS  7
+
+struct process;
+
+typedef struct cpu {
+	struct cpu *       self;        /* %gs:0 */
+	int                id;          /* Index into cpus[] */
+	uint8_t            lapic_id;
+	volatile int       online;
+
+	volatile struct process * process;   /* current_process */
+	page_directory_t * directory;   /* current_directory */
+	struct process *   idle_task;
+	struct process *   fpu_owner;   /* Whose state is loaded in the FPU */
+
+	list_t *           ready_queue; /* In order of vruntime */
+	volatile uint8_t   ready_lock;
+	uint64_t           min_vruntime;/* Never goes backwards; where woken processes join the queue */
+	volatile int       need_resched;/* Something woke up that should run before the current process */
+
+	volatile int       tlb_flush;   /* A TLB shootdown is waiting for us */
+
+	/* Local APIC timer, in timer_usec() time */
+	uint64_t           next_tick;
+	uint64_t           alarm;       /* A sleeper is due; 0 for none */
+	int                tickless;    /* Tick stopped while idle */
+
+	/* Idle */
+	volatile int       halted;      /* The idle task is in hlt */
+	uint64_t           halted_at;
+	uint64_t           idle_usec;   /* Time spent halted */
+	uint32_t           idle_wakeups;
+
+	volatile int       fpu_flush;   /* Someone wants the FPU context we are holding */
+
+	/* Statistics */
+	uint32_t           switches;
+	uint32_t           steals;      /* Processes taken from other ready queues */
+	uint32_t           fpu_saves;
+	uint32_t           fpu_restores;
+	uint32_t           fpu_deferred;        /* Switched away from the FPU owner without saving */
+	uint32_t           fpu_reloads_avoided; /* The FPU owner trapped again with its context still loaded */
+	uint32_t           runs;        /* Processes picked to run, not counting the idle task */
+	uint64_t           wait_usec;   /* Total time they waited in the ready queue */
+	uint32_t           wait_hist[SCHED_WAIT_BUCKETS];
+} cpu_t;
+
+extern cpu_t cpus[MAX_CPUS];
+extern int   cpu_count;             /* Processors that are online */
+extern int   ioapic_active;         /* Interrupts come through the I/O APIC, not the PIC */
+
+static inline cpu_t * this_cpu(void) {
+	cpu_t * cpu;
+	__asm__ __volatile__ ("mov %%gs:0, %0" : "=r"(cpu));
+	return cpu;
+}
+
+#define current_process   (this_cpu()->process)
+#define current_directory (this_cpu()->directory)
+
+/* Spin locks for data that is touched without the kernel lock */
+extern void spin_lock_irq(uint8_t volatile * lock, uint32_t * flags);
+extern void spin_unlock_irq(uint8_t volatile * lock, uint32_t flags);
+
+extern void kernel_enter(void);
+extern void kernel_leave(void);
+
+extern void smp_install(void);
+extern void lapic_eoi(void);
+extern void smp_reschedule(cpu_t * cpu);
+extern void tlb_shootdown(page_directory_t * dir);
+extern void lapic_alarm(uint64_t usec);
+extern void fpu_shootdown(cpu_t * cpu);
+extern void tick_stop(void);
+extern void tick_restart(void);
+
+extern void gdt_install_cpu(cpu_t * cpu);
+
+#endif
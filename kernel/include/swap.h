@@ -0,0 +1,39 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ *
+ * Swap
+ *
+ * Page reclaim to a block device or a file. A swapped-out
+ * page has `present` clear, `swapped` set, and the swap slot
+ * holding its contents in place of the frame number.
+ */
+
+#ifndef SWAP_H
+#define SWAP_H
+
+#include <types.h>
+#include <fs.h>
+
+struct regs;
+
+typedef struct {
+	char *      path;
+	fs_node_t * node;
+	uint32_t    slots;       /* Page-sized slots, including the reserved first one */
+	uint32_t    used;
+	uint16_t *  map;         /* Number of page table entries referring to each slot */
+
+	/* Statistics */
+	uint32_t    swapped_in;
+	uint32_t    swapped_out;
+	uint32_t    discarded;   /* Clean pages dropped without being written out */
+} swap_area_t;
+
+extern swap_area_t * swap_area;
+
+extern int  swap_enable(char * path);
+extern int  swap_fault(struct regs * r, uintptr_t address);
+extern void swap_throttle(void);
+extern void swap_dup(uint32_t slot);
+extern void swap_free(uint32_t slot);
+
+#endif
@@ -113,7 +113,13 @@ extern void irq_ack(size_t);
 /* Timer */
 extern void timer_install(void);
 extern unsigned long timer_ticks;
-extern unsigned char timer_subticks;
+extern unsigned long timer_subticks;
+extern int timer_precise;
+#define TIMER_HZ 100
+#define SUBTICKS_PER_TICK 1000000 /* timer_subticks are microseconds */
+extern uint64_t timer_usec(void);
+extern void timer_update(void);
+extern void timer_alarm(uint64_t usec);
 extern void relative_time(unsigned long seconds, unsigned long subseconds, unsigned long * out_seconds, unsigned long * out_subseconds);
 
 /* Memory Management */
@@ -128,7 +134,6 @@ extern uintptr_t kvmalloc_p(size_t size, uintptr_t * phys);
 // Page types moved to task.h
 
 extern page_directory_t *kernel_directory;
-extern page_directory_t *current_directory;
 
 extern void paging_install(uint32_t memsize);
 extern void paging_prestart(void);
@@ -138,6 +143,7 @@ extern void switch_page_directory(page_directory_t * new);
 extern void invalidate_page_tables(void);
 extern void invalidate_tables_at(uintptr_t addr);
 extern page_t *get_page(uintptr_t address, int make, page_directory_t * dir);
+extern void map_frames(page_directory_t * dir, uintptr_t address, uintptr_t * frames, uint32_t count, int is_writeable);
 extern void page_fault(struct regs *r);
 extern void dma_frame(page_t * page, int, int, uintptr_t);
 extern void debug_print_directory(page_directory_t *);
@@ -147,8 +153,13 @@ int debug_shell_start(void);
 void heap_install(void);
 
 void alloc_frame(page_t *page, int is_kernel, int is_writeable);
+void alloc_frame_zeroed(page_t *page, int is_kernel, int is_writeable);
+int zero_pool_refill(void);
+void zero_pool_stats(uintptr_t * pooled, uintptr_t * hits, uintptr_t * misses);
 void free_frame(page_t *page);
+void share_frame(page_t *src, page_t *dest);
 uintptr_t memory_use(void);
+void memory_fragmentation(uintptr_t * largest, uintptr_t * extents);
 uintptr_t memory_total(void);
 
 /* klmalloc */
@@ -161,6 +172,8 @@ void free(void *ptr);
 /* Tasks */
 extern uintptr_t read_eip(void);
 extern void copy_page_physical(uint32_t, uint32_t);
+extern void zero_page_physical(uint32_t);
+extern void zero_page_physical_nt(uint32_t);
 extern page_directory_t * clone_directory(page_directory_t * src);
 extern page_table_t * clone_table(page_table_t * src, uintptr_t * physAddr);
 extern void move_stack(void *new_stack_start, size_t size);
@@ -172,6 +185,7 @@ extern void tasking_install(void);
 extern void switch_task(uint8_t reschedule);
 extern void switch_next(void);
 extern uint32_t fork(void);
+extern uint32_t vfork(void);
 extern uint32_t clone(uintptr_t new_stack, uintptr_t thread_func, uintptr_t arg);
 extern uint32_t getpid(void);
 extern void enter_user_jmp(uintptr_t location, int argc, char ** argv, uintptr_t stack);
@@ -191,12 +205,23 @@ struct timeval {
 };
 
 extern int gettimeofday(struct timeval * t, void * z);
+
+/* Process times, in timer ticks */
+struct tms {
+	uint32_t tms_utime;
+	uint32_t tms_stime;
+	uint32_t tms_cutime;
+	uint32_t tms_cstime;
+};
 extern uint32_t now(void);
+extern uint32_t boot_time(void);
 
 
 /* Floating Point Unit */
 extern void switch_fpu(void);
 extern void fpu_install(void);
+extern void fpu_flush(void);
+extern void fpu_release(process_t * proc);
 
 /* ELF */
 extern int exec( char *, int, char **, char **);
@@ -217,12 +242,16 @@ typedef struct {
 } signal_t;
 
 extern void handle_signal(process_t *, signal_t *);
+extern signal_t * signal_alloc(void);
 
 extern int send_signal(pid_t process, uint32_t signal);
 
+#define USER_MMAP_START   0x80000000
+#define USER_MMAP_END     0xAFF00000
 #define USER_STACK_BOTTOM 0xAFF00000
 #define USER_STACK_TOP    0xB0000000
 #define SHM_START         0xB0000000
+#define SHM_END           0xD0000000
 
 extern void validate(void * ptr);
 extern int validate_safe(void * ptr);
@@ -4,13 +4,21 @@
 #include <types.h>
 
 
+struct vma;
+
 typedef struct page {
 	unsigned int present:1;
 	unsigned int rw:1;
 	unsigned int user:1;
+	unsigned int writethrough:1;
+	unsigned int cachedisable:1;
 	unsigned int accessed:1;
 	unsigned int dirty:1;
-	unsigned int unused:7;
+	unsigned int pat:1;
+	unsigned int global:1;
+	unsigned int cow:1;      /* Shared copy-on-write, writeable after a copy */
+	unsigned int shared:1;   /* Shared mapping, stays shared across fork */
+	unsigned int swapped:1;  /* Not present; `frame` is a swap slot */
 	unsigned int frame:20;
 } __attribute__((packed)) page_t;
 
@@ -23,6 +31,8 @@ typedef struct page_directory {
 	page_table_t *tables[1024];	/* 1024 pointers to page tables... */
 	uintptr_t physical_address;	/* The physical address of physical_tables */
 	int32_t ref_count;
+	struct vma * regions;	/* Root of the tree of regions (vma_t), sorted by address */
+	uint32_t kernel_generation;	/* Changes to kernel_directory's large pages we have picked up */
 } page_directory_t;
 
 #endif
@@ -0,0 +1 @@
+../../toolchain/patches/newlib/toaru/sys/time_page.h
\ No newline at end of file
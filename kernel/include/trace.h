@@ -0,0 +1,29 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ *
+ * Kernel event tracing
+ *
+ * Tracepoints are compiled in everywhere, but do nothing but test
+ * trace_enabled until tracing is turned on, with the "trace" kernel
+ * argument or by writing 1 to /proc/trace.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <types.h>
+#include <trace_defs.h>
+
+extern volatile int trace_enabled;
+extern void trace_record(uint16_t type, uint32_t a, uint32_t b);
+
+#define TRACE(type, a, b) \
+	do { \
+		if (trace_enabled) trace_record((type), (uint32_t)(a), (uint32_t)(b)); \
+	} while (0)
+
+extern void trace_install(void);
+extern void trace_start(void);
+extern void trace_stop(void);
+extern uint32_t trace_read(uint32_t offset, uint32_t size, uint8_t * buffer);
+
+#endif
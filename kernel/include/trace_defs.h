@@ -0,0 +1 @@
+../../toolchain/patches/newlib/toaru/sys/trace_defs.h
\ No newline at end of file
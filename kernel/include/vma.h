@@ -0,0 +1,62 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ *
+ * Virtual Memory Areas
+ *
+ * Regions of a user address space which are populated
+ * lazily from page_fault() rather than up front.
+ */
+
+#ifndef VMA_H
+#define VMA_H
+
+#include <types.h>
+#include <fs.h>
+#include <task.h>
+
+struct regs;
+struct shm_chunk;
+
+#define VMA_READ   0x01
+#define VMA_WRITE  0x02
+#define VMA_EXEC   0x04
+#define VMA_SHARED 0x08
+#define VMA_SHM    0x10 /* shm_obtain() mapping: populated up front, not inherited */
+
+typedef struct vma {
+	uintptr_t   start;     /* First page of the region */
+	uintptr_t   end;       /* One past the last page */
+	uint32_t    flags;     /* VMA_* */
+
+	fs_node_t * file;      /* Backing file, or NULL for zero-fill */
+	uint32_t    offset;    /* File (or chunk) offset corresponding to `start` */
+	uintptr_t   file_end;  /* Address after which the file supplies no more data */
+
+	struct shm_chunk * chunk; /* Frames shared with other mappings (VMA_SHARED) */
+
+	/* AVL tree linkage, augmented with the extent of each subtree */
+	struct vma * left;
+	struct vma * right;
+	int          height;
+	uintptr_t    subtree_start; /* Lowest start in this subtree */
+	uintptr_t    subtree_end;   /* Highest end in this subtree */
+	uintptr_t    subtree_gap;   /* Largest hole between regions in this subtree */
+} vma_t;
+
+extern vma_t * vma_insert(page_directory_t * dir, uintptr_t start, uintptr_t end, uint32_t flags, fs_node_t * file, uint32_t offset, uintptr_t file_end);
+extern vma_t * vma_find(page_directory_t * dir, uintptr_t address);
+extern vma_t * vma_find_next(page_directory_t * dir, uintptr_t address);
+extern uintptr_t vma_find_gap(page_directory_t * dir, uintptr_t low, uintptr_t high, size_t length);
+extern void    vma_resize(page_directory_t * dir, vma_t * vma, uintptr_t end);
+extern void    vma_remove(page_directory_t * dir, vma_t * vma);
+extern vma_t * vma_split(page_directory_t * dir, vma_t * vma, uintptr_t address);
+extern void    vma_clone(page_directory_t * src, page_directory_t * dest);
+extern void    vma_release_all(page_directory_t * dir);
+extern int     vma_populate(vma_t * vma, uintptr_t address, int interruptible);
+extern int     vma_fault(struct regs * r, uintptr_t address);
+
+/* mmap.c */
+extern uintptr_t mmap_region(uintptr_t addr, size_t length, int prot, int flags, fs_node_t * file, uint32_t offset);
+extern int       munmap_region(uintptr_t addr, size_t length);
+extern int       mprotect_region(uintptr_t addr, size_t length, int prot);
+
+#endif
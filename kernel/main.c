@@ -48,6 +48,10 @@
 #include <shm.h>
 #include <args.h>
 #include <module.h>
+#include <swap.h>
+#include <smp.h>
+#include <trace.h>
+#include <profile.h>
 
 uintptr_t initial_esp = 0;
 
@@ -156,7 +160,11 @@ int kmain(struct multiboot *mboot, uint32_t mboot_mag, uintptr_t esp) {
 	tasking_install();  /* Multi-tasking */
 	timer_install();    /* PIC driver */
 	fpu_install();      /* FPU/SSE magic */
+	smp_install();      /* Other processors */
 	syscalls_install(); /* Install the system calls */
+	trace_install();    /* Event tracing */
+	klogd_install();    /* Write the log out in the background */
+	profile_install();  /* Sampling profiler */
 	shm_install();      /* Install shared memory */
 	modules_install();  /* Modules! */
 
@@ -190,6 +198,11 @@ int kmain(struct multiboot *mboot, uint32_t mboot_mag, uintptr_t esp) {
 		vfs_mount_type("ext2", args_value("root"), "/");
 	}
 
+	if (args_present("swap")) {
+		/* A disk (eg. /dev/hdb) or a preallocated file on the root filesystem */
+		swap_enable(args_value("swap"));
+	}
+
 	if (args_present("start")) {
 		char * c = args_value("start");
 		if (!c) {
@@ -103,6 +103,8 @@
 
 /* Includes {{{ */
 #include <system.h>
+#include <mem.h>
+#include <slab.h>
 /* }}} */
 /* Definitions {{{ */
 
@@ -143,6 +145,14 @@ void * __attribute__ ((malloc)) malloc(uintptr_t size) {
 }
 
 void * __attribute__ ((malloc)) realloc(void * ptr, uintptr_t size) {
+	if (kmem_cache_object(ptr)) {
+		/* Objects from a cache can't grow in place */
+		kmem_cache_t * cache = *(kmem_cache_t **)((uintptr_t)ptr & ~PAGE_MASK);
+		void * ret = malloc(size);
+		memcpy(ret, ptr, size < cache->size ? size : cache->size);
+		kmem_cache_free(cache, ptr);
+		return ret;
+	}
 	spin_lock(&mem_lock);
 	void * ret = klrealloc(ptr, size);
 	spin_unlock(&mem_lock);
@@ -164,6 +174,10 @@ void * __attribute__ ((malloc)) valloc(uintptr_t size) {
 }
 
 void free(void * ptr) {
+	if (kmem_cache_object(ptr)) {
+		kmem_cache_free(*(kmem_cache_t **)((uintptr_t)ptr & ~PAGE_MASK), ptr);
+		return;
+	}
 	spin_lock(&mem_lock);
 	if ((uintptr_t)ptr > placement_pointer) {
 		klfree(ptr);
@@ -967,3 +981,94 @@ static void * __attribute__ ((malloc)) klcalloc(uintptr_t nmemb, uintptr_t size)
 	return ptr;
 }
 /* }}} */
+/* Object caches {{{ */
+
+/*
+ * Caches hand out objects of a single type from pages taken
+ * straight from the kernel heap. Each page starts with a pointer
+ * to its cache, and is marked in `slab_pages` so that free() can
+ * tell cache objects apart from regular allocations. Freed objects
+ * go back on their cache's free list; pages are never returned.
+ */
+#define SLAB_HEADER_SIZE 8
+#define SLAB_PAGES (KERNEL_HEAP_END / PAGE_SIZE)
+
+static uint32_t slab_pages[SLAB_PAGES / 32];
+static uint8_t volatile kmem_caches_lock = 0;
+kmem_cache_t * kmem_caches = NULL;
+
+int kmem_cache_object(void * ptr) {
+	uintptr_t page = (uintptr_t)ptr / PAGE_SIZE;
+	if (page >= SLAB_PAGES) return 0;
+	return (slab_pages[page / 32] & (1 << (page % 32))) ? 1 : 0;
+}
+
+kmem_cache_t * kmem_cache_create(char * name, size_t size, void (*ctor)(void *)) {
+	size = (size + 7) & ~7;
+	assert(size <= PAGE_SIZE - SLAB_HEADER_SIZE && "Object is too large for a cache.");
+
+	kmem_cache_t * cache = malloc(sizeof(kmem_cache_t));
+	memset(cache, 0x00, sizeof(kmem_cache_t));
+	cache->name     = name;
+	cache->size     = size;
+	cache->ctor     = ctor;
+	cache->per_slab = (PAGE_SIZE - SLAB_HEADER_SIZE) / size;
+
+	spin_lock(&kmem_caches_lock);
+	cache->next = kmem_caches;
+	kmem_caches = cache;
+	spin_unlock(&kmem_caches_lock);
+
+	return cache;
+}
+
+static void kmem_cache_grow(kmem_cache_t * cache) {
+	spin_lock(&mem_lock);
+	uintptr_t slab = (uintptr_t)sbrk(PAGE_SIZE);
+	spin_unlock(&mem_lock);
+
+	*(kmem_cache_t **)slab = cache;
+	uintptr_t page = slab / PAGE_SIZE;
+	__sync_fetch_and_or(&slab_pages[page / 32], 1 << (page % 32));
+
+	for (uint32_t i = 0; i < cache->per_slab; ++i) {
+		void ** obj = (void **)(slab + SLAB_HEADER_SIZE + i * cache->size);
+		*obj = cache->free_list;
+		cache->free_list = obj;
+	}
+	cache->slabs++;
+}
+
+void * kmem_cache_alloc(kmem_cache_t * cache) {
+	spin_lock(&cache->lock);
+	cache->allocs++;
+	if (cache->free_list) {
+		cache->hits++;
+	} else {
+		kmem_cache_grow(cache);
+	}
+	void ** obj = cache->free_list;
+	cache->free_list = *obj;
+	cache->active++;
+	spin_unlock(&cache->lock);
+
+	if (cache->ctor) {
+		cache->ctor(obj);
+	} else {
+		memset(obj, 0x00, cache->size);
+	}
+	return obj;
+}
+
+void kmem_cache_free(kmem_cache_t * cache, void * obj) {
+	if (!obj) return;
+	assert(kmem_cache_object(obj) && *(kmem_cache_t **)((uintptr_t)obj & ~PAGE_MASK) == cache && "Object freed to the wrong cache.");
+
+	spin_lock(&cache->lock);
+	*(void **)obj = cache->free_list;
+	cache->free_list = obj;
+	cache->active--;
+	cache->frees++;
+	spin_unlock(&cache->lock);
+}
+/* }}} */
@@ -14,9 +14,10 @@
 #include <signal.h>
 #include <hashmap.h>
 #include <module.h>
-
-#define KERNEL_HEAP_INIT 0x00800000
-#define KERNEL_HEAP_END  0x20000000
+#include <vma.h>
+#include <swap.h>
+#include <time_page.h>
+#include <trace.h>
 
 extern void *end;
 uintptr_t placement_pointer = (uintptr_t)&end;
@@ -26,6 +27,21 @@ uintptr_t kernel_heap_alloc_point = KERNEL_HEAP_INIT;
 static volatile uint8_t frame_alloc_lock = 0;
 uint32_t first_n_frames(int n);
 
+int large_pages = 0; /* CPU supports PSE, and we've turned it on */
+struct time_page * time_page = NULL;
+static uint32_t kernel_generation = 0; /* Bumped whenever kernel_directory gains a large page */
+static void sync_kernel_tables(page_directory_t * dir);
+
+/*
+ * Is [address, address + size) inside a single (physically contiguous) large page?
+ */
+static int large_page_covers(uintptr_t address, size_t size) {
+	if (!kernel_directory || !(kernel_directory->physical_tables[address / LARGE_PAGE_SIZE] & PAGE_DIR_LARGE)) {
+		return 0;
+	}
+	return address / LARGE_PAGE_SIZE == (address + size - 1) / LARGE_PAGE_SIZE;
+}
+
 void
 kmalloc_startat(
 		uintptr_t address
@@ -50,10 +66,10 @@ kmalloc_real(
 			address = malloc(size);
 		}
 		if (phys) {
-			if (align && size >= 0x3000) {
+			if (align && size >= 0x3000 && !large_page_covers((uintptr_t)address, size)) {
 				debug_print(NOTICE, "Requested large aligned alloc of size 0x%x", size);
 				for (uintptr_t i = (uintptr_t)address; i < (uintptr_t)address + size; i += 0x1000) {
-					clear_frame(map_to_physical(i));
+					frame_release(map_to_physical(i) / 0x1000);
 				}
 				/* XXX This is going to get touchy... */
 				spin_lock(&frame_alloc_lock);
@@ -63,6 +79,8 @@ kmalloc_real(
 				}
 				for (unsigned int i = 0; i < (size + 0xFFF) / 0x1000; ++i) {
 					set_frame((index + i) * 0x1000);
+					frame_table[index + i].refcount = 1;
+					frame_table[index + i].owner    = FRAME_OWNER_KERNEL;
 					page_t * page = get_page((uintptr_t)address + (i * 0x1000),0,kernel_directory);
 					page->frame = index + i;
 				}
@@ -129,10 +147,51 @@ kvmalloc_p(
 
 uint32_t *frames;
 uint32_t nframes;
+uint32_t frames_used = 0;
+
+/*
+ * Per-frame metadata. A frame mapped into more than one address
+ * space (copy-on-write after fork) is only returned to the bitmap
+ * when the last reference is released.
+ */
+frame_t *frame_table;
 
 #define INDEX_FROM_BIT(b) (b / 0x20)
 #define OFFSET_FROM_BIT(b) (b % 0x20)
 
+/*
+ * The bitmap is the authoritative record of which frames are in use;
+ * on top of it we keep a small stack of frames that are (probably)
+ * free. Frames are pushed when they go from used to free, and when
+ * the stack runs dry it is refilled by scanning the bitmap a word at
+ * a time from where the last refill left off. Since anything may
+ * set_frame() a frame that is on the stack (DMA regions, aligned
+ * kmallocs), entries are checked against the bitmap when popped.
+ */
+#define FREE_STACK_SIZE 1024
+static uint32_t free_stack[FREE_STACK_SIZE];
+static uint32_t free_stack_top = 0;
+static uint32_t frame_hint = 0; /* bitmap word to resume refills from */
+
+#define BITMAP_WORDS ((nframes + 0x1F) / 0x20)
+
+/* Only grow the kernel heap by whole large pages while at least this many frames are free */
+#define HEAP_LARGE_MIN_FREE 8192
+
+/*
+ * Frames which have already been cleared, ready for anyone who
+ * needs a zero page. The idle task keeps this topped up. Frames
+ * in the pool are marked used in the bitmap but have no owner,
+ * and are handed back out if we otherwise run out of memory.
+ */
+#define ZERO_POOL_SIZE    512
+#define ZERO_POOL_RESERVE 1024 /* Leave at least this many frames free */
+static uint32_t zero_pool[ZERO_POOL_SIZE];
+static uint32_t zero_pool_top = 0;
+static uintptr_t zero_pool_hits = 0;
+static uintptr_t zero_pool_misses = 0;
+static void (*zero_page)(uint32_t) = zero_page_physical;
+
 void
 set_frame(
 		uintptr_t frame_addr
@@ -140,7 +199,10 @@ set_frame(
 	uint32_t frame  = frame_addr / 0x1000;
 	uint32_t index  = INDEX_FROM_BIT(frame);
 	uint32_t offset = OFFSET_FROM_BIT(frame);
-	frames[index] |= (0x1 << offset);
+	if (!(frames[index] & (0x1 << offset))) {
+		frames[index] |= (0x1 << offset);
+		frames_used++;
+	}
 }
 
 void
@@ -150,7 +212,13 @@ clear_frame(
 	uint32_t frame  = frame_addr / 0x1000;
 	uint32_t index  = INDEX_FROM_BIT(frame);
 	uint32_t offset = OFFSET_FROM_BIT(frame);
-	frames[index] &= ~(0x1 << offset);
+	if (frames[index] & (0x1 << offset)) {
+		frames[index] &= ~(0x1 << offset);
+		frames_used--;
+		if (free_stack_top < FREE_STACK_SIZE) {
+			free_stack[free_stack_top++] = frame;
+		}
+	}
 }
 
 uint32_t test_frame(uintptr_t frame_addr) {
@@ -160,33 +228,78 @@ uint32_t test_frame(uintptr_t frame_addr) {
 	return (frames[index] & (0x1 << offset));
 }
 
+/*
+ * Mask of the valid bits in bitmap word `i`; the last word may
+ * describe frames past the end of memory.
+ */
+static inline uint32_t valid_bits(uint32_t i) {
+	if (i * 0x20 + 0x20 <= nframes) return 0xFFFFFFFF;
+	return (0x1 << (nframes - i * 0x20)) - 1;
+}
+
+static void refill_free_stack(void) {
+	uint32_t words = BITMAP_WORDS;
+	for (uint32_t n = 0; n < words && free_stack_top < FREE_STACK_SIZE; ++n) {
+		uint32_t i = frame_hint;
+		uint32_t avail = ~frames[i] & valid_bits(i);
+		while (avail && free_stack_top < FREE_STACK_SIZE) {
+			uint32_t j = __builtin_ctz(avail);
+			avail &= avail - 1;
+			free_stack[free_stack_top++] = i * 0x20 + j;
+		}
+		if (avail) {
+			/* Stack is full, resume from this word next time */
+			break;
+		}
+		frame_hint = (i + 1 == words) ? 0 : i + 1;
+	}
+}
+
 uint32_t first_n_frames(int n) {
-	for (uint32_t i = 0; i < nframes * 0x1000; i += 0x1000) {
-		int bad = 0;
-		for (int j = 0; j < n; ++j) {
-			if (test_frame(i + 0x1000 * j)) {
-				bad = j+1;
-			}
+	uint32_t run   = 0;
+	uint32_t start = 0;
+	for (uint32_t i = 0; i < BITMAP_WORDS; ++i) {
+		uint32_t word = frames[i] | ~valid_bits(i);
+		if (word == 0xFFFFFFFF) {
+			run = 0;
+			continue;
+		}
+		if (word == 0 && run + 0x20 < (uint32_t)n) {
+			/* Whole word free, take it in one go */
+			if (!run) start = i * 0x20;
+			run += 0x20;
+			continue;
 		}
-		if (!bad) {
-			return i / 0x1000;
+		for (uint32_t j = 0; j < 0x20; ++j) {
+			if (word & (0x1 << j)) {
+				run = 0;
+			} else {
+				if (!run) start = i * 0x20 + j;
+				if (++run == (uint32_t)n) {
+					return start;
+				}
+			}
 		}
 	}
 	return 0xFFFFFFFF;
 }
 
 uint32_t first_frame(void) {
-	uint32_t i, j;
-
-	for (i = 0; i < INDEX_FROM_BIT(nframes); ++i) {
-		if (frames[i] != 0xFFFFFFFF) {
-			for (j = 0; j < 32; ++j) {
-				uint32_t testFrame = 0x1 << j;
-				if (!(frames[i] & testFrame)) {
-					return i * 0x20 + j;
-				}
+	while (1) {
+		while (free_stack_top) {
+			uint32_t frame = free_stack[--free_stack_top];
+			if (!test_frame(frame * 0x1000)) {
+				return frame;
 			}
 		}
+		if (frames_used >= nframes) break;
+		refill_free_stack();
+		if (!free_stack_top) break;
+	}
+
+	if (zero_pool_top) {
+		/* Still marked used, so the caller's set_frame() is harmless */
+		return zero_pool[--zero_pool_top];
 	}
 
 	debug_print(CRITICAL, "System claims to be out of usable memory, which means we probably overwrote the page frames.\033[0m");
@@ -197,7 +310,7 @@ uint32_t first_frame(void) {
 	}
 
 #if 0
-	signal_t * sig = malloc(sizeof(signal_t));
+	signal_t * sig = signal_alloc();
 	sig->handler = current_process->signals.functions[SIGSEGV];
 	sig->signum  = SIGSEGV;
 	handle_signal((process_t *)current_process, sig);
@@ -216,14 +329,22 @@ alloc_frame(
 		) {
 	if (page->frame != 0) {
 		page->present = 1;
-		page->rw      = (is_writeable == 1) ? 1 : 0;
 		page->user    = (is_kernel == 1)    ? 0 : 1;
+		if (page->cow) {
+			/* Still shared; the write fault will make it writeable. */
+			page->rw  = 0;
+			return;
+		}
+		page->rw      = (is_writeable == 1) ? 1 : 0;
 		return;
 	} else {
 		spin_lock(&frame_alloc_lock);
 		uint32_t index = first_frame();
 		assert(index != (uint32_t)-1 && "Out of frames.");
 		set_frame(index * 0x1000);
+		frame_table[index].refcount = 1;
+		frame_table[index].flags    = 0;
+		frame_table[index].owner    = is_kernel ? FRAME_OWNER_KERNEL : FRAME_OWNER_USER;
 		page->frame   = index;
 		spin_unlock(&frame_alloc_lock);
 		page->present = 1;
@@ -232,6 +353,92 @@ alloc_frame(
 	}
 }
 
+/*
+ * Like alloc_frame(), but the new frame is guaranteed to be zeroed;
+ * it comes from the pool if there is one ready.
+ */
+void
+alloc_frame_zeroed(
+		page_t *page,
+		int is_kernel,
+		int is_writeable
+		) {
+	if (page->frame != 0) {
+		alloc_frame(page, is_kernel, is_writeable);
+		return;
+	}
+
+	int needs_zero = 0;
+	spin_lock(&frame_alloc_lock);
+	uint32_t index;
+	if (zero_pool_top) {
+		index = zero_pool[--zero_pool_top];
+		zero_pool_hits++;
+	} else {
+		index = first_frame();
+		assert(index != (uint32_t)-1 && "Out of frames.");
+		set_frame(index * 0x1000);
+		zero_pool_misses++;
+		needs_zero = 1;
+	}
+	frame_table[index].refcount = 1;
+	frame_table[index].flags    = 0;
+	frame_table[index].owner    = is_kernel ? FRAME_OWNER_KERNEL : FRAME_OWNER_USER;
+	spin_unlock(&frame_alloc_lock);
+
+	if (needs_zero) {
+		zero_page(index * 0x1000);
+	}
+
+	page->frame   = index;
+	page->present = 1;
+	page->rw      = (is_writeable == 1) ? 1 : 0;
+	page->user    = (is_kernel == 1)    ? 0 : 1;
+}
+
+/*
+ * Clear one more frame for the zero pool. Called from the idle task;
+ * returns 0 when there is nothing left to do.
+ */
+int
+zero_pool_refill(void) {
+	IRQ_OFF;
+	spin_lock(&frame_alloc_lock);
+	if (zero_pool_top >= ZERO_POOL_SIZE || nframes - frames_used < ZERO_POOL_RESERVE) {
+		spin_unlock(&frame_alloc_lock);
+		IRQ_RES;
+		return 0;
+	}
+	uint32_t index = first_frame();
+	set_frame(index * 0x1000);
+	spin_unlock(&frame_alloc_lock);
+	IRQ_RES;
+
+	zero_page(index * 0x1000);
+
+	IRQ_OFF;
+	spin_lock(&frame_alloc_lock);
+	if (zero_pool_top < ZERO_POOL_SIZE) {
+		zero_pool[zero_pool_top++] = index;
+	} else {
+		clear_frame(index * 0x1000);
+	}
+	spin_unlock(&frame_alloc_lock);
+	IRQ_RES;
+	return 1;
+}
+
+void
+zero_pool_stats(
+		uintptr_t * pooled,
+		uintptr_t * hits,
+		uintptr_t * misses
+		) {
+	*pooled = zero_pool_top;
+	*hits   = zero_pool_hits;
+	*misses = zero_pool_misses;
+}
+
 void
 dma_frame(
 		page_t *page,
@@ -246,6 +453,8 @@ dma_frame(
 	page->frame   = address / 0x1000;
 	if (address < nframes * 4 * 0x400) {
 		set_frame(address);
+		frame_table[address / 0x1000].owner  = FRAME_OWNER_DMA;
+		frame_table[address / 0x1000].flags |= FRAME_FLAG_PINNED;
 	}
 }
 
@@ -257,34 +466,201 @@ free_frame(
 	if (!(frame = page->frame)) {
 		assert(0);
 		return;
+	} else if (page->swapped) {
+		swap_free(frame);
+		page->frame   = 0x0;
+		page->swapped = 0;
+		page->cow     = 0;
 	} else {
-		clear_frame(frame * 0x1000);
+		frame_release(frame);
 		page->frame = 0x0;
+		page->cow   = 0;
+	}
+}
+
+/*
+ * Take an additional reference to a frame.
+ */
+void
+frame_ref(
+		uint32_t frame
+		) {
+	if (frame >= nframes) return;
+	spin_lock(&frame_alloc_lock);
+	if (!frame_table[frame].refcount) {
+		/* Marked in use without being allocated (eg. by set_frame) */
+		frame_table[frame].refcount = 1;
+	}
+	frame_table[frame].refcount++;
+	spin_unlock(&frame_alloc_lock);
+}
+
+/*
+ * Drop a reference to a frame, returning it to the allocator
+ * when the last one goes away. Returns 1 if the frame was freed.
+ */
+int
+frame_release(
+		uint32_t frame
+		) {
+	if (frame >= nframes) return 0;
+	int freed = 0;
+	spin_lock(&frame_alloc_lock);
+	frame_t * f = &frame_table[frame];
+	if (f->refcount > 1) {
+		/* Someone else still has this frame */
+		f->refcount--;
+	} else if (!(f->flags & FRAME_FLAG_PINNED)) {
+		f->refcount = 0;
+		f->flags    = 0;
+		f->owner    = FRAME_OWNER_NONE;
+		clear_frame(frame * 0x1000);
+		freed = 1;
+	}
+	spin_unlock(&frame_alloc_lock);
+	return freed;
+}
+
+void
+frame_set_owner(
+		uint32_t frame,
+		uint8_t owner
+		) {
+	if (frame >= nframes) return;
+	frame_table[frame].owner = owner;
+}
+
+/*
+ * Share the frame behind `src` with `dest` (which should be empty).
+ * Writeable private pages become read-only copy-on-write in both places;
+ * the caller is responsible for flushing the source's TLB entries.
+ */
+void
+share_frame(
+		page_t *src,
+		page_t *dest
+		) {
+	if (src->swapped) {
+		/* Both will read their own copy back in */
+		*dest = *src;
+		swap_dup(src->frame);
+		return;
 	}
+	if (src->rw && !src->shared) {
+		src->rw  = 0;
+		src->cow = 1;
+	}
+	*dest = *src;
+	dest->accessed = 0;
+	frame_ref(src->frame);
+}
+
+/*
+ * Resolve a write to a copy-on-write page. If we are the last
+ * user of the frame we simply take it back; otherwise we copy it
+ * into a fresh frame and drop our reference to the shared one.
+ * Pages in regions without write access (mprotect()) stay as they
+ * are, and the write is a segmentation fault.
+ */
+static int
+copy_on_write(
+		uintptr_t address
+		) {
+	page_t * page = get_page(address, 0, current_directory);
+	if (!page || !page->present) {
+		return 0;
+	}
+	if (!page->cow) {
+		if (page->rw && page->user) {
+			/* Another thread's fault on another processor got here first; try again */
+			invalidate_tables_at(address & 0xFFFFF000);
+			return 1;
+		}
+		return 0;
+	}
+
+	vma_t * vma = vma_find(current_directory, address);
+	if (vma && !(vma->flags & VMA_WRITE)) {
+		return 0;
+	}
+
+	uint32_t old = page->frame;
+	spin_lock(&frame_alloc_lock);
+	if (old >= nframes || frame_table[old].refcount <= 1) {
+		spin_unlock(&frame_alloc_lock);
+	} else {
+		uint32_t index = first_frame();
+		set_frame(index * 0x1000);
+		frame_table[index].refcount = 1;
+		frame_table[index].flags    = 0;
+		frame_table[index].owner    = FRAME_OWNER_USER;
+		frame_table[old].refcount--;
+		spin_unlock(&frame_alloc_lock);
+		copy_page_physical(old * 0x1000, index * 0x1000);
+		page->frame = index;
+	}
+	page->cow = 0;
+	page->rw  = 1;
+	invalidate_tables_at(address & 0xFFFFF000);
+	return 1;
 }
 
 uintptr_t memory_use(void ) {
-	uintptr_t ret = 0;
-	uint32_t i, j;
-	for (i = 0; i < INDEX_FROM_BIT(nframes); ++i) {
-		for (j = 0; j < 32; ++j) {
-			uint32_t testFrame = 0x1 << j;
-			if (frames[i] & testFrame) {
-				ret++;
-			}
+	/* Pooled zero frames are still available */
+	return (frames_used - zero_pool_top) * 4;
+}
+
+/*
+ * Fragmentation statistics: the number of separate runs of free
+ * frames and the length of the longest one, in frames.
+ */
+void memory_fragmentation(uintptr_t * largest, uintptr_t * extents) {
+	uint32_t run = 0;
+	*largest = 0;
+	*extents = 0;
+	for (uint32_t i = 0; i < nframes; ++i) {
+		if (!(i & 0x1F) && frames[INDEX_FROM_BIT(i)] == 0xFFFFFFFF) {
+			if (run) (*extents)++;
+			run = 0;
+			i += 0x1F;
+			continue;
+		}
+		if (test_frame(i * 0x1000)) {
+			if (run) (*extents)++;
+			run = 0;
+		} else {
+			if (++run > *largest) *largest = run;
 		}
 	}
-	return ret * 4;
+	if (run) (*extents)++;
 }
 
 uintptr_t memory_total(){
 	return nframes * 4;
 }
 
+static int cpu_has_pse(void) {
+	uint32_t eax = 1, ebx, ecx, edx;
+	asm volatile ("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+	return (edx & (1 << 3)) ? 1 : 0;
+}
+
+static int cpu_has_sse2(void) {
+	uint32_t eax = 1, ebx, ecx, edx;
+	asm volatile ("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+	return (edx & (1 << 26)) ? 1 : 0;
+}
+
 void paging_install(uint32_t memsize) {
 	nframes = memsize  / 4;
 	frames  = (uint32_t *)kmalloc(INDEX_FROM_BIT(nframes * 8));
-	memset(frames, 0, INDEX_FROM_BIT(nframes));
+	memset(frames, 0, INDEX_FROM_BIT(nframes * 8));
+	frame_table = (frame_t *)kmalloc(nframes * sizeof(frame_t));
+	memset(frame_table, 0, nframes * sizeof(frame_t));
+
+	if (cpu_has_sse2()) {
+		zero_page = zero_page_physical_nt;
+	}
 
 	uintptr_t phys;
 	kernel_directory = (page_directory_t *)kvmalloc_p(sizeof(page_directory_t),&phys);
@@ -293,9 +669,19 @@ void paging_install(uint32_t memsize) {
 
 void paging_mark_system(uint64_t addr) {
 	set_frame(addr);
+	if (addr / 0x1000 < nframes) {
+		frame_table[addr / 0x1000].owner  = FRAME_OWNER_KERNEL;
+		frame_table[addr / 0x1000].flags |= FRAME_FLAG_PINNED;
+	}
 }
 
 void paging_finalize(void) {
+	/* Map the time page for user processes; the kernel writes to it through `time_page` */
+	uintptr_t time_phys;
+	time_page = (struct time_page *)kvmalloc_p(0x1000, &time_phys);
+	memset(time_page, 0, 0x1000);
+	dma_frame(get_page(TIME_PAGE_ADDR, 1, kernel_directory), 0, 0, time_phys);
+
 	debug_print(INFO, "Placement pointer is at 0x%x", placement_pointer);
 #if 1
 	get_page(0,1,kernel_directory)->present = 0;
@@ -304,13 +690,13 @@ void paging_finalize(void) {
 #else
 	for (uintptr_t i = 0x0; i < 0x80000; i += 0x1000) {
 #endif
-		dma_frame(get_page(i, 1, kernel_directory), 1, 0, i);
+		dma_frame(get_page(i, 1, kernel_directory), 1, 1, i);
 	}
 	for (uintptr_t i = 0x80000; i < 0x100000; i += 0x1000) {
-		dma_frame(get_page(i, 1, kernel_directory), 1, 0, i);
+		dma_frame(get_page(i, 1, kernel_directory), 1, 1, i);
 	}
 	for (uintptr_t i = 0x100000; i < placement_pointer + 0x3000; i += 0x1000) {
-		dma_frame(get_page(i, 1, kernel_directory), 1, 0, i);
+		dma_frame(get_page(i, 1, kernel_directory), 1, 1, i);
 	}
 	debug_print(INFO, "Mapping VGA text-mode directly.");
 	for (uintptr_t j = 0xb8000; j < 0xc0000; j += 0x1000) {
@@ -329,13 +715,37 @@ void paging_finalize(void) {
 
 	/* Kernel Heap Space */
 	for (uintptr_t i = placement_pointer + 0x3000; i < tmp_heap_start; i += 0x1000) {
-		alloc_frame(get_page(i, 1, kernel_directory), 1, 0);
+		page_t * page = get_page(i, 1, kernel_directory);
+		if (!test_frame(i)) {
+			/* Identity-map it when we can, so it can be covered by a large page */
+			dma_frame(page, 1, 1, i);
+			frame_table[i / 0x1000].owner    = FRAME_OWNER_KERNEL;
+			frame_table[i / 0x1000].flags    = 0;
+			frame_table[i / 0x1000].refcount = 1;
+		} else {
+			alloc_frame(page, 1, 1);
+		}
 	}
 	/* And preallocate the page entries for all the rest of the kernel heap as well */
 	for (uintptr_t i = tmp_heap_start; i < KERNEL_HEAP_END; i += 0x1000) {
 		get_page(i, 1, kernel_directory);
 	}
 
+	if (cpu_has_pse()) {
+		uint32_t cr4;
+		asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+		cr4 |= 0x10;
+		asm volatile ("mov %0, %%cr4" :: "r"(cr4));
+		large_pages = 1;
+
+		/* Not the first 4MB, which has the NULL page */
+		int count = 0;
+		for (uintptr_t i = LARGE_PAGE_SIZE; i + LARGE_PAGE_SIZE <= tmp_heap_start; i += LARGE_PAGE_SIZE) {
+			count += map_large(kernel_directory, i);
+		}
+		debug_print(NOTICE, "Using 4MB pages; %d cover the low kernel region", count);
+	}
+
 	debug_print(NOTICE, "Setting directory.");
 	current_directory = clone_directory(kernel_directory);
 	switch_page_directory(kernel_directory);
@@ -356,27 +766,27 @@ uintptr_t map_to_physical(uintptr_t virtual) {
 }
 
 void debug_print_directory(page_directory_t * arg) {
-	page_directory_t * current_directory = arg;
-	debug_print(INSANE, " ---- [k:0x%x u:0x%x]", kernel_directory, current_directory);
+	page_directory_t * dir = arg;
+	debug_print(INSANE, " ---- [k:0x%x u:0x%x]", kernel_directory, dir);
 	for (uintptr_t i = 0; i < 1024; ++i) {
-		if (!current_directory->tables[i] || (uintptr_t)current_directory->tables[i] == (uintptr_t)0xFFFFFFFF) {
+		if (!dir->tables[i] || (uintptr_t)dir->tables[i] == (uintptr_t)0xFFFFFFFF) {
 			continue;
 		}
-		if (kernel_directory->tables[i] == current_directory->tables[i]) {
-			debug_print(INSANE, "  0x%x - kern [0x%x/0x%x] 0x%x", current_directory->tables[i], &current_directory->tables[i], &kernel_directory->tables[i], i * 0x1000 * 1024);
+		if (kernel_directory->tables[i] == dir->tables[i]) {
+			debug_print(INSANE, "  0x%x - kern [0x%x/0x%x] 0x%x", dir->tables[i], &dir->tables[i], &kernel_directory->tables[i], i * 0x1000 * 1024);
 			for (uint16_t j = 0; j < 1024; ++j) {
 #if 1
-				page_t *  p= &current_directory->tables[i]->pages[j];
+				page_t *  p= &dir->tables[i]->pages[j];
 				if (p->frame) {
 					debug_print(INSANE, " k  0x%x 0x%x %s", (i * 1024 + j) * 0x1000, p->frame * 0x1000, p->present ? "[present]" : "");
 				}
 #endif
 			}
 		} else {
-			debug_print(INSANE, "  0x%x - user [0x%x] 0x%x [0x%x]", current_directory->tables[i], &current_directory->tables[i], i * 0x1000 * 1024, kernel_directory->tables[i]);
+			debug_print(INSANE, "  0x%x - user [0x%x] 0x%x [0x%x]", dir->tables[i], &dir->tables[i], i * 0x1000 * 1024, kernel_directory->tables[i]);
 			for (uint16_t j = 0; j < 1024; ++j) {
 #if 1
-				page_t *  p= &current_directory->tables[i]->pages[j];
+				page_t *  p= &dir->tables[i]->pages[j];
 				if (p->frame) {
 					debug_print(INSANE, "    0x%x 0x%x %s", (i * 1024 + j) * 0x1000, p->frame * 0x1000, p->present ? "[present]" : "");
 				}
@@ -392,10 +802,14 @@ switch_page_directory(
 		page_directory_t * dir
 		) {
 	current_directory = dir;
+	if (dir != kernel_directory && dir->kernel_generation != kernel_generation) {
+		sync_kernel_tables(dir);
+	}
 	asm volatile (
 			"mov %0, %%cr3\n"
 			"mov %%cr0, %%eax\n"
-			"orl $0x80000000, %%eax\n"
+			/* Paging, and write-protect so the kernel honors copy-on-write too */
+			"orl $0x80010000, %%eax\n"
 			"mov %%eax, %%cr0\n"
 			:: "r"(dir->physical_address)
 			: "%eax");
@@ -406,6 +820,8 @@ void invalidate_page_tables(void) {
 			"movl %%cr3, %%eax\n"
 			"movl %%eax, %%cr3\n"
 			::: "%eax");
+	/* Other processors may be running in this directory too */
+	tlb_shootdown(current_directory);
 }
 
 void invalidate_tables_at(uintptr_t addr) {
@@ -413,6 +829,7 @@ void invalidate_tables_at(uintptr_t addr) {
 			"movl %0,%%eax\n"
 			"invlpg (%%eax)\n"
 			:: "r"(addr) : "%eax");
+	tlb_shootdown(current_directory);
 }
 
 page_t *
@@ -436,6 +853,191 @@ get_page(
 	}
 }
 
+/*
+ * Allocate 1024 free frames making up an aligned 4MB block of
+ * physical memory. Returns the first frame, or -1 if there is no
+ * such block free.
+ */
+uint32_t
+alloc_large_frames(
+		uint8_t owner
+		) {
+	uint32_t found = (uint32_t)-1;
+	spin_lock(&frame_alloc_lock);
+	/* Skip the first block; it's full of BIOS and boot data anyway */
+	for (uint32_t block = 1; (block + 1) * 1024 <= nframes; ++block) {
+		uint32_t * words = &frames[block * 32];
+		uint32_t j;
+		for (j = 0; j < 32 && !words[j]; ++j);
+		if (j < 32) continue;
+
+		for (uint32_t i = 0; i < 1024; ++i) {
+			uint32_t frame = block * 1024 + i;
+			set_frame(frame * 0x1000);
+			frame_table[frame].refcount = 1;
+			frame_table[frame].flags    = 0;
+			frame_table[frame].owner    = owner;
+		}
+		found = block * 1024;
+		break;
+	}
+	spin_unlock(&frame_alloc_lock);
+	return found;
+}
+
+/*
+ * Bring a directory up to date with the large pages in kernel_directory.
+ */
+static void
+sync_kernel_tables(
+		page_directory_t * dir
+		) {
+	for (uint32_t i = 0; i < 1024; ++i) {
+		if (dir->tables[i] && dir->tables[i] == kernel_directory->tables[i]) {
+			dir->physical_tables[i] = kernel_directory->physical_tables[i];
+		}
+	}
+	dir->kernel_generation = kernel_generation;
+}
+
+/*
+ * Switch the 4MB at `address` (already mapped, through one page table,
+ * to an aligned and contiguous block of frames) over to a single large
+ * page. Returns 0 if the mapping doesn't allow it.
+ */
+int
+map_large(
+		page_directory_t * dir,
+		uintptr_t address
+		) {
+	if (!large_pages || (address % LARGE_PAGE_SIZE)) {
+		return 0;
+	}
+	uint32_t index = address / LARGE_PAGE_SIZE;
+	page_table_t * table = dir->tables[index];
+	if (!table || (dir->physical_tables[index] & PAGE_DIR_LARGE)) {
+		return 0;
+	}
+
+	page_t * first = &table->pages[0];
+	if (!first->present || (first->frame % 1024)) {
+		return 0;
+	}
+	for (uint32_t i = 1; i < 1024; ++i) {
+		page_t * page = &table->pages[i];
+		if (!page->present || page->frame != first->frame + i ||
+			page->rw != first->rw || page->user != first->user) {
+			return 0;
+		}
+	}
+
+	dir->physical_tables[index] = (first->frame * 0x1000) | PAGE_DIR_LARGE | 0x1 |
+		(first->rw ? 0x2 : 0) | (first->user ? 0x4 : 0);
+
+	if (dir == kernel_directory) {
+		/* Everyone else picks this up when they next switch in */
+		kernel_generation++;
+		if (current_directory != kernel_directory) {
+			sync_kernel_tables(current_directory);
+		}
+	}
+	invalidate_page_tables();
+	return 1;
+}
+
+/*
+ * Go back to mapping the 4MB at `address` through its page table.
+ */
+void
+unmap_large(
+		page_directory_t * dir,
+		uintptr_t address
+		) {
+	uint32_t index = address / LARGE_PAGE_SIZE;
+	if (!(dir->physical_tables[index] & PAGE_DIR_LARGE)) {
+		return;
+	}
+	dir->physical_tables[index] = map_to_physical((uintptr_t)dir->tables[index]) | 0x7;
+	invalidate_page_tables();
+}
+
+/*
+ * Map device memory [physical, physical + size) at `address` in the
+ * kernel directory, using large pages wherever the range allows.
+ */
+void
+map_physical(
+		uintptr_t address,
+		uintptr_t physical,
+		size_t size,
+		int is_kernel
+		) {
+	for (uintptr_t i = 0; i < size; i += 0x1000) {
+		dma_frame(get_page(address + i, 1, kernel_directory), is_kernel, 1, physical + i);
+	}
+	for (uintptr_t i = (address + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1); i + LARGE_PAGE_SIZE <= address + size; i += LARGE_PAGE_SIZE) {
+		map_large(kernel_directory, i);
+	}
+}
+
+/*
+ * Grow the kernel heap by a whole large page at `address`, if we can
+ * spare a 4MB block of physical memory for it.
+ */
+static int
+heap_large_block(
+		uintptr_t address
+		) {
+	if (!large_pages || address + LARGE_PAGE_SIZE > KERNEL_HEAP_END) {
+		return 0;
+	}
+	if ((memory_total() - memory_use()) / 4 < HEAP_LARGE_MIN_FREE) {
+		return 0;
+	}
+	uint32_t base = alloc_large_frames(FRAME_OWNER_KERNEL);
+	if (base == (uint32_t)-1) {
+		return 0;
+	}
+
+	page_t * page = get_page(address, 0, kernel_directory);
+	for (uint32_t i = 0; i < 1024; ++i) {
+		page[i].frame   = base + i;
+		page[i].present = 1;
+		page[i].rw      = 1;
+		page[i].user    = 0;
+	}
+	map_large(kernel_directory, address);
+	memset((void *)address, 0, LARGE_PAGE_SIZE);
+
+	debug_print(INFO, "Kernel heap gained a large page at 0x%x (frames at 0x%x)", address, base * 0x1000);
+	return 1;
+}
+
+/*
+ * Map `count` existing frames at `address`, looking up
+ * each page table once rather than once per page.
+ */
+void
+map_frames(
+		page_directory_t * dir,
+		uintptr_t address,
+		uintptr_t * frames,
+		uint32_t count,
+		int is_writeable
+		) {
+	uint32_t i = 0;
+	while (i < count) {
+		page_t * page = get_page(address + i * 0x1000, 1, dir);
+		uint32_t in_table = 1024 - ((address / 0x1000 + i) % 1024);
+		for (uint32_t j = 0; j < in_table && i < count; ++j, ++i) {
+			page[j].frame   = frames[i];
+			page[j].present = 1;
+			page[j].rw      = is_writeable ? 1 : 0;
+			page[j].user    = 1;
+		}
+	}
+}
+
 void
 page_fault(
 		struct regs *r)  {
@@ -443,12 +1045,33 @@ page_fault(
 	asm volatile("mov %%cr2, %0" : "=r"(faulting_address));
 
 	if (r->eip == SIGNAL_RETURN) {
-		return_from_signal_handler();
+		return_from_signal_handler(r);
+		return;
 	} else if (r->eip == THREAD_RETURN) {
 		debug_print(INFO, "Returned from thread.");
 		kexit(0);
 	}
 
+	TRACE(TRACE_PAGE_FAULT, faulting_address, r->eip);
+
+	if (!(r->err_code & 0x1) && faulting_address < SHM_START) {
+		/* Not present; may have been swapped out */
+		if (swap_fault(r, faulting_address)) {
+			return;
+		}
+		/* ... or be part of a region we populate on demand */
+		if (vma_fault(r, faulting_address)) {
+			return;
+		}
+	}
+
+	if ((r->err_code & 0x3) == 0x3 && faulting_address < SHM_START) {
+		/* Write to a present page; may be a copy-on-write page */
+		if (copy_on_write(faulting_address)) {
+			return;
+		}
+	}
+
 #if 1
 	int present  = !(r->err_code & 0x1) ? 1 : 0;
 	int rw       = r->err_code & 0x2    ? 1 : 0;
@@ -510,7 +1133,12 @@ page_fault(
 
 #endif
 
-	signal_t * sig = malloc(sizeof(signal_t));
+	if ((r->cs & 0x3) != 0x3) {
+		/* There is no going back to the kernel code that faulted to run a handler */
+		kexit(128 + SIGSEGV);
+	}
+
+	signal_t * sig = signal_alloc();
 	sig->handler = current_process->signals.functions[SIGSEGV];
 	sig->signum  = SIGSEGV;
 	handle_signal((process_t *)current_process, sig);
@@ -536,18 +1164,30 @@ void * sbrk(uintptr_t increment) {
 	assert((heap_end + increment <= KERNEL_HEAP_END - 1) && "The kernel has attempted to allocate beyond the end of its heap.");
 	uintptr_t address = heap_end;
 
-	if (heap_end + increment > kernel_heap_alloc_point) {
+	/* Anything below the allocation point was mapped at boot and may be dirty */
+	uintptr_t mapped = heap_end + increment;
+	if (mapped > kernel_heap_alloc_point) {
+		mapped = (heap_end > kernel_heap_alloc_point) ? heap_end : kernel_heap_alloc_point;
 		debug_print(INFO, "Hit the end of available kernel heap, going to allocate more (at 0x%x, want to be at 0x%x)", heap_end, heap_end + increment);
-		for (uintptr_t i = heap_end; i < heap_end + increment; i += 0x1000) {
+		for (uintptr_t i = mapped; i < heap_end + increment; i += 0x1000) {
+			page_t * page = get_page(i, 0, kernel_directory);
+			if (page->present) {
+				/* Part of a large page we took earlier */
+				continue;
+			}
+			if (!(i % LARGE_PAGE_SIZE) && heap_large_block(i)) {
+				i += LARGE_PAGE_SIZE - 0x1000;
+				continue;
+			}
 			debug_print(INFO, "Allocating frame at 0x%x...", i);
-			alloc_frame(get_page(i, 0, kernel_directory), 1, 0);
+			alloc_frame_zeroed(page, 1, 1);
 		}
 		invalidate_page_tables();
 		debug_print(INFO, "Done.");
 	}
 
 	heap_end += increment;
-	memset((void *)address, 0x0, increment);
+	memset((void *)address, 0x0, mapped - address);
 	return (void *)address;
 }
 
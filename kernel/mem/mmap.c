@@ -0,0 +1,243 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2014 Kevin Lange
+ *
+ * Memory Mappings
+ *
+ * mmap(), munmap() and mprotect() for the region of the user
+ * address space between USER_MMAP_START and USER_MMAP_END.
+ * Mappings are described by regions (vma_t) and populated
+ * from page_fault() as they are touched.
+ */
+#include <system.h>
+#include <process.h>
+#include <logging.h>
+#include <mem.h>
+#include <fs.h>
+#include <shm.h>
+#include <vma.h>
+#include <mman.h>
+
+static volatile uint8_t mmap_lock = 0;
+
+#define PAGE_ALIGN(x) (((x) + 0xFFF) & 0xFFFFF000)
+
+static int in_mmap_area(uintptr_t addr, size_t length) {
+	return addr >= USER_MMAP_START && addr < USER_MMAP_END &&
+		length <= USER_MMAP_END - addr;
+}
+
+static uint32_t prot_to_flags(int prot) {
+	uint32_t flags = 0;
+	/* Everything that is mapped at all is readable on x86 */
+	if (prot & (PROT_READ | PROT_WRITE | PROT_EXEC)) flags |= VMA_READ;
+	if (prot & PROT_WRITE) flags |= VMA_WRITE;
+	if (prot & PROT_EXEC)  flags |= VMA_EXEC;
+	return flags;
+}
+
+/*
+ * Find `length` bytes of unused space in the mmap area, preferring `hint`.
+ */
+static uintptr_t find_gap(page_directory_t * dir, uintptr_t hint, size_t length) {
+	if (hint && in_mmap_area(hint, length)) {
+		vma_t * next = vma_find_next(dir, hint);
+		if (!next || (next->start >= hint && next->start - hint >= length)) {
+			return hint;
+		}
+	}
+	return vma_find_gap(dir, USER_MMAP_START, USER_MMAP_END, length);
+}
+
+/*
+ * Drop the pages (and frames) backing [start, end).
+ */
+static void unmap_pages(page_directory_t * dir, uintptr_t start, uintptr_t end) {
+	for (uintptr_t a = start; a < end; a += 0x1000) {
+		page_t * page = get_page(a, 0, dir);
+		if (!page) continue;
+		if (page->frame) {
+			free_frame(page);
+		}
+		memset(page, 0, sizeof(page_t));
+	}
+	invalidate_page_tables();
+}
+
+/*
+ * Make sure no region straddles `start` or `end`.
+ */
+static void split_at(page_directory_t * dir, uintptr_t start, uintptr_t end) {
+	vma_t * vma = vma_find(dir, start);
+	if (vma && vma->start < start) {
+		vma_split(dir, vma, start);
+	}
+	vma = vma_find(dir, end);
+	if (vma && vma->start < end) {
+		vma_split(dir, vma, end);
+	}
+}
+
+static int unmap_range(page_directory_t * dir, uintptr_t start, uintptr_t end) {
+	split_at(dir, start, end);
+
+	vma_t * vma;
+	while ((vma = vma_find_next(dir, start)) && vma->start < end) {
+		vma_remove(dir, vma);
+	}
+	unmap_pages(dir, start, end);
+	return 0;
+}
+
+uintptr_t mmap_region(uintptr_t addr, size_t length, int prot, int flags, fs_node_t * file, uint32_t offset) {
+	page_directory_t * dir = current_directory;
+
+	if (!length || (offset & 0xFFF)) {
+		return -EINVAL;
+	}
+	if (!(flags & MAP_SHARED) == !(flags & MAP_PRIVATE)) {
+		/* Exactly one of these */
+		return -EINVAL;
+	}
+
+	if (!(flags & MAP_ANONYMOUS)) {
+		if (!file) {
+			return -EBADF;
+		}
+		if (!(file->flags & FS_FILE)) {
+			return -ENODEV;
+		}
+		if ((flags & MAP_SHARED) && (prot & PROT_WRITE)) {
+			/* We have no way to write pages back to the file */
+			return -ENOTSUP;
+		}
+	}
+
+	length = PAGE_ALIGN(length);
+
+	spin_lock(&mmap_lock);
+
+	uintptr_t start;
+	if (flags & MAP_FIXED) {
+		if ((addr & 0xFFF) || !in_mmap_area(addr, length)) {
+			spin_unlock(&mmap_lock);
+			return -EINVAL;
+		}
+		start = addr;
+		unmap_range(dir, start, start + length);
+	} else {
+		start = find_gap(dir, addr & 0xFFFFF000, length);
+		if (!start) {
+			spin_unlock(&mmap_lock);
+			return -ENOMEM;
+		}
+	}
+
+	uint32_t vflags = prot_to_flags(prot);
+	vma_t * vma;
+
+	if (flags & MAP_ANONYMOUS) {
+		vma = vma_insert(dir, start, start + length, vflags, NULL, 0, 0);
+		if (flags & MAP_SHARED) {
+			vma->flags |= VMA_SHARED;
+			vma->chunk  = shm_chunk_anonymous(length);
+		}
+	} else {
+		/* Past the end of the file, pages are zero-filled */
+		uintptr_t file_end = start;
+		if (offset < file->length) {
+			size_t available = file->length - offset;
+			file_end = start + (available < length ? available : length);
+		}
+		vma = vma_insert(dir, start, start + length, vflags, file, offset, file_end);
+		if (flags & MAP_SHARED) {
+			/* Read-only, so the same as private for now, but it may never be made writeable */
+			vma->flags |= VMA_SHARED;
+		}
+	}
+
+	spin_unlock(&mmap_lock);
+
+	debug_print(INFO, "mmap 0x%x bytes at 0x%x (prot=0x%x, flags=0x%x)", length, start, prot, flags);
+
+	return start;
+}
+
+int munmap_region(uintptr_t addr, size_t length) {
+	if ((addr & 0xFFF) || !length) {
+		return -EINVAL;
+	}
+	length = PAGE_ALIGN(length);
+	if (!in_mmap_area(addr, length)) {
+		return -EINVAL;
+	}
+
+	spin_lock(&mmap_lock);
+	unmap_range(current_directory, addr, addr + length);
+	spin_unlock(&mmap_lock);
+
+	return 0;
+}
+
+int mprotect_region(uintptr_t addr, size_t length, int prot) {
+	page_directory_t * dir = current_directory;
+
+	if ((addr & 0xFFF) || !length) {
+		return -EINVAL;
+	}
+	length = PAGE_ALIGN(length);
+	if (!in_mmap_area(addr, length)) {
+		return -EINVAL;
+	}
+
+	spin_lock(&mmap_lock);
+
+	/* The whole range must be mapped */
+	for (uintptr_t a = addr; a < addr + length; a += 0x1000) {
+		vma_t * vma = vma_find(dir, a);
+		if (!vma) {
+			spin_unlock(&mmap_lock);
+			return -ENOMEM;
+		}
+		if ((prot & PROT_WRITE) && vma->file && (vma->flags & VMA_SHARED)) {
+			spin_unlock(&mmap_lock);
+			return -EACCES;
+		}
+		a = vma->end - 0x1000;
+	}
+
+	split_at(dir, addr, addr + length);
+
+	uint32_t vflags = prot_to_flags(prot);
+	for (uintptr_t a = addr; a < addr + length; a += 0x1000) {
+		vma_t * vma = vma_find(dir, a);
+		vma->flags = (vma->flags & VMA_SHARED) | vflags;
+		a = vma->end - 0x1000;
+	}
+
+	/* Update any pages that are already present */
+	for (uintptr_t a = addr; a < addr + length; a += 0x1000) {
+		page_t * page = get_page(a, 0, dir);
+		if (!page || !page->frame) continue;
+		/* Swapped-out pages pick up the new protection when they come back */
+		page->present = ((vflags & VMA_READ) && !page->swapped) ? 1 : 0;
+		if (!(vflags & VMA_WRITE) || page->cow) {
+			/* Copy-on-write pages stay read-only until the fault copies them */
+			page->rw = 0;
+		} else if (!page->shared && !page->swapped && page->frame < nframes && frame_table[page->frame].refcount > 1) {
+			/*
+			 * A private page that was read-only when we forked, so its
+			 * frame is still shared without being copy-on-write.
+			 */
+			page->cow = 1;
+			page->rw  = 0;
+		} else {
+			page->rw = 1;
+		}
+	}
+	invalidate_page_tables();
+
+	spin_unlock(&mmap_lock);
+	return 0;
+}
@@ -11,6 +11,7 @@
 #include <logging.h>
 #include <shm.h>
 #include <mem.h>
+#include <vma.h>
 #include <tree.h>
 #include <list.h>
 
@@ -79,7 +80,25 @@ static shm_node_t * get_node (char * shm_path, int create) {
 /* Create and Release */
 
 
-static shm_chunk_t * create_chunk (shm_node_t * parent, size_t size) {
+/* Try to back a chunk with whole 4MB blocks of frames */
+static int alloc_large_chunk (shm_chunk_t * chunk) {
+	for (uint32_t i = 0; i < chunk->num_frames; i += 1024) {
+		uint32_t base = alloc_large_frames(FRAME_OWNER_SHM);
+		if (base == (uint32_t)-1) {
+			/* Give back what we got */
+			for (uint32_t j = 0; j < i; ++j) {
+				frame_release(chunk->frames[j]);
+			}
+			return 0;
+		}
+		for (uint32_t j = 0; j < 1024; ++j) {
+			chunk->frames[i + j] = base + j;
+		}
+	}
+	return 1;
+}
+
+static shm_chunk_t * create_chunk (shm_node_t * parent, size_t size, int large) {
 	debug_print(WARNING, "Size supplied to create_chunk was 0");
 	if (!size) return NULL;
 
@@ -92,19 +111,40 @@ static shm_chunk_t * create_chunk (shm_node_t * parent, size_t size) {
 	chunk->parent = parent;
 	chunk->lock = 0;
 	chunk->ref_count = 1;
+	chunk->large = 0;
 
 	chunk->num_frames = (size / 0x1000) + ((size % 0x1000) ? 1 : 0);
-	chunk->frames = malloc(sizeof(uintptr_t) * chunk->num_frames);
+
+	/* Room for a whole number of 4MB blocks, in case we get them */
+	uint32_t slots = chunk->num_frames;
+	if (large && large_pages) {
+		slots = (slots + 1023) & ~1023;
+	}
+
+	chunk->frames = malloc(sizeof(uintptr_t) * slots);
 	if (chunk->frames == NULL) {
-		debug_print(ERROR, "Failed to allocate uintptr_t[%d]", chunk->num_frames);
+		debug_print(ERROR, "Failed to allocate uintptr_t[%d]", slots);
 		free(chunk);
 		return NULL;
 	}
 
+	if (large && large_pages) {
+		uint32_t num_frames = chunk->num_frames;
+		chunk->num_frames = slots;
+		if (alloc_large_chunk(chunk)) {
+			chunk->large = 1;
+			return chunk;
+		}
+		/* Normal pages only need to cover what was asked for */
+		chunk->num_frames = num_frames;
+		debug_print(WARNING, "No 4MB blocks free for shm chunk %s, using normal pages", parent->name);
+	}
+
 	/* Now grab some frames for this guy. */
 	for (uint32_t i = 0; i < chunk->num_frames; i++) {
-		page_t tmp = {0,0,0,0,0,0,0};
+		page_t tmp = {0};
 		alloc_frame(&tmp, 0, 0);
+		frame_set_owner(tmp.frame, FRAME_OWNER_SHM);
 		chunk->frames[i] = tmp.frame;
 #if 0
 		debug_print(WARNING, "Using frame 0x%x for chunk[%d] (name=%s)", tmp.frame * 0x1000, i, parent->name);
@@ -126,11 +166,15 @@ static int release_chunk (shm_chunk_t * chunk) {
 
 			/* First, free the frames used by this chunk */
 			for (uint32_t i = 0; i < chunk->num_frames; i++) {
-				clear_frame(chunk->frames[i] * 0x1000);
+				if (chunk->frames[i]) {
+					frame_release(chunk->frames[i]);
+				}
 			}
 
 			/* Then, get rid of the damn thing */
-			chunk->parent->chunk = NULL;
+			if (chunk->parent) {
+				chunk->parent->chunk = NULL;
+			}
 			free(chunk->frames);
 			free(chunk);
 		}
@@ -141,21 +185,39 @@ static int release_chunk (shm_chunk_t * chunk) {
 	return -1;
 }
 
+shm_chunk_t * shm_chunk_anonymous(size_t size) {
+	shm_chunk_t * chunk = malloc(sizeof(shm_chunk_t));
 
-/* Mapping and Unmapping */
+	chunk->parent = NULL;
+	chunk->lock = 0;
+	chunk->ref_count = 1;
+	chunk->large = 0;
+
+	chunk->num_frames = (size / 0x1000) + ((size % 0x1000) ? 1 : 0);
+	chunk->frames = malloc(sizeof(uintptr_t) * chunk->num_frames);
+	/* No frames yet, they are allocated as the mapping is faulted in */
+	memset(chunk->frames, 0, sizeof(uintptr_t) * chunk->num_frames);
 
-static uintptr_t proc_sbrk(uint32_t num_pages, process_t * proc) {
-	uintptr_t initial = proc->image.shm_heap;
-	assert(!(initial & 0xFFF) && "shm_heap not page-aligned!");
+	return chunk;
+}
 
-	if (initial % 0x1000) {
-		initial += 0x1000 - (initial % 0x1000);
-		proc->image.shm_heap = initial;
-	}
-	proc->image.shm_heap += num_pages * 0x1000;
-	assert(!(proc->image.shm_heap & 0xFFF) && "math is wrong, dumbass");
+void shm_chunk_ref(shm_chunk_t * chunk) {
+	spin_lock(&bsl);
+	chunk->ref_count++;
+	spin_unlock(&bsl);
+}
+
+void shm_chunk_release(shm_chunk_t * chunk) {
+	spin_lock(&bsl);
+	release_chunk(chunk);
+	spin_unlock(&bsl);
+}
+
+
+/* Mapping and Unmapping */
 
-	return initial;
+static size_t chunk_size (shm_chunk_t * chunk) {
+	return (size_t)(chunk->num_frames * 0x1000);
 }
 
 static void * map_in (shm_chunk_t * chunk, process_t * proc) {
@@ -163,93 +225,71 @@ static void * map_in (shm_chunk_t * chunk, process_t * proc) {
 		return NULL;
 	}
 
-	shm_mapping_t * mapping = malloc(sizeof(shm_mapping_t));
-	mapping->chunk = chunk;
-	mapping->num_vaddrs = chunk->num_frames;
-	mapping->vaddrs = malloc(sizeof(uintptr_t) * mapping->num_vaddrs);
-
-	debug_print(INFO, "want %d bytes, running through mappings...", mapping->num_vaddrs * 0x1000);
-	uintptr_t last_address = SHM_START;
-	foreach(node, proc->shm_mappings) {
-		shm_mapping_t * m = node->value;
-		if (m->vaddrs[0] > last_address) {
-			size_t gap = (uintptr_t)m->vaddrs[0] - last_address;
-			debug_print(INFO, "gap found at 0x%x of size %d", last_address, gap);
-			if (gap >= mapping->num_vaddrs * 0x1000) {
-				debug_print(INFO, "Gap is sufficient, we can insert here.");
-
-				/* Map the gap */
-				for (unsigned int i = 0; i < chunk->num_frames; ++i) {
-					page_t * page = get_page(last_address + i * 0x1000, 1, proc->thread.page_directory);
-					page->frame = chunk->frames[i];
-					alloc_frame(page, 0, 1);
-					invalidate_tables_at(last_address + i * 0x1000);
-					mapping->vaddrs[i] = last_address + i * 0x1000;
-				}
+	page_directory_t * dir = proc->thread.page_directory;
+	size_t size = chunk_size(chunk);
 
-				/* Insert us before this node */
-				list_insert_before(proc->shm_mappings, node, mapping);
-
-				return (void *)mapping->vaddrs[0];
-			}
-		}
-		last_address = m->vaddrs[0] + m->num_vaddrs * 0x1000;
-		debug_print(INFO, "[0x%x:0x%x] %s", m->vaddrs[0], last_address, m->chunk->parent->name);
+	/* Large chunks need to start on a 4MB boundary */
+	size_t align = chunk->large ? LARGE_PAGE_SIZE - 0x1000 : 0;
+	uintptr_t start = vma_find_gap(dir, SHM_START, SHM_END, size + align);
+	if (!start) {
+		debug_print(ERROR, "No room left to map %d bytes of shared memory", size);
+		return NULL;
+	}
+	if (chunk->large) {
+		start = (start + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1);
 	}
-	if (proc->image.shm_heap > last_address) {
-		size_t gap = proc->image.shm_heap - last_address;
-		debug_print(INFO, "gap found at 0x%x of size %d", last_address, gap);
-		if (gap >= mapping->num_vaddrs * 0x1000) {
-			debug_print(INFO, "Gap is sufficient, we can insert here.");
-
-			for (unsigned int i = 0; i < chunk->num_frames; ++i) {
-				page_t * page = get_page(last_address + i * 0x1000, 1, proc->thread.page_directory);
-				page->frame = chunk->frames[i];
-				alloc_frame(page, 0, 1);
-				invalidate_tables_at(last_address + i * 0x1000);
-				mapping->vaddrs[i] = last_address + i * 0x1000;
-			}
 
-			list_insert(proc->shm_mappings, mapping);
+	/* The region holds the reference to the chunk */
+	vma_t * vma = vma_insert(dir, start, start + size, VMA_READ | VMA_WRITE | VMA_SHARED | VMA_SHM, NULL, 0, 0);
+	vma->chunk = chunk;
 
-			return (void *)mapping->vaddrs[0];
-		} else {
-			debug_print(INFO, "should be more efficient here - there is space available, but we are not going to use it");
+	map_frames(dir, start, chunk->frames, chunk->num_frames, 1);
+	if (chunk->large) {
+		for (uintptr_t addr = start; addr < start + size; addr += LARGE_PAGE_SIZE) {
+			map_large(dir, addr);
 		}
 	}
 
+	return (void *)start;
+}
 
-	for (uint32_t i = 0; i < chunk->num_frames; i++) {
-		uintptr_t new_vpage = proc_sbrk(1, proc);
-		assert(new_vpage % 0x1000 == 0);
-
-		page_t * page = get_page(new_vpage, 1, proc->thread.page_directory);
-		assert(page && "Page not allocated by sys_sbrk?");
+/* Unmap a shm_obtain() region and drop its reference to the chunk; bsl must be held */
+static void map_out (vma_t * vma, page_directory_t * dir) {
+	shm_chunk_t * chunk = vma->chunk;
 
-		page->frame = chunk->frames[i];
-		alloc_frame(page, 0, 1);
-		invalidate_tables_at(new_vpage);
-		mapping->vaddrs[i] = new_vpage;
+	for (uintptr_t addr = vma->start; addr < vma->end; addr += 0x1000) {
+		page_t * page = get_page(addr, 0, dir);
+		assert(page && "Shared memory mapping was invalid!");
 
-#if 0
-			debug_print(INFO, "mapping vaddr 0x%x --> #%d", new_vpage, page->frame);
-#endif
+		memset(page, 0, sizeof(page_t));
+	}
+	if (chunk->large) {
+		for (uintptr_t addr = vma->start; addr < vma->end; addr += LARGE_PAGE_SIZE) {
+			unmap_large(dir, addr);
+		}
 	}
 
-	list_insert(proc->shm_mappings, mapping);
-
-	return (void *)mapping->vaddrs[0];
+	vma->chunk = NULL;
+	vma_remove(dir, vma);
+	release_chunk(chunk);
 }
 
-static size_t chunk_size (shm_chunk_t * chunk) {
-	return (size_t)(chunk->num_frames * 0x1000);
+static vma_t * next_mapping (page_directory_t * dir, uintptr_t from) {
+	vma_t * vma = vma_find_next(dir, from);
+	while (vma && vma->start < SHM_END) {
+		if (vma->flags & VMA_SHM) {
+			return vma;
+		}
+		vma = vma_find_next(dir, vma->end);
+	}
+	return NULL;
 }
 
 
 /* Kernel-Facing Functions and Syscalls */
 
 
-void * shm_obtain (char * path, size_t * size) {
+static void * obtain (char * path, size_t * size, int large) {
 	spin_lock(&bsl);
 	process_t * proc = (process_t *)current_process;
 
@@ -272,7 +312,7 @@ void * shm_obtain (char * path, size_t * size) {
 			return NULL;
 		}
 
-		chunk = create_chunk(node, *size);
+		chunk = create_chunk(node, *size, large);
 		if (chunk == NULL) {
 			debug_print(ERROR, "Could not allocate a shm_chunk_t");
 			spin_unlock(&bsl);
@@ -285,6 +325,11 @@ void * shm_obtain (char * path, size_t * size) {
 		chunk->ref_count++;
 	}
 	void * vshm_start = map_in(chunk, proc);
+	if (!vshm_start) {
+		release_chunk(chunk);
+		spin_unlock(&bsl);
+		return NULL;
+	}
 	*size = chunk_size(chunk);
 
 	spin_unlock(&bsl);
@@ -293,6 +338,15 @@ void * shm_obtain (char * path, size_t * size) {
 	return vshm_start;
 }
 
+void * shm_obtain (char * path, size_t * size) {
+	return obtain(path, size, 0);
+}
+
+/* As shm_obtain(), but a new chunk is made of 4MB pages (and rounded up to fit them) */
+void * shm_obtain_large (char * path, size_t * size) {
+	return obtain(path, size, 1);
+}
+
 int shm_release (char * path) {
 	spin_lock(&bsl);
 	process_t * proc = (process_t *)current_process;
@@ -310,59 +364,35 @@ int shm_release (char * path) {
 	shm_chunk_t * chunk = _node->chunk;
 
 	/* Next, find the proc's mapping for that chunk */
-	node_t * node = NULL;
-	foreach (n, proc->shm_mappings) {
-		shm_mapping_t * m = (shm_mapping_t *)n->value;
-		if (m->chunk == chunk) {
-			node = n;
-			break;
-		}
+	page_directory_t * dir = proc->thread.page_directory;
+	vma_t * vma = next_mapping(dir, SHM_START);
+	while (vma && vma->chunk != chunk) {
+		vma = next_mapping(dir, vma->end);
 	}
-	if (node == NULL) {
+	if (vma == NULL) {
 		spin_unlock(&bsl);
 		return 1;
 	}
 
-	shm_mapping_t * mapping = (shm_mapping_t *)node->value;
-
-	/* Clear the mappings from the process's address space */
-	for (uint32_t i = 0; i < mapping->num_vaddrs; i++) {
-		page_t * page = get_page(mapping->vaddrs[i], 0, proc->thread.page_directory);
-		assert(page && "Shared memory mapping was invalid!");
-
-		memset(page, 0, sizeof(page_t));
-	}
+	/* Clear the mapping from the process's address space */
+	map_out(vma, dir);
 	invalidate_page_tables();
 
-	/* Clean up */
-	release_chunk(chunk);
-	list_delete(proc->shm_mappings, node);
-	free(node);
-	free(mapping);
-
 	spin_unlock(&bsl);
 	return 0;
 }
 
-/* This function should only be called if the process's address space
- * is about to be destroyed -- chunks will not be unmounted therefrom ! */
+/* Called before exec() replaces the process's address space */
 void shm_release_all (process_t * proc) {
 	spin_lock(&bsl);
 
-	node_t * node;
-	while ((node = list_pop(proc->shm_mappings)) != NULL) {
-		shm_mapping_t * mapping = node->value;
-		release_chunk(mapping->chunk);
-		free(mapping);
-		free(node);
+	page_directory_t * dir = proc->thread.page_directory;
+	vma_t * vma;
+	while ((vma = next_mapping(dir, SHM_START)) != NULL) {
+		map_out(vma, dir);
 	}
-
-	/* Empty, but don't free, the mappings list */
-	list_free(proc->shm_mappings);
-	proc->shm_mappings->head = proc->shm_mappings->tail = NULL;
-	proc->shm_mappings->length = 0;
+	invalidate_page_tables();
 
 	spin_unlock(&bsl);
 }
 
-
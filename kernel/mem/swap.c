@@ -0,0 +1,398 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2014 Kevin Lange
+ *
+ * Swap
+ *
+ * When free memory runs low, [kswapd] sweeps a clock hand over the
+ * user address spaces. Pages which have been accessed since the
+ * last sweep get a second chance (their accessed bit is cleared);
+ * the others are reclaimed. Clean pages which a region (vma_t) can
+ * fill in again are simply dropped, everything else is written to
+ * the swap area and read back from page_fault().
+ */
+#include <system.h>
+#include <process.h>
+#include <logging.h>
+#include <mem.h>
+#include <vma.h>
+#include <swap.h>
+#include <list.h>
+
+/* Thresholds, in free frames */
+#define SWAP_WAKE_FRAMES   2048 /* Wake [kswapd] below this */
+#define SWAP_TARGET_FRAMES 3072 /* ... which reclaims until we're back above this */
+#define SWAP_MIN_FRAMES    512  /* Faulting processes wait for [kswapd] below this */
+
+#define SWAP_BATCH         32   /* Pages to reclaim per scan */
+#define SWAP_SCAN_BUDGET   8192 /* Page table entries to look at per scan */
+#define SWAP_THROTTLE_MAX  100  /* Times a faulting process will yield to [kswapd] */
+
+/* page_t bits, for changing entries other processors may be changing too */
+#define PTE_PRESENT 0x01
+#define PTE_DIRTY   0x40
+
+swap_area_t * swap_area = NULL;
+
+static volatile uint8_t swap_map_lock = 0;
+static volatile uint8_t swap_io_lock = 0; /* Serializes slot reads and writes */
+static list_t * kswapd_queue = NULL;
+
+/* Bounce page for [kswapd]'s writes */
+static uint8_t * swap_bounce = NULL;
+static uintptr_t swap_bounce_phys = 0;
+
+/* The clock hand */
+static pid_t     scan_pid = 0;
+static uintptr_t scan_address = 0;
+static uint32_t  slot_hint = 1;
+
+static uint32_t free_frames(void) {
+	return (memory_total() - memory_use()) / 4;
+}
+
+static uint32_t slot_alloc(void) {
+	uint32_t slot = 0;
+	spin_lock(&swap_map_lock);
+	for (uint32_t i = 0; i < swap_area->slots - 1; ++i) {
+		uint32_t s = slot_hint + i;
+		if (s >= swap_area->slots) s -= swap_area->slots - 1;
+		if (!swap_area->map[s]) {
+			swap_area->map[s] = 1;
+			swap_area->used++;
+			slot_hint = s + 1;
+			if (slot_hint >= swap_area->slots) slot_hint = 1;
+			slot = s;
+			break;
+		}
+	}
+	spin_unlock(&swap_map_lock);
+	return slot;
+}
+
+/*
+ * Another page table entry refers to `slot` (fork).
+ */
+void swap_dup(uint32_t slot) {
+	if (!swap_area || !slot || slot >= swap_area->slots) return;
+	spin_lock(&swap_map_lock);
+	swap_area->map[slot]++;
+	spin_unlock(&swap_map_lock);
+}
+
+/*
+ * A page table entry referring to `slot` went away.
+ */
+void swap_free(uint32_t slot) {
+	if (!swap_area || !slot || slot >= swap_area->slots) return;
+	spin_lock(&swap_map_lock);
+	assert(swap_area->map[slot] && "Released a free swap slot.");
+	if (!--swap_area->map[slot]) {
+		swap_area->used--;
+	}
+	spin_unlock(&swap_map_lock);
+}
+
+static int reclaimable(page_t * page) {
+	if (!page->present || !page->user || page->shared) {
+		return 0;
+	}
+	if (page->frame >= nframes) {
+		return 0;
+	}
+	frame_t * f = &frame_table[page->frame];
+	/* Only frames with a single mapping; we have no way to find the others */
+	return f->refcount == 1 && f->owner == FRAME_OWNER_USER && !(f->flags & FRAME_FLAG_PINNED);
+}
+
+/*
+ * Take the page out of every processor's hands, unless it has been
+ * written since it was last marked clean; then it is left mapped
+ * and we return 0. Threads on other processors may be setting the
+ * accessed and dirty bits meanwhile, so the entry is only changed
+ * with locked operations until the shootdown is done.
+ */
+static int unmap_clean(page_directory_t * dir, page_t * page) {
+	__sync_fetch_and_and((uint32_t *)page, ~PTE_PRESENT);
+	tlb_shootdown(dir);
+	if (page->dirty) {
+		__sync_fetch_and_or((uint32_t *)page, PTE_PRESENT);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Reclaim the page at `address` in `dir`.
+ * Called with interrupts disabled; may enable them while writing.
+ */
+static int evict(page_directory_t * dir, uintptr_t address, page_t * page) {
+	uint32_t frame = page->frame;
+	vma_t * vma = vma_find(dir, address);
+
+	if (!page->dirty && vma && !vma->chunk && (vma->file || !(vma->flags & VMA_SHARED))) {
+		/* Unchanged since the region filled it in, so it can just do so again */
+		if (!unmap_clean(dir, page)) {
+			return 0;
+		}
+		memset(page, 0, sizeof(page_t));
+		frame_release(frame);
+		swap_area->discarded++;
+		return 1;
+	}
+
+	uint32_t slot = slot_alloc();
+	if (!slot) {
+		return 0;
+	}
+
+	spin_lock(&swap_io_lock);
+
+	/* Any write from here on marks the page dirty again and cancels the eviction */
+	__sync_fetch_and_and((uint32_t *)page, ~PTE_DIRTY);
+	tlb_shootdown(dir);
+	copy_page_physical(frame * 0x1000, swap_bounce_phys);
+
+	/* Hold on to the directory while we sleep */
+	dir->ref_count++;
+
+	IRQ_RES;
+	uint32_t written = write_fs(swap_area->node, slot * 0x1000, 0x1000, swap_bounce);
+	IRQ_OFF;
+
+	int reclaimed = 0;
+	page = get_page(address, 0, dir);
+	if (written == 0x1000 && page && page->present && page->frame == frame && !page->dirty && reclaimable(page) &&
+			unmap_clean(dir, page)) {
+		page->accessed = 0;
+		page->swapped  = 1;
+		page->frame    = slot;
+		frame_release(frame);
+		swap_area->swapped_out++;
+		reclaimed = 1;
+	} else {
+		if (written != 0x1000) {
+			debug_print(ERROR, "Failed to write swap slot %d", slot);
+		}
+		swap_free(slot);
+	}
+
+	spin_unlock(&swap_io_lock);
+	release_directory(dir);
+	return reclaimed;
+}
+
+/*
+ * The next address space for the clock hand to visit:
+ * the thread group leader with the lowest pid at or after `scan_pid`.
+ */
+static process_t * scan_process(void) {
+	process_t * best = NULL;
+	process_t * first = NULL;
+	foreach(node, process_list) {
+		process_t * proc = node->value;
+		if (proc->is_tasklet || proc->finished || proc->id != proc->group) continue;
+		if (!proc->thread.page_directory || proc->thread.page_directory == kernel_directory) continue;
+		if (!first || proc->id < first->id) first = proc;
+		if (proc->id >= scan_pid && (!best || proc->id < best->id)) best = proc;
+	}
+	if (!best && first) {
+		/* Wrap around */
+		scan_address = 0;
+		best = first;
+	}
+	if (best && best->id != scan_pid) {
+		scan_address = 0;
+	}
+	if (best) {
+		scan_pid = best->id;
+	}
+	return best;
+}
+
+/*
+ * Advance the clock hand, reclaiming up to `target` pages.
+ */
+static int swap_scan(int target) {
+	int reclaimed = 0;
+	int budget = SWAP_SCAN_BUDGET;
+
+	while (reclaimed < target && budget > 0) {
+		IRQ_OFF;
+		process_t * proc = scan_process();
+		if (!proc) {
+			IRQ_RES;
+			break;
+		}
+		page_directory_t * dir = proc->thread.page_directory;
+
+		page_t * page = NULL;
+		uintptr_t address = 0;
+		while (!page && scan_address < SHM_START && budget > 0) {
+			uint32_t table = scan_address / 0x400000;
+			if (!dir->tables[table] || dir->tables[table] == kernel_directory->tables[table]) {
+				scan_address = (table + 1) * 0x400000;
+				continue;
+			}
+			page_t * p = &dir->tables[table]->pages[(scan_address / 0x1000) % 1024];
+			address = scan_address;
+			scan_address += 0x1000;
+			budget--;
+			if (!reclaimable(p)) continue;
+			if (p->accessed) {
+				/* Second chance */
+				p->accessed = 0;
+				continue;
+			}
+			page = p;
+		}
+
+		if (page) {
+			reclaimed += evict(dir, address, page);
+		} else if (scan_address >= SHM_START) {
+			/* Done with this one, move on */
+			scan_pid++;
+			scan_address = 0;
+			budget--;
+		}
+		IRQ_RES;
+	}
+
+	return reclaimed;
+}
+
+static void kswapd(void * data, char * name) {
+	while (1) {
+		if (free_frames() >= SWAP_WAKE_FRAMES) {
+			sleep_on(kswapd_queue);
+			continue;
+		}
+		while (free_frames() < SWAP_TARGET_FRAMES) {
+			if (!swap_scan(SWAP_BATCH)) break;
+		}
+		if (free_frames() < SWAP_TARGET_FRAMES) {
+			/* Nothing we can take right now; try again shortly */
+			unsigned long s, ss;
+			relative_time(0, 100000, &s, &ss);
+			sleep_until((process_t *)current_process, s, ss);
+			switch_task(0);
+		}
+	}
+}
+
+/*
+ * Called before allocating memory for a user page: kick [kswapd]
+ * if we're running low, and give it a chance to catch up if we're
+ * almost out.
+ */
+void swap_throttle(void) {
+	if (!swap_area) return;
+	if (free_frames() >= SWAP_WAKE_FRAMES) return;
+
+	wakeup_queue(kswapd_queue);
+	for (int i = 0; i < SWAP_THROTTLE_MAX && free_frames() < SWAP_MIN_FRAMES; ++i) {
+		wakeup_queue(kswapd_queue);
+		switch_task(1);
+	}
+}
+
+/*
+ * Called from page_fault() for not-present pages; reads the
+ * page back in if it was swapped out.
+ */
+int swap_fault(struct regs * r, uintptr_t address) {
+	address &= 0xFFFFF000;
+	page_t * page = get_page(address, 0, current_directory);
+	if (!page || !page->swapped) {
+		return 0;
+	}
+	vma_t * vma = vma_find(current_directory, address);
+	if (vma && !(vma->flags & VMA_READ)) {
+		/* PROT_NONE; leave it where it is */
+		return 0;
+	}
+
+	swap_throttle();
+
+	uint8_t * bounce = malloc(0x1000);
+	spin_lock(&swap_io_lock);
+
+	page = get_page(address, 0, current_directory);
+	if (page && page->swapped) {
+		uint32_t slot = page->frame;
+
+		/* Only let interrupts in if the faulting context had them */
+		int interruptible = (r->eflags & 0x200) ? 1 : 0;
+		if (interruptible) IRQ_RES;
+		read_fs(swap_area->node, slot * 0x1000, 0x1000, bounce);
+		if (interruptible) IRQ_OFF;
+
+		/* Another thread may have brought it in (or unmapped it) meanwhile */
+		page = get_page(address, 0, current_directory);
+		if (page && page->swapped && page->frame == slot) {
+			int rw = page->rw;
+			page->swapped = 0;
+			page->frame   = 0;
+			/* Map it writeable while we fill it in */
+			alloc_frame(page, 0, 1);
+			invalidate_tables_at(address);
+			memcpy((void *)address, bounce, 0x1000);
+			page->rw    = rw;
+			page->dirty = 1; /* No longer has a copy in the swap area */
+			invalidate_tables_at(address);
+			swap_free(slot);
+			swap_area->swapped_in++;
+		}
+	}
+
+	spin_unlock(&swap_io_lock);
+	free(bounce);
+	return 1;
+}
+
+/*
+ * Start swapping to `path`, which may be a block device
+ * or a (preallocated) file.
+ */
+int swap_enable(char * path) {
+	if (swap_area) {
+		return -EBUSY;
+	}
+
+	fs_node_t * node = kopen(path, 0);
+	if (!node) {
+		debug_print(WARNING, "Could not open swap area %s", path);
+		return -ENOENT;
+	}
+
+	uint32_t slots = node->length / 0x1000;
+	if (slots > 0x100000) {
+		/* As many as fit in a page table entry */
+		slots = 0x100000;
+	}
+	if (slots < 2) {
+		debug_print(WARNING, "Swap area %s is too small", path);
+		close_fs(node);
+		return -EINVAL;
+	}
+
+	swap_area_t * area = malloc(sizeof(swap_area_t));
+	memset(area, 0, sizeof(swap_area_t));
+	area->path  = strdup(path);
+	area->node  = node;
+	area->slots = slots;
+	area->map   = malloc(slots * sizeof(uint16_t));
+	memset(area->map, 0, slots * sizeof(uint16_t));
+	/* Slot 0 is never used, so a swapped entry always has a non-zero frame */
+	area->map[0] = 1;
+
+	swap_bounce  = (uint8_t *)kvmalloc_p(0x1000, &swap_bounce_phys);
+	kswapd_queue = list_create();
+	swap_area    = area;
+
+	create_kernel_tasklet(kswapd, "[kswapd]", NULL);
+
+	debug_print(NOTICE, "Swapping to %s (%d kB)", path, (slots - 1) * 4);
+	return 0;
+}
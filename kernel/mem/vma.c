@@ -0,0 +1,472 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2014 Kevin Lange
+ *
+ * Virtual Memory Areas
+ *
+ * Describes the lazily-populated parts of a user address space
+ * (program segments, the stack, mmap() regions) so page_fault()
+ * knows what to put in a page the first time it is touched.
+ */
+#include <system.h>
+#include <process.h>
+#include <logging.h>
+#include <fs.h>
+#include <shm.h>
+#include <mem.h>
+#include <vma.h>
+#include <swap.h>
+
+/*
+ * The regions of a directory are kept in an AVL tree ordered by
+ * address. Each node also records the span of its subtree and the
+ * largest hole between regions inside it, so a free range of a
+ * given size can be found without visiting every region.
+ */
+
+static int vma_height(vma_t * node) {
+	return node ? node->height : 0;
+}
+
+static void vma_update(vma_t * node) {
+	vma_t * l = node->left;
+	vma_t * r = node->right;
+
+	node->height = 1 + (vma_height(l) > vma_height(r) ? vma_height(l) : vma_height(r));
+	node->subtree_start = l ? l->subtree_start : node->start;
+	node->subtree_end   = r ? r->subtree_end   : node->end;
+
+	uintptr_t gap = 0;
+	if (l) {
+		gap = l->subtree_gap;
+		if (node->start - l->subtree_end > gap) gap = node->start - l->subtree_end;
+	}
+	if (r) {
+		if (r->subtree_gap > gap) gap = r->subtree_gap;
+		if (r->subtree_start - node->end > gap) gap = r->subtree_start - node->end;
+	}
+	node->subtree_gap = gap;
+}
+
+static vma_t * vma_rotate_right(vma_t * node) {
+	vma_t * l = node->left;
+	node->left = l->right;
+	l->right = node;
+	vma_update(node);
+	vma_update(l);
+	return l;
+}
+
+static vma_t * vma_rotate_left(vma_t * node) {
+	vma_t * r = node->right;
+	node->right = r->left;
+	r->left = node;
+	vma_update(node);
+	vma_update(r);
+	return r;
+}
+
+static vma_t * vma_balance(vma_t * node) {
+	vma_update(node);
+	int balance = vma_height(node->left) - vma_height(node->right);
+	if (balance > 1) {
+		if (vma_height(node->left->left) < vma_height(node->left->right)) {
+			node->left = vma_rotate_left(node->left);
+		}
+		return vma_rotate_right(node);
+	}
+	if (balance < -1) {
+		if (vma_height(node->right->right) < vma_height(node->right->left)) {
+			node->right = vma_rotate_right(node->right);
+		}
+		return vma_rotate_left(node);
+	}
+	return node;
+}
+
+static vma_t * vma_tree_insert(vma_t * root, vma_t * vma) {
+	if (!root) {
+		vma->left  = NULL;
+		vma->right = NULL;
+		vma_update(vma);
+		return vma;
+	}
+	if (vma->start < root->start) {
+		root->left = vma_tree_insert(root->left, vma);
+	} else {
+		root->right = vma_tree_insert(root->right, vma);
+	}
+	return vma_balance(root);
+}
+
+static vma_t * vma_tree_remove_min(vma_t * root, vma_t ** min) {
+	if (!root->left) {
+		*min = root;
+		return root->right;
+	}
+	root->left = vma_tree_remove_min(root->left, min);
+	return vma_balance(root);
+}
+
+static vma_t * vma_tree_remove(vma_t * root, vma_t * vma) {
+	if (!root) return NULL;
+	if (vma->start < root->start) {
+		root->left = vma_tree_remove(root->left, vma);
+	} else if (vma->start > root->start) {
+		root->right = vma_tree_remove(root->right, vma);
+	} else {
+		vma_t * l = root->left;
+		vma_t * r = root->right;
+		if (!r) return l;
+		vma_t * min;
+		r = vma_tree_remove_min(r, &min);
+		min->left  = l;
+		min->right = r;
+		return vma_balance(min);
+	}
+	return vma_balance(root);
+}
+
+vma_t *
+vma_insert(
+		page_directory_t * dir,
+		uintptr_t start,
+		uintptr_t end,
+		uint32_t flags,
+		fs_node_t * file,
+		uint32_t offset,
+		uintptr_t file_end
+		) {
+	assert(!(start & 0xFFF) && !(end & 0xFFF) && start < end);
+
+	vma_t * vma = malloc(sizeof(vma_t));
+	vma->start    = start;
+	vma->end      = end;
+	vma->flags    = flags;
+	vma->file     = file ? clone_fs(file) : NULL;
+	vma->offset   = offset;
+	vma->file_end = file ? file_end : start;
+	vma->chunk    = NULL;
+
+	dir->regions = vma_tree_insert(dir->regions, vma);
+	return vma;
+}
+
+vma_t *
+vma_find(
+		page_directory_t * dir,
+		uintptr_t address
+		) {
+	vma_t * node = dir->regions;
+	while (node) {
+		if (address < node->start) {
+			node = node->left;
+		} else if (address >= node->end) {
+			node = node->right;
+		} else {
+			return node;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * The region containing `address`, or else the first one above it.
+ */
+vma_t *
+vma_find_next(
+		page_directory_t * dir,
+		uintptr_t address
+		) {
+	vma_t * best = NULL;
+	vma_t * node = dir->regions;
+	while (node) {
+		if (address < node->end) {
+			best = node;
+			if (address >= node->start) break;
+			node = node->left;
+		} else {
+			node = node->right;
+		}
+	}
+	return best;
+}
+
+static int vma_gap_fits(uintptr_t from, uintptr_t to, size_t length) {
+	return to > from && to - from >= length;
+}
+
+/*
+ * In-order walk for the lowest hole of `length` bytes at or above
+ * `*cursor`, skipping any subtree whose holes are all too small.
+ * Returns 1 when found, -1 once past `high`, 0 to keep looking.
+ */
+static int vma_gap_walk(vma_t * node, uintptr_t * cursor, uintptr_t high, size_t length) {
+	if (!node || node->subtree_end <= *cursor) return 0;
+	if (*cursor >= high) return -1;
+
+	if (node->subtree_start >= *cursor && node->subtree_start - *cursor >= length) {
+		return vma_gap_fits(*cursor, high, length) ? 1 : -1;
+	}
+	if (node->subtree_gap < length) {
+		*cursor = node->subtree_end;
+		return 0;
+	}
+
+	int ret = vma_gap_walk(node->left, cursor, high, length);
+	if (ret) return ret;
+
+	if (node->start >= *cursor && node->start - *cursor >= length) {
+		return vma_gap_fits(*cursor, high, length) ? 1 : -1;
+	}
+	if (node->end > *cursor) {
+		*cursor = node->end;
+	}
+
+	return vma_gap_walk(node->right, cursor, high, length);
+}
+
+/*
+ * Find the lowest unused range of `length` bytes within [low, high).
+ * Returns 0 if there is none.
+ */
+uintptr_t
+vma_find_gap(
+		page_directory_t * dir,
+		uintptr_t low,
+		uintptr_t high,
+		size_t length
+		) {
+	uintptr_t cursor = low;
+	int ret = vma_gap_walk(dir->regions, &cursor, high, length);
+	if (ret < 0) return 0;
+	if (ret == 0 && !vma_gap_fits(cursor, high, length)) return 0;
+	return cursor;
+}
+
+static void vma_free(vma_t * vma) {
+	if (vma->file) {
+		close_fs(vma->file);
+	}
+	if (vma->chunk) {
+		shm_chunk_release(vma->chunk);
+	}
+	free(vma);
+}
+
+void
+vma_remove(
+		page_directory_t * dir,
+		vma_t * vma
+		) {
+	dir->regions = vma_tree_remove(dir->regions, vma);
+	vma_free(vma);
+}
+
+/*
+ * Move the end of `vma`, eg. as the heap grows.
+ * The caller makes sure the new range is free.
+ */
+void
+vma_resize(
+		page_directory_t * dir,
+		vma_t * vma,
+		uintptr_t end
+		) {
+	assert(!(end & 0xFFF) && end > vma->start);
+
+	/* The subtree extents along the path depend on it, so reinsert */
+	dir->regions = vma_tree_remove(dir->regions, vma);
+	vma->end = end;
+	if (vma->file_end > end) {
+		vma->file_end = end;
+	}
+	dir->regions = vma_tree_insert(dir->regions, vma);
+}
+
+static void vma_clone_tree(vma_t * node, page_directory_t * dest) {
+	if (!node) return;
+
+	vma_clone_tree(node->left, dest);
+	if (!(node->flags & VMA_SHM)) {
+		vma_t * copy = vma_insert(dest, node->start, node->end, node->flags, node->file, node->offset, node->file_end);
+		if (node->chunk) {
+			shm_chunk_ref(node->chunk);
+			copy->chunk = node->chunk;
+		}
+	}
+	vma_clone_tree(node->right, dest);
+}
+
+void
+vma_clone(
+		page_directory_t * src,
+		page_directory_t * dest
+		) {
+	/* shm_obtain() mappings live in tables which are not cloned */
+	vma_clone_tree(src->regions, dest);
+}
+
+/*
+ * Split `vma` in two at `address`; returns the upper half.
+ */
+vma_t *
+vma_split(
+		page_directory_t * dir,
+		vma_t * vma,
+		uintptr_t address
+		) {
+	assert(address > vma->start && address < vma->end);
+
+	uintptr_t end = vma->end;
+	uintptr_t file_end = vma->file_end;
+	vma_resize(dir, vma, address);
+
+	vma_t * upper = vma_insert(dir, address, end, vma->flags, vma->file,
+			vma->offset + (address - vma->start), file_end);
+	if (vma->chunk) {
+		shm_chunk_ref(vma->chunk);
+		upper->chunk = vma->chunk;
+	}
+	return upper;
+}
+
+static void vma_free_tree(vma_t * node) {
+	if (!node) return;
+	vma_free_tree(node->left);
+	vma_free_tree(node->right);
+	vma_free(node);
+}
+
+void
+vma_release_all(
+		page_directory_t * dir
+		) {
+	vma_free_tree(dir->regions);
+	dir->regions = NULL;
+}
+
+/*
+ * Shared regions take their frames from a chunk, allocating
+ * (already zeroed) each one the first time any mapping touches it.
+ */
+static int
+vma_populate_shared(
+		vma_t * vma,
+		uintptr_t address
+		) {
+	shm_chunk_t * chunk = vma->chunk;
+	uint32_t index = (vma->offset + (address - vma->start)) / 0x1000;
+
+	page_t * page = get_page(address, 1, current_directory);
+	if (page->present) {
+		return 1;
+	}
+
+	spin_lock(&chunk->lock);
+	if (chunk->frames[index]) {
+		page->frame = chunk->frames[index];
+		frame_ref(page->frame);
+		alloc_frame(page, 0, (vma->flags & VMA_WRITE) ? 1 : 0);
+	} else {
+		alloc_frame_zeroed(page, 0, 1);
+		invalidate_tables_at(address);
+		/* One reference for us and one for the chunk */
+		chunk->frames[index] = page->frame;
+		frame_ref(page->frame);
+		frame_set_owner(page->frame, FRAME_OWNER_SHM);
+		page->rw = (vma->flags & VMA_WRITE) ? 1 : 0;
+	}
+	page->shared = 1;
+	spin_unlock(&chunk->lock);
+
+	invalidate_tables_at(address);
+	return 1;
+}
+
+/*
+ * Fill in the page at `address` from `vma` in the current directory.
+ *
+ * File data is read into a bounce buffer first so the page only
+ * becomes visible (to other threads sharing this directory) once
+ * it is complete. If `interruptible` is set, interrupts are enabled
+ * while reading from the file.
+ */
+int
+vma_populate(
+		vma_t * vma,
+		uintptr_t address,
+		int interruptible
+		) {
+	address &= 0xFFFFF000;
+
+	if (vma->chunk) {
+		return vma_populate_shared(vma, address);
+	}
+
+	uint8_t * bounce = NULL;
+	size_t to_read = 0;
+
+	if (vma->file && address < vma->file_end) {
+		to_read = vma->file_end - address;
+		if (to_read > 0x1000) to_read = 0x1000;
+
+		fs_node_t * file = clone_fs(vma->file);
+		uint32_t offset  = vma->offset + (address - vma->start);
+
+		bounce = malloc(0x1000);
+		memset(bounce, 0, to_read);
+
+		if (interruptible) IRQ_RES;
+		read_fs(file, offset, to_read, bounce);
+		if (interruptible) IRQ_OFF;
+
+		close_fs(file);
+
+		/* Someone may have unmapped or replaced this region while we slept */
+		if (vma_find(current_directory, address) != vma) {
+			free(bounce);
+			vma = vma_find(current_directory, address);
+			return vma ? vma_populate(vma, address, interruptible) : 0;
+		}
+	}
+
+	page_t * page = get_page(address, 1, current_directory);
+	if (!page->present && !page->swapped) {
+		/* Map it writeable while we fill it in; the rest of the page is already clear */
+		alloc_frame_zeroed(page, 0, 1);
+		invalidate_tables_at(address);
+		if (to_read) {
+			memcpy((void *)address, bounce, to_read);
+		}
+		page->rw = (vma->flags & VMA_WRITE) ? 1 : 0;
+		/* Matches the region again, so it can be dropped rather than swapped */
+		page->dirty = 0;
+		invalidate_tables_at(address);
+	}
+
+	if (bounce) {
+		free(bounce);
+	}
+
+	return 1;
+}
+
+/*
+ * Called from page_fault() for not-present pages.
+ */
+int
+vma_fault(
+		struct regs * r,
+		uintptr_t address
+		) {
+	vma_t * vma = vma_find(current_directory, address);
+	if (!vma || !(vma->flags & VMA_READ)) {
+		/* Unmapped, or PROT_NONE */
+		return 0;
+	}
+	swap_throttle();
+	/* Only let interrupts in if the faulting context had them */
+	return vma_populate(vma, address, (r->eflags & 0x200) ? 1 : 0);
+}
@@ -12,77 +12,148 @@
 #include <elf.h>
 #include <process.h>
 #include <logging.h>
+#include <vma.h>
+#include <signal.h>
+
+#define ELF_MAX_PHDRS 64 /* More than any program we build has, by far */
+
+/*
+ * Load the part of a segment which falls into a page that is also
+ * used by the previous segment. Such pages can not be described by
+ * a single file-backed region, so they are populated right away and
+ * kept as an anonymous region.
+ */
+static void load_shared_page(fs_node_t * file, vma_t * prev, uintptr_t page_addr, Elf32_Phdr * phdr, uint32_t flags) {
+	vma_populate(prev, page_addr, 0);
+
+	page_t * page = get_page(page_addr, 0, current_directory);
+	page->rw = 1;
+	invalidate_tables_at(page_addr);
+
+	uintptr_t lo = phdr->p_vaddr;
+	uintptr_t hi = phdr->p_vaddr + phdr->p_filesz;
+	if (lo < page_addr) lo = page_addr;
+	if (hi > page_addr + 0x1000) hi = page_addr + 0x1000;
+	if (lo < hi) {
+		read_fs(file, phdr->p_offset + (lo - phdr->p_vaddr), hi - lo, (uint8_t *)lo);
+	}
+
+	flags |= prev->flags;
+	page->rw = (flags & VMA_WRITE) ? 1 : 0;
+	invalidate_tables_at(page_addr);
+
+	if (prev->start == page_addr) {
+		vma_remove(current_directory, prev);
+	} else {
+		prev->end = page_addr;
+	}
+	vma_insert(current_directory, page_addr, page_addr + 0x1000, flags, NULL, 0, 0);
+}
 
 int exec_elf(char * path, fs_node_t * file, int argc, char ** argv, char ** env) {
-	Elf32_Header * header = (Elf32_Header *)malloc(file->length + 100);
+	Elf32_Header header;
 
-	debug_print(NOTICE, "---> Starting load.");
-	IRQ_RES;
-	read_fs(file, 0, file->length, (uint8_t *)header);
-	IRQ_OFF;
-	debug_print(NOTICE, "---> Finished load.");
+	if (read_fs(file, 0, sizeof(Elf32_Header), (uint8_t *)&header) != sizeof(Elf32_Header)) {
+		debug_print(ERROR, "Could not read ELF header.");
+		close_fs(file);
+		return -1;
+	}
 
 	current_process->name = malloc(strlen(path) + 1);
 	memcpy(current_process->name, path, strlen(path) + 1);
 
 	current_process->cmdline = argv;
 
-	/* Alright, we've read the binary, time to load the loadable sections */
 	/* Verify the magic */
-	if (	header->e_ident[0] != ELFMAG0 ||
-			header->e_ident[1] != ELFMAG1 ||
-			header->e_ident[2] != ELFMAG2 ||
-			header->e_ident[3] != ELFMAG3) {
+	if (	header.e_ident[0] != ELFMAG0 ||
+			header.e_ident[1] != ELFMAG1 ||
+			header.e_ident[2] != ELFMAG2 ||
+			header.e_ident[3] != ELFMAG3) {
 		/* What? This isn't an ELF... */
 		debug_print(ERROR, "Not a valid ELF executable.");
-		free(header);
 		close_fs(file);
 		return -1;
 	}
 
-	release_directory_for_exec(current_directory);
+	/* Only the program headers are read now; segments are paged in on demand */
+	if (header.e_phentsize != sizeof(Elf32_Phdr) || !header.e_phnum || header.e_phnum > ELF_MAX_PHDRS ||
+			header.e_phoff > file->length || header.e_phnum * sizeof(Elf32_Phdr) > file->length - header.e_phoff) {
+		debug_print(ERROR, "Bad program header table in ELF executable.");
+		close_fs(file);
+		return -1;
+	}
+	size_t phdrs_size = header.e_phnum * sizeof(Elf32_Phdr);
+	uint8_t * phdrs = malloc(phdrs_size);
+	if (read_fs(file, header.e_phoff, phdrs_size, phdrs) != phdrs_size) {
+		debug_print(ERROR, "Could not read ELF program headers.");
+		free(phdrs);
+		close_fs(file);
+		return -1;
+	}
+
+	if (current_process->vfork_parent) {
+		/* Borrowed from our parent: leave it be and start afresh */
+		page_directory_t * borrowed = current_directory;
+		set_process_environment((process_t *)current_process, clone_directory(kernel_directory));
+		current_directory = current_process->thread.page_directory;
+		switch_page_directory(current_directory);
+		release_directory(borrowed);
+		vfork_release((process_t *)current_process);
+	} else {
+		release_directory_for_exec(current_directory);
+	}
 	invalidate_page_tables();
 
-	/* Load the loadable segments from the binary */
-	for (uintptr_t x = 0; x < (uint32_t)header->e_shentsize * header->e_shnum; x += header->e_shentsize) {
-		/* read a section header */
-		Elf32_Shdr * shdr = (Elf32_Shdr *)((uintptr_t)header + (header->e_shoff + x));
-		if (shdr->sh_addr) {
-			/* If this is a loadable section, load it up. */
-			if (shdr->sh_addr < current_process->image.entry) {
-				/* If this is the lowest entry point, store it for memory reasons */
-				current_process->image.entry = shdr->sh_addr;
-			}
-			if (shdr->sh_addr + shdr->sh_size - current_process->image.entry > current_process->image.size) {
-				/* We also store the total size of the memory region used by the application */
-				current_process->image.size = shdr->sh_addr + shdr->sh_size - current_process->image.entry;
-			}
-			for (uintptr_t i = 0; i < shdr->sh_size + 0x2000; i += 0x1000) {
-				/* This doesn't care if we already allocated this page */
-				alloc_frame(get_page(shdr->sh_addr + i, 1, current_directory), 0, 1);
-				invalidate_tables_at(shdr->sh_addr + i);
-			}
-			if (shdr->sh_type == SHT_NOBITS) {
-				/* This is the .bss, zero it */
-				memset((void *)(shdr->sh_addr), 0x0, shdr->sh_size);
-			} else {
-				/* Copy the section into memory */
-				memcpy((void *)(shdr->sh_addr), (void *)((uintptr_t)header + shdr->sh_offset), shdr->sh_size);
-			}
+	signal_exec_reset((process_t *)current_process);
+
+	uintptr_t base = 0xFFFFFFFF;
+	uintptr_t top  = 0;
+
+	for (uintptr_t x = 0; x < phdrs_size; x += header.e_phentsize) {
+		Elf32_Phdr * phdr = (Elf32_Phdr *)(phdrs + x);
+		if (phdr->p_type != PT_LOAD || !phdr->p_memsz) {
+			continue;
 		}
-	}
 
-	/* Store the entry point to the code segment */
-	uintptr_t entry = (uintptr_t)header->e_entry;
+		uintptr_t start  = phdr->p_vaddr & 0xFFFFF000;
+		uintptr_t end    = (phdr->p_vaddr + phdr->p_memsz + 0xFFF) & 0xFFFFF000;
+		uint32_t  offset = phdr->p_offset - (phdr->p_vaddr - start);
+		uint32_t  flags  = VMA_READ;
+		if (phdr->p_flags & PF_W) flags |= VMA_WRITE;
+		if (phdr->p_flags & PF_X) flags |= VMA_EXEC;
+
+		debug_print(INFO, "Segment 0x%x-0x%x (file 0x%x+0x%x) flags 0x%x", start, end, offset, phdr->p_filesz, flags);
 
-	/* Free the space we used for the ELF headers and files */
-	free(header);
+		vma_t * prev = vma_find(current_directory, start);
+		if (prev) {
+			load_shared_page(file, prev, start, phdr, flags);
+			start  += 0x1000;
+			offset += 0x1000;
+		}
 
-	for (uintptr_t stack_pointer = USER_STACK_BOTTOM; stack_pointer < USER_STACK_TOP; stack_pointer += 0x1000) {
-		alloc_frame(get_page(stack_pointer, 1, current_directory), 0, 1);
-		invalidate_tables_at(stack_pointer);
+		if (start < end) {
+			vma_insert(current_directory, start, end, flags, file, offset, phdr->p_vaddr + phdr->p_filesz);
+		}
+
+		if (phdr->p_vaddr < base) {
+			base = phdr->p_vaddr;
+		}
+		if (phdr->p_vaddr + phdr->p_memsz > top) {
+			top = phdr->p_vaddr + phdr->p_memsz;
+		}
 	}
 
+	free(phdrs);
+
+	current_process->image.entry = base;
+	current_process->image.size  = top - base;
+
+	/* Store the entry point to the code segment */
+	uintptr_t entry = (uintptr_t)header.e_entry;
+
+	/* The stack is zero-filled on demand as well */
+	vma_insert(current_directory, USER_STACK_BOTTOM, USER_STACK_TOP, VMA_READ | VMA_WRITE, NULL, 0, 0);
+
 	/* Collect arguments */
 	int envc = 0;
 	for (envc = 0; env[envc] != NULL; ++envc);
@@ -96,7 +167,9 @@ int exec_elf(char * path, fs_node_t * file, int argc, char ** argv, char ** env)
 	for (auxvc = 0; auxv[auxvc].id != 0; ++auxvc);
 	auxvc++;
 
-	uintptr_t heap = current_process->image.entry + current_process->image.size;
+	/* The heap starts on a fresh page after the last segment */
+	uintptr_t heap = (top + 0xFFF) & 0xFFFFF000;
+	uintptr_t heap_start = heap;
 	alloc_frame(get_page(heap, 1, current_directory), 0, 1);
 	invalidate_tables_at(heap);
 	char ** argv_ = (char **)heap;
@@ -135,8 +208,8 @@ int exec_elf(char * path, fs_node_t * file, int argc, char ** argv, char ** env)
 
 	current_process->image.heap        = heap; /* heap end */
 	current_process->image.heap_actual = heap + (0x1000 - heap % 0x1000);
-	alloc_frame(get_page(current_process->image.heap_actual, 1, current_directory), 0, 1);
-	invalidate_tables_at(current_process->image.heap_actual);
+	/* The rest of the heap is filled on demand as sbrk() grows it */
+	vma_insert(current_directory, heap_start, current_process->image.heap_actual + 0x1000, VMA_READ | VMA_WRITE, NULL, 0, 0);
 	current_process->image.user_stack  = USER_STACK_TOP;
 
 	current_process->image.start = entry;
@@ -276,7 +349,8 @@ system(
 	}
 	argv_[argc] = 0;
 	char * env[] = {NULL};
-	set_process_environment((process_t*)current_process, clone_directory(current_directory));
+	/* Nothing of ours is wanted in the new image, so don't copy it */
+	set_process_environment((process_t*)current_process, clone_directory(kernel_directory));
 	current_directory = current_process->thread.page_directory;
 	switch_page_directory(current_directory);
 	exec(path,argc,argv_,env);
@@ -73,17 +73,25 @@ static void print_hex(unsigned int value, unsigned int width, char * buf, int *
 }
 
 /*
- * vasprintf()
+ * Format into `buf`, writing at most `size` bytes including the
+ * null at the end. Returns the length of what was written.
  */
-size_t
-vasprintf(char * buf, const char *fmt, va_list args) {
+static size_t
+format(char * buf, size_t size, const char *fmt, va_list args) {
 	int i = 0;
 	char *s;
-	int ptr = 0;
+	size_t ptr = 0;
 	int len = strlen(fmt);
+	char num[16];
+	int num_len;
+
+	if (!size) return 0;
+
+#define PUT(c) do { if (ptr + 1 < size) buf[ptr++] = (c); } while (0)
+
 	for ( ; i < len && fmt[i]; ++i) {
 		if (fmt[i] != '%') {
-			buf[ptr++] = fmt[i];
+			PUT(fmt[i]);
 			continue;
 		}
 		++i;
@@ -93,7 +101,9 @@ vasprintf(char * buf, const char *fmt, va_list args) {
 			arg_width += fmt[i] - '0';
 			++i;
 		}
+		if (arg_width > 10) arg_width = 10;
 		/* fmt[i] == '%' */
+		num_len = 0;
 		switch (fmt[i]) {
 			case 's': /* String pointer -> String */
 				s = (char *)va_arg(args, char *);
@@ -101,30 +111,52 @@ vasprintf(char * buf, const char *fmt, va_list args) {
 					s = "(null)";
 				}
 				while (*s) {
-					buf[ptr++] = *s++;
+					PUT(*s++);
 				}
 				break;
 			case 'c': /* Single character */
-				buf[ptr++] = (char)va_arg(args, int);
+				PUT((char)va_arg(args, int));
 				break;
 			case 'x': /* Hexadecimal number */
-				print_hex((unsigned long)va_arg(args, unsigned long), arg_width, buf, &ptr);
+				print_hex((unsigned long)va_arg(args, unsigned long), arg_width, num, &num_len);
 				break;
 			case 'd': /* Decimal number */
-				print_dec((unsigned long)va_arg(args, unsigned long), arg_width, buf, &ptr);
+				print_dec((unsigned long)va_arg(args, unsigned long), arg_width, num, &num_len);
 				break;
 			case '%': /* Escape */
-				buf[ptr++] = '%';
+				PUT('%');
 				break;
 			default: /* Nothing at all, just dump it */
-				buf[ptr++] = fmt[i];
+				PUT(fmt[i]);
 				break;
 		}
+		for (int j = 0; j < num_len; ++j) {
+			PUT(num[j]);
+		}
 	}
+
+#undef PUT
+
 	/* Ensure the buffer ends in a null */
 	buf[ptr] = '\0';
 	return ptr;
+}
 
+/*
+ * vasprintf()
+ */
+size_t
+vasprintf(char * buf, const char *fmt, va_list args) {
+	return format(buf, (size_t)-1, fmt, args);
+}
+
+/*
+ * vasprintf(), but for a buffer of `size` bytes; anything that
+ * doesn't fit is left off.
+ */
+size_t
+vsnprintf(char * buf, size_t size, const char *fmt, va_list args) {
+	return format(buf, size, fmt, args);
 }
 
 static unsigned short * textmemptr = (unsigned short *)0xB8000;
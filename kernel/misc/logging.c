@@ -5,16 +5,27 @@
  *
  * Kernel Logging Facility
  *
- * Maintains a log in-memory as well as to serial (unless
- * told not to).
+ * Log lines are formatted into an in-memory ring, which anyone can
+ * read through /proc/kmsg. Appending never waits on the log device:
+ * [klogd] copies new lines out to debug_file (usually the serial
+ * port) at its own pace. Before [klogd] is running, and for errors,
+ * which may be the last thing we get to say, the ring is flushed
+ * right away instead.
  */
 
 #include <system.h>
 #include <list.h>
 #include <logging.h>
+#include <process.h>
 #include <va_list.h>
 #include <printf.h>
 
+#define LOG_SIZE    0x10000 /* A power of two, so the ring wraps cleanly with the counters */
+#define LOG_LINE    1280
+#define KLOGD_CHUNK 32      /* Bytes [klogd] writes before giving up the processor */
+#define KLOGD_POLL  10000   /* Microseconds [klogd] sleeps when there is nothing to write */
+#define KLOGD_IDLE  1000000 /* ... or when there is nowhere to write it */
+
 log_type_t debug_level = NOTICE;
 void * debug_file = NULL;
 void (*debug_hook)(void *, char *) = NULL;
@@ -29,25 +40,163 @@ static char * c_messages[] = {
 	" \033[1;31;44mINSANE\033[0m:"
 };
 
-static char buffer[1024];
+static char log_ring[LOG_SIZE];
+static volatile uint32_t log_head = 0; /* Bytes claimed by writers */
+static volatile uint32_t log_done = 0; /* Bytes written; everything before this can be read */
+static uint32_t log_tail = 0;          /* Bytes sent to debug_file */
+static volatile uint8_t log_flush_lock = 0;
+static int klogd_running = 0;
+
+/* Where the ring ended when /proc/kmsg was last read from the start */
+static uint32_t log_snapshot = 0;
+
+/*
+ * Claim space in the ring and copy a line into it. Lines are
+ * published in the order their space was claimed, so if someone
+ * claimed space before us we wait for them to finish copying;
+ * interrupts are off meanwhile, so they can't be waiting on us.
+ */
+static void log_append(char * line, uint32_t len) {
+	uint32_t flags;
+	asm volatile ("pushf\npop %0\ncli" : "=r"(flags) :: "memory");
+
+	uint32_t start = __sync_fetch_and_add(&log_head, len);
+	for (uint32_t i = 0; i < len; ++i) {
+		log_ring[(start + i) & (LOG_SIZE - 1)] = line[i];
+	}
+	while (log_done != start) {
+		asm volatile ("pause");
+	}
+	asm volatile ("" ::: "memory");
+	log_done = start + len;
+
+	if (flags & 0x200) {
+		IRQ_RES;
+	}
+}
+
+/*
+ * Write up to `limit` bytes (or everything, for 0) that debug_file
+ * hasn't seen yet. Returns how many were written.
+ */
+static uint32_t log_flush(uint32_t limit) {
+	if (__sync_lock_test_and_set(&log_flush_lock, 0x01)) {
+		/* Someone else is already at it */
+		return 0;
+	}
+
+	uint32_t done = log_done;
+	fs_node_t * file = debug_file;
+	if (!file) {
+		/* Nobody to tell; skip ahead */
+		log_tail = done;
+		__sync_lock_release(&log_flush_lock);
+		return 0;
+	}
+
+	if (done - log_tail > LOG_SIZE) {
+		char note[64];
+		sprintf(note, "[... %d bytes of log lost]\n", done - log_tail - LOG_SIZE);
+		write_fs(file, 0, strlen(note), (uint8_t *)note);
+		log_tail = done - LOG_SIZE;
+	}
+
+	uint32_t count = done - log_tail;
+	if (limit && count > limit) {
+		count = limit;
+	}
+
+	uint32_t written = 0;
+	while (written < count) {
+		uint32_t index = (log_tail + written) & (LOG_SIZE - 1);
+		uint32_t chunk = count - written;
+		if (chunk > LOG_SIZE - index) {
+			chunk = LOG_SIZE - index;
+		}
+		write_fs(file, 0, chunk, (uint8_t *)&log_ring[index]);
+		written += chunk;
+	}
+	log_tail += count;
+
+	__sync_lock_release(&log_flush_lock);
+	return count;
+}
 
 void _debug_print(char * title, int line_no, log_type_t level, char *fmt, ...) {
-	if (level >= debug_level && debug_file) {
-		va_list args;
-		va_start(args, fmt);
-		vasprintf(buffer, fmt, args);
-		va_end(args);
-
-		char * type;
-		if (level > INSANE) {
-			type = "";
-		} else {
-			type = c_messages[level];
+	if (level < debug_level) {
+		return;
+	}
+
+	char line[LOG_LINE];
+	char * type;
+	if (level > INSANE) {
+		type = "";
+	} else {
+		type = c_messages[level];
+	}
+
+	uint64_t now = timer_usec();
+	uint32_t len = sprintf(line, "[%10d.%06d:%s:%d]%s ", (uint32_t)(now / SUBTICKS_PER_TICK), (uint32_t)(now % SUBTICKS_PER_TICK), title, line_no, type);
+
+	va_list args;
+	va_start(args, fmt);
+	/* Arguments may be as long as the user likes (paths, process names); leave room for the newline */
+	len += vsnprintf(line + len, LOG_LINE - 1 - len, fmt, args);
+	va_end(args);
+	line[len++] = '\n';
+
+	log_append(line, len);
+
+	if (!klogd_running || level >= ERROR) {
+		log_flush(0);
+	}
+}
+
+/*
+ * Read /proc/kmsg: whatever is still in the ring, as of the last
+ * read at offset 0, starting from the oldest whole line.
+ */
+uint32_t log_read(uint32_t offset, uint32_t size, uint8_t * buffer) {
+	if (offset == 0) {
+		log_snapshot = log_done;
+	}
+
+	uint32_t start = 0;
+	if (log_snapshot > LOG_SIZE) {
+		start = log_snapshot - LOG_SIZE;
+		while (start < log_snapshot && log_ring[start & (LOG_SIZE - 1)] != '\n') {
+			start++;
+		}
+		if (start < log_snapshot) {
+			start++;
 		}
+	}
 
-		fprintf(debug_file, "[%10d.%2d:%s:%d]%s %s\n", timer_ticks, timer_subticks, title, line_no, type, buffer);
+	uint32_t total = log_snapshot - start;
+	if (offset >= total) return 0;
+	if (size > total - offset) size = total - offset;
 
+	for (uint32_t i = 0; i < size; ++i) {
+		buffer[i] = log_ring[(start + offset + i) & (LOG_SIZE - 1)];
 	}
-	/* else ignore */
+	return size;
 }
 
+static void klogd(void * data, char * name) {
+	klogd_running = 1;
+	while (1) {
+		if (log_flush(KLOGD_CHUNK)) {
+			/* There may be more; let everyone else have a turn first */
+			switch_task(1);
+			continue;
+		}
+		unsigned long s, ss;
+		relative_time(0, debug_file ? KLOGD_POLL : KLOGD_IDLE, &s, &ss);
+		sleep_until((process_t *)current_process, s, ss);
+		switch_task(0);
+	}
+}
+
+void klogd_install(void) {
+	create_kernel_tasklet(klogd, "[klogd]", NULL);
+}
@@ -0,0 +1,261 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2014 Kevin Lange
+ *
+ * Sampling Profiler
+ *
+ * Each scheduler tick (timer_handler() on the bootstrap processor,
+ * the local APIC tick on the others) records the interrupted PID
+ * and EIP, and whether it was in the kernel. With call graphs on,
+ * it also follows the saved frame pointers back through the stack
+ * it interrupted, which works because we build with
+ * -fno-omit-frame-pointer. Samples go into a buffer that holds the
+ * first PROFILE_SAMPLES after profiling is started; once it is full
+ * the rest are only counted.
+ *
+ * /proc/profile is the report, in text:
+ *
+ *     # samples <count> dropped <count> hz <rate> callgraph <0|1>
+ *     sym <address> <symbol>+<offset>      one per kernel address seen
+ *     <pid> <cpu> <k|u> <eip> <caller> ... one per sample
+ *
+ * Kernel addresses are named from the module symbol table; naming
+ * user addresses is left to `prof`, which can read the binary.
+ */
+#include <system.h>
+#include <logging.h>
+#include <args.h>
+#include <process.h>
+#include <smp.h>
+#include <module.h>
+#include <hashmap.h>
+#include <list.h>
+#include <printf.h>
+#include <profile.h>
+
+#define PROFILE_SAMPLES 8192
+#define PROFILE_DEPTH   8    /* EIP and up to seven callers */
+
+struct profile_sample {
+	pid_t     pid;
+	uint8_t   cpu;
+	uint8_t   kernel;
+	uint8_t   depth;
+	uintptr_t pc[PROFILE_DEPTH];
+};
+
+static volatile int profile_enabled = 0;
+static int profile_callgraph = 0;
+
+static struct profile_sample * samples = NULL;
+static volatile uint32_t sample_count = 0; /* Claimed, including those that didn't fit */
+
+/* The report built by the last read of /proc/profile at offset 0 */
+static char *   report = NULL;
+static uint32_t report_size = 0;
+static uint32_t report_space = 0;
+
+/*
+ * Start profiling from an empty buffer.
+ */
+void profile_start(int callgraph) {
+	if (!samples) {
+		samples = malloc(PROFILE_SAMPLES * sizeof(struct profile_sample));
+	}
+	profile_enabled = 0;
+	sample_count = 0;
+	profile_callgraph = callgraph;
+	profile_enabled = 1;
+	debug_print(NOTICE, "Profiling started (%d samples%s)", PROFILE_SAMPLES, callgraph ? ", with call graphs" : "");
+}
+
+void profile_stop(void) {
+	profile_enabled = 0;
+}
+
+/*
+ * Can we read the frame at `ebp` (saved EBP and return address)
+ * without faulting?
+ */
+static int frame_readable(uintptr_t ebp, int kernel) {
+	if (!ebp || (ebp & 3) || (ebp & 0xFFF) > 0xFF8) {
+		return 0;
+	}
+	if (kernel) {
+		/* Kernel frames must be on this process's kernel stack */
+		uintptr_t top = current_process->image.stack;
+		return ebp >= top - KERNEL_STACK_SIZE && ebp + 8 <= top;
+	}
+	page_t * page = get_page(ebp, 0, current_directory);
+	return page && page->present && page->user;
+}
+
+void profile_tick(struct regs * r) {
+	if (!profile_enabled || !current_process) {
+		return;
+	}
+	uint32_t index = __sync_fetch_and_add(&sample_count, 1);
+	if (index >= PROFILE_SAMPLES) {
+		return;
+	}
+
+	struct profile_sample * sample = &samples[index];
+	sample->pid    = current_process->id;
+	sample->cpu    = this_cpu()->id;
+	sample->kernel = (r->cs & 0x3) != 0x3;
+	sample->pc[0]  = r->eip;
+	sample->depth  = 1;
+
+	if (!profile_callgraph) {
+		return;
+	}
+
+	uintptr_t ebp = r->ebp;
+	while (sample->depth < PROFILE_DEPTH && frame_readable(ebp, sample->kernel)) {
+		uintptr_t * frame = (uintptr_t *)ebp;
+		if (!frame[1]) break;
+		sample->pc[sample->depth++] = frame[1];
+		/* Frames only ever go up the stack; anything else is garbage */
+		if (frame[0] <= ebp) break;
+		ebp = frame[0];
+	}
+}
+
+static void report_append(char * str) {
+	uint32_t len = strlen(str);
+	if (report_size + len + 1 > report_space) {
+		while (report_size + len + 1 > report_space) {
+			report_space *= 2;
+		}
+		report = realloc(report, report_space);
+	}
+	memcpy(report + report_size, str, len + 1);
+	report_size += len;
+}
+
+struct ksym {
+	uintptr_t addr;
+	char *    name;
+};
+
+/*
+ * The kernel and module symbols, sorted by address.
+ */
+static struct ksym * load_symbols(int * count) {
+	hashmap_t * table = modules_get_symbols();
+	if (!table) {
+		*count = 0;
+		return NULL;
+	}
+
+	list_t * names = hashmap_keys(table);
+	struct ksym * syms = malloc(sizeof(struct ksym) * (names->length + 1));
+	int n = 0;
+	foreach(node, names) {
+		syms[n].name = (char *)node->value;
+		syms[n].addr = (uintptr_t)hashmap_get(table, syms[n].name);
+		n++;
+	}
+	list_free(names);
+	free(names);
+
+	/* Shell sort */
+	for (int gap = n / 2; gap > 0; gap /= 2) {
+		for (int i = gap; i < n; ++i) {
+			struct ksym tmp = syms[i];
+			int j = i;
+			for (; j >= gap && syms[j - gap].addr > tmp.addr; j -= gap) {
+				syms[j] = syms[j - gap];
+			}
+			syms[j] = tmp;
+		}
+	}
+
+	*count = n;
+	return syms;
+}
+
+/* The last symbol at or below `addr` */
+static struct ksym * find_symbol(struct ksym * syms, int count, uintptr_t addr) {
+	int lo = 0, hi = count - 1;
+	struct ksym * best = NULL;
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (syms[mid].addr <= addr) {
+			best = &syms[mid];
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return best;
+}
+
+static void build_report(void) {
+	char line[256];
+	uint32_t count = (sample_count < PROFILE_SAMPLES) ? sample_count : PROFILE_SAMPLES;
+
+	if (!report) {
+		report_space = 4096;
+		report = malloc(report_space);
+	}
+	report_size = 0;
+	report[0] = '\0';
+
+	sprintf(line, "# samples %d dropped %d hz %d callgraph %d\n",
+			count, sample_count - count, TIMER_HZ, profile_callgraph);
+	report_append(line);
+
+	int nsyms;
+	struct ksym * syms = load_symbols(&nsyms);
+	hashmap_t * seen = hashmap_create_int(64);
+	for (uint32_t i = 0; i < count; ++i) {
+		struct profile_sample * sample = &samples[i];
+		if (!sample->kernel) continue;
+		for (int j = 0; j < sample->depth; ++j) {
+			uintptr_t pc = sample->pc[j];
+			if (hashmap_has(seen, (void *)pc)) continue;
+			hashmap_set(seen, (void *)pc, (void *)1);
+			struct ksym * sym = find_symbol(syms, nsyms, pc);
+			if (sym) {
+				sprintf(line, "sym %x %s+0x%x\n", pc, sym->name, pc - sym->addr);
+				report_append(line);
+			}
+		}
+	}
+	hashmap_free(seen);
+	free(seen);
+	free(syms);
+
+	for (uint32_t i = 0; i < count; ++i) {
+		struct profile_sample * sample = &samples[i];
+		char * c = line;
+		c += sprintf(c, "%d %d %c", sample->pid, sample->cpu, sample->kernel ? 'k' : 'u');
+		for (int j = 0; j < sample->depth; ++j) {
+			c += sprintf(c, " %x", sample->pc[j]);
+		}
+		sprintf(c, "\n");
+		report_append(line);
+	}
+}
+
+/*
+ * Read /proc/profile. The report is put together when it is read
+ * from the start, and the rest of the reads come from that copy.
+ */
+uint32_t profile_read(uint32_t offset, uint32_t size, uint8_t * buffer) {
+	if (offset == 0 || !report) {
+		build_report();
+	}
+	if (offset >= report_size) return 0;
+	if (size > report_size - offset) size = report_size - offset;
+	memcpy(buffer, report + offset, size);
+	return size;
+}
+
+void profile_install(void) {
+	if (args_present("profile")) {
+		profile_start(1);
+	}
+}
@@ -0,0 +1,120 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2014 Kevin Lange
+ *
+ * Kernel Event Tracing
+ *
+ * Tracepoints append fixed-size binary events to a ring, stamped
+ * with the TSC, without taking any locks or formatting anything;
+ * when the ring is full the oldest events are overwritten. The
+ * ring is read back through /proc/trace (see trace_defs.h for the
+ * layout) and decoded by the `trace` utility.
+ */
+#include <system.h>
+#include <logging.h>
+#include <args.h>
+#include <smp.h>
+#include <mem.h>
+#include <time_page.h>
+#include <trace.h>
+
+#define TRACE_EVENTS 8192 /* A power of two, so the ring wraps cleanly with the counter */
+
+volatile int trace_enabled = 0;
+
+static struct trace_event * ring = NULL;
+static volatile uint32_t ring_head = 0; /* Events recorded since tracing was started */
+
+/* Where the ring ended when /proc/trace was last read from the start */
+static uint32_t snapshot_head = 0;
+
+static uint64_t trace_stamp(void) {
+	if (timer_precise) {
+		uint32_t lo, hi;
+		asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+		return ((uint64_t)hi << 32) | lo;
+	}
+	return timer_usec() * 1000;
+}
+
+void trace_record(uint16_t type, uint32_t a, uint32_t b) {
+	uint32_t slot = __sync_fetch_and_add(&ring_head, 1) & (TRACE_EVENTS - 1);
+	struct trace_event * event = &ring[slot];
+	event->stamp = trace_stamp();
+	event->pid   = current_process ? current_process->id : 0;
+	event->a     = a;
+	event->b     = b;
+	event->type  = type;
+	event->cpu   = this_cpu()->id;
+}
+
+/*
+ * Start tracing from an empty ring.
+ */
+void trace_start(void) {
+	if (!ring) {
+		ring = malloc(TRACE_EVENTS * sizeof(struct trace_event));
+	}
+	trace_enabled = 0;
+	ring_head = 0;
+	snapshot_head = 0;
+	trace_enabled = 1;
+	debug_print(NOTICE, "Tracing started (%d events)", TRACE_EVENTS);
+}
+
+void trace_stop(void) {
+	trace_enabled = 0;
+}
+
+/*
+ * Read /proc/trace: a header, then the events in the ring as of
+ * the last read at offset 0, oldest first. Events recorded while
+ * it is being read may overwrite the oldest ones before they are
+ * read; stop tracing first for a consistent copy.
+ */
+uint32_t trace_read(uint32_t offset, uint32_t size, uint8_t * buffer) {
+	if (offset == 0) {
+		snapshot_head = ring_head;
+	}
+	uint32_t count = (snapshot_head < TRACE_EVENTS) ? snapshot_head : TRACE_EVENTS;
+
+	struct trace_header header;
+	header.magic   = TRACE_MAGIC;
+	header.count   = count;
+	header.dropped = snapshot_head - count;
+	if (timer_precise) {
+		header.tsc_mult = time_page->tsc_mult;
+		header.tsc_base = time_page->tsc_base;
+	} else {
+		header.tsc_mult = 1 << TRACE_SHIFT;
+		header.tsc_base = 0;
+	}
+
+	uint32_t total = sizeof(struct trace_header) + count * sizeof(struct trace_event);
+	if (offset >= total) return 0;
+	if (size > total - offset) size = total - offset;
+
+	uint32_t done = 0;
+	if (offset < sizeof(struct trace_header)) {
+		done = sizeof(struct trace_header) - offset;
+		if (done > size) done = size;
+		memcpy(buffer, (uint8_t *)&header + offset, done);
+	}
+	while (done < size) {
+		uint32_t pos    = offset + done - sizeof(struct trace_header);
+		uint32_t slot   = (snapshot_head - count + pos / sizeof(struct trace_event)) & (TRACE_EVENTS - 1);
+		uint32_t within = pos % sizeof(struct trace_event);
+		uint32_t chunk  = sizeof(struct trace_event) - within;
+		if (chunk > size - done) chunk = size - done;
+		memcpy(buffer + done, (uint8_t *)&ring[slot] + within, chunk);
+		done += chunk;
+	}
+	return size;
+}
+
+void trace_install(void) {
+	if (args_present("trace")) {
+		trace_start();
+	}
+}
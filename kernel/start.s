@@ -62,17 +62,19 @@ start:
 
 ; Global Descriptor Table
 global gdt_flush
-extern gp
 gdt_flush:
-	; Load the GDT
-	lgdt [gp]
+	; Load the GDT we were given
+	mov eax, [esp+4]
+	lgdt [eax]
 	; Flush the values to 0x10
 	mov ax, 0x10
 	mov ds, ax
 	mov es, ax
 	mov fs, ax
-	mov gs, ax
 	mov ss, ax
+	; And %gs to this processor's per-CPU segment
+	mov ax, 0x30
+	mov gs, ax
 	jmp 0x08:flush2
 flush2:
 	ret
@@ -85,8 +87,14 @@ idt_load:
 	ret
 
 ; Return to Userspace (from thread creation)
+extern kernel_leave
 global return_to_userspace
 return_to_userspace:
+	cli
+	test dword [esp+60], 3
+	jz .kernel
+	call kernel_leave
+.kernel:
 	pop gs
 	pop fs
 	pop es
@@ -155,6 +163,8 @@ ISR_NOERR 28
 ISR_NOERR 29
 ISR_NOERR 30
 ISR_NOERR 31
+ISR_NOERR 64
+ISR_NOERR 65
 ISR_NOERR 127
 
 
@@ -177,6 +187,8 @@ IRQ_ENTRY 14, 46
 IRQ_ENTRY 15, 47
 
 ; Interrupt handlers
+extern kernel_enter
+extern deliver_signals
 extern fault_handler
 isr_common_stub:
 	pusha
@@ -188,13 +200,25 @@ isr_common_stub:
 	mov ds, ax
 	mov es, ax
 	mov fs, ax
+	mov ax, 0x30
 	mov gs, ax
+	call kernel_enter
 	mov eax, esp
 	push eax
 	; Call the C kernel fault handler
 	mov eax, fault_handler
 	call eax
 	pop eax
+	; Going back to user mode? Then deliver any signals and let go of the kernel.
+	cli
+	test dword [esp+60], 3
+	jz .kernel
+	mov eax, esp
+	push eax
+	call deliver_signals
+	pop eax
+	call kernel_leave
+.kernel:
 	pop gs
 	pop fs
 	pop es
@@ -214,19 +238,131 @@ irq_common_stub:
 	mov ds, ax
 	mov es, ax
 	mov fs, ax
+	mov ax, 0x30
 	mov gs, ax
+	call kernel_enter
 	mov eax, esp
 	push eax
 	; Call the C kernel hardware interrupt handler
 	mov eax, irq_handler
 	call eax
 	pop eax
+	; Going back to user mode? Then deliver any signals and let go of the kernel.
+	cli
+	test dword [esp+60], 3
+	jz .kernel
+	mov eax, esp
+	push eax
+	call deliver_signals
+	pop eax
+	call kernel_leave
+.kernel:
+	pop gs
+	pop fs
+	pop es
+	pop ds
+	popa
+	add esp, 8
+	iret
+
+; Fast system calls. The C library's stub has left the user stack
+; pointer in ebp, with its return address on top; build the same
+; frame an int 0x7F would have, so nothing after this can tell the
+; difference, and leave with sysexit. ebp is only a user pointer, so
+; sysenter_handler() checks it before reading the return address.
+extern sysenter_handler
+global sysenter_entry
+sysenter_entry:
+	mov esp, [esp]          ; SYSENTER_ESP points at this processor's TSS esp0
+	push dword 0x23         ; ss
+	push ebp                ; useresp, once the return address is popped
+	add dword [esp], 4
+	pushf                   ; eflags, which had interrupts on in user mode
+	or dword [esp], 0x200
+	push dword 0x1B         ; cs
+	push dword 0            ; eip, filled in by sysenter_handler
+	push dword 0
+	push dword 0x7F
+	pusha
+	push ds
+	push es
+	push fs
+	push gs
+	mov ax, 0x10
+	mov ds, ax
+	mov es, ax
+	mov fs, ax
+	mov ax, 0x30
+	mov gs, ax
+	call kernel_enter
+	mov eax, esp
+	push eax
+	call sysenter_handler
+	pop eax
+	cli
+	mov eax, esp
+	push eax
+	call deliver_signals
+	pop eax
+	call kernel_leave
 	pop gs
 	pop fs
 	pop es
 	pop ds
 	popa
 	add esp, 8
+	mov edx, [esp]          ; eip
+	mov ecx, [esp+12]       ; esp
+	push dword [esp+8]      ; eflags, but interrupts stay off until sysexit
+	and dword [esp], 0xFFFFFDFF
+	popf
+	sti
+	sysexit
+
+; TLB shootdown requests from other processors. These are
+; handled without taking the kernel lock, as the sender holds it.
+extern tlb_shootdown_handler
+global _isr_tlb
+_isr_tlb:
+	pusha
+	push ds
+	push es
+	push gs
+	mov ax, 0x10
+	mov ds, ax
+	mov es, ax
+	mov ax, 0x30
+	mov gs, ax
+	call tlb_shootdown_handler
+	pop gs
+	pop es
+	pop ds
+	popa
+	iret
+
+; Another processor wants the FPU context we are holding
+extern fpu_flush_handler
+global _isr_fpu
+_isr_fpu:
+	pusha
+	push ds
+	push es
+	push gs
+	mov ax, 0x10
+	mov ds, ax
+	mov es, ax
+	mov ax, 0x30
+	mov gs, ax
+	call fpu_flush_handler
+	pop gs
+	pop es
+	pop ds
+	popa
+	iret
+
+; Spurious local APIC interrupts need no acknowledgement
+global _isr_spurious
+_isr_spurious:
 	iret
 
 global read_eip
@@ -259,12 +395,126 @@ copy_page_physical:
     pop ebx
     ret
 
+global zero_page_physical
+zero_page_physical:
+    push edi
+    pushf
+    cli
+    mov edi, [esp+12]
+    mov edx, cr0
+    and edx, 0x7FFFFFFF
+    mov cr0, edx
+    xor eax, eax
+    mov ecx, 0x400
+    rep stosd
+    mov edx, cr0
+    or  edx, 0x80000000
+    mov cr0, edx
+    popf
+    pop edi
+    ret
+
+; Same, but with non-temporal stores (requires SSE2) so
+; zeroing a page doesn't push everything else out of the cache
+global zero_page_physical_nt
+zero_page_physical_nt:
+    push edi
+    pushf
+    cli
+    mov edi, [esp+12]
+    mov edx, cr0
+    and edx, 0x7FFFFFFF
+    mov cr0, edx
+    xor eax, eax
+    mov ecx, 0x100
+.zero_loop:
+    movnti [edi], eax
+    movnti [edi+4], eax
+    movnti [edi+8], eax
+    movnti [edi+12], eax
+    add edi, 16
+    dec ecx
+    jnz .zero_loop
+    sfence
+    mov edx, cr0
+    or  edx, 0x80000000
+    mov cr0, edx
+    popf
+    pop edi
+    ret
+
 global tss_flush
 tss_flush:
 	mov ax, 0x2B
 	ltr ax
 	ret
 
+; Application processor startup
+;
+; Copied to AP_TRAMPOLINE (below 1MB) and started there by a
+; startup IPI in real mode. Switches to protected mode with
+; paging, then calls ap_main() on the stack it was given.
+AP_TRAMPOLINE equ 0x8000
+%define AP_ADDR(x) (AP_TRAMPOLINE + (x) - ap_trampoline)
+
+global ap_trampoline
+global ap_trampoline_end
+global ap_cr3
+global ap_cr4
+global ap_stack
+global ap_entry
+
+BITS 16
+ap_trampoline:
+	cli
+	cld
+	mov ax, cs
+	mov ds, ax
+	lgdt [ap_gdt_ptr - ap_trampoline]
+	mov eax, cr0
+	or  eax, 1
+	mov cr0, eax
+	jmp dword 0x08:AP_ADDR(ap_protected)
+
+BITS 32
+ap_protected:
+	mov ax, 0x10
+	mov ds, ax
+	mov es, ax
+	mov fs, ax
+	mov gs, ax
+	mov ss, ax
+	; Large pages first, as the kernel directory may have some
+	mov eax, [AP_ADDR(ap_cr4)]
+	mov cr4, eax
+	mov eax, [AP_ADDR(ap_cr3)]
+	mov cr3, eax
+	mov eax, cr0
+	or  eax, 0x80010000
+	mov cr0, eax
+	mov esp, [AP_ADDR(ap_stack)]
+	mov eax, [AP_ADDR(ap_entry)]
+	call eax
+	jmp $
+
+ALIGN 8
+ap_gdt:
+	dq 0x0000000000000000 ; NULL
+	dq 0x00CF9A000000FFFF ; Code
+	dq 0x00CF92000000FFFF ; Data
+ap_gdt_ptr:
+	dw 23
+	dd AP_ADDR(ap_gdt)
+ap_cr3:
+	dd 0
+ap_cr4:
+	dd 0
+ap_stack:
+	dd 0
+ap_entry:
+	dd 0
+ap_trampoline_end:
+
 ; BSS Section
 SECTION .bss
 	resb 8192 ; 8KB of memory reserved
@@ -0,0 +1,99 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2014 Kevin Lange
+ *
+ * Futexes
+ *
+ * Wait queues keyed by user addresses, for building locks in
+ * userspace which only enter the kernel when they are contended.
+ * A waiter sleeps only if the word at its address still holds the
+ * value it expects, so a wakeup between it reading the word and
+ * calling in here is never lost.
+ *
+ * Waiters are kept in a fixed number of hashed queues; a queue may
+ * hold waiters for several addresses, so wakeups check the address
+ * (and address space) of each process they look at.
+ */
+#include <system.h>
+#include <process.h>
+#include <logging.h>
+#include <list.h>
+#include <futex.h>
+
+#define FUTEX_QUEUES 64
+
+static list_t * futex_queues[FUTEX_QUEUES];
+static uint8_t volatile futex_lock = 0;
+
+static list_t * futex_queue(page_directory_t * dir, int * addr) {
+	uint32_t hash = ((uintptr_t)addr >> 2) ^ ((uintptr_t)dir >> 12);
+	hash ^= hash >> 6;
+	list_t ** queue = &futex_queues[hash % FUTEX_QUEUES];
+	if (!*queue) {
+		*queue = list_create();
+	}
+	return *queue;
+}
+
+/*
+ * Sleep until woken through `addr`, if it still contains `val`.
+ */
+int futex_wait(int * addr, int val) {
+	process_t * proc = (process_t *)current_process;
+	list_t * queue = futex_queue(proc->thread.page_directory, addr);
+
+	IRQ_OFF;
+	spin_lock(&futex_lock);
+	if (*(volatile int *)addr != val) {
+		spin_unlock(&futex_lock);
+		IRQ_RES;
+		return -EAGAIN;
+	}
+	proc->futex_addr = addr;
+	spin_unlock(&futex_lock);
+
+	int interrupted = sleep_on(queue);
+	proc->futex_addr = NULL;
+
+	return interrupted ? -EINTR : 0;
+}
+
+/*
+ * Wake up to `count` processes in this address space waiting on `addr`.
+ * Returns how many were woken.
+ */
+int futex_wake(int * addr, int count) {
+	page_directory_t * dir = current_process->thread.page_directory;
+	list_t * queue = futex_queue(dir, addr);
+	int woken = 0;
+
+	spin_lock(&futex_lock);
+	node_t * node = queue->head;
+	while (node && woken < count) {
+		node_t * next = node->next;
+		process_t * proc = node->value;
+		if (proc->futex_addr == addr && proc->thread.page_directory == dir) {
+			list_delete(queue, node);
+			if (!proc->finished) {
+				make_process_ready(proc);
+			}
+			woken++;
+		}
+		node = next;
+	}
+	spin_unlock(&futex_lock);
+
+	return woken;
+}
+
+/*
+ * A thread is exiting; if it asked for it, let anyone joining it know.
+ * Must be called while its address space is still the current one.
+ */
+void futex_exit(process_t * proc) {
+	if (!proc->clear_tid) return;
+	*proc->clear_tid = 0;
+	futex_wake(proc->clear_tid, 0x7FFFFFFF);
+	proc->clear_tid = NULL;
+}
@@ -16,19 +16,33 @@
 #include <logging.h>
 #include <shm.h>
 #include <printf.h>
+#include <slab.h>
+#include <hashmap.h>
+#include <trace.h>
 
 tree_t * process_tree;  /* Parent->Children tree */
 list_t * process_list;  /* Flat storage */
-list_t * process_queue; /* Ready queue */
-list_t * sleep_queue;
-volatile process_t * current_process = NULL;
-process_t * kernel_idle_task = NULL;
+list_t * sleep_queue;   /* Owner of sleep_node during a timed sleep */
+
+/* Processes by PID, for process_from_pid() */
+#define PROCESS_TABLE_SIZE 256
+static hashmap_t * process_table;
+
+/* PIDs in use, one bit each */
+#define PID_MAX 32768
+static uint32_t pid_map[PID_MAX / 32];
+static pid_t pid_hint = 2;
 
 static uint8_t volatile tree_lock = 0;
-static uint8_t volatile process_queue_lock = 0;
 static uint8_t volatile wait_lock_tmp = 0;
 static uint8_t volatile sleep_lock = 0;
 
+static kmem_cache_t * process_cache = NULL;
+
+static void wheel_remove(node_t * node);
+static void wheel_init(void);
+static void release_pid(pid_t pid);
+
 /* Default process name string */
 char * default_name = "[unnamed]";
 
@@ -38,8 +52,20 @@ char * default_name = "[unnamed]";
 void initialize_process_tree(void) {
 	process_tree = tree_create();
 	process_list = list_create();
-	process_queue = list_create();
+	this_cpu()->ready_queue = list_create();
 	sleep_queue = list_create();
+	wheel_init();
+	process_cache = kmem_cache_create("process_t", sizeof(process_t), NULL);
+	process_table = hashmap_create_int(PROCESS_TABLE_SIZE);
+	/* 0 is never handed out, 1 is init */
+	pid_map[0] |= 0x3;
+}
+
+/*
+ * Allocate a (zeroed) process entry.
+ */
+static process_t * process_alloc(void) {
+	return kmem_cache_alloc(process_cache);
 }
 
 /*
@@ -86,21 +112,143 @@ void debug_print_process_tree(void) {
 }
 
 /*
- * Retreive the next ready process.
+ * Scheduling
+ *
+ * Each processor keeps its ready queue in order of virtual runtime:
+ * the time a process has spent running, scaled down by the weight
+ * of its nice level. The process at the head has had the least of
+ * its share and is the next to run. Processes which wake up are
+ * placed just ahead of the others, so interactive work keeps up
+ * with CPU hogs without being credited for its whole sleep.
+ */
+
+/* Weight of each nice level, -20 through 19; each level is about 10% of the processor */
+static const uint32_t nice_weights[NICE_MAX - NICE_MIN + 1] = {
+	88761, 71755, 56483, 46273, 36291, 29154, 23254, 18705, 14949, 11916,
+	 9548,  7620,  6100,  4904,  3906,  3121,  2501,  1991,  1586,  1277,
+	 1024,   820,   655,   526,   423,   335,   272,   215,   172,   137,
+	  110,    87,    70,    56,    45,    36,    29,    23,    18,    15,
+};
+
+#define NICE_0_WEIGHT 1024
+
+static process_t * queue_head(cpu_t * cpu) {
+	node_t * head = cpu->ready_queue->head;
+	return head ? head->value : NULL;
+}
+
+/*
+ * Virtual runtimes are only comparable on one processor; keep the
+ * lead or lag of a process relative to the queue it is moving to.
+ */
+static void migrate_vruntime(process_t * proc, cpu_t * from, cpu_t * to) {
+	if (from == to) return;
+	if (proc->vruntime >= from->min_vruntime) {
+		proc->vruntime = to->min_vruntime + (proc->vruntime - from->min_vruntime);
+	} else {
+		uint64_t lag = from->min_vruntime - proc->vruntime;
+		proc->vruntime = (to->min_vruntime > lag) ? to->min_vruntime - lag : 0;
+	}
+}
+
+/*
+ * Insert a process into a ready queue behind everything with
+ * the same or less virtual runtime.
+ */
+static void enqueue_ready(cpu_t * cpu, process_t * proc, int behind_head) {
+	uint32_t flags;
+	if (!proc->ready_at) {
+		/* Moving between queues doesn't restart the wait */
+		proc->ready_at = timer_usec();
+	}
+	spin_lock_irq(&cpu->ready_lock, &flags);
+	process_t * head = queue_head(cpu);
+	if (behind_head && head && head->vruntime > proc->vruntime) {
+		/* Yielding (or preempted): let whoever is next have a turn first */
+		proc->vruntime = head->vruntime;
+	}
+	node_t * before = NULL;
+	foreachr(node, cpu->ready_queue) {
+		if (((process_t *)node->value)->vruntime <= proc->vruntime) {
+			before = node;
+			break;
+		}
+	}
+	list_append_after(cpu->ready_queue, before, &proc->sched_node);
+	spin_unlock_irq(&cpu->ready_lock, flags);
+}
+
+static process_t * dequeue_ready(cpu_t * cpu) {
+	uint32_t flags;
+	spin_lock_irq(&cpu->ready_lock, &flags);
+	node_t * np = list_dequeue(cpu->ready_queue);
+	spin_unlock_irq(&cpu->ready_lock, flags);
+	return np ? np->value : NULL;
+}
+
+/*
+ * Retreive the next ready process for this processor.
  * XXX: POPs from the ready queue!
  *
  * @return A pointer to the next process in the queue.
  */
 process_t * next_ready_process(void) {
-	if (!process_available()) {
-		return kernel_idle_task;
+	cpu_t * cpu = this_cpu();
+	process_t * next = dequeue_ready(cpu);
+	if (!next) {
+		/* Nothing of our own to do; take something from the busiest processor */
+		cpu_t * busiest = NULL;
+		for (int i = 0; i < cpu_count; ++i) {
+			if (&cpus[i] == cpu || !cpus[i].ready_queue->length) continue;
+			if (!busiest || cpus[i].ready_queue->length > busiest->ready_queue->length) {
+				busiest = &cpus[i];
+			}
+		}
+		if (busiest && (next = dequeue_ready(busiest))) {
+			migrate_vruntime(next, busiest, cpu);
+			cpu->steals++;
+		}
 	}
-	node_t * np = list_dequeue(process_queue);
-	assert(np && "Ready queue is empty.");
-	process_t * next = np->value;
+	if (!next) {
+		return cpu->idle_task;
+	}
+	if (next->vruntime > cpu->min_vruntime) {
+		cpu->min_vruntime = next->vruntime;
+	}
+	next->cpu = cpu->id;
 	return next;
 }
 
+static int cpu_load(cpu_t * cpu) {
+	return cpu->ready_queue->length + (cpu->process != cpu->idle_task);
+}
+
+/*
+ * Choose a ready queue for a process: the one of the processor
+ * it last ran on, unless another has noticeably less to do.
+ */
+static cpu_t * ready_cpu(process_t * proc) {
+	cpu_t * cpu = &cpus[proc->cpu < cpu_count ? proc->cpu : 0];
+	cpu_t * idlest = cpu;
+	for (int i = 0; i < cpu_count; ++i) {
+		if (cpu_load(&cpus[i]) < cpu_load(idlest)) {
+			idlest = &cpus[i];
+		}
+	}
+	return (cpu_load(cpu) > cpu_load(idlest) + 1) ? idlest : cpu;
+}
+
+/*
+ * Should `proc`, which just woke up, take over from whatever `cpu` is running?
+ */
+static int should_preempt(cpu_t * cpu, process_t * proc) {
+	process_t * running = (process_t *)cpu->process;
+	if (!running || running == cpu->idle_task) {
+		return 1;
+	}
+	return proc->vruntime + SCHED_WAKEUP_PREEMPT < running->vruntime;
+}
+
 /*
  * Reinsert a process into the ready queue.
  *
@@ -109,13 +257,13 @@ process_t * next_ready_process(void) {
 void make_process_ready(process_t * proc) {
 	if (proc->sleep_node.owner != NULL) {
 		if (proc->sleep_node.owner == sleep_queue) {
-			/* XXX can't wake from timed sleep */
+			/* Woken early from a timed sleep */
 			if (proc->timed_sleep_node) {
 				spin_lock(&sleep_lock);
-				list_delete(sleep_queue, proc->timed_sleep_node);
+				wheel_remove(proc->timed_sleep_node);
 				spin_unlock(&sleep_lock);
 				proc->sleep_node.owner = NULL;
-				free(proc->timed_sleep_node->value);
+				proc->timed_sleep_node = NULL;
 			}
 			/* Else: I have no idea what happened. */
 		} else {
@@ -125,9 +273,118 @@ void make_process_ready(process_t * proc) {
 			spin_unlock(&wait_lock_tmp);
 		}
 	}
-	spin_lock(&process_queue_lock);
-	list_append(process_queue, &proc->sched_node);
-	spin_unlock(&process_queue_lock);
+	cpu_t * last = &cpus[proc->cpu < cpu_count ? proc->cpu : 0];
+	cpu_t * cpu = ready_cpu(proc);
+	migrate_vruntime(proc, last, cpu);
+	proc->cpu = cpu->id;
+
+	int waking = (proc != current_process);
+	if (waking) {
+		/* Start slightly ahead of the queue, but no further */
+		uint64_t earliest = (cpu->min_vruntime > SCHED_WAKEUP_BONUS) ? cpu->min_vruntime - SCHED_WAKEUP_BONUS : 0;
+		if (proc->vruntime < earliest) {
+			proc->vruntime = earliest;
+		}
+	}
+	enqueue_ready(cpu, proc, !waking);
+	if (waking) {
+		TRACE(TRACE_WAKEUP, proc->id, cpu->id);
+	}
+
+	if (waking && should_preempt(cpu, proc)) {
+		if (cpu == this_cpu()) {
+			cpu->need_resched = 1;
+		} else {
+			smp_reschedule(cpu);
+		}
+	}
+}
+
+/*
+ * Charge the running process for a timer tick and switch away
+ * from it if something else is now further behind.
+ */
+void sched_tick(int user) {
+	cpu_t * cpu = this_cpu();
+	process_t * proc = (process_t *)cpu->process;
+	if (!proc || proc == cpu->idle_task) {
+		switch_task(1);
+		return;
+	}
+
+	if (user) {
+		proc->utime++;
+	} else {
+		proc->stime++;
+	}
+
+	proc->vruntime += SCHED_TICK_US * NICE_0_WEIGHT / nice_weights[proc->nice - NICE_MIN];
+
+	process_t * head = queue_head(cpu);
+	uint64_t min = (head && head->vruntime < proc->vruntime) ? head->vruntime : proc->vruntime;
+	if (min > cpu->min_vruntime) {
+		cpu->min_vruntime = min;
+	}
+
+	if (cpu->need_resched || (head && head->vruntime < proc->vruntime)) {
+		switch_task(1);
+	}
+}
+
+/*
+ * Account for a context switch from `prev` to `next`
+ * (either may be the idle task, which is not accounted).
+ */
+void sched_account(process_t * prev, process_t * next) {
+	cpu_t * cpu = this_cpu();
+	uint64_t now = timer_usec();
+
+	if (prev && prev != cpu->idle_task && prev->run_start) {
+		prev->run_usec += now - prev->run_start;
+		prev->run_start = 0;
+	}
+
+	if (next == cpu->idle_task) {
+		return;
+	}
+
+	next->run_start = now;
+	next->runs++;
+	cpu->runs++;
+	if (next->ready_at) {
+		uint64_t wait = (now > next->ready_at) ? now - next->ready_at : 0;
+		next->ready_at = 0;
+		next->wait_usec += wait;
+		if (wait > next->wait_max) {
+			next->wait_max = (wait > 0xFFFFFFFF) ? 0xFFFFFFFF : (uint32_t)wait;
+		}
+		cpu->wait_usec += wait;
+		int bucket = 0;
+		for (uint64_t limit = 10; bucket < SCHED_WAIT_BUCKETS - 1 && wait >= limit; limit *= 10) {
+			bucket++;
+		}
+		cpu->wait_hist[bucket]++;
+	}
+}
+
+/*
+ * Switch now if a wakeup asked for it; called on the way
+ * out of interrupt handlers and system calls.
+ */
+void check_reschedule(void) {
+	cpu_t * cpu = this_cpu();
+	if (cpu->need_resched && current_process) {
+		switch_task(1);
+	}
+}
+
+/*
+ * Change the nice level of a process, clamping it to the valid range.
+ */
+void process_set_nice(process_t * proc, int nice) {
+	if (nice < NICE_MIN) nice = NICE_MIN;
+	if (nice > NICE_MAX) nice = NICE_MAX;
+	proc->nice = nice;
 }
 
 
@@ -157,16 +414,41 @@ void delete_process(process_t * proc) {
 	/* Reparent everyone below me to init */
 	tree_remove_reparent_root(process_tree, entry);
 	list_delete(process_list, list_find(process_list, proc));
+	hashmap_remove(process_table, (void *)proc->id);
+	release_pid(proc->id);
 	spin_unlock(&tree_lock);
 
+	/* Don't leave a processor thinking it holds our FPU context */
+	fpu_release(proc);
+
 	/* Uh... */
-	free(proc);
+	kmem_cache_free(process_cache, proc);
 }
 
 static void _kidle(void) {
 	while (1) {
-		IRQ_RES;
-		PAUSE;
+		IRQ_OFF;
+		kernel_enter();
+		if (process_available()) {
+			/* Something was woken up for this processor while we were busy */
+			switch_task(1);
+		}
+		/* Spend spare cycles clearing frames; only halt once the pool is full */
+		int busy = zero_pool_refill();
+		if (!busy) {
+			/* Nothing to time-slice until something wakes up */
+			tick_stop();
+		}
+		/* Let the other processors into the kernel between pages */
+		kernel_leave();
+		if (busy) {
+			IRQ_RES;
+		} else {
+			cpu_t * cpu = this_cpu();
+			cpu->halted_at = timer_usec();
+			cpu->halted = 1;
+			asm volatile ("sti\nhlt");
+		}
 	}
 }
 
@@ -174,8 +456,7 @@ static void _kidle(void) {
  * Spawn the idle "process".
  */
 process_t * spawn_kidle(void) {
-	process_t * idle = malloc(sizeof(process_t));
-	memset(idle, 0x00, sizeof(process_t));
+	process_t * idle = process_alloc();
 	idle->id = -1;
 	idle->name = strdup("[kidle]");
 	idle->is_tasklet = 1;
@@ -188,7 +469,6 @@ process_t * spawn_kidle(void) {
 	idle->started = 1;
 	idle->running = 1;
 	idle->wait_queue = list_create();
-	idle->shm_mappings = list_create();
 	idle->signal_queue = list_create();
 
 	set_process_environment(idle, current_directory);
@@ -205,7 +485,7 @@ process_t * spawn_init(void) {
 	assert((!process_tree->root) && "Tried to regenerate init!");
 
 	/* Allocate space for a new process */
-	process_t * init = malloc(sizeof(process_t));
+	process_t * init = process_alloc();
 	/* Set it as the root process */
 	tree_set_root(process_tree, (void *)init);
 	/* Set its tree entry pointer so we can keep track
@@ -236,7 +516,6 @@ process_t * spawn_init(void) {
 	init->image.stack       = initial_esp + 1;
 	init->image.user_stack  = 0;
 	init->image.size        = 0;
-	init->image.shm_heap    = SHM_START; /* Yeah, a bit of a hack. */
 	init->image.lock = 0;
 
 	/* Process is not finished */
@@ -244,9 +523,11 @@ process_t * spawn_init(void) {
 	init->started = 1;
 	init->running = 1;
 	init->wait_queue = list_create();
-	init->shm_mappings = list_create();
 	init->signal_queue = list_create();
-	init->signal_kstack = NULL; /* None yet initialized */
+	init->blocked = 0;
+	init->signal_kstack = 0;
+	init->signal_kstack_prev = 0;
+	init->signal_frame = 0;
 
 	init->sched_node.prev = NULL;
 	init->sched_node.next = NULL;
@@ -257,6 +538,10 @@ process_t * spawn_init(void) {
 	init->sleep_node.value = init;
 
 	init->timed_sleep_node = NULL;
+	init->futex_addr = NULL;
+	init->clear_tid = NULL;
+	init->vfork_parent = NULL;
+	init->vfork_child = NULL;
 
 	init->is_tasklet = 0;
 
@@ -265,6 +550,7 @@ process_t * spawn_init(void) {
 	/* What the hey, let's also set the description on this one */
 	init->description = strdup("[init]");
 	list_insert(process_list, (void *)init);
+	hashmap_set(process_table, (void *)init->id, init);
 
 	return init;
 }
@@ -272,12 +558,32 @@ process_t * spawn_init(void) {
 /*
  * Get the next available PID
  *
- * @return A usable PID for a new process.
+ * PIDs are handed out in increasing order, wrapping around to
+ * reuse those that have been freed, so a PID is not reused
+ * right after its process is reaped.
+ *
+ * @return A usable PID for a new process, or -1 if there are none.
  */
 pid_t get_next_pid(void) {
-	/* Terribly naïve, I know, but it works for now */
-	static pid_t next = 2;
-	return (next++);
+	for (pid_t i = 0; i < PID_MAX; ++i) {
+		pid_t pid = pid_hint + i;
+		if (pid >= PID_MAX) pid -= PID_MAX;
+		if (!(pid_map[pid / 32] & (1 << (pid % 32)))) {
+			pid_map[pid / 32] |= (1 << (pid % 32));
+			pid_hint = pid + 1;
+			if (pid_hint >= PID_MAX) pid_hint = 2;
+			return pid;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Give back a PID from get_next_pid().
+ */
+static void release_pid(pid_t pid) {
+	if (pid < 2 || pid >= PID_MAX) return;
+	pid_map[pid / 32] &= ~(1 << (pid % 32));
 }
 
 /*
@@ -307,9 +613,12 @@ process_t * spawn_process(volatile process_t * parent) {
 
 	/* Allocate a new process */
 	debug_print(INFO,"   process_t {");
-	process_t * proc = malloc(sizeof(process_t));
+	process_t * proc = process_alloc();
 	debug_print(INFO,"   }");
+	spin_lock(&tree_lock);
 	proc->id = get_next_pid(); /* Set its PID */
+	spin_unlock(&tree_lock);
+	assert(proc->id > 0 && "Out of process IDs.");
 	proc->group = proc->id;    /* Set the GID */
 	proc->name = strdup(parent->name); /* Use the default name */
 	proc->description = NULL;  /* No description */
@@ -328,6 +637,11 @@ process_t * spawn_process(volatile process_t * parent) {
 	proc->thread.eip = 0;
 	proc->thread.fpu_enabled = 0;
 
+	/* Start out next to the parent, with its place in line and its priority */
+	proc->cpu = this_cpu()->id;
+	proc->vruntime = parent->vruntime;
+	proc->nice = parent->nice;
+
 	/* Set the process image information from the parent */
 	proc->image.entry       = parent->image.entry;
 	proc->image.heap        = parent->image.heap;
@@ -337,7 +651,6 @@ process_t * spawn_process(volatile process_t * parent) {
 	proc->image.stack       = (uintptr_t)malloc(KERNEL_STACK_SIZE) + KERNEL_STACK_SIZE;
 	debug_print(INFO,"    }");
 	proc->image.user_stack  = parent->image.user_stack;
-	proc->image.shm_heap    = SHM_START; /* Yeah, a bit of a hack. */
 	proc->image.lock = 0;
 
 	assert(proc->image.stack && "Failed to allocate kernel stack for new process.");
@@ -365,11 +678,14 @@ process_t * spawn_process(volatile process_t * parent) {
 	proc->finished = 0;
 	proc->started = 0;
 	proc->running = 0;
-	memset(proc->signals.functions, 0x00, sizeof(uintptr_t) * NUMSIGNALS);
+	/* Handlers are inherited; exec() puts them back to the defaults */
+	memcpy(&proc->signals, (void *)&parent->signals, sizeof(sig_table_t));
 	proc->wait_queue = list_create();
-	proc->shm_mappings = list_create();
 	proc->signal_queue = list_create();
-	proc->signal_kstack = NULL; /* None yet initialized */
+	proc->blocked = parent->blocked;
+	proc->signal_kstack = 0;
+	proc->signal_kstack_prev = 0;
+	proc->signal_frame = 0;
 
 	proc->sched_node.prev = NULL;
 	proc->sched_node.next = NULL;
@@ -380,6 +696,10 @@ process_t * spawn_process(volatile process_t * parent) {
 	proc->sleep_node.value = proc;
 
 	proc->timed_sleep_node = NULL;
+	proc->futex_addr = NULL;
+	proc->clear_tid = NULL;
+	proc->vfork_parent = NULL;
+	proc->vfork_child = NULL;
 
 	proc->is_tasklet = 0;
 
@@ -391,29 +711,20 @@ process_t * spawn_process(volatile process_t * parent) {
 	spin_lock(&tree_lock);
 	tree_node_insert_child_node(process_tree, parent->tree_entry, entry);
 	list_insert(process_list, (void *)proc);
+	hashmap_set(process_table, (void *)proc->id, proc);
 	spin_unlock(&tree_lock);
 
 	/* Return the new process */
 	return proc;
 }
 
-uint8_t process_compare(void * proc_v, void * pid_v) {
-	pid_t pid = (*(pid_t *)pid_v);
-	process_t * proc = (process_t *)proc_v;
-
-	return (uint8_t)(proc->id == pid);
-}
-
 process_t * process_from_pid(pid_t pid) {
 	if (pid < 0) return NULL;
 
 	spin_lock(&tree_lock);
-	tree_node_t * entry = tree_find(process_tree,&pid,process_compare);
+	process_t * proc = hashmap_get(process_table, (void *)pid);
 	spin_unlock(&tree_lock);
-	if (entry) {
-		return (process_t *)entry->value;
-	}
-	return NULL;
+	return proc;
 }
 
 process_t * process_get_parent(process_t * process) {
@@ -485,7 +796,7 @@ void set_process_environment(process_t * proc, page_directory_t * directory) {
  * @return 1 if there are processes available, 0 otherwise
  */
 uint8_t process_available(void) {
-	return (process_queue->head != NULL);
+	return (this_cpu()->ready_queue->head != NULL);
 }
 
 /*
@@ -576,6 +887,10 @@ int sleep_on(list_t * queue) {
 	list_append(queue, (node_t *)&current_process->sleep_node);
 	spin_unlock(&wait_lock_tmp);
 	switch_task(0);
+	if (current_process->sleep_interrupted) {
+		/* Perhaps by a signal; its handler runs before we go on */
+		signal_interrupted_sleep();
+	}
 	return current_process->sleep_interrupted;
 }
 
@@ -584,27 +899,191 @@ int process_is_ready(process_t * proc) {
 }
 
 
+/*
+ * Timed sleeps
+ *
+ * Sleepers wait in a hierarchical timer wheel. Level 0 has a slot
+ * for each of the next WHEEL_SLOTS milliseconds; each level above
+ * it covers WHEEL_SLOTS times as long with the same number of slots,
+ * and its slots are emptied into the levels below as time reaches
+ * them. Adding or removing a sleeper takes constant time, and a tick
+ * only looks at the slots for the milliseconds that have passed.
+ */
+#define WHEEL_LEVELS 4
+#define WHEEL_BITS   6
+#define WHEEL_SLOTS  (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SLOTS - 1)
+#define WHEEL_RANGE  (1UL << (WHEEL_BITS * WHEEL_LEVELS)) /* About four and a half hours */
+
+static list_t * wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static uint32_t wheel_count[WHEEL_LEVELS];
+static uint32_t wheel_time = 0; /* The next millisecond to expire */
+
+static void wheel_init(void) {
+	for (int level = 0; level < WHEEL_LEVELS; ++level) {
+		for (int slot = 0; slot < WHEEL_SLOTS; ++slot) {
+			wheel[level][slot] = list_create();
+		}
+	}
+}
+
+static uint64_t sleeper_usec(sleeper_t * sleeper) {
+	return (uint64_t)sleeper->end_tick * SUBTICKS_PER_TICK + sleeper->end_subtick;
+}
+
+static void wheel_insert(sleeper_t * sleeper) {
+	uint32_t expires = sleeper->expires;
+	int32_t delta = (int32_t)(expires - wheel_time);
+	if (delta < 0) {
+		/* Already due; goes off with the next slot */
+		expires = wheel_time;
+		delta = 0;
+	} else if ((uint32_t)delta >= WHEEL_RANGE) {
+		/* Too far out; park it in the last slot and try again when it cascades */
+		expires = wheel_time + WHEEL_RANGE - 1;
+		delta = WHEEL_RANGE - 1;
+	}
+
+	int level = 0;
+	while (level < WHEEL_LEVELS - 1 && (uint32_t)delta >= (1UL << (WHEEL_BITS * (level + 1)))) {
+		level++;
+	}
+	uint32_t slot = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+	sleeper->level = level;
+	wheel_count[level]++;
+	sleeper->process->timed_sleep_node = list_insert(wheel[level][slot], sleeper);
+}
+
+static sleeper_t * wheel_take(node_t * node) {
+	sleeper_t * sleeper = node->value;
+	list_delete(node->owner, node);
+	free(node);
+	wheel_count[sleeper->level]--;
+	return sleeper;
+}
+
+static void wheel_remove(node_t * node) {
+	free(wheel_take(node));
+}
+
+/*
+ * Move the sleepers out of the higher level slots that
+ * wheel_time has just reached.
+ */
+static void wheel_cascade(void) {
+	for (int level = 1; level < WHEEL_LEVELS; ++level) {
+		uint32_t slot = (wheel_time >> (WHEEL_BITS * level)) & WHEEL_MASK;
+		list_t * list = wheel[level][slot];
+		while (list->head) {
+			wheel_insert(wheel_take(list->head));
+		}
+		if (slot) break;
+	}
+}
+
+/*
+ * When the first sleeper in the next WHEEL_SLOTS milliseconds is due.
+ * Anything later is normally caught by a regular tick; with `far`
+ * (for a processor whose tick is stopped), we also look for the
+ * next cascade that has sleepers to move down. 0 if there is nothing.
+ */
+static uint64_t wheel_next(int far) {
+	if (wheel_count[0]) {
+		for (uint32_t i = 0; i < WHEEL_SLOTS; ++i) {
+			list_t * list = wheel[0][(wheel_time + i) & WHEEL_MASK];
+			if (!list->head) continue;
+			uint64_t next = 0;
+			foreach(node, list) {
+				uint64_t usec = sleeper_usec(node->value);
+				if (!next || usec < next) next = usec;
+			}
+			return next;
+		}
+	}
+	if (!far) return 0;
+
+	/* In milliseconds from wheel_time */
+	uint32_t soonest = 0;
+	for (int level = 1; level < WHEEL_LEVELS; ++level) {
+		if (!wheel_count[level]) continue;
+		int shift = WHEEL_BITS * level;
+		for (uint32_t i = 1; i <= WHEEL_SLOTS; ++i) {
+			if (!wheel[level][((wheel_time >> shift) + i) & WHEEL_MASK]->head) continue;
+			uint32_t delta = (((wheel_time >> shift) + i) << shift) - wheel_time;
+			if (!soonest || delta < soonest) soonest = delta;
+			break;
+		}
+	}
+	if (!soonest) return 0;
+
+	uint64_t now = timer_usec();
+	int32_t ahead = (int32_t)(wheel_time + soonest - (uint32_t)(now / 1000));
+	return ahead > 0 ? now + (uint64_t)ahead * 1000 : now;
+}
+
+/*
+ * When the next sleeper or cascade is due; see wheel_next().
+ */
+uint64_t sleep_next_wakeup(void) {
+	spin_lock(&sleep_lock);
+	uint64_t next = wheel_next(1);
+	spin_unlock(&sleep_lock);
+	return next;
+}
+
 void wakeup_sleepers(unsigned long seconds, unsigned long subseconds) {
+	uint64_t now_usec = (uint64_t)seconds * SUBTICKS_PER_TICK + subseconds;
+	uint32_t now = seconds * 1000 + subseconds / 1000;
+
 	spin_lock(&sleep_lock);
-	if (sleep_queue->length) {
-		sleeper_t * proc = ((sleeper_t *)sleep_queue->head->value);
-		while (proc && (proc->end_tick < seconds || (proc->end_tick == seconds && proc->end_subtick <= subseconds))) {
-			process_t * process = proc->process;
-			process->sleep_node.owner = NULL;
-			process->timed_sleep_node = NULL;
-			if (!process_is_ready(process)) {
-				make_process_ready(process);
+	while (1) {
+		/* Everything in the slot is due, except for the rest of the current millisecond */
+		node_t * node = wheel[0][wheel_time & WHEEL_MASK]->head;
+		while (node) {
+			node_t * next = node->next;
+			sleeper_t * sleeper = node->value;
+			if ((int32_t)(sleeper->expires - wheel_time) > 0) {
+				/* Came around from beyond the end of the wheel */
+				wheel_insert(wheel_take(node));
+			} else if (sleeper_usec(sleeper) <= now_usec) {
+				process_t * process = sleeper->process;
+				wheel_remove(node);
+				process->sleep_node.owner = NULL;
+				process->timed_sleep_node = NULL;
+				if (!process_is_ready(process)) {
+					make_process_ready(process);
+				}
 			}
-			free(proc);
-			free(list_dequeue(sleep_queue));
-			if (sleep_queue->length) {
-				proc = ((sleeper_t *)sleep_queue->head->value);
-			} else {
-				break;
+			node = next;
+		}
+
+		if ((int32_t)(now - wheel_time) <= 0) break;
+
+		if (!wheel_count[0]) {
+			/* Nothing to do before the next cascade */
+			uint32_t next = (wheel_time | WHEEL_MASK) + 1;
+			int empty = !wheel_count[1] && !wheel_count[2] && !wheel_count[3];
+			if (empty || (int32_t)(next - now) > 0) {
+				wheel_time = now;
+				continue;
 			}
+			wheel_time = next;
+		} else {
+			wheel_time++;
+		}
+		if (!(wheel_time & WHEEL_MASK)) {
+			wheel_cascade();
 		}
 	}
+	/* A processor without a tick has to keep itself going */
+	cpu_t * cpu = this_cpu();
+	uint64_t next = wheel_next(cpu->tickless && !cpu->id);
 	spin_unlock(&sleep_lock);
+
+	if (next) {
+		timer_alarm(next);
+	}
 }
 
 void sleep_until(process_t * process, unsigned long seconds, unsigned long subseconds) {
@@ -613,21 +1092,18 @@ void sleep_until(process_t * process, unsigned long seconds, unsigned long subse
 		return;
 	}
 	process->sleep_node.owner = sleep_queue;
+	sleeper_t * sleeper = malloc(sizeof(sleeper_t));
+	sleeper->process     = process;
+	sleeper->end_tick    = seconds;
+	sleeper->end_subtick = subseconds;
+	sleeper->expires     = seconds * 1000 + subseconds / 1000;
+
 	spin_lock(&sleep_lock);
-	node_t * before = NULL;
-	foreach(node, sleep_queue) {
-		sleeper_t * candidate = ((sleeper_t *)node->value);
-		if (candidate->end_tick > seconds || (candidate->end_tick == seconds && candidate->end_subtick > subseconds)) {
-			break;
-		}
-		before = node;
-	}
-	sleeper_t * proc = malloc(sizeof(sleeper_t));
-	proc->process     = process;
-	proc->end_tick    = seconds;
-	proc->end_subtick = subseconds;
-	process->timed_sleep_node = list_insert_after(sleep_queue, before, proc);
+	wheel_insert(sleeper);
 	spin_unlock(&sleep_lock);
+
+	/* Between ticks? Ask for an interrupt when it's due */
+	timer_alarm(sleeper_usec(sleeper));
 }
 
 void cleanup_process(process_t * proc, int retval) {
@@ -639,18 +1115,13 @@ void cleanup_process(process_t * proc, int retval) {
 	list_free(proc->signal_queue);
 	free(proc->signal_queue);
 	free(proc->wd_name);
-	debug_print(INFO, "Releasing shared memory for %d", proc->id);
-	shm_release_all(proc);
-	free(proc->shm_mappings);
 	debug_print(INFO, "Freeing more mems %d", proc->id);
-	if (proc->signal_kstack) {
-		free(proc->signal_kstack);
-	}
 	debug_print(INFO, "Dec'ing fds for %d", proc->id);
+	/* Every thread holds its own reference to the page directory; its shared memory regions go with it */
+	release_directory(proc->thread.page_directory);
 	proc->fds->refs--;
 	if (proc->fds->refs == 0) {
-		debug_print(INFO, "Reached 0, all dependencies are closed for %d's file descriptors and page directories", proc->id);
-		release_directory(proc->thread.page_directory);
+		debug_print(INFO, "Reached 0, all dependencies are closed for %d's file descriptors", proc->id);
 		debug_print(INFO, "Going to clear out the file descriptors %d", proc->id);
 		for (uint32_t i = 0; i < proc->fds->length; ++i) {
 			if (proc->fds->entries[i]) {
@@ -661,9 +1132,9 @@ void cleanup_process(process_t * proc, int retval) {
 		debug_print(INFO, "... and their storage %d", proc->id);
 		free(proc->fds->entries);
 		free(proc->fds);
-		debug_print(INFO, "... and the kernel stack (hope this ain't us) %d", proc->id);
-		free((void *)(proc->image.stack - KERNEL_STACK_SIZE));
 	}
+	debug_print(INFO, "... and the kernel stack (hope this ain't us) %d", proc->id);
+	free((void *)(proc->image.stack - KERNEL_STACK_SIZE));
 }
 
 void reap_process(process_t * proc) {
@@ -734,6 +1205,8 @@ int waitpid(int pid, int * status, int options) {
 				*status = candidate->status;
 			}
 			int pid = candidate->id;
+			proc->cutime += candidate->utime + candidate->cutime;
+			proc->cstime += candidate->stime + candidate->cstime;
 			reap_process(candidate);
 			return pid;
 		} else {
@@ -4,41 +4,37 @@
  * Copyright (C) 2012-2014 Kevin Lange
  *
  * Signal Handling
+ *
+ * Signals are queued on the receiving process and acted on when it
+ * next heads back to user mode: a handler is entered by pushing a
+ * frame with the interrupted registers onto the user stack and
+ * pointing the saved registers at the handler. When the handler
+ * returns to SIGNAL_RETURN, the fault that causes brings us back to
+ * restore the registers from that frame.
+ *
+ * A process asleep in the kernel when a signal arrives runs its
+ * handler from where it slept: the handler's own trips into the
+ * kernel use the stack below the sleeping frames, and returning from
+ * it jumps straight back into the sleep. A handler may also never
+ * return (longjmp() out of it); once the user stack pointer is back
+ * above its frame, the sleep is abandoned along with the system call
+ * it was part of.
  */
 
 #include <system.h>
 #include <signal.h>
 #include <logging.h>
+#include <slab.h>
 
-void enter_signal_handler(uintptr_t location, int signum, uintptr_t stack) {
-	IRQ_OFF;
-	asm volatile(
-			"mov %2, %%esp\n"
-			"pushl %1\n"           /*          argument count   */
-			"pushl $" STRSTR(SIGNAL_RETURN) "\n"
-			"mov $0x23, %%ax\n"    /* Segment selector */
-			"mov %%ax, %%ds\n"
-			"mov %%ax, %%es\n"
-			"mov %%ax, %%fs\n"
-			"mov %%ax, %%gs\n"
-			"mov %%esp, %%eax\n"   /* Stack -> EAX */
-			"pushl $0x23\n"        /* Segment selector again */
-			"pushl %%eax\n"
-			"pushf\n"              /* Push flags */
-			"popl %%eax\n"         /* Fix the Interrupt flag */
-			"orl  $0x200, %%eax\n"
-			"pushl %%eax\n"
-			"pushl $0x1B\n"
-			"pushl %0\n"           /* Push the entry point */
-			"iret\n"
-			: : "m"(location), "m"(signum), "r"(stack) : "%ax", "%esp", "%eax");
+static kmem_cache_t * signal_cache = NULL;
 
-	debug_print(CRITICAL, "Failed to jump to signal handler!");
+signal_t * signal_alloc(void) {
+	if (!signal_cache) {
+		signal_cache = kmem_cache_create("signal_t", sizeof(signal_t), NULL);
+	}
+	return kmem_cache_alloc(signal_cache);
 }
 
-static uint8_t volatile sig_lock;
-static uint8_t volatile sig_lock_b;
-
 char isdeadly[] = {
 	0, /* 0? */
 	1, /* SIGHUP     */
@@ -77,105 +73,352 @@ char isdeadly[] = {
 	0, /* SIGHATE    */
 	0, /* SIGWINEVENT*/
 	0, /* SIGCAT     */
+	3, /* SIGTTOU    */
 };
 
-void handle_signal(process_t * proc, signal_t * sig) {
-	uintptr_t handler = sig->handler;
-	uintptr_t signum  = sig->signum;
-	free(sig);
 
-	if (proc->finished) {
-		return;
+/* What a handler finds on its stack; the return address is its own */
+struct signal_frame {
+	uintptr_t return_address;
+	uint32_t  signum;
+	uint32_t  blocked;           /* Mask to go back to */
+	regs_t    registers;         /* Where the process was */
+};
+
+/* Flags user code may change when returning from a handler */
+#define USER_EFLAGS 0x40DD5
+
+static uint32_t signal_bit(uint32_t signum) {
+	return (signum < 32) ? (1UL << signum) : 0;
+}
+
+static int is_blocked(process_t * proc, uint32_t signum) {
+	return (proc->blocked & signal_bit(signum) & ~SIG_UNBLOCKABLE) != 0;
+}
+
+static int frame_ok(process_t * proc, uintptr_t frame) {
+	return frame >= proc->image.entry && frame + sizeof(struct signal_frame) <= USER_STACK_TOP;
+}
+
+/*
+ * Kernel stack top for the process: lower than usual while it is
+ * running a handler from a sleep, so as to leave the sleep alone.
+ */
+uintptr_t signal_kernel_stack(process_t * proc) {
+	return proc->signal_kstack ? proc->signal_kstack : proc->image.stack;
+}
+
+/*
+ * Has the handler run from a sleep been left without returning?
+ * `r` is the user state we entered (or are leaving) the kernel with.
+ */
+static int handler_abandoned(process_t * proc, struct regs * r) {
+	return proc->signal_frame && r->useresp > proc->signal_frame;
+}
+
+/*
+ * Take the first queued signal that isn't blocked.
+ */
+static uint32_t next_signal(process_t * proc) {
+	foreach(node, proc->signal_queue) {
+		signal_t * sig = node->value;
+		if (!is_blocked(proc, sig->signum)) {
+			uint32_t signum = sig->signum;
+			list_delete(proc->signal_queue, node);
+			free(node);
+			kmem_cache_free(signal_cache, sig);
+			return signum;
+		}
 	}
+	return 0;
+}
 
-	if (signum == 0 || signum >= NUMSIGNALS) {
-		/* Ignore */
-		return;
+/*
+ * Carry out the default action for a signal nobody is handling.
+ */
+static void default_action(process_t * proc, uint32_t signum) {
+	char dowhat = isdeadly[signum];
+	if (dowhat == 1 || dowhat == 2) {
+		debug_print(WARNING, "Process %d killed by unhandled signal (%d)", proc->id, signum);
+		kexit(128 + signum);
+		__builtin_unreachable();
 	}
+	/* XXX dowhat == 2: should dump core */
+	/* XXX dowhat == 3: stop */
+	debug_print(WARNING, "Ignoring signal %d by default in pid %d", signum, proc->id);
+}
 
-	if (!handler) {
-		char dowhat = isdeadly[signum];
-		if (dowhat == 1 || dowhat == 2) {
-			debug_print(WARNING, "Process %d killed by unhandled signal (%d)", proc->id, signum);
-			kexit(128 + signum);
-			__builtin_unreachable();
-		} else {
-			debug_print(WARNING, "Ignoring signal %d by default in pid %d", signum, proc->id);
+/*
+ * Decide what to do about the next deliverable signal. Default actions
+ * and ignored signals are dealt with here; returns the handler to run,
+ * if there is one, with its signal in `signum`.
+ */
+static uintptr_t next_handler(process_t * proc, uint32_t * signum) {
+	while ((*signum = next_signal(proc))) {
+		uintptr_t handler = proc->signals.functions[*signum];
+		if (!handler) {
+			default_action(proc, *signum);
+		} else if (handler != 1) {
+			return handler;
 		}
-		/* XXX dowhat == 2: should dump core */
-		/* XXX dowhat == 3: stop */
-		return;
 	}
+	return 0;
+}
 
-	if (handler == 1) /* Ignore */ {
-		return;
+/*
+ * Block what the handler asked to be blocked while it runs.
+ */
+static void handler_mask(process_t * proc, uint32_t signum) {
+	proc->blocked |= proc->signals.masks[signum];
+	if (!(proc->signals.flags[signum] & SA_NODEFER)) {
+		proc->blocked |= signal_bit(signum);
 	}
+	proc->blocked &= ~SIG_UNBLOCKABLE;
+	if (proc->signals.flags[signum] & SA_RESETHAND) {
+		proc->signals.functions[signum] = 0;
+	}
+}
 
-	debug_print(NOTICE, "handling signal in process %d (%d)", proc->id, signum);
+/*
+ * Push a signal frame below the user stack pointer in `r`.
+ */
+static struct signal_frame * push_frame(process_t * proc, struct regs * r, uint32_t signum) {
+	/* Aligned as if the handler had been called normally */
+	uintptr_t sp = ((r->useresp - sizeof(struct signal_frame)) & ~0xF) - 4;
+	if (!frame_ok(proc, sp)) {
+		debug_print(WARNING, "Process %d has no room for a signal frame (esp=0x%x)", proc->id, r->useresp);
+		kexit(128 + SIGSEGV);
+		__builtin_unreachable();
+	}
 
-	uintptr_t stack = 0xFFFF0000;
-	if (proc->syscall_registers->useresp < 0x10000100) {
-		stack = proc->image.user_stack;
-	} else {
-		stack = proc->syscall_registers->useresp;
+	struct signal_frame * frame = (struct signal_frame *)sp;
+	frame->return_address = SIGNAL_RETURN;
+	frame->signum         = signum;
+	frame->blocked        = proc->blocked;
+	memcpy(&frame->registers, r, sizeof(regs_t));
+	return frame;
+}
+
+/*
+ * Called on every return to user mode, with the registers we are
+ * about to return with.
+ */
+void deliver_signals(struct regs * r) {
+	process_t * proc = (process_t *)current_process;
+	if (!proc) return;
+
+	if (proc->signal_kstack && (!proc->signal_frame || handler_abandoned(proc, r))) {
+		/* Not heading back into a handler, so nothing below the top of the stack is wanted again */
+		proc->signal_kstack = 0;
+		proc->signal_frame  = 0;
+		set_kernel_stack(proc->image.stack);
 	}
 
-	/* Not marked as ignored, must call signal */
-	enter_signal_handler(handler, signum, stack);
+	if (!proc->signal_queue->length) return;
+
+	uint32_t signum;
+	uintptr_t handler = next_handler(proc, &signum);
+	if (!handler) return;
+
+	debug_print(INFO, "handling signal in process %d (%d)", proc->id, signum);
+
+	struct signal_frame * frame = push_frame(proc, r, signum);
+	handler_mask(proc, signum);
+
+	r->useresp = (uintptr_t)frame;
+	r->eip     = handler;
+	r->eflags &= ~0x400; /* Direction flag clear on entry, as for any call */
+}
+
+/*
+ * Drop to user mode at a handler, with `stack` as its stack pointer.
+ */
+static void enter_signal_handler(uintptr_t location, uintptr_t stack) {
+	IRQ_OFF;
+	kernel_leave();
+	asm volatile(
+			"mov $0x23, %%ax\n"    /* Segment selector */
+			"mov %%ax, %%ds\n"
+			"mov %%ax, %%es\n"
+			"mov %%ax, %%fs\n"
+			"mov %%ax, %%gs\n"
+			"pushl $0x23\n"        /* Segment selector again */
+			"pushl %1\n"           /* Stack */
+			"pushf\n"              /* Push flags */
+			"popl %%eax\n"         /* Fix the Interrupt flag */
+			"orl  $0x200, %%eax\n"
+			"pushl %%eax\n"
+			"pushl $0x1B\n"
+			"pushl %0\n"           /* Push the entry point */
+			"iret\n"
+			: : "r"(location), "r"(stack) : "%ax", "%eax");
 
+	debug_print(CRITICAL, "Failed to jump to signal handler!");
 }
 
-list_t * rets_from_sig;
+/*
+ * A sleep in the kernel was cut short; if it was for a signal with a
+ * handler, run the handler now and come back here when it returns, so
+ * whatever we were waiting for can carry on.
+ */
+void signal_interrupted_sleep(void) {
+	process_t * proc = (process_t *)current_process;
+	if (proc->finished || proc->is_tasklet || !proc->signal_queue->length) {
+		return;
+	}
+	if (proc->vfork_child) {
+		/* The child is running on our user stack; the handler can wait until it's done */
+		return;
+	}
+
+	/* Registers from when we entered the kernel, at the top of the stack that entry used */
+	struct regs * r = (struct regs *)signal_kernel_stack(proc) - 1;
+
+	if (handler_abandoned(proc, r)) {
+		/* We are in the kernel from wherever the last handler jumped to; that sleep won't be back */
+		proc->signal_frame = 0;
+	}
+	if (proc->signal_frame) {
+		/* Still in that handler; this one can wait for the way out */
+		return;
+	}
+
+	uintptr_t esp, ebp, eip;
+	asm volatile ("mov %%esp, %0" : "=r" (esp));
+	asm volatile ("mov %%ebp, %0" : "=r" (ebp));
+	if (esp < proc->image.stack - KERNEL_STACK_SIZE / 2) {
+		/*
+		 * Sleeps abandoned by earlier handlers are still on the
+		 * stack above us, and every handler run from here goes
+		 * lower; past halfway, it waits for the way out instead.
+		 */
+		return;
+	}
+	eip = read_eip();
+	if (eip == 0x10000) {
+		/* The handler has returned */
+		return;
+	}
+
+	uint32_t signum;
+	uintptr_t handler = next_handler(proc, &signum);
+	if (!handler) return;
+
+	debug_print(INFO, "handling signal in sleeping process %d (%d)", proc->id, signum);
+
+	struct signal_frame * frame = push_frame(proc, r, signum);
+	handler_mask(proc, signum);
 
-void return_from_signal_handler(void) {
-#if 0
-	debug_print(INFO, "Return From Signal for process %d", current_process->id);
-#endif
+	proc->signal_state.esp   = esp;
+	proc->signal_state.ebp   = ebp;
+	proc->signal_state.eip   = eip;
+	proc->signal_frame       = (uintptr_t)frame;
+	proc->signal_kstack_prev = proc->signal_kstack;
+	proc->signal_kstack      = (esp - 256) & ~0xF;
+	set_kernel_stack(proc->signal_kstack);
+
+	enter_signal_handler(handler, (uintptr_t)frame);
+}
 
-	if (__builtin_expect(!rets_from_sig, 0)) {
-		rets_from_sig = list_create();
+/*
+ * A handler returned to SIGNAL_RETURN; `r` is the fault that caused.
+ */
+void return_from_signal_handler(struct regs * r) {
+	process_t * proc = (process_t *)current_process;
+	/* The handler's return popped the return address */
+	uintptr_t sp = r->useresp - sizeof(uintptr_t);
+
+	if (!frame_ok(proc, sp)) {
+		debug_print(WARNING, "Process %d returned from a signal handler with a bad stack", proc->id);
+		kexit(128 + SIGSEGV);
+		__builtin_unreachable();
 	}
 
-	spin_lock(&sig_lock);
-	list_insert(rets_from_sig, (process_t *)current_process);
-	spin_unlock(&sig_lock);
+	struct signal_frame * frame = (struct signal_frame *)sp;
+	proc->blocked = frame->blocked & ~SIG_UNBLOCKABLE;
 
-	switch_next();
+	if (proc->signal_frame && sp == proc->signal_frame) {
+		/* Back to the sleep the handler interrupted, and the stack that was in use then */
+		uintptr_t esp = proc->signal_state.esp;
+		uintptr_t ebp = proc->signal_state.ebp;
+		uintptr_t eip = proc->signal_state.eip;
+		proc->signal_kstack = proc->signal_kstack_prev;
+		proc->signal_frame  = 0;
+		set_kernel_stack(signal_kernel_stack(proc));
+		asm volatile (
+				"mov %0, %%ebx\n"
+				"mov %1, %%esp\n"
+				"mov %2, %%ebp\n"
+				"mov $0x10000, %%eax\n" /* read_eip() will return 0x10000 */
+				"jmp *%%ebx"
+				: : "r" (eip), "r" (esp), "r" (ebp)
+				: "%ebx", "%eax");
+	}
+
+	/* Only take back what user code could have set itself */
+	regs_t * saved = &frame->registers;
+	r->edi     = saved->edi;
+	r->esi     = saved->esi;
+	r->ebp     = saved->ebp;
+	r->ebx     = saved->ebx;
+	r->edx     = saved->edx;
+	r->ecx     = saved->ecx;
+	r->eax     = saved->eax;
+	r->eip     = saved->eip;
+	r->useresp = saved->useresp;
+	r->eflags  = (r->eflags & ~USER_EFLAGS) | (saved->eflags & USER_EFLAGS) | 0x200;
 }
 
-void fix_signal_stacks(void) {
-	uint8_t redo_me = 0;
-	if (rets_from_sig) {
-		spin_lock(&sig_lock_b);
-		while (rets_from_sig->head) {
-			spin_lock(&sig_lock);
-			node_t * n = list_dequeue(rets_from_sig);
-			spin_unlock(&sig_lock);
-			if (!n) {
-				continue;
-			}
-			process_t * p = n->value;
-			free(n);
-			if (p == current_process) {
-				redo_me = 1;
-				continue;
+/*
+ * Kill the current process now if a signal it can't handle is waiting,
+ * as it may not be heading back to user mode any time soon.
+ */
+void signal_check_fatal(void) {
+	process_t * proc = (process_t *)current_process;
+	if (proc->finished || !proc->signal_queue->length) return;
+
+	foreach(node, proc->signal_queue) {
+		signal_t * sig = node->value;
+		if (!proc->signals.functions[sig->signum] && !is_blocked(proc, sig->signum)) {
+			char dowhat = isdeadly[sig->signum];
+			if (dowhat == 1 || dowhat == 2) {
+				debug_print(WARNING, "Process %d killed by unhandled signal (%d)", proc->id, sig->signum);
+				kexit(128 + sig->signum);
+				__builtin_unreachable();
 			}
-			p->thread.esp = p->signal_state.esp;
-			p->thread.eip = p->signal_state.eip;
-			p->thread.ebp = p->signal_state.ebp;
-			memcpy((void *)(p->image.stack - KERNEL_STACK_SIZE), p->signal_kstack, KERNEL_STACK_SIZE);
-			free(p->signal_kstack);
-			p->signal_kstack = NULL;
-			make_process_ready(p);
 		}
-		spin_unlock(&sig_lock_b);
 	}
-	if (redo_me) {
-		spin_lock(&sig_lock);
-		list_insert(rets_from_sig, (process_t *)current_process);
-		spin_unlock(&sig_lock);
-		switch_next();
+}
+
+/*
+ * A signal raised by the current process itself (a fault, a broken pipe).
+ * Default actions are taken right away; handlers run on the way back
+ * to user mode.
+ */
+void handle_signal(process_t * proc, signal_t * sig) {
+	uint32_t signum = sig->signum;
+
+	if (proc->finished || signum == 0 || signum >= NUMSIGNALS) {
+		kmem_cache_free(signal_cache, sig);
+		return;
+	}
+
+	uintptr_t handler = proc->signals.functions[signum];
+	if (handler == 1) {
+		kmem_cache_free(signal_cache, sig);
+		return;
+	}
+	if (!handler) {
+		kmem_cache_free(signal_cache, sig);
+		default_action(proc, signum);
+		return;
 	}
+
+	/* Retrying the instruction won't help while it stays blocked */
+	proc->blocked &= ~signal_bit(signum);
+
+	sig->handler = handler;
+	list_insert(proc->signal_queue, sig);
 }
 
 int send_signal(pid_t process, uint32_t signal) {
@@ -191,7 +434,7 @@ int send_signal(pid_t process, uint32_t signal) {
 		return 1;
 	}
 
-	if (signal > NUMSIGNALS) {
+	if (signal >= NUMSIGNALS) {
 		/* Invalid signal */
 		return 1;
 	}
@@ -207,17 +450,92 @@ int send_signal(pid_t process, uint32_t signal) {
 	}
 
 	/* Append signal to list */
-	signal_t * sig = malloc(sizeof(signal_t));
+	signal_t * sig = signal_alloc();
 	sig->handler = (uintptr_t)receiver->signals.functions[signal];
 	sig->signum  = signal;
 	memset(&sig->registers_before, 0x00, sizeof(regs_t));
 
-	if (!process_is_ready(receiver)) {
+	list_insert(receiver->signal_queue, sig);
+
+	if (is_blocked(receiver, signal)) {
+		/* Stays queued until it is unblocked */
+		return 0;
+	}
+
+	if (receiver->running) {
+		/* Running on another processor (or it's us); it will see this on its way back to user mode */
+		if (receiver != current_process) {
+			smp_reschedule(&cpus[receiver->cpu]);
+		}
+	} else if (!process_is_ready(receiver)) {
 		make_process_ready(receiver);
 	}
 
-	list_insert(receiver->signal_queue, sig);
+	return 0;
+}
 
+/*
+ * Change the action for a signal, as sigaction() does.
+ */
+int signal_action(uint32_t signum, struct sigaction * act, struct sigaction * oldact) {
+	process_t * proc = (process_t *)current_process;
+	if (signum == 0 || signum >= NUMSIGNALS) {
+		return -EINVAL;
+	}
+	if (oldact) {
+		oldact->sa_handler = proc->signals.functions[signum];
+		oldact->sa_mask    = proc->signals.masks[signum];
+		oldact->sa_flags   = proc->signals.flags[signum];
+	}
+	if (act) {
+		if (signum == SIGKILL || signum == SIGSTOP) {
+			return -EINVAL;
+		}
+		proc->signals.functions[signum] = act->sa_handler;
+		proc->signals.masks[signum]     = act->sa_mask & ~SIG_UNBLOCKABLE;
+		proc->signals.flags[signum]     = act->sa_flags;
+	}
 	return 0;
 }
 
+/*
+ * A new program can't have handlers in the old one; signals caught
+ * go back to their defaults, and those ignored stay ignored.
+ */
+void signal_exec_reset(process_t * proc) {
+	for (int i = 0; i <= NUMSIGNALS; ++i) {
+		if (proc->signals.functions[i] != 1) {
+			proc->signals.functions[i] = 0;
+		}
+		proc->signals.masks[i] = 0;
+		proc->signals.flags[i] = 0;
+	}
+}
+
+/*
+ * Examine or change the set of blocked signals, as sigprocmask() does.
+ * Anything this unblocks is delivered on the way back to user mode.
+ */
+int signal_mask(int how, uint32_t * set, uint32_t * oldset) {
+	process_t * proc = (process_t *)current_process;
+	if (oldset) {
+		*oldset = proc->blocked;
+	}
+	if (set) {
+		switch (how) {
+			case SIG_BLOCK:
+				proc->blocked |= *set;
+				break;
+			case SIG_UNBLOCK:
+				proc->blocked &= ~*set;
+				break;
+			case SIG_SETMASK:
+				proc->blocked = *set;
+				break;
+			default:
+				return -EINVAL;
+		}
+		proc->blocked &= ~SIG_UNBLOCKABLE;
+	}
+	return 0;
+}
@@ -16,7 +16,12 @@
 #include <shm.h>
 #include <utsname.h>
 #include <printf.h>
+#include <vma.h>
+#include <mman.h>
+#include <resource.h>
+#include <futex.h>
 #include <syscall_nums.h>
+#include <trace.h>
 
 static char   hostname[256];
 static size_t hostname_len = 0;
@@ -170,12 +175,25 @@ static int sys_sbrk(int size) {
 	while (ret % 0x1000) {
 		ret++;
 	}
+	if (ret + size >= USER_MMAP_START) {
+		/* The heap may not grow into the mmap area */
+		spin_unlock(&proc->image.lock);
+		return -1;
+	}
 	proc->image.heap += (ret - i_ret) + size;
+	uintptr_t old_actual = proc->image.heap_actual;
 	while (proc->image.heap > proc->image.heap_actual) {
 		proc->image.heap_actual += 0x1000;
 		assert(proc->image.heap_actual % 0x1000 == 0);
-		alloc_frame(get_page(proc->image.heap_actual, 1, current_directory), 0, 1);
-		invalidate_tables_at(proc->image.heap_actual);
+	}
+	if (proc->image.heap_actual != old_actual) {
+		/* Grow the heap region; the new pages are filled in as they are touched */
+		vma_t * heap = vma_find(current_directory, old_actual);
+		if (heap) {
+			vma_resize(current_directory, heap, proc->image.heap_actual + 0x1000);
+		} else {
+			vma_insert(current_directory, old_actual + 0x1000, proc->image.heap_actual + 0x1000, VMA_READ | VMA_WRITE, NULL, 0, 0);
+		}
 	}
 	spin_unlock(&proc->image.lock);
 	return ret;
@@ -225,8 +243,11 @@ static int sys_execve(const char * filename, char *const argv[], char *const env
 		envp_ = malloc(sizeof(char *));
 		envp_[0] = NULL;
 	}
-	debug_print(INFO,"Releasing all shmem regions...");
-	shm_release_all((process_t *)current_process);
+	if (!current_process->vfork_parent) {
+		/* (A vfork() child's are its parent's, and it gets a new address space anyway) */
+		debug_print(INFO,"Releasing all shmem regions...");
+		shm_release_all((process_t *)current_process);
+	}
 
 	debug_print(INFO,"Executing...");
 	/* Discard envp */
@@ -373,6 +394,8 @@ static int sys_signal(uint32_t signum, uintptr_t handler) {
 	}
 	uintptr_t old = current_process->signals.functions[signum];
 	current_process->signals.functions[signum] = handler;
+	current_process->signals.masks[signum] = 0;
+	current_process->signals.flags[signum] = 0;
 	return (int)old;
 }
 
@@ -536,7 +559,7 @@ static int sys_sleepabs(unsigned long seconds, unsigned long subseconds) {
 	/* Switch without adding us to the queue */
 	switch_task(0);
 
-	if (seconds > timer_ticks || (seconds == timer_ticks && subseconds >= timer_subticks)) {
+	if ((uint64_t)seconds * SUBTICKS_PER_TICK + subseconds >= timer_usec()) {
 		return 0;
 	} else {
 		return 1;
@@ -549,6 +572,28 @@ static int sys_sleep(unsigned long seconds, unsigned long subseconds) {
 	return sys_sleepabs(s, ss);
 }
 
+/*
+ * CPU time used by this process (all of its threads) and its
+ * reaped children, in timer ticks. Returns ticks since boot.
+ */
+static int sys_times(struct tms * buf) {
+	if (buf) {
+		validate(buf);
+		pid_t group = current_process->group ? current_process->group : current_process->id;
+		memset(buf, 0, sizeof(struct tms));
+		foreach(node, process_list) {
+			process_t * proc = node->value;
+			if (proc->id != group && proc->group != group) continue;
+			buf->tms_utime  += proc->utime;
+			buf->tms_stime  += proc->stime;
+			buf->tms_cutime += proc->cutime;
+			buf->tms_cstime += proc->cstime;
+		}
+	}
+	/* Not timer_ticks, which stand still while the tick is stopped */
+	return (uint32_t)(timer_usec() / (SUBTICKS_PER_TICK / TIMER_HZ));
+}
+
 static int sys_umask(int mode) {
 	current_process->mask = mode & 0777;
 	return 0;
@@ -562,6 +607,10 @@ static int sys_fork(void) {
 	return (int)fork();
 }
 
+static int sys_vfork(void) {
+	return (int)vfork();
+}
+
 static int sys_clone(uintptr_t new_stack, uintptr_t thread_func, uintptr_t arg) {
 	if (!new_stack || validate_safe((void*)new_stack)) {
 		return -1;
@@ -580,6 +629,94 @@ static int sys_shm_obtain(char * path, size_t * size) {
 	return (int)shm_obtain(path, size);
 }
 
+static int sys_shm_obtain_large(char * path, size_t * size) {
+	validate(path);
+	validate(size);
+
+	return (int)shm_obtain_large(path, size);
+}
+
+static process_t * priority_target(int who) {
+	return who ? process_from_pid(who) : (process_t *)current_process;
+}
+
+/*
+ * Set the nice level of a process; only root may make things
+ * more favored, or touch processes belonging to someone else.
+ */
+static int sys_setpriority(int which, int who, int prio) {
+	if (which != PRIO_PROCESS) {
+		return -EINVAL;
+	}
+	process_t * proc = priority_target(who);
+	if (!proc) {
+		return -ESRCH;
+	}
+	if (current_process->user != USER_ROOT_UID) {
+		if (proc->user != current_process->user) {
+			return -EPERM;
+		}
+		if (prio < proc->nice) {
+			return -EACCES;
+		}
+	}
+	process_set_nice(proc, prio);
+	return 0;
+}
+
+/*
+ * Returns 20 - nice, so the result is never negative.
+ */
+static int sys_getpriority(int which, int who) {
+	if (which != PRIO_PROCESS) {
+		return -EINVAL;
+	}
+	process_t * proc = priority_target(who);
+	if (!proc) {
+		return -ESRCH;
+	}
+	return 20 - proc->nice;
+}
+
+static int sys_futex(int * addr, int op, int val) {
+	if (!addr || validate_safe(addr) || ((uintptr_t)addr & 3)) {
+		return -EINVAL;
+	}
+	switch (op) {
+		case FUTEX_WAIT:
+			return futex_wait(addr, val);
+		case FUTEX_WAKE:
+			return futex_wake(addr, val);
+		default:
+			return -EINVAL;
+	}
+}
+
+/*
+ * Have the kernel zero `tid` and wake its futex when this thread exits.
+ */
+static int sys_set_tid_address(int * tid) {
+	if (tid && (validate_safe(tid) || ((uintptr_t)tid & 3))) {
+		return -EINVAL;
+	}
+	current_process->clear_tid = tid;
+	return current_process->id;
+}
+
+static int sys_sigaction(int signum, struct sigaction * act, struct sigaction * oldact) {
+	if (validate_safe(act) || validate_safe(oldact)) {
+		return -EINVAL;
+	}
+	return signal_action(signum, act, oldact);
+}
+
+static int sys_sigprocmask(int how, uint32_t * set, uint32_t * oldset) {
+	if (validate_safe(set) || validate_safe(oldset)) {
+		return -EINVAL;
+	}
+	return signal_mask(how, set, oldset);
+}
+
 static int sys_shm_release(char * path) {
 	validate(path);
 
@@ -653,6 +790,33 @@ static int sys_mount(char * arg, char * mountpoint, char * type, unsigned long f
 	return vfs_mount_type(type, arg, mountpoint);
 }
 
+static int sys_mmap(struct mmap_args * args) {
+	if (validate_safe(args)) {
+		return -EFAULT;
+	}
+
+	fs_node_t * file = NULL;
+	if (!(args->flags & MAP_ANONYMOUS)) {
+		if (args->fd >= (int)current_process->fds->length || args->fd < 0) {
+			return -EBADF;
+		}
+		file = current_process->fds->entries[args->fd];
+	}
+	if (args->offset < 0) {
+		return -EINVAL;
+	}
+
+	return (int)mmap_region((uintptr_t)args->addr, args->length, args->prot, args->flags, file, args->offset);
+}
+
+static int sys_munmap(void * addr, size_t length) {
+	return munmap_region((uintptr_t)addr, length);
+}
+
+static int sys_mprotect(void * addr, size_t length, int prot) {
+	return mprotect_region((uintptr_t)addr, length, prot);
+}
+
 /*
  * System Call Internals
  */
@@ -702,6 +866,18 @@ static int (*syscalls[])() = {
 	[SYS_WAITPID]      = sys_waitpid,
 	[SYS_PIPE]         = sys_pipe,
 	[SYS_MOUNT]        = sys_mount,
+	[SYS_MMAP]         = sys_mmap,
+	[SYS_MUNMAP]       = sys_munmap,
+	[SYS_MPROTECT]     = sys_mprotect,
+	[SYS_SHM_OBTAIN_LARGE] = sys_shm_obtain_large,
+	[SYS_SETPRIORITY]  = sys_setpriority,
+	[SYS_GETPRIORITY]  = sys_getpriority,
+	[SYS_FUTEX]        = sys_futex,
+	[SYS_SET_TID_ADDRESS] = sys_set_tid_address,
+	[SYS_TIMES]        = sys_times,
+	[SYS_SIGACTION]    = sys_sigaction,
+	[SYS_SIGPROCMASK]  = sys_sigprocmask,
+	[SYS_VFORK]        = sys_vfork,
 };
 
 uint32_t num_syscalls = sizeof(syscalls) / sizeof(int (*)());
@@ -723,12 +899,37 @@ void syscall_handler(struct regs * r) {
 
 	/* Call the syscall function */
 	scall_func func = (scall_func)location;
+	uint32_t num = r->eax;
+	TRACE(TRACE_SYSCALL_ENTER, num, r->ebx);
 	uint32_t ret = func(r->ebx, r->ecx, r->edx, r->esi, r->edi);
+	TRACE(TRACE_SYSCALL_EXIT, num, ret);
 
 	if ((current_process->syscall_registers == r) ||
 			(location != (uintptr_t)&fork && location != (uintptr_t)&clone)) {
 		r->eax = ret;
 	}
+
+	/* Something we woke up may deserve the processor more than we do */
+	check_reschedule();
+}
+
+/*
+ * System calls made with SYSENTER. The C library's stub leaves the
+ * address to return to at the top of the user stack, which it passes
+ * in ebp; that is just a value from user space, so it must be a user
+ * page before we read it. If it isn't, the call goes nowhere and
+ * returns to address 0, where the process gets its segmentation fault.
+ */
+void sysenter_handler(struct regs * r) {
+	uintptr_t sp = r->ebp;
+	page_t * page = (sp & 3) ? NULL : get_page(sp, 0, current_directory);
+	if (!page || !page->user || !(page->present || page->swapped)) {
+		r->eip = 0;
+		return;
+	}
+	/* A swapped-out stack page is read back in by the fault */
+	r->eip = *(uintptr_t *)sp;
+	syscall_handler(r);
 }
 
 void syscalls_install(void) {
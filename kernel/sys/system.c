@@ -10,6 +10,10 @@
 
 unsigned int __irq_sem = 0;
 
+/*
+ * Only one processor runs kernel code at a time (see smp.c), so
+ * whoever holds a lock we want isn't running; let it.
+ */
 void spin_lock(uint8_t volatile * lock) {
 	while(__sync_lock_test_and_set(lock, 0x01)) {
 		switch_task(1);
@@ -12,6 +12,8 @@
 #include <logging.h>
 #include <shm.h>
 #include <mem.h>
+#include <vma.h>
+#include <trace.h>
 
 #define TASK_MAGIC 0xDEADBEEF
 
@@ -21,7 +23,6 @@ uint32_t next_pid = 0;
 							*((type *) stack) = item
 
 page_directory_t *kernel_directory;
-page_directory_t *current_directory;
 
 /*
  * Clone a page directory and its contents.
@@ -62,6 +63,8 @@ clone_directory(
 			}
 		}
 	}
+	/* Pages not yet faulted in will be populated from the same regions */
+	vma_clone(src, dir);
 	return dir;
 }
 
@@ -69,6 +72,11 @@ clone_directory(
  * Free a directory and its tables
  */
 void release_directory(page_directory_t * dir) {
+	if (dir == kernel_directory) {
+		/* Shared by all kernel tasklets and never freed */
+		return;
+	}
+
 	dir->ref_count--;
 
 	if (dir->ref_count < 1) {
@@ -88,6 +96,7 @@ void release_directory(page_directory_t * dir) {
 				free(dir->tables[i]);
 			}
 		}
+		vma_release_all(dir);
 		free(dir);
 	}
 }
@@ -100,7 +109,8 @@ void release_directory_for_exec(page_directory_t * dir) {
 			continue;
 		}
 		if (kernel_directory->tables[i] != dir->tables[i]) {
-			if (i * 0x1000 * 1024 < USER_STACK_BOTTOM) {
+			if (i * 0x1000 * 1024 < SHM_START) {
+				/* The stack goes too; its frames may still be shared with our parent */
 				for (uint32_t j = 0; j < 1024; ++j) {
 					if (dir->tables[i]->pages[j].frame) {
 						free_frame(&(dir->tables[i]->pages[j]));
@@ -112,6 +122,7 @@ void release_directory_for_exec(page_directory_t * dir) {
 			}
 		}
 	}
+	vma_release_all(dir);
 }
 
 extern char * default_name;
@@ -119,6 +130,9 @@ extern char * default_name;
 /*
  * Clone a page table
  *
+ * Frames are not copied; they are shared with the new table and
+ * marked copy-on-write in both, see page_fault().
+ *
  * @param src      Pointer to a page table to clone.
  * @param physAddr [out] Pointer to the physical address of the new page table
  * @return         A pointer to a new page table.
@@ -137,16 +151,8 @@ clone_table(
 		if (!src->pages[i].frame) {
 			continue;
 		}
-		/* Allocate a new frame */
-		alloc_frame(&table->pages[i], 0, 0);
-		/* Set the correct access bit */
-		if (src->pages[i].present)	table->pages[i].present = 1;
-		if (src->pages[i].rw)		table->pages[i].rw = 1;
-		if (src->pages[i].user)		table->pages[i].user = 1;
-		if (src->pages[i].accessed)	table->pages[i].accessed = 1;
-		if (src->pages[i].dirty)	table->pages[i].dirty = 1;
-		/* Copy the contents of the page from the old table to the new one */
-		copy_page_physical(src->pages[i].frame * 0x1000, table->pages[i].frame * 0x1000);
+		/* Share the frame, read-only until someone writes to it */
+		share_frame(&src->pages[i], &table->pages[i]);
 	}
 	return table;
 }
@@ -165,7 +171,7 @@ void tasking_install(void) {
 	initialize_process_tree();
 	/* Spawn the initial process */
 	current_process = spawn_init();
-	kernel_idle_task = spawn_kidle();
+	this_cpu()->idle_task = spawn_kidle();
 	/* Initialize the paging environment */
 #if 0
 	set_process_environment((process_t *)current_process, current_directory);
@@ -197,6 +203,8 @@ uint32_t fork(void) {
 	/* Clone the current process' page directory */
 	page_directory_t * directory = clone_directory(current_directory);
 	assert(directory && "Could not allocate a new page directory!");
+	/* Our writeable pages are now read-only copy-on-write */
+	invalidate_page_tables();
 	/* Spawn a new process from this one */
 	debug_print(INFO,"\033[1;32mALLOC {\033[0m");
 	process_t * new_proc = spawn_process(current_process);
@@ -232,6 +240,75 @@ uint32_t fork(void) {
 	return new_proc->id;
 }
 
+/*
+ * vfork: a child that borrows our address space until it execs or
+ * exits, with us waiting until it does. Nothing is copied, which is
+ * all a child that is about to exec needs.
+ *
+ * @return To the parent: PID of the child; to the child: 0
+ */
+uint32_t vfork(void) {
+	IRQ_OFF;
+
+	uintptr_t esp, ebp;
+
+	process_t * parent = (process_t *)current_process;
+	assert(parent && "Forked from nothing??");
+	page_directory_t * directory = current_directory;
+	process_t * new_proc = spawn_process(current_process);
+	assert(new_proc && "Could not allocate a new process!");
+	set_process_environment(new_proc, directory);
+	directory->ref_count++;
+
+	struct regs r;
+	memcpy(&r, current_process->syscall_registers, sizeof(struct regs));
+	new_proc->syscall_registers = &r;
+
+	esp = new_proc->image.stack;
+	ebp = esp;
+
+	new_proc->syscall_registers->eax = 0;
+
+	PUSH(esp, struct regs, r);
+
+	new_proc->thread.esp = esp;
+	new_proc->thread.ebp = ebp;
+
+	new_proc->is_tasklet = parent->is_tasklet;
+
+	new_proc->thread.eip = (uintptr_t)&return_to_userspace;
+
+	new_proc->vfork_parent = parent;
+	parent->vfork_child = new_proc;
+
+	make_process_ready(new_proc);
+
+	while (parent->vfork_child == new_proc) {
+		sleep_on(parent->wait_queue);
+	}
+
+	IRQ_RES;
+
+	return new_proc->id;
+}
+
+/*
+ * A vfork() child is done with its parent's address space, either
+ * because it has exec'd or because it is exiting: wake the parent.
+ */
+void vfork_release(process_t * proc) {
+	if (proc->vfork_child) {
+		/* We're going away first */
+		proc->vfork_child->vfork_parent = NULL;
+		proc->vfork_child = NULL;
+	}
+	process_t * parent = proc->vfork_parent;
+	if (!parent) return;
+	proc->vfork_parent = NULL;
+	parent->vfork_child = NULL;
+	wakeup_queue(parent->wait_queue);
+}
+
 int create_kernel_tasklet(tasklet_t tasklet, char * name, void * argp) {
 	IRQ_OFF;
 
@@ -344,6 +421,13 @@ clone(uintptr_t new_stack, uintptr_t thread_func, uintptr_t arg) {
 
 	new_proc->is_tasklet = parent->is_tasklet;
 
+	/* Threads share their parent's descriptors, drop the copies spawn_process made */
+	for (uint32_t i = 0; i < new_proc->fds->length; ++i) {
+		if (new_proc->fds->entries[i]) {
+			close_fs(new_proc->fds->entries[i]);
+		}
+	}
+	free(new_proc->fds->entries);
 	free(new_proc->fds);
 	new_proc->fds = current_process->fds;
 	new_proc->fds->refs++;
@@ -392,18 +476,7 @@ void switch_task(uint8_t reschedule) {
 	if (eip == 0x10000) {
 		/* Returned from EIP after task switch, we have
 		 * finished switching. */
-		fix_signal_stacks();
-
-		/* XXX: Signals */
-		if (!current_process->finished) {
-			if (current_process->signal_queue->length > 0) {
-				node_t * node = list_dequeue(current_process->signal_queue);
-				signal_t * sig = node->value;
-				free(node);
-				handle_signal((process_t *)current_process, sig);
-			}
-		}
-
+		signal_check_fatal();
 		return;
 	}
 
@@ -416,9 +489,14 @@ void switch_task(uint8_t reschedule) {
 	/* Save floating point state */
 	switch_fpu();
 
-	if (reschedule && current_process != kernel_idle_task) {
-		/* And reinsert it into the ready queue */
-		make_process_ready((process_t *)current_process);
+	if (current_process != this_cpu()->idle_task) {
+		if (reschedule) {
+			/* And reinsert it into the ready queue */
+			current_process->nivcsw++;
+			make_process_ready((process_t *)current_process);
+		} else {
+			current_process->nvcsw++;
+		}
 	}
 
 	/* Switch to the next task */
@@ -433,7 +511,16 @@ void switch_task(uint8_t reschedule) {
 void switch_next(void) {
 	uintptr_t esp, ebp, eip;
 	/* Get the next available process */
+	process_t * prev = (process_t *)current_process;
 	current_process = next_ready_process();
+	sched_account(prev, (process_t *)current_process);
+	TRACE(TRACE_SWITCH, prev->id, current_process->id);
+	this_cpu()->need_resched = 0;
+	this_cpu()->switches++;
+	if (this_cpu()->tickless && current_process != this_cpu()->idle_task) {
+		/* Back to work; start ticking again */
+		tick_restart();
+	}
 	/* Retreive the ESP/EBP/EIP */
 	eip = current_process->thread.eip;
 	esp = current_process->thread.esp;
@@ -454,19 +541,9 @@ void switch_next(void) {
 	current_directory = current_process->thread.page_directory;
 	switch_page_directory(current_directory);
 	/* Set the kernel stack in the TSS */
-	set_kernel_stack(current_process->image.stack);
+	set_kernel_stack(signal_kernel_stack((process_t *)current_process));
 
-	if (current_process->started) {
-		if (!current_process->signal_kstack) {
-			if (current_process->signal_queue->length > 0) {
-				current_process->signal_kstack  = malloc(KERNEL_STACK_SIZE);
-				current_process->signal_state.esp = current_process->thread.esp;
-				current_process->signal_state.eip = current_process->thread.eip;
-				current_process->signal_state.ebp = current_process->thread.ebp;
-				memcpy(current_process->signal_kstack, (void *)(current_process->image.stack - KERNEL_STACK_SIZE), KERNEL_STACK_SIZE);
-			}
-		}
-	} else {
+	if (!current_process->started) {
 		current_process->started = 1;
 	}
 
@@ -496,7 +573,11 @@ void switch_next(void) {
 void
 enter_user_jmp(uintptr_t location, int argc, char ** argv, uintptr_t stack) {
 	IRQ_OFF;
+	/* Whatever we were doing in the kernel, including running a signal handler from a sleep, is over */
+	current_process->signal_kstack = 0;
+	current_process->signal_frame = 0;
 	set_kernel_stack(current_process->image.stack);
+	kernel_leave();
 
 	PUSH(stack, uintptr_t, (uintptr_t)argv);
 	PUSH(stack, int, argc);
@@ -534,6 +615,9 @@ void task_exit(int retval) {
 		switch_next();
 		return;
 	}
+	/* Tell anyone joining us, while our address space is still around */
+	futex_exit((process_t *)current_process);
+	vfork_release((process_t *)current_process);
 	cleanup_process((process_t *)current_process, retval);
 
 	process_t * parent = process_get_parent((process_t *)current_process);
@@ -13,6 +13,7 @@
 #include <module.h>
 #include <fs.h>
 #include <printf.h>
+#include <trace.h>
 
 /* TODO: Move this to mod/ata.h */
 #include <ata.h>
@@ -303,6 +304,7 @@ static void ata_device_read_sector(struct ata_device * dev, uint32_t lba, uint8_
 	uint8_t slave = dev->slave;
 
 	spin_lock(&ata_lock);
+	TRACE(TRACE_BLOCK_START, lba, 0);
 
 	int errors = 0;
 try_again:
@@ -323,6 +325,7 @@ try_again:
 		errors++;
 		if (errors > 4) {
 			debug_print(WARNING, "-- Too many errors trying to read this block. Bailing.");
+			TRACE(TRACE_BLOCK_DONE, lba, 0);
 			spin_unlock(&ata_lock);
 			return;
 		}
@@ -332,6 +335,7 @@ try_again:
 	int size = 256;
 	inportsm(bus,buf,size);
 	ata_wait(dev, 0);
+	TRACE(TRACE_BLOCK_DONE, lba, 0);
 	spin_unlock(&ata_lock);
 }
 
@@ -340,6 +344,7 @@ static void ata_device_write_sector(struct ata_device * dev, uint32_t lba, uint8
 	uint8_t slave = dev->slave;
 
 	spin_lock(&ata_lock);
+	TRACE(TRACE_BLOCK_START, lba, 1);
 
 	outportb(bus + ATA_REG_CONTROL, 0x02);
 
@@ -358,6 +363,7 @@ static void ata_device_write_sector(struct ata_device * dev, uint32_t lba, uint8
 	outportsm(bus,buf,size);
 	outportb(bus + 0x07, ATA_CMD_CACHE_FLUSH);
 	ata_wait(dev, 0);
+	TRACE(TRACE_BLOCK_DONE, lba, 1);
 	spin_unlock(&ata_lock);
 }
 
@@ -1008,8 +1008,7 @@ static fs_node_t * finddir_ext2(fs_node_t *node, char *name) {
 		free(block);
 		return NULL;
 	}
-	fs_node_t *outnode = malloc(sizeof(fs_node_t));
-	memset(outnode, 0, sizeof(fs_node_t));
+	fs_node_t *outnode = fs_node_alloc();
 
 	inode = read_inode(this, direntry->inode);
 
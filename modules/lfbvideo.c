@@ -16,6 +16,7 @@
 #include <args.h>
 #include <tokenize.h>
 #include <module.h>
+#include <mem.h>
 #include <video.h>
 
 #include "../userspace/gui/terminal/terminal-font.h"
@@ -224,9 +225,7 @@ static void graphics_install_bochs(uint16_t resolution_x, uint16_t resolution_y)
 	if (lfb_vid_memory) {
 		/* Enable the higher memory */
 		uintptr_t fb_offset = (uintptr_t)lfb_vid_memory;
-		for (uintptr_t i = fb_offset; i <= fb_offset + 0xFF0000; i += 0x1000) {
-			dma_frame(get_page(i, 1, kernel_directory), 0, 1, i);
-		}
+		map_physical(fb_offset, fb_offset, 0x1000000, 0);
 
 		goto mem_found;
 	} else {
@@ -237,9 +236,7 @@ static void graphics_install_bochs(uint16_t resolution_x, uint16_t resolution_y)
 
 		for (uintptr_t fb_offset = 0xE0000000; fb_offset < 0xFF000000; fb_offset += 0x01000000) {
 			/* Enable the higher memory */
-			for (uintptr_t i = fb_offset; i <= fb_offset + 0xFF0000; i += 0x1000) {
-				dma_frame(get_page(i, 1, kernel_directory), 0, 1, i);
-			}
+			map_physical(fb_offset, fb_offset, 0x1000000, 0);
 
 			/* Go find it */
 			for (uintptr_t x = fb_offset; x < fb_offset + 0xFF0000; x += 0x1000) {
@@ -267,9 +264,7 @@ static void graphics_install_preset(uint16_t w, uint16_t h) {
 	herp[1] = 0xFAF42943;
 
 	if (lfb_vid_memory) {
-		for (uintptr_t i = (uintptr_t)lfb_vid_memory; i <= (uintptr_t)lfb_vid_memory + 0xFF0000; i += 0x1000) {
-			dma_frame(get_page(i, 1, kernel_directory), 0, 1, i);
-		}
+		map_physical((uintptr_t)lfb_vid_memory, (uintptr_t)lfb_vid_memory, 0x1000000, 0);
 		if (((uintptr_t *)lfb_vid_memory)[0] == 0xA5ADFACE && ((uintptr_t *)lfb_vid_memory)[1] == 0xFAF42943) {
 			debug_print(INFO, "Was able to locate video memory at 0x%x without dicking around.", lfb_vid_memory);
 			goto mem_found;
@@ -283,9 +278,7 @@ static void graphics_install_preset(uint16_t w, uint16_t h) {
 
 	for (uintptr_t fb_offset = 0xE0000000; fb_offset < 0xFF000000; fb_offset += 0x01000000) {
 		/* Enable the higher memory */
-		for (uintptr_t i = fb_offset; i <= fb_offset + 0xFF0000; i += 0x1000) {
-			dma_frame(get_page(i, 1, kernel_directory), 0, 1, i);
-		}
+		map_physical(fb_offset, fb_offset, 0x1000000, 0);
 
 		/* Go find it */
 		for (uintptr_t x = fb_offset; x < fb_offset + 0xFF0000; x += 0x1000) {
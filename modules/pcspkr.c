@@ -20,7 +20,8 @@ static void note(int length, int freq) {
 	outportb(0x61, t | 0x3);
 
 	unsigned long s, ss;
-	relative_time(0, length, &s, &ss);
+	/* `length` is in hundredths of a second */
+	relative_time(0, length * (SUBTICKS_PER_TICK / 100), &s, &ss);
 	sleep_until((process_t *)current_process, s, ss);
 	switch_task(0);
 
@@ -10,6 +10,10 @@
 #include <process.h>
 #include <printf.h>
 #include <module.h>
+#include <slab.h>
+#include <swap.h>
+#include <trace.h>
+#include <profile.h>
 
 #define PROCFS_STANDARD_ENTRIES (sizeof(std_entries) / sizeof(struct procfs_entry))
 #define PROCFS_PROCDIR_ENTRIES  (sizeof(procdir_entries) / sizeof(struct procfs_entry))
@@ -18,6 +22,7 @@ struct procfs_entry {
 	int          id;
 	char *       name;
 	read_type_t  func;
+	write_type_t write; /* NULL for read-only entries */
 };
 
 static fs_node_t * procfs_generic_create(char * name, read_type_t read_func) {
@@ -81,6 +86,20 @@ static uint32_t proc_cmdline_func(fs_node_t *node, uint32_t offset, uint32_t siz
 	return size;
 }
 
+static char * proc_basename(process_t * proc) {
+	char * name = proc->name + strlen(proc->name) - 1;
+
+	while (1) {
+		if (*name == '/') {
+			name++;
+			break;
+		}
+		if (name == proc->name) break;
+		name--;
+	}
+	return name;
+}
+
 static uint32_t proc_status_func(fs_node_t *node, uint32_t offset, uint32_t size, uint8_t *buffer) {
 	char buf[2048];
 	process_t * proc = process_from_pid(node->inode);
@@ -92,16 +111,7 @@ static uint32_t proc_status_func(fs_node_t *node, uint32_t offset, uint32_t size
 	}
 
 	char state = process_is_ready(proc) ? 'R' : 'S';
-	char * name = proc->name + strlen(proc->name) - 1;
-
-	while (1) {
-		if (*name == '/') {
-			name++;
-			break;
-		}
-		if (name == proc->name) break;
-		name--;
-	}
+	char * name = proc_basename(proc);
 
 	sprintf(buf,
 			"Name:\t%s\n" /* name */
@@ -110,13 +120,64 @@ static uint32_t proc_status_func(fs_node_t *node, uint32_t offset, uint32_t size
 			"Pid:\t%d\n" /* pid */
 			"PPid:\t%d\n" /* parent pid */
 			"Uid:\t%d\n"
+			"Nice:\t%d\n"
+			"Cpu:\t%d\n"
 			,
 			name,
 			state,
 			proc->group ? proc->group : proc->id,
 			proc->id,
 			parent ? parent->id : 0,
-			proc->user);
+			proc->user,
+			proc->nice,
+			proc->cpu);
+
+	size_t _bsize = strlen(buf);
+	if (offset > _bsize) return 0;
+	if (size > _bsize - offset) size = _bsize - offset;
+
+	memcpy(buffer, buf, size);
+	return size;
+}
+
+/*
+ * Scheduler accounting, on one line:
+ *   pid (name) state ppid utime stime cutime cstime nice cpu
+ *   nvcsw nivcsw runs run_ms wait_ms wait_max_us
+ * Times in the first group are in timer ticks (TIMER_HZ per second).
+ */
+static uint32_t proc_stat_func(fs_node_t *node, uint32_t offset, uint32_t size, uint8_t *buffer) {
+	char buf[1024];
+	process_t * proc = process_from_pid(node->inode);
+
+	if (!proc) {
+		return 0;
+	}
+
+	process_t * parent = process_get_parent(proc);
+	char state = proc->finished ? 'Z' : ((proc->running || process_is_ready(proc)) ? 'R' : 'S');
+
+	/* Include the time it has been running for, if it is running now */
+	uint64_t run_usec = proc->run_usec;
+	if (proc->running && proc->run_start) {
+		run_usec += timer_usec() - proc->run_start;
+	}
+
+	sprintf(buf,
+			"%d (%s) %c %d %d %d %d %d %d %d %d %d %d %d %d %d\n",
+			proc->id,
+			proc_basename(proc),
+			state,
+			parent ? parent->id : 0,
+			proc->utime, proc->stime,
+			proc->cutime, proc->cstime,
+			proc->nice,
+			proc->cpu,
+			proc->nvcsw, proc->nivcsw,
+			proc->runs,
+			(uint32_t)(run_usec / 1000),
+			(uint32_t)(proc->wait_usec / 1000),
+			proc->wait_max);
 
 	size_t _bsize = strlen(buf);
 	if (offset > _bsize) return 0;
@@ -127,8 +188,9 @@ static uint32_t proc_status_func(fs_node_t *node, uint32_t offset, uint32_t size
 }
 
 static struct procfs_entry procdir_entries[] = {
-	{1, "cmdline", proc_cmdline_func},
-	{2, "status",  proc_status_func},
+	{1, "cmdline", proc_cmdline_func, NULL},
+	{2, "status",  proc_status_func,  NULL},
+	{3, "stat",    proc_stat_func,    NULL},
 };
 
 static struct dirent * readdir_procfs_procdir(fs_node_t *node, uint32_t index) {
@@ -195,14 +257,200 @@ static fs_node_t * procfs_procdir_create(pid_t pid) {
 }
 
 static uint32_t cpuinfo_func(fs_node_t *node, uint32_t offset, uint32_t size, uint8_t *buffer) {
-	return 0;
+	char buf[4096];
+	char * c = buf;
+	for (int i = 0; i < cpu_count; ++i) {
+		if (c - buf > (int)sizeof(buf) - 512) break;
+		cpu_t * cpu = &cpus[i];
+		/* The name is whatever path it was run from; keep it to a line */
+		char name[64] = {0};
+		if (cpu->process) {
+			size_t len = strlen(cpu->process->name);
+			if (len > sizeof(name) - 1) len = sizeof(name) - 1;
+			memcpy(name, cpu->process->name, len);
+		}
+		/* Every switch away from the FPU owner used to cost a save */
+		uint32_t avoided = cpu->fpu_deferred > cpu->fpu_saves ? cpu->fpu_deferred - cpu->fpu_saves : 0;
+		c += sprintf(c,
+			"processor: %d\n"
+			"apicid: %d\n"
+			"running: %s\n"
+			"ready: %d\n"
+			"switches: %d\n"
+			"steals: %d\n"
+			"fpu saves: %d\n"
+			"fpu restores: %d\n"
+			"fpu saves avoided: %d\n"
+			"fpu reloads avoided: %d\n"
+			"\n",
+			cpu->id, cpu->lapic_id,
+			name,
+			cpu->ready_queue->length,
+			cpu->switches, cpu->steals,
+			cpu->fpu_saves, cpu->fpu_restores,
+			avoided,
+			cpu->fpu_reloads_avoided);
+	}
+
+	size_t _bsize = strlen(buf);
+	if (offset > _bsize) return 0;
+	if (size > _bsize - offset) size = _bsize - offset;
+
+	memcpy(buffer, buf, size);
+	return size;
+}
+
+/*
+ * Idle wakeups, in total and per second since the last read.
+ */
+static uint32_t idle_func(fs_node_t *node, uint32_t offset, uint32_t size, uint8_t *buffer) {
+	static uint64_t last_read = 0;
+	static uint32_t last_wakeups[MAX_CPUS];
+	static uint64_t last_idle[MAX_CPUS];
+
+	char buf[1024];
+	char * c = buf;
+	uint64_t now = timer_usec();
+	uint32_t elapsed = (uint32_t)((now - last_read) / 1000); /* ms */
+	if (!elapsed) elapsed = 1;
+
+	c += sprintf(c, "cpu\twakeups\twakeups/s\tidle%%\ttickless\n");
+	for (int i = 0; i < cpu_count; ++i) {
+		cpu_t * cpu = &cpus[i];
+		uint32_t wakeups = cpu->idle_wakeups - last_wakeups[i];
+		uint32_t idle = (uint32_t)((cpu->idle_usec - last_idle[i]) / 1000);
+		c += sprintf(c, "%d\t%d\t%d\t%d\t%s\n",
+			cpu->id,
+			cpu->idle_wakeups,
+			wakeups * 1000 / elapsed,
+			idle * 100 / elapsed,
+			cpu->tickless ? "yes" : "no");
+		if (!offset) {
+			last_wakeups[i] = cpu->idle_wakeups;
+			last_idle[i]    = cpu->idle_usec;
+		}
+	}
+	if (!offset) {
+		last_read = now;
+	}
+
+	size_t _bsize = strlen(buf);
+	if (offset > _bsize) return 0;
+	if (size > _bsize - offset) size = _bsize - offset;
+
+	memcpy(buffer, buf, size);
+	return size;
+}
+
+/*
+ * How long processes waited in each processor's ready queue.
+ */
+static uint32_t schedstat_func(fs_node_t *node, uint32_t offset, uint32_t size, uint8_t *buffer) {
+	char buf[2048];
+	char * c = buf;
+
+	c += sprintf(c, "cpu\truns\tswitches\tsteals\twait_ms\t<10us\t<100us\t<1ms\t<10ms\t<100ms\t<1s\t>=1s\n");
+	for (int i = 0; i < cpu_count; ++i) {
+		cpu_t * cpu = &cpus[i];
+		c += sprintf(c, "%d\t%d\t%d\t%d\t%d",
+			cpu->id,
+			cpu->runs,
+			cpu->switches,
+			cpu->steals,
+			(uint32_t)(cpu->wait_usec / 1000));
+		for (int j = 0; j < SCHED_WAIT_BUCKETS; ++j) {
+			c += sprintf(c, "\t%d", cpu->wait_hist[j]);
+		}
+		c += sprintf(c, "\n");
+	}
+
+	size_t _bsize = strlen(buf);
+	if (offset > _bsize) return 0;
+	if (size > _bsize - offset) size = _bsize - offset;
+
+	memcpy(buffer, buf, size);
+	return size;
 }
 
 static uint32_t meminfo_func(fs_node_t *node, uint32_t offset, uint32_t size, uint8_t *buffer) {
 	char buf[1024];
 	unsigned int total = memory_total();
 	unsigned int free  = total - memory_use();
-	sprintf(buf, "MemTotal: %d kB\nMemFree: %d kB\n", total, free);
+	uintptr_t largest, extents;
+	memory_fragmentation(&largest, &extents);
+	uintptr_t pooled, hits, misses;
+	zero_pool_stats(&pooled, &hits, &misses);
+	unsigned int swap_total = 0, swap_free = 0, swap_in = 0, swap_out = 0, discarded = 0;
+	if (swap_area) {
+		swap_total = (swap_area->slots - 1) * 4;
+		swap_free  = swap_total - swap_area->used * 4;
+		swap_in    = swap_area->swapped_in;
+		swap_out   = swap_area->swapped_out;
+		discarded  = swap_area->discarded;
+	}
+	sprintf(buf,
+		"MemTotal: %d kB\n"
+		"MemFree: %d kB\n"
+		"FreeFrames: %d\n"
+		"LargestFreeRun: %d kB\n"
+		"FreeExtents: %d\n"
+		"ZeroPool: %d kB\n"
+		"ZeroPoolHits: %d\n"
+		"ZeroPoolMisses: %d\n"
+		"SwapTotal: %d kB\n"
+		"SwapFree: %d kB\n"
+		"PagesSwappedIn: %d\n"
+		"PagesSwappedOut: %d\n"
+		"PagesDiscarded: %d\n",
+		total, free, free / 4, largest * 4, extents,
+		pooled * 4, hits, misses,
+		swap_total, swap_free, swap_in, swap_out, discarded);
+
+	size_t _bsize = strlen(buf);
+	if (offset > _bsize) return 0;
+	if (size > _bsize - offset) size = _bsize - offset;
+
+	memcpy(buffer, buf, size);
+	return size;
+}
+
+static uint32_t swaps_func(fs_node_t *node, uint32_t offset, uint32_t size, uint8_t *buffer) {
+	char buf[1024];
+	char * c = buf;
+	c += sprintf(c, "Filename\tType\tSize\tUsed\tPriority\n");
+	if (swap_area) {
+		sprintf(c, "%s\t%s\t%d\t%d\t-1\n",
+			swap_area->path,
+			(swap_area->node->flags & FS_BLOCKDEVICE) ? "partition" : "file",
+			(swap_area->slots - 1) * 4,
+			swap_area->used * 4);
+	}
+
+	size_t _bsize = strlen(buf);
+	if (offset > _bsize) return 0;
+	if (size > _bsize - offset) size = _bsize - offset;
+
+	memcpy(buffer, buf, size);
+	return size;
+}
+
+static uint32_t slabinfo_func(fs_node_t *node, uint32_t offset, uint32_t size, uint8_t *buffer) {
+	char buf[2048];
+	char * c = buf;
+	c += sprintf(c, "# name active total size slabs kB allocs hits hit%%\n");
+	for (kmem_cache_t * cache = kmem_caches; cache; cache = cache->next) {
+		if (c - buf > (int)sizeof(buf) - 128) break;
+		c += sprintf(c, "%s %d %d %d %d %d %d %d %d%%\n",
+			cache->name,
+			cache->active,
+			cache->slabs * cache->per_slab,
+			cache->size,
+			cache->slabs,
+			cache->slabs * 4,
+			cache->allocs,
+			cache->hits,
+			cache->allocs ? (cache->hits * 100 / cache->allocs) : 100);
+	}
 
 	size_t _bsize = strlen(buf);
 	if (offset > _bsize) return 0;
@@ -214,7 +462,9 @@ static uint32_t meminfo_func(fs_node_t *node, uint32_t offset, uint32_t size, ui
 
 static uint32_t uptime_func(fs_node_t *node, uint32_t offset, uint32_t size, uint8_t *buffer) {
 	char buf[1024];
-	sprintf(buf, "%d.%2d\n", timer_ticks, timer_subticks);
+	/* The tick may be stopped on this processor */
+	timer_update();
+	sprintf(buf, "%d.%2d\n", timer_ticks, timer_subticks / (SUBTICKS_PER_TICK / 100));
 
 	size_t _bsize = strlen(buf);
 	if (offset > _bsize) return 0;
@@ -273,13 +523,63 @@ static uint32_t compiler_func(fs_node_t *node, uint32_t offset, uint32_t size, u
 	return size;
 }
 
+/*
+ * The trace ring, in binary (see trace_defs.h). Writing 1 starts
+ * tracing from an empty ring and writing 0 stops it.
+ */
+static uint32_t trace_func(fs_node_t *node, uint32_t offset, uint32_t size, uint8_t *buffer) {
+	return trace_read(offset, size, buffer);
+}
+
+static uint32_t trace_write_func(fs_node_t *node, uint32_t offset, uint32_t size, uint8_t *buffer) {
+	if (!size) return 0;
+	if (buffer[0] == '1') {
+		trace_start();
+	} else if (buffer[0] == '0') {
+		trace_stop();
+	}
+	return size;
+}
+
+/*
+ * The kernel log, as much of it as is still in memory.
+ */
+static uint32_t kmsg_func(fs_node_t *node, uint32_t offset, uint32_t size, uint8_t *buffer) {
+	return log_read(offset, size, buffer);
+}
+
+/*
+ * Profiler samples (see profile.c). Writing 1 starts profiling from
+ * an empty buffer, 2 does the same with call graphs, and 0 stops it.
+ */
+static uint32_t profile_func(fs_node_t *node, uint32_t offset, uint32_t size, uint8_t *buffer) {
+	return profile_read(offset, size, buffer);
+}
+
+static uint32_t profile_write_func(fs_node_t *node, uint32_t offset, uint32_t size, uint8_t *buffer) {
+	if (!size) return 0;
+	if (buffer[0] == '1' || buffer[0] == '2') {
+		profile_start(buffer[0] == '2');
+	} else if (buffer[0] == '0') {
+		profile_stop();
+	}
+	return size;
+}
+
 static struct procfs_entry std_entries[] = {
-	{-1, "cpuinfo",  cpuinfo_func},
-	{-2, "meminfo",  meminfo_func},
-	{-3, "uptime",   uptime_func},
-	{-4, "cmdline",  cmdline_func},
-	{-5, "version",  version_func},
-	{-6, "compiler", compiler_func},
+	{-1, "cpuinfo",  cpuinfo_func,    NULL},
+	{-2, "meminfo",  meminfo_func,    NULL},
+	{-3, "uptime",   uptime_func,     NULL},
+	{-4, "cmdline",  cmdline_func,    NULL},
+	{-5, "version",  version_func,    NULL},
+	{-6, "compiler", compiler_func,   NULL},
+	{-7, "slabinfo", slabinfo_func,   NULL},
+	{-8, "swaps",    swaps_func,      NULL},
+	{-9, "idle",     idle_func,       NULL},
+	{-10,"schedstat",schedstat_func,  NULL},
+	{-11,"trace",    trace_func,      trace_write_func},
+	{-12,"kmsg",     kmsg_func,       NULL},
+	{-13,"profile",  profile_func,    profile_write_func},
 };
 
 static struct dirent * readdir_procfs_root(fs_node_t *node, uint32_t index) {
@@ -353,6 +653,10 @@ static fs_node_t * finddir_procfs_root(fs_node_t * node, char * name) {
 	for (unsigned int i = 0; i < PROCFS_STANDARD_ENTRIES; ++i) {
 		if (!strcmp(name, std_entries[i].name)) {
 			fs_node_t * out = procfs_generic_create(std_entries[i].name, std_entries[i].func);
+			if (std_entries[i].write) {
+				out->write = std_entries[i].write;
+				out->mask  = 0644;
+			}
 			return out;
 		}
 	}
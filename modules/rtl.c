@@ -996,7 +996,7 @@ DEFINE_SHELL_FUNCTION(irc_test, "irc test") {
 		outportl(rtl_iobase + RTL_PORT_TXSTAT + 4 * my_tx, packet_size);
 
 		unsigned long s, ss;
-		relative_time(0, 500, &s, &ss);
+		relative_time(5, 0, &s, &ss);
 		sleep_until((process_t *)current_process, s, ss);
 		switch_task(0);
 	}
@@ -213,8 +213,7 @@ static void open_tmpfs(fs_node_t * node, unsigned int flags) {
 }
 
 static fs_node_t * tmpfs_from_file(struct tmpfs_file * t) {
-	fs_node_t * fnode = malloc(sizeof(fs_node_t));
-	memset(fnode, 0x00, sizeof(fs_node_t));
+	fs_node_t * fnode = fs_node_alloc();
 	fnode->inode = 0;
 	strcpy(fnode->name, t->name);
 	fnode->device = t;
@@ -384,8 +383,7 @@ static void mkdir_tmpfs(fs_node_t * parent, char * name, uint16_t permission) {
 }
 
 static fs_node_t * tmpfs_from_dir(struct tmpfs_dir * d) {
-	fs_node_t * fnode = malloc(sizeof(fs_node_t));
-	memset(fnode, 0x00, sizeof(fs_node_t));
+	fs_node_t * fnode = fs_node_alloc();
 	fnode->inode = 0;
 	strcpy(fnode->name, "tmp");
 	fnode->mask = d->mask;
@@ -11,15 +11,21 @@
 #define DECL_SYSCALL4(fn,p1,p2,p3,p4)    int syscall_##fn(p1,p2,p3,p4)
 #define DECL_SYSCALL5(fn,p1,p2,p3,p4,p5) int syscall_##fn(p1,p2,p3,p4,p5)
 
+/*
+ * System calls go through __syscall_entry, which is SYSENTER where the
+ * processor has it and int 0x7F where it doesn't. Either way the call
+ * number goes in eax and the arguments in ebx, ecx, edx, esi and edi,
+ * and everything but eax comes back unchanged.
+ */
 #define DEFN_SYSCALL0(fn, num) \
 	int syscall_##fn() { \
-		int a; __asm__ __volatile__("int $0x7F" : "=a" (a) : "0" (num)); \
+		int a; __asm__ __volatile__("call *__syscall_entry" : "=a" (a) : "0" (num)); \
 		return a; \
 	}
 
 #define DEFN_SYSCALL1(fn, num, P1) \
 	int syscall_##fn(P1 p1) { \
-		int __res; __asm__ __volatile__("push %%ebx; movl %2,%%ebx; int $0x7F; pop %%ebx" \
+		int __res; __asm__ __volatile__("push %%ebx; movl %2,%%ebx; call *__syscall_entry; pop %%ebx" \
 				: "=a" (__res) \
 				: "0" (num), "r" ((int)(p1))); \
 		return __res; \
@@ -27,7 +33,7 @@
 
 #define DEFN_SYSCALL2(fn, num, P1, P2) \
 	int syscall_##fn(P1 p1, P2 p2) { \
-		int __res; __asm__ __volatile__("push %%ebx; movl %2,%%ebx; int $0x7F; pop %%ebx" \
+		int __res; __asm__ __volatile__("push %%ebx; movl %2,%%ebx; call *__syscall_entry; pop %%ebx" \
 				: "=a" (__res) \
 				: "0" (num), "r" ((int)(p1)), "c"((int)(p2))); \
 		return __res; \
@@ -35,7 +41,7 @@
 
 #define DEFN_SYSCALL3(fn, num, P1, P2, P3) \
 	int syscall_##fn(P1 p1, P2 p2, P3 p3) { \
-		int __res; __asm__ __volatile__("push %%ebx; movl %2,%%ebx; int $0x7F; pop %%ebx" \
+		int __res; __asm__ __volatile__("push %%ebx; movl %2,%%ebx; call *__syscall_entry; pop %%ebx" \
 				: "=a" (__res) \
 				: "0" (num), "r" ((int)(p1)), "c"((int)(p2)), "d"((int)(p3))); \
 		return __res; \
@@ -43,7 +49,7 @@
 
 #define DEFN_SYSCALL4(fn, num, P1, P2, P3, P4) \
 	int syscall_##fn(P1 p1, P2 p2, P3 p3, P4 p4) { \
-		int __res; __asm__ __volatile__("push %%ebx; movl %2,%%ebx; int $0x7F; pop %%ebx" \
+		int __res; __asm__ __volatile__("push %%ebx; movl %2,%%ebx; call *__syscall_entry; pop %%ebx" \
 				: "=a" (__res) \
 				: "0" (num), "r" ((int)(p1)), "c"((int)(p2)), "d"((int)(p3)), "S"((int)(p4))); \
 		return __res; \
@@ -51,7 +57,7 @@
 
 #define DEFN_SYSCALL5(fn, num, P1, P2, P3, P4, P5) \
 	int syscall_##fn(P1 p1, P2 p2, P3 p3, P4 p4, P5 p5) { \
-		int __res; __asm__ __volatile__("push %%ebx; movl %2,%%ebx; int $0x7F; pop %%ebx" \
+		int __res; __asm__ __volatile__("push %%ebx; movl %2,%%ebx; call *__syscall_entry; pop %%ebx" \
 				: "=a" (__res) \
 				: "0" (num), "r" ((int)(p1)), "c"((int)(p2)), "d"((int)(p3)), "S"((int)(p4)), "D"((int)(p5))); \
 		return __res; \
@@ -94,6 +100,7 @@ DECL_SYSCALL1(gethostname, char *);
 DECL_SYSCALL0(mousedevice);
 DECL_SYSCALL2(mkdir, char *, unsigned int);
 DECL_SYSCALL2(shm_obtain, char *, size_t *);
+DECL_SYSCALL2(shm_obtain_large, char *, size_t *);
 DECL_SYSCALL1(shm_release, char *);
 DECL_SYSCALL2(send_signal, uint32_t, uint32_t);
 DECL_SYSCALL2(signal, uint32_t, void *);
@@ -101,6 +108,13 @@ DECL_SYSCALL2(share_fd, int, int);
 DECL_SYSCALL1(get_fd, int);
 DECL_SYSCALL0(gettid);
 DECL_SYSCALL0(yield);
+DECL_SYSCALL3(setpriority, int, int, int);
+DECL_SYSCALL2(getpriority, int, int);
+DECL_SYSCALL3(futex, int *, int, int);
+DECL_SYSCALL1(set_tid_address, int *);
+DECL_SYSCALL1(times, void *);
+DECL_SYSCALL3(sigaction, int, void *, void *);
+DECL_SYSCALL3(sigprocmask, int, void *, void *);
 DECL_SYSCALL2(system_function, int, char **);
 DECL_SYSCALL1(open_serial, int);
 DECL_SYSCALL2(sleepabs, unsigned long, unsigned long);
@@ -42,3 +42,15 @@
 #define SYS_WAITPID 53
 #define SYS_PIPE 54
 #define SYS_MOUNT 55
+#define SYS_MMAP 56
+#define SYS_MUNMAP 57
+#define SYS_MPROTECT 58
+#define SYS_SHM_OBTAIN_LARGE 59
+#define SYS_SETPRIORITY 60
+#define SYS_GETPRIORITY 61
+#define SYS_FUTEX 62
+#define SYS_SET_TID_ADDRESS 63
+#define SYS_TIMES 64
+#define SYS_SIGACTION 65
+#define SYS_SIGPROCMASK 66
+#define SYS_VFORK 67
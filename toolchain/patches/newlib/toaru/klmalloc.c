@@ -106,6 +106,7 @@
 #include <assert.h>
 #include <stdint.h>
 #include <limits.h>
+#include <sys/mman.h>
 /* }}} */
 /* Definitions {{{ */
 
@@ -125,6 +126,9 @@
 
 #define BIN_MAGIC 0xDEFAD00D
 
+#define MMAP_THRESHOLD 0x20000						/* Big blocks at least this large get their own mapping. */
+#define MMAP_HEAD ((void *)0x1)						/* Marks the head of a big bin obtained from mmap(). */
+
 /* }}} */
 
 /*
@@ -645,6 +649,24 @@ static void * __attribute__ ((malloc)) klmalloc(uintptr_t size) {
 		/*
 		 * Big bins.
 		 */
+		if (size >= MMAP_THRESHOLD) {
+			/*
+			 * Very large blocks are mapped on their own so that
+			 * freeing them returns the memory to the system rather
+			 * than leaving a hole in the heap.
+			 */
+			uintptr_t pages = (size + sizeof(klmalloc_big_bin_header)) / PAGE_SIZE + 1;
+			klmalloc_big_bin_header * mapped = mmap(NULL, PAGE_SIZE * pages, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (mapped != MAP_FAILED) {
+				mapped->bin_magic = BIN_MAGIC;
+				mapped->size = pages * PAGE_SIZE - sizeof(klmalloc_big_bin_header);
+				mapped->head = MMAP_HEAD;
+				mapped->next = NULL;
+				mapped->prev = NULL;
+				return (void*)((uintptr_t)mapped + sizeof(klmalloc_big_bin_header));
+			}
+			/* Otherwise, fall back to the heap. */
+		}
 		klmalloc_big_bin_header * bin_header = klmalloc_skip_list_findbest(size);
 		if (bin_header) {
 			assert(bin_header->size >= size);
@@ -772,6 +794,13 @@ static void klfree(void *ptr) {
 		klmalloc_big_bin_header *bheader = (klmalloc_big_bin_header*)header;
 		
 		assert(bheader);
+		if (bheader->head == MMAP_HEAD) {
+			/*
+			 * This block has its own mapping; just give it back.
+			 */
+			munmap(bheader, bheader->size + sizeof(klmalloc_big_bin_header));
+			return;
+		}
 		assert(bheader->head == NULL);
 		assert((bheader->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
 		/*
@@ -0,0 +1,8 @@
+#ifndef _SYS_FUTEX_H
+#define _SYS_FUTEX_H
+
+/* Operations for the futex system call */
+#define FUTEX_WAIT 0 /* Sleep if the word still holds val */
+#define FUTEX_WAKE 1 /* Wake up to val waiters */
+
+#endif
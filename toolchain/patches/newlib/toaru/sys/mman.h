@@ -0,0 +1,37 @@
+#ifndef _SYS_MMAN_H
+#define _SYS_MMAN_H
+
+#define PROT_NONE  0x0
+#define PROT_READ  0x1
+#define PROT_WRITE 0x2
+#define PROT_EXEC  0x4
+
+#define MAP_SHARED    0x01
+#define MAP_PRIVATE   0x02
+#define MAP_FIXED     0x10
+#define MAP_ANONYMOUS 0x20
+#define MAP_ANON      MAP_ANONYMOUS
+
+#define MAP_FAILED ((void *)-1)
+
+/*
+ * mmap() takes more arguments than fit in registers,
+ * so they are passed to the kernel in this structure.
+ */
+struct mmap_args {
+	void * addr;
+	unsigned long length;
+	int prot;
+	int flags;
+	int fd;
+	long offset;
+};
+
+#ifndef _KERNEL_
+#include <sys/types.h>
+void * mmap(void * addr, size_t length, int prot, int flags, int fd, off_t offset);
+int munmap(void * addr, size_t length);
+int mprotect(void * addr, size_t length, int prot);
+#endif
+
+#endif
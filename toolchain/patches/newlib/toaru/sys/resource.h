@@ -0,0 +1,29 @@
+#ifndef _SYS_RESOURCE_H
+#define _SYS_RESOURCE_H
+
+/* Targets for getpriority() and setpriority() */
+#define PRIO_PROCESS 0
+#define PRIO_PGRP    1
+#define PRIO_USER    2
+
+/* Nice levels run from PRIO_MIN (most favored) to PRIO_MAX - 1 */
+#define PRIO_MIN -20
+#define PRIO_MAX 20
+
+#ifndef _KERNEL_
+#include <sys/time.h>
+
+#define RUSAGE_SELF     0
+#define RUSAGE_CHILDREN -1
+
+struct rusage {
+	struct timeval ru_utime;
+	struct timeval ru_stime;
+};
+
+int getrusage(int who, struct rusage * usage);
+int getpriority(int which, int who);
+int setpriority(int which, int who, int prio);
+#endif
+
+#endif
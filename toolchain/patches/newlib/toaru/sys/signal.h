@@ -22,13 +22,6 @@ typedef unsigned long sigset_t;
 #define SI_ASYNCIO 4
 #define SI_MESGQ   5
 
-#define SA_NOCLDSTOP 1
-#define SA_SIGINFO   2
-
-#define SIG_SETMASK 0
-#define SIG_BLOCK 1
-#define SIG_UNBLOCK 2
-
 #define sa_handler   _signal_handlers._handler
 #define sa_sigaction _signal_handlers._sigaction
 
@@ -41,3 +41,14 @@
 
 #define NUMSIGNALS  38
 #define NSIG        NUMSIGNALS
+
+/* sigaction() flags */
+#define SA_NOCLDSTOP 1
+#define SA_SIGINFO   2
+#define SA_NODEFER   0x40000000 /* Don't block the signal in its own handler */
+#define SA_RESETHAND 0x80000000 /* Go back to the default action once handled */
+
+/* sigprocmask() */
+#define SIG_SETMASK 0
+#define SIG_BLOCK   1
+#define SIG_UNBLOCK 2
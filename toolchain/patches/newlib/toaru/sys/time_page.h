@@ -0,0 +1,54 @@
+#ifndef _SYS_TIME_PAGE_H
+#define _SYS_TIME_PAGE_H
+
+/*
+ * The time page is mapped read-only into every process at
+ * TIME_PAGE_ADDR, so the C library can read the clock without a
+ * system call.
+ *
+ * With a usable TSC, nanoseconds since boot are
+ *     time_page_ns(tsc_mult, rdtsc() - tsc_base)
+ * and without one, coarse_ns holds the uptime as of the last tick.
+ * The kernel makes seq odd while it changes anything; readers start
+ * over if it was odd or has changed by the time they are done.
+ */
+#ifdef _KERNEL_
+#include <types.h>
+#else
+#include <stdint.h>
+#endif
+
+#define TIME_PAGE_ADDR  0xFFFFF000
+#define TIME_PAGE_SHIFT 24
+
+struct time_page {
+	volatile uint32_t seq;
+	uint32_t tsc_mult;  /* Nanoseconds per TSC count << TIME_PAGE_SHIFT; 0 if there is no TSC */
+	uint64_t tsc_base;  /* TSC at uptime zero */
+	uint64_t coarse_ns; /* Uptime as of the last tick */
+	uint32_t boot_time; /* Wall clock seconds at uptime zero */
+};
+
+/* Scale a count of TSC cycles to nanoseconds without a 128-bit product */
+static inline uint64_t time_page_ns(uint32_t mult, uint64_t cycles) {
+	uint64_t hi = (uint64_t)(uint32_t)(cycles >> 32) * mult;
+	uint64_t lo = (uint64_t)(uint32_t)cycles * mult;
+	return (hi << (32 - TIME_PAGE_SHIFT)) + (lo >> TIME_PAGE_SHIFT);
+}
+
+#ifndef _KERNEL_
+#include <sys/types.h>
+#include <time.h>
+
+/* Newlib only declares these for targets with _POSIX_TIMERS */
+#ifndef CLOCK_REALTIME
+#define CLOCK_REALTIME  (clockid_t)1
+#endif
+#ifndef CLOCK_MONOTONIC
+#define CLOCK_MONOTONIC (clockid_t)4
+#endif
+
+int clock_gettime(clockid_t clock_id, struct timespec * tp);
+#endif
+
+#endif
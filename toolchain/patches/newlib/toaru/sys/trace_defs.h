@@ -0,0 +1,46 @@
+#ifndef _SYS_TRACE_DEFS_H
+#define _SYS_TRACE_DEFS_H
+
+/*
+ * Layout of /proc/trace: a trace_header, then `count` trace_events,
+ * oldest first. Timestamps convert to nanoseconds since boot as
+ *     ((stamp - tsc_base) * tsc_mult) >> TRACE_SHIFT
+ */
+#ifdef _KERNEL_
+#include <types.h>
+#else
+#include <stdint.h>
+#endif
+
+#define TRACE_MAGIC 0x54524345 /* "TRCE" */
+#define TRACE_SHIFT 24
+
+/* Event types, and what they put in a and b */
+#define TRACE_SWITCH        1 /* Previous PID, next PID */
+#define TRACE_SYSCALL_ENTER 2 /* Number, first argument */
+#define TRACE_SYSCALL_EXIT  3 /* Number, return value */
+#define TRACE_PAGE_FAULT    4 /* Address, EIP */
+#define TRACE_IRQ           5 /* IRQ line, 0 */
+#define TRACE_BLOCK_START   6 /* LBA, 1 for a write */
+#define TRACE_BLOCK_DONE    7 /* LBA, 1 for a write */
+#define TRACE_WAKEUP        8 /* PID woken, processor it was queued on */
+#define TRACE_TYPES         9
+
+struct trace_header {
+	uint32_t magic;
+	uint32_t count;    /* Events that follow */
+	uint32_t dropped;  /* Older events that were overwritten */
+	uint32_t tsc_mult; /* Nanoseconds per timestamp unit << TRACE_SHIFT */
+	uint64_t tsc_base;
+};
+
+struct trace_event {
+	uint64_t stamp;
+	uint32_t pid;      /* Process running when it happened */
+	uint32_t a;
+	uint32_t b;
+	uint16_t type;
+	uint16_t cpu;
+};
+
+#endif
@@ -12,6 +12,9 @@
 #include <sys/utsname.h>
 #include <sys/termios.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/time_page.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <utime.h>
@@ -33,6 +36,48 @@ extern void *realloc(void *ptr, size_t size);
 extern void _init();
 extern void _fini();
 
+/*
+ * System call entry points (see syscall.h). The first call finds out
+ * which one this processor can use.
+ */
+extern void __syscall_detect(void);
+void * __syscall_entry = (void *)__syscall_detect;
+
+__asm__(
+	".global __syscall_int\n"
+	"__syscall_int:\n"
+	"	int $0x7F\n"
+	"	ret\n"
+	/* SYSENTER doesn't say where to come back to; the kernel finds
+	 * the return address at the top of the stack pointer in ebp,
+	 * and comes back to it with ecx and edx overwritten. */
+	".global __syscall_sysenter\n"
+	"__syscall_sysenter:\n"
+	"	push %ebp\n"
+	"	push %ecx\n"
+	"	push %edx\n"
+	"	call 1f\n"
+	"	pop %edx\n"
+	"	pop %ecx\n"
+	"	pop %ebp\n"
+	"	ret\n"
+	"1:\n"
+	"	mov %esp, %ebp\n"
+	"	sysenter\n"
+	".global __syscall_detect\n"
+	"__syscall_detect:\n"
+	"	pusha\n"
+	"	mov $1, %eax\n"
+	"	cpuid\n"
+	"	movl $__syscall_int, __syscall_entry\n"
+	"	test $0x800, %edx\n" /* SEP */
+	"	jz 2f\n"
+	"	movl $__syscall_sysenter, __syscall_entry\n"
+	"2:\n"
+	"	popa\n"
+	"	jmp *__syscall_entry\n"
+);
+
 DEFN_SYSCALL1(exit,  0, int);
 DEFN_SYSCALL1(print, 1, const char *);
 DEFN_SYSCALL3(open,  2, const char *, int, int);
@@ -89,6 +134,17 @@ DEFN_SYSCALL1(unlink, 52, char *);
 DEFN_SYSCALL3(waitpid, 53, int, int *, int);
 DEFN_SYSCALL1(pipe, 54, int *);
 DEFN_SYSCALL5(mount, SYS_MOUNT, char *, char *, char *, unsigned long, void *);
+DEFN_SYSCALL1(mmap, SYS_MMAP, struct mmap_args *);
+DEFN_SYSCALL2(munmap, SYS_MUNMAP, void *, size_t);
+DEFN_SYSCALL3(mprotect, SYS_MPROTECT, void *, size_t, int);
+DEFN_SYSCALL2(shm_obtain_large, SYS_SHM_OBTAIN_LARGE, char *, size_t *);
+DEFN_SYSCALL3(setpriority, SYS_SETPRIORITY, int, int, int);
+DEFN_SYSCALL2(getpriority, SYS_GETPRIORITY, int, int);
+DEFN_SYSCALL3(futex, SYS_FUTEX, int *, int, int);
+DEFN_SYSCALL1(set_tid_address, SYS_SET_TID_ADDRESS, int *);
+DEFN_SYSCALL1(times, SYS_TIMES, void *);
+DEFN_SYSCALL3(sigaction, SYS_SIGACTION, int, void *, void *);
+DEFN_SYSCALL3(sigprocmask, SYS_SIGPROCMASK, int, void *, void *);
 
 static int toaru_debug_stubs_enabled(void) {
 	static int checked = 0;
@@ -180,6 +236,24 @@ int fork(void) {
 	return syscall_fork();
 }
 
+#define VFORK_STR(x) #x
+#define VFORK_NUM(x) VFORK_STR(x)
+
+/*
+ * The child runs on our stack until it execs, so vfork() can't keep
+ * its return address there for the parent: the child's next call
+ * would overwrite it. Keep it in %ecx over the system call instead.
+ */
+__asm__(
+	".global vfork\n"
+	"vfork:\n"
+	"	pop %ecx\n"
+	"	mov $" VFORK_NUM(SYS_VFORK) ", %eax\n"
+	"	int $0x7F\n"
+	"	push %ecx\n"
+	"	ret\n"
+);
+
 int uname(struct utsname *__name) {
 	return syscall_uname((void *)__name);
 }
@@ -297,8 +371,58 @@ caddr_t sbrk(int nbytes){
 }
 
 // --- Other ---
+
+/*
+ * Nanoseconds since boot, from the time page (see sys/time_page.h),
+ * and the wall clock time at boot in seconds.
+ */
+static uint64_t time_page_read(uint32_t * boot_time) {
+	volatile struct time_page * page = (volatile struct time_page *)TIME_PAGE_ADDR;
+	uint32_t seq;
+	uint64_t ns;
+	do {
+		while ((seq = page->seq) & 1);
+		asm volatile ("" ::: "memory");
+		if (page->tsc_mult) {
+			uint32_t lo, hi;
+			asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+			ns = time_page_ns(page->tsc_mult, (((uint64_t)hi << 32) | lo) - page->tsc_base);
+		} else {
+			ns = page->coarse_ns;
+		}
+		*boot_time = page->boot_time;
+		asm volatile ("" ::: "memory");
+	} while (page->seq != seq);
+	return ns;
+}
+
+int clock_gettime(clockid_t clock_id, struct timespec * tp) {
+	uint32_t boot_time;
+	uint64_t ns;
+
+	switch (clock_id) {
+		case CLOCK_MONOTONIC:
+			ns = time_page_read(&boot_time);
+			break;
+		case CLOCK_REALTIME:
+			ns = time_page_read(&boot_time) + (uint64_t)boot_time * 1000000000;
+			break;
+		default:
+			errno = EINVAL;
+			return -1;
+	}
+
+	tp->tv_sec  = ns / 1000000000;
+	tp->tv_nsec = ns % 1000000000;
+	return 0;
+}
+
 int gettimeofday(struct timeval *p, void *z){
-	return syscall_gettimeofday(p,z);
+	uint32_t boot_time;
+	uint64_t usec = time_page_read(&boot_time) / 1000;
+	p->tv_sec  = boot_time + usec / 1000000;
+	p->tv_usec = usec % 1000000;
+	return 0;
 }
 
 int pipe(int fildes[2]) {
@@ -337,7 +461,7 @@ unsigned int sleep(unsigned int seconds) {
 }
 
 int usleep(useconds_t usec) {
-	syscall_nanosleep(0, usec / 10000);
+	syscall_nanosleep(usec / 1000000, usec % 1000000);
 	return 0;
 }
 
@@ -435,11 +559,6 @@ unsigned int alarm(unsigned int seconds) {
 	return 0;
 }
 
-clock_t times(struct tms *buf) {
-	/* TODO: times() */
-	return -1;
-}
-
 
 int  fcntl(int fd, int cmd, ...) {
 	if (cmd == F_GETFD || cmd == F_SETFD) {
@@ -500,6 +619,9 @@ char *ttyname(int fd) {
 
 long sysconf(int name) {
 	switch (name) {
+		case 2:
+			/* _SC_CLK_TCK */
+			return 100;
 		case 8:
 			return 4096;
 		case 11:
@@ -628,8 +750,12 @@ int sched_yield(void) {
 }
 
 int sigprocmask(int how, const sigset_t *set, sigset_t *oldset) {
-	DEBUG_STUB("sigprocmask(%d, 0x%x, 0x%x);\n", how, set, oldset);
-	return -1;
+	int ret = syscall_sigprocmask(how, (void *)set, oldset);
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+	return 0;
 }
 
 int sigsuspend(const sigset_t * mask) {
@@ -644,26 +770,11 @@ int setpgid(pid_t pid, pid_t pgid) {
 }
 
 int sigaction(int signum, const struct sigaction *act, struct sigaction *oldact)  {
-
-	sighandler_t old;
-
-	if (act) {
-		old = signal(signum, act->sa_handler);
-	} else {
-		/* We don't have a way to query, so we need to set to something, then
-		 * set back to whatever it was... XXX */
-		old = signal(signum, NULL);
-		signal(signum, old);
-	}
-
-	if (oldact) {
-		oldact->sa_handler = old;
-	}
-
-	if (act) {
-		DEBUG_STUB("sigaction(%d,...,0x%x);\n", signum, act->sa_flags);
+	int ret = syscall_sigaction(signum, (void *)act, oldact);
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
 	}
-
 	return 0;
 }
 
@@ -688,3 +799,92 @@ int mount(char * source, char * target, char * type, unsigned long flags, void *
 	return r;
 }
 
+void * mmap(void * addr, size_t length, int prot, int flags, int fd, off_t offset) {
+	/* There are more arguments than registers, so pass them in a struct */
+	struct mmap_args args = {addr, length, prot, flags, fd, offset};
+	int r = syscall_mmap(&args);
+
+	/* Addresses in the last page double as error numbers */
+	if ((uintptr_t)r >= (uintptr_t)-4096) {
+		errno = -r;
+		return MAP_FAILED;
+	}
+
+	return (void *)r;
+}
+
+int munmap(void * addr, size_t length) {
+	int r = syscall_munmap(addr, length);
+
+	if (r < 0) {
+		errno = -r;
+		return -1;
+	}
+
+	return r;
+}
+
+int mprotect(void * addr, size_t length, int prot) {
+	int r = syscall_mprotect(addr, length, prot);
+
+	if (r < 0) {
+		errno = -r;
+		return -1;
+	}
+
+	return r;
+}
+
+int setpriority(int which, int who, int prio) {
+	int r = syscall_setpriority(which, who, prio);
+
+	if (r < 0) {
+		errno = -r;
+		return -1;
+	}
+
+	return r;
+}
+
+int getpriority(int which, int who) {
+	int r = syscall_getpriority(which, who);
+
+	if (r < 0) {
+		errno = -r;
+		return -1;
+	}
+
+	/* The kernel hands back 20 - nice so it never looks like an error */
+	return 20 - r;
+}
+
+int nice(int inc) {
+	errno = 0;
+	int prio = getpriority(PRIO_PROCESS, 0);
+	if (prio == -1 && errno) {
+		return -1;
+	}
+	if (setpriority(PRIO_PROCESS, 0, prio + inc) < 0) {
+		return -1;
+	}
+	return getpriority(PRIO_PROCESS, 0);
+}
+
+clock_t times(struct tms *buf) {
+	/* In sysconf(_SC_CLK_TCK) ticks */
+	return syscall_times(buf);
+}
+
+int getrusage(int who, struct rusage * usage) {
+	struct tms t;
+	if (times(&t) == (clock_t)-1) {
+		return -1;
+	}
+	clock_t utime = (who == RUSAGE_CHILDREN) ? t.tms_cutime : t.tms_utime;
+	clock_t stime = (who == RUSAGE_CHILDREN) ? t.tms_cstime : t.tms_stime;
+	usage->ru_utime.tv_sec  = utime / 100;
+	usage->ru_utime.tv_usec = (utime % 100) * 10000;
+	usage->ru_stime.tv_sec  = stime / 100;
+	usage->ru_stime.tv_usec = (stime % 100) * 10000;
+	return 0;
+}
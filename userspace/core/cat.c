@@ -14,6 +14,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/mman.h>
 
 #define CHUNK_SIZE 4096
 
@@ -27,6 +28,23 @@ void doit(int fd) {
 	}
 }
 
+/*
+ * Map a regular file and write it out in one go,
+ * rather than copying it through a buffer.
+ */
+int doit_mapped(int fd, size_t size) {
+	char * data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) return 1;
+	size_t done = 0;
+	while (done < size) {
+		ssize_t r = write(STDOUT_FILENO, data + done, size - done);
+		if (r <= 0) break;
+		done += r;
+	}
+	munmap(data, size);
+	return 0;
+}
+
 int main(int argc, char ** argv) {
 	int ret = 0;
 	if (argc == 1) {
@@ -51,7 +69,9 @@ int main(int argc, char ** argv) {
 			continue;
 		}
 
-		doit(fd);
+		if (!S_ISREG(_stat.st_mode) || !_stat.st_size || doit_mapped(fd, _stat.st_size)) {
+			doit(fd);
+		}
 
 		close(fd);
 	}
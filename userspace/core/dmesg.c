@@ -0,0 +1,75 @@
+/* This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2014 Kevin Lange
+ */
+/*
+ * dmesg
+ *
+ * Print the kernel log, as much of it as the kernel still has
+ * in memory, from /proc/kmsg.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+void usage(char * argv[]) {
+	printf(
+			"dmesg - print the kernel log\n"
+			"\n"
+			"usage: %s [-n lines]\n"
+			"\n"
+			" -n     \033[3monly print the last this many lines\033[0m\n"
+			" -?     \033[3mshow this help text\033[0m\n"
+			"\n", argv[0]);
+}
+
+int main(int argc, char * argv[]) {
+	int lines = 0;
+
+	int c;
+	while ((c = getopt(argc, argv, "n:?")) != -1) {
+		switch (c) {
+			case 'n':
+				lines = atoi(optarg);
+				break;
+			case '?':
+				usage(argv);
+				return 0;
+		}
+	}
+
+	FILE * f = fopen("/proc/kmsg", "r");
+	if (!f) {
+		fprintf(stderr, "%s: can't open /proc/kmsg\n", argv[0]);
+		return 1;
+	}
+
+	/* Read it all in one go, so it is all from the same moment */
+	size_t size = 0, space = 4096;
+	char * log = malloc(space);
+	size_t r;
+	while ((r = fread(log + size, 1, space - size, f)) > 0) {
+		size += r;
+		if (size == space) {
+			space *= 2;
+			log = realloc(log, space);
+		}
+	}
+	fclose(f);
+
+	char * start = log;
+	if (lines > 0) {
+		char * p = log + size;
+		if (p > log && p[-1] == '\n') p--;
+		while (p > log) {
+			if (p[-1] == '\n' && --lines == 0) break;
+			p--;
+		}
+		start = p;
+	}
+
+	fwrite(start, 1, size - (start - log), stdout);
+	free(log);
+	return 0;
+}
@@ -9,25 +9,87 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define LINE_SIZE 4096
 
+static char * needle;
+
+static int grep_line(char * buf) {
+	char * found = strstr(buf, needle);
+	if (found) {
+		*found = '\0';
+		found += strlen(needle);
+		fprintf(stdout, "%s\033[1;31m%s\033[0m%s", buf, needle, found);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Search a file by mapping it, rather than reading it through stdio.
+ */
+static int grep_file(char * name, char * file) {
+	int fd = open(file, O_RDONLY);
+	if (fd == -1) {
+		fprintf(stderr, "%s: %s: no such file or directory\n", name, file);
+		return -1;
+	}
+
+	struct stat _stat;
+	fstat(fd, &_stat);
+	if (!S_ISREG(_stat.st_mode) || !_stat.st_size) {
+		close(fd);
+		return 0;
+	}
+
+	char * data = mmap(NULL, _stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "%s: %s: could not map file\n", name, file);
+		return -1;
+	}
+
+	char buf[LINE_SIZE];
+	int found = 0;
+	char * end = data + _stat.st_size;
+	char * line = data;
+	while (line < end) {
+		char * eol = memchr(line, '\n', end - line);
+		size_t len = (eol ? eol + 1 : end) - line;
+		if (len >= LINE_SIZE) len = LINE_SIZE - 1;
+		memcpy(buf, line, len);
+		buf[len] = '\0';
+		found |= grep_line(buf);
+		line = eol ? eol + 1 : end;
+	}
+
+	munmap(data, _stat.st_size);
+	return found;
+}
+
 int main(int argc, char ** argv) {
 	if (argc < 2) {
-		fprintf(stderr, "usage: %s thing-to-grep-for\n", argv[0]);
+		fprintf(stderr, "usage: %s thing-to-grep-for [file...]\n", argv[0]);
 		return 1;
 	}
 
-	char * needle = argv[1];
-	char buf[LINE_SIZE];
+	needle = argv[1];
 	int ret = 1;
 
+	if (argc > 2) {
+		for (int i = 2; i < argc; ++i) {
+			if (grep_file(argv[0], argv[i]) > 0) {
+				ret = 0;
+			}
+		}
+		return ret;
+	}
+
+	char buf[LINE_SIZE];
 	while (fgets(buf, LINE_SIZE, stdin)) {
-		char * found = strstr(buf, needle);
-		if (found) {
-			*found = '\0';
-			found += strlen(needle);
-			fprintf(stdout, "%s\033[1;31m%s\033[0m%s", buf, needle, found);
+		if (grep_line(buf)) {
 			ret = 0;
 		}
 	}
@@ -0,0 +1,73 @@
+/* This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2014 Kevin Lange
+ */
+/*
+ * nice
+ *
+ * Run a command with a different scheduling priority,
+ * or print the current one.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/resource.h>
+
+void usage(char * argv[]) {
+	printf(
+			"nice - run a command with a different priority\n"
+			"\n"
+			"usage: %s [-n \033[3madjustment\033[0m] [\033[3mcommand\033[0m [\033[3margs\033[0m...]]\n"
+			"\n"
+			" -h --help       \033[3mShow this help message.\033[0m\n"
+			" -n \033[3madjustment\033[0m   \033[3mAdd this to the nice level (default 10)\033[0m\n"
+			"\n"
+			"Without a command, prints the current nice level.\n"
+			"\n",
+			argv[0]);
+}
+
+int main(int argc, char * argv[]) {
+	int adjustment = 10;
+	int i = 1;
+
+	for (; i < argc; ++i) {
+		if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+			usage(argv);
+			return 0;
+		} else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+			adjustment = atoi(argv[++i]);
+		} else {
+			break;
+		}
+	}
+
+	errno = 0;
+	int prio = getpriority(PRIO_PROCESS, 0);
+	if (prio == -1 && errno) {
+		fprintf(stderr, "%s: getpriority: %s\n", argv[0], strerror(errno));
+		return 1;
+	}
+
+	if (i == argc) {
+		printf("%d\n", prio);
+		return 0;
+	}
+
+	if (setpriority(PRIO_PROCESS, 0, prio + adjustment) < 0) {
+		/* Not allowed to go lower; carry on at the current priority */
+		fprintf(stderr, "%s: setpriority: %s\n", argv[0], strerror(errno));
+	}
+
+	execvp(argv[i], &argv[i]);
+	fprintf(stderr, "%s: %s: command not found\n", argv[0], argv[i]);
+	return 127;
+}
+
+/*
+ * vim:tabstop=4
+ * vim:noexpandtab
+ * vim:shiftwidth=4
+ */
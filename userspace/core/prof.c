@@ -0,0 +1,386 @@
+/* This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2014 Kevin Lange
+ */
+/*
+ * prof
+ *
+ * Turn the kernel's sampling profiler on and off, and report on
+ * the samples in /proc/profile for one process: a flat profile of
+ * where it was when it was sampled and, for samples with call
+ * chains, who called each function. Kernel addresses come already
+ * named; user addresses are named from the program's symbol table.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "lib/list.h"
+#include "lib/hashmap.h"
+
+#include "../../kernel/include/elf.h"
+
+#define MAX_DEPTH 16
+
+struct func {
+	char * name;
+	int self;      /* Samples taken in it */
+	int total;     /* Samples with it anywhere on the call chain */
+	hashmap_t * callers;
+};
+
+struct usym {
+	uint32_t addr;
+	char * name;
+};
+
+static hashmap_t * kernel_syms; /* Address -> "symbol+offset", from /proc/profile */
+static struct usym * user_syms = NULL;
+static int user_sym_count = 0;
+
+static int set_profiling(char * how) {
+	FILE * f = fopen("/proc/profile", "w");
+	if (!f) {
+		fprintf(stderr, "prof: can't open /proc/profile\n");
+		return 1;
+	}
+	fprintf(f, "%s\n", how);
+	fclose(f);
+	return 0;
+}
+
+static int compare_usyms(const void * a, const void * b) {
+	const struct usym * x = a;
+	const struct usym * y = b;
+	if (x->addr == y->addr) return 0;
+	return (x->addr < y->addr) ? -1 : 1;
+}
+
+/*
+ * Read the function symbols out of an ELF binary.
+ */
+static int load_binary(char * path) {
+	FILE * f = fopen(path, "r");
+	if (!f) return 0;
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	char * data = malloc(size);
+	fread(data, size, 1, f);
+	fclose(f);
+
+	Elf32_Header * header = (Elf32_Header *)data;
+	if (size < (long)sizeof(Elf32_Header) ||
+			header->e_ident[0] != ELFMAG0 || header->e_ident[1] != ELFMAG1 ||
+			header->e_ident[2] != ELFMAG2 || header->e_ident[3] != ELFMAG3) {
+		free(data);
+		return 0;
+	}
+
+	list_t * found = list_create();
+	for (int i = 0; i < header->e_shnum; ++i) {
+		Elf32_Shdr * shdr = (Elf32_Shdr *)(data + header->e_shoff + i * header->e_shentsize);
+		if (shdr->sh_type != SHT_SYMTAB) continue;
+		Elf32_Shdr * strtab = (Elf32_Shdr *)(data + header->e_shoff + shdr->sh_link * header->e_shentsize);
+		Elf32_Sym * table = (Elf32_Sym *)(data + shdr->sh_offset);
+		for (unsigned int j = 0; j < shdr->sh_size / sizeof(Elf32_Sym); ++j) {
+			if (ELF32_ST_TYPE(table[j].st_info) != STT_FUNC || !table[j].st_value) continue;
+			struct usym * sym = malloc(sizeof(struct usym));
+			sym->addr = table[j].st_value;
+			sym->name = strdup(data + strtab->sh_offset + table[j].st_name);
+			list_insert(found, sym);
+		}
+	}
+
+	user_syms = malloc(sizeof(struct usym) * (found->length + 1));
+	user_sym_count = 0;
+	foreach(node, found) {
+		user_syms[user_sym_count++] = *(struct usym *)node->value;
+	}
+	list_free(found);
+	free(found);
+	free(data);
+
+	qsort(user_syms, user_sym_count, sizeof(struct usym), compare_usyms);
+	return user_sym_count;
+}
+
+/*
+ * Find the binary for a process from its command line.
+ */
+static int load_binary_for(int pid) {
+	char tmp[256], cmdline[1024];
+	snprintf(tmp, 256, "/proc/%d/cmdline", pid);
+	FILE * f = fopen(tmp, "r");
+	if (!f) return 0;
+	if (!fgets(cmdline, sizeof(cmdline), f)) {
+		fclose(f);
+		return 0;
+	}
+	fclose(f);
+
+	char * end = strchr(cmdline, ' ');
+	if (end) *end = '\0';
+	if (load_binary(cmdline)) return 1;
+	if (!strchr(cmdline, '/')) {
+		snprintf(tmp, 256, "/bin/%s", cmdline);
+		return load_binary(tmp);
+	}
+	return 0;
+}
+
+/*
+ * The name of the function an address is in.
+ */
+static char * function_name(int kernel, uint32_t addr, char * buf) {
+	if (kernel) {
+		char * sym = hashmap_get(kernel_syms, (void *)addr);
+		if (sym) {
+			sprintf(buf, "[k] %s", sym);
+			char * plus = strrchr(buf, '+');
+			if (plus) *plus = '\0';
+			return buf;
+		}
+		sprintf(buf, "[k] 0x%08x", addr);
+		return buf;
+	}
+
+	int lo = 0, hi = user_sym_count - 1;
+	struct usym * best = NULL;
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (user_syms[mid].addr <= addr) {
+			best = &user_syms[mid];
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	if (best) {
+		return strcpy(buf, best->name);
+	}
+	sprintf(buf, "0x%08x", addr);
+	return buf;
+}
+
+static struct func * get_func(hashmap_t * funcs, char * name) {
+	struct func * f = hashmap_get(funcs, name);
+	if (!f) {
+		f = malloc(sizeof(struct func));
+		f->name = strdup(name);
+		f->self = 0;
+		f->total = 0;
+		f->callers = hashmap_create(16);
+		hashmap_set(funcs, name, f);
+	}
+	return f;
+}
+
+static int compare_funcs(const void * a, const void * b) {
+	const struct func * x = *(const struct func **)a;
+	const struct func * y = *(const struct func **)b;
+	if (x->self != y->self) return y->self - x->self;
+	return y->total - x->total;
+}
+
+static int compare_totals(const void * a, const void * b) {
+	const struct func * x = *(const struct func **)a;
+	const struct func * y = *(const struct func **)b;
+	return y->total - x->total;
+}
+
+static int report(int pid, int lines) {
+	FILE * f = fopen("/proc/profile", "r");
+	if (!f) {
+		fprintf(stderr, "prof: can't open /proc/profile\n");
+		return 1;
+	}
+
+	kernel_syms = hashmap_create_int(256);
+	hashmap_t * funcs = hashmap_create(256);
+	int samples = 0, dropped = 0, hz = 0, callgraph = 0, matched = 0;
+
+	char line[1024];
+	char buf[MAX_DEPTH][256];
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#') {
+			sscanf(line, "# samples %d dropped %d hz %d callgraph %d", &samples, &dropped, &hz, &callgraph);
+			continue;
+		}
+		if (strstr(line, "sym ") == line) {
+			uint32_t addr;
+			char name[256];
+			if (sscanf(line, "sym %x %255s", &addr, name) == 2) {
+				hashmap_set(kernel_syms, (void *)addr, strdup(name));
+			}
+			continue;
+		}
+
+		int spid, cpu;
+		char where;
+		int n;
+		if (sscanf(line, "%d %d %c%n", &spid, &cpu, &where, &n) != 3 || spid != pid) {
+			continue;
+		}
+		matched++;
+
+		/* Name each frame, innermost first */
+		int depth = 0;
+		char * names[MAX_DEPTH];
+		char * c = line + n;
+		uint32_t addr;
+		int used;
+		while (depth < MAX_DEPTH && sscanf(c, " %x%n", &addr, &used) == 1) {
+			names[depth] = function_name(where == 'k', addr, buf[depth]);
+			depth++;
+			c += used;
+		}
+		if (!depth) continue;
+
+		get_func(funcs, names[0])->self++;
+		for (int i = 0; i < depth; ++i) {
+			/* Recursion only counts once toward the total */
+			int seen = 0;
+			for (int j = 0; j < i; ++j) {
+				if (!strcmp(names[i], names[j])) seen = 1;
+			}
+			struct func * fn = get_func(funcs, names[i]);
+			if (!seen) fn->total++;
+			if (i + 1 < depth) {
+				int count = (int)hashmap_get(fn->callers, names[i + 1]);
+				hashmap_set(fn->callers, names[i + 1], (void *)(count + 1));
+			}
+		}
+	}
+	fclose(f);
+
+	if (!matched) {
+		fprintf(stderr, "prof: no samples for process %d (of %d)\n", pid, samples);
+		return 1;
+	}
+
+	list_t * values = hashmap_values(funcs);
+	struct func ** sorted = malloc(sizeof(struct func *) * (values->length + 1));
+	int count = 0;
+	foreach(node, values) {
+		sorted[count++] = node->value;
+	}
+
+	printf("%d samples for process %d at %d Hz", matched, pid, hz);
+	if (dropped) printf(" (%d more were not recorded)", dropped);
+	printf("\n\n");
+
+	qsort(sorted, count, sizeof(struct func *), compare_funcs);
+	printf("\033[1m%6s %6s %6s  %s\033[0m\n", "%SELF", "SELF", "TOTAL", "FUNCTION");
+	for (int i = 0; i < count && i < lines; ++i) {
+		int permille = sorted[i]->self * 1000 / matched;
+		printf("%4d.%d %6d %6d  %s\n", permille / 10, permille % 10,
+				sorted[i]->self, sorted[i]->total, sorted[i]->name);
+	}
+
+	if (callgraph) {
+		printf("\n\033[1mCallers, by samples with the function on the stack\033[0m\n");
+		qsort(sorted, count, sizeof(struct func *), compare_totals);
+		for (int i = 0; i < count && i < lines; ++i) {
+			printf("\n%6d  %s\n", sorted[i]->total, sorted[i]->name);
+			list_t * callers = hashmap_keys(sorted[i]->callers);
+			foreach(node, callers) {
+				char * caller = node->value;
+				printf("%6d    <- %s\n", (int)hashmap_get(sorted[i]->callers, caller), caller);
+			}
+			list_free(callers);
+			free(callers);
+		}
+	}
+
+	return 0;
+}
+
+void usage(char * argv[]) {
+	printf(
+			"prof - sampling profiler\n"
+			"\n"
+			"usage: %s [-g] start\n"
+			"       %s stop\n"
+			"       %s [-b binary] [-n lines] -p pid\n"
+			"       %s [-g] [-n lines] run command...\n"
+			"\n"
+			" start  \033[3mstart sampling from an empty buffer\033[0m\n"
+			" stop   \033[3mstop sampling\033[0m\n"
+			" run    \033[3msample while a command runs, then report on it\033[0m\n"
+			" -g     \033[3mrecord call chains as well\033[0m\n"
+			" -p     \033[3mreport on this process\033[0m\n"
+			" -b     \033[3mthe program it was running, for symbols\033[0m\n"
+			" -n     \033[3mfunctions to show (default 20)\033[0m\n"
+			" -?     \033[3mshow this help text\033[0m\n"
+			"\n", argv[0], argv[0], argv[0], argv[0]);
+}
+
+int main(int argc, char * argv[]) {
+	int pid = 0;
+	int lines = 20;
+	int callgraph = 0;
+	char * binary = NULL;
+
+	int c;
+	while ((c = getopt(argc, argv, "gp:b:n:?")) != -1) {
+		switch (c) {
+			case 'g':
+				callgraph = 1;
+				break;
+			case 'p':
+				pid = atoi(optarg);
+				break;
+			case 'b':
+				binary = optarg;
+				break;
+			case 'n':
+				lines = atoi(optarg);
+				break;
+			case '?':
+				usage(argv);
+				return 0;
+		}
+	}
+
+	if (optind < argc && !strcmp(argv[optind], "start")) {
+		return set_profiling(callgraph ? "2" : "1");
+	} else if (optind < argc && !strcmp(argv[optind], "stop")) {
+		return set_profiling("0");
+	} else if (optind + 1 < argc && !strcmp(argv[optind], "run")) {
+		if (set_profiling(callgraph ? "2" : "1")) return 1;
+		pid = fork();
+		if (!pid) {
+			execvp(argv[optind + 1], &argv[optind + 1]);
+			fprintf(stderr, "prof: %s: command not found\n", argv[optind + 1]);
+			_exit(127);
+		}
+		waitpid(pid, NULL, 0);
+		set_profiling("0");
+		if (!binary) {
+			binary = argv[optind + 1];
+			if (!load_binary(binary) && !strchr(binary, '/')) {
+				char tmp[256];
+				snprintf(tmp, 256, "/bin/%s", binary);
+				load_binary(tmp);
+			}
+			binary = NULL;
+		}
+	} else if (!pid) {
+		usage(argv);
+		return 1;
+	}
+
+	if (binary) {
+		if (!load_binary(binary)) {
+			fprintf(stderr, "prof: %s: no symbols\n", binary);
+		}
+	} else if (!user_sym_count) {
+		load_binary_for(pid);
+	}
+
+	return report(pid, lines);
+}
@@ -523,6 +523,17 @@ void run_cmd(char ** args) {
 	exit(i);
 }
 
+/*
+ * For a child from vfork(), which shares our memory until it execs:
+ * it mustn't touch anything of ours, so it only gets to exec or _exit.
+ */
+void exec_cmd(char ** args) {
+	execvp(*args, args);
+	write(STDERR_FILENO, *args, strlen(*args));
+	write(STDERR_FILENO, ": Command not found\n", 20);
+	_exit(127);
+}
+
 int shell_exec(char * buffer, int buffer_size) {
 
 	/* Read previous history entries */
@@ -774,9 +785,10 @@ _done:
 		if (func) {
 			return func(argcs[0], arg_starts[0]);
 		} else {
-			child_pid = fork();
+			/* Not a builtin, so the child goes straight to exec */
+			child_pid = vfork();
 			if (!child_pid) {
-				run_cmd(arg_starts[0]);
+				exec_cmd(arg_starts[0]);
 			}
 		}
 	}
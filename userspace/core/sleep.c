@@ -17,7 +17,7 @@ int main(int argc, char ** argv) {
 	float time = atof(arg);
 
 	unsigned int seconds = (unsigned int)time;
-	unsigned int subsecs = (unsigned int)((time - (float)seconds) * 100);
+	unsigned int subsecs = (unsigned int)((time - (float)seconds) * 1000000);
 
 	ret = syscall_nanosleep(seconds, subsecs);
 
@@ -0,0 +1,227 @@
+/* This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2014 Kevin Lange
+ */
+/*
+ * top
+ *
+ * Show the processes using the most processor time, from the
+ * accounting in /proc/<pid>/stat, refreshing every few seconds.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/time.h>
+#include <sys/time_page.h>
+
+#include "lib/list.h"
+#include "lib/hashmap.h"
+
+struct proc_sample {
+	int pid;
+	char name[64];
+	char state;
+	int ppid;
+	int utime, stime;
+	int nice;
+	int cpu;
+	int nvcsw, nivcsw;
+	int runs;
+	int run_ms;
+	int wait_ms;
+	int wait_max;
+
+	int cpu_permille; /* Share of one processor since the last sample */
+};
+
+static unsigned long now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int read_sample(char * pid, struct proc_sample * out) {
+	char tmp[256], line[512];
+	snprintf(tmp, 256, "/proc/%s/stat", pid);
+	FILE * f = fopen(tmp, "r");
+	if (!f) return 0;
+	if (!fgets(line, sizeof(line), f)) {
+		fclose(f);
+		return 0;
+	}
+	fclose(f);
+
+	/* The name may contain spaces; it runs to the last ')' */
+	char * open  = strchr(line, '(');
+	char * close = strrchr(line, ')');
+	if (!open || !close || close < open) return 0;
+
+	out->pid = atoi(line);
+	size_t len = close - open - 1;
+	if (len >= sizeof(out->name)) len = sizeof(out->name) - 1;
+	memcpy(out->name, open + 1, len);
+	out->name[len] = '\0';
+
+	int count = sscanf(close + 2, "%c %d %d %d %*d %*d %d %d %d %d %d %d %d %d",
+			&out->state, &out->ppid, &out->utime, &out->stime,
+			&out->nice, &out->cpu, &out->nvcsw, &out->nivcsw,
+			&out->runs, &out->run_ms, &out->wait_ms, &out->wait_max);
+	return count == 12;
+}
+
+static list_t * take_samples(void) {
+	list_t * samples = list_create();
+	DIR * dirp = opendir("/proc");
+	struct dirent * ent = readdir(dirp);
+	while (ent != NULL) {
+		if (ent->d_name[0] >= '0' && ent->d_name[0] <= '9') {
+			struct proc_sample * s = malloc(sizeof(struct proc_sample));
+			if (read_sample(ent->d_name, s)) {
+				list_insert(samples, s);
+			} else {
+				free(s);
+			}
+		}
+		ent = readdir(dirp);
+	}
+	closedir(dirp);
+	return samples;
+}
+
+static int count_cpus(void) {
+	char line[256];
+	int cpus = 0;
+	FILE * f = fopen("/proc/cpuinfo", "r");
+	if (!f) return 1;
+	while (fgets(line, sizeof(line), f)) {
+		if (strstr(line, "processor:") == line) cpus++;
+	}
+	fclose(f);
+	return cpus ? cpus : 1;
+}
+
+static int compare_samples(const void * a, const void * b) {
+	const struct proc_sample * x = *(const struct proc_sample **)a;
+	const struct proc_sample * y = *(const struct proc_sample **)b;
+	if (x->cpu_permille != y->cpu_permille) {
+		return y->cpu_permille - x->cpu_permille;
+	}
+	return y->run_ms - x->run_ms;
+}
+
+static void show(list_t * samples, hashmap_t * last, unsigned long elapsed, int cpus, int lines) {
+	struct proc_sample ** sorted = malloc(sizeof(struct proc_sample *) * (samples->length + 1));
+	int count = 0;
+	int busy = 0;
+
+	foreach(node, samples) {
+		struct proc_sample * s = node->value;
+		struct proc_sample * before = hashmap_get(last, (void *)s->pid);
+		int ran = before ? s->run_ms - before->run_ms : s->run_ms;
+		s->cpu_permille = elapsed ? ran * 1000 / elapsed : 0;
+		busy += ran;
+		sorted[count++] = s;
+	}
+	qsort(sorted, count, sizeof(struct proc_sample *), compare_samples);
+
+	printf("\033[H\033[2J");
+	printf("top - %d processes, %d processor%s, %d%% busy\n\n",
+			count, cpus, cpus == 1 ? "" : "s",
+			elapsed ? (int)(busy * 100 / (elapsed * cpus)) : 0);
+	printf("\033[7m%5s %5s S %3s %3s %5s %9s %7s %7s %8s %8s %-16s\033[0m\n",
+			"PID", "PPID", "NI", "CPU", "%CPU", "TIME", "VCSW", "IVCSW", "AVGWAIT", "MAXWAIT", "COMMAND");
+
+	for (int i = 0; i < count && i < lines; ++i) {
+		struct proc_sample * s = sorted[i];
+		int avg_wait = s->runs ? (int)((long long)s->wait_ms * 1000 / s->runs) : 0;
+		printf("%5d %5d %c %3d %3d %3d.%d %5d:%02d.%d %7d %7d %6dus %6dus %-16s\n",
+				s->pid, s->ppid, s->state, s->nice, s->cpu,
+				s->cpu_permille / 10, s->cpu_permille % 10,
+				s->run_ms / 60000, (s->run_ms / 1000) % 60, (s->run_ms / 100) % 10,
+				s->nvcsw, s->nivcsw,
+				avg_wait, s->wait_max,
+				s->name);
+	}
+	fflush(stdout);
+	free(sorted);
+}
+
+static void free_samples(list_t * samples) {
+	foreach(node, samples) {
+		free(node->value);
+	}
+	list_free(samples);
+	free(samples);
+}
+
+void usage(char * argv[]) {
+	printf(
+			"top - show processes using the most processor time\n"
+			"\n"
+			"usage: %s [-d seconds] [-n iterations] [-l lines]\n"
+			"\n"
+			" -d     \033[3mseconds between updates (default 2)\033[0m\n"
+			" -n     \033[3mstop after this many updates\033[0m\n"
+			" -l     \033[3mprocesses to show (default 20)\033[0m\n"
+			" -?     \033[3mshow this help text\033[0m\n"
+			"\n", argv[0]);
+}
+
+int main(int argc, char * argv[]) {
+	int delay = 2;
+	int iterations = -1;
+	int lines = 20;
+
+	int c;
+	while ((c = getopt(argc, argv, "d:n:l:?")) != -1) {
+		switch (c) {
+			case 'd':
+				delay = atoi(optarg);
+				if (delay < 1) delay = 1;
+				break;
+			case 'n':
+				iterations = atoi(optarg);
+				break;
+			case 'l':
+				lines = atoi(optarg);
+				break;
+			case '?':
+				usage(argv);
+				return 0;
+		}
+	}
+
+	int cpus = count_cpus();
+
+	/* The first update covers everything since each process started */
+	hashmap_t * last = hashmap_create_int(64);
+	list_t * last_samples = NULL;
+	unsigned long last_time = 0;
+
+	while (iterations != 0) {
+		unsigned long now = now_ms();
+		list_t * samples = take_samples();
+
+		show(samples, last, last_samples ? now - last_time : now, cpus, lines);
+
+		if (last_samples) {
+			free_samples(last_samples);
+		}
+		hashmap_free(last);
+		free(last);
+		last = hashmap_create_int(64);
+		foreach(node, samples) {
+			struct proc_sample * s = node->value;
+			hashmap_set(last, (void *)s->pid, s);
+		}
+		last_samples = samples;
+		last_time = now;
+
+		if (iterations > 0) iterations--;
+		if (iterations != 0) sleep(delay);
+	}
+
+	return 0;
+}
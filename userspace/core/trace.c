@@ -0,0 +1,211 @@
+/* This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2014 Kevin Lange
+ */
+/*
+ * trace
+ *
+ * Turn kernel event tracing on and off, and print the contents of
+ * /proc/trace as a timeline.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/time_page.h>
+#include <sys/trace_defs.h>
+
+#include "lib/hashmap.h"
+
+static char * event_names[TRACE_TYPES] = {
+	[TRACE_SWITCH]        = "switch",
+	[TRACE_SYSCALL_ENTER] = "syscall",
+	[TRACE_SYSCALL_EXIT]  = "sysret",
+	[TRACE_PAGE_FAULT]    = "fault",
+	[TRACE_IRQ]           = "irq",
+	[TRACE_BLOCK_START]   = "block",
+	[TRACE_BLOCK_DONE]    = "blockdone",
+	[TRACE_WAKEUP]        = "wakeup",
+};
+
+/* Events waiting for the one that ends them, by PID and by LBA */
+static hashmap_t * syscalls_pending;
+static hashmap_t * blocks_pending;
+
+static int set_tracing(int on) {
+	FILE * f = fopen("/proc/trace", "w");
+	if (!f) {
+		fprintf(stderr, "trace: can't open /proc/trace\n");
+		return 1;
+	}
+	fprintf(f, "%d\n", on);
+	fclose(f);
+	return 0;
+}
+
+static uint64_t event_ns(struct trace_header * header, struct trace_event * event) {
+	return time_page_ns(header->tsc_mult, event->stamp - header->tsc_base);
+}
+
+static void print_event(struct trace_header * header, struct trace_event * event, uint64_t start) {
+	uint64_t ns = event_ns(header, event) - start;
+	char * name = (event->type < TRACE_TYPES && event_names[event->type]) ? event_names[event->type] : "?";
+
+	printf("%6d.%06d %3d %5d  %-9s ",
+			(int)(ns / 1000000000), (int)(ns % 1000000000 / 1000),
+			event->cpu, event->pid, name);
+
+	switch (event->type) {
+		case TRACE_SWITCH:
+			printf("%d -> %d\n", event->a, event->b);
+			break;
+		case TRACE_SYSCALL_ENTER:
+			printf("%d (0x%x)\n", event->a, event->b);
+			hashmap_set(syscalls_pending, (void *)event->pid, event);
+			break;
+		case TRACE_SYSCALL_EXIT: {
+			struct trace_event * enter = hashmap_get(syscalls_pending, (void *)event->pid);
+			printf("%d = %d", event->a, (int)event->b);
+			if (enter && enter->type == TRACE_SYSCALL_ENTER && enter->a == event->a) {
+				printf(" (%d us)", (int)((event_ns(header, event) - event_ns(header, enter)) / 1000));
+				hashmap_remove(syscalls_pending, (void *)event->pid);
+			}
+			printf("\n");
+			break;
+		}
+		case TRACE_PAGE_FAULT:
+			printf("0x%08x at 0x%08x\n", event->a, event->b);
+			break;
+		case TRACE_IRQ:
+			printf("%d\n", event->a);
+			break;
+		case TRACE_BLOCK_START:
+			printf("%s %d\n", event->b ? "write" : "read", event->a);
+			hashmap_set(blocks_pending, (void *)event->a, event);
+			break;
+		case TRACE_BLOCK_DONE: {
+			struct trace_event * begin = hashmap_get(blocks_pending, (void *)event->a);
+			printf("%s %d", event->b ? "write" : "read", event->a);
+			if (begin) {
+				printf(" (%d us)", (int)((event_ns(header, event) - event_ns(header, begin)) / 1000));
+				hashmap_remove(blocks_pending, (void *)event->a);
+			}
+			printf("\n");
+			break;
+		}
+		case TRACE_WAKEUP:
+			printf("%d on cpu %d\n", event->a, event->b);
+			break;
+		default:
+			printf("0x%x 0x%x\n", event->a, event->b);
+			break;
+	}
+}
+
+static int show(int pid) {
+	FILE * f = fopen("/proc/trace", "r");
+	if (!f) {
+		fprintf(stderr, "trace: can't open /proc/trace\n");
+		return 1;
+	}
+
+	struct trace_header header;
+	if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != TRACE_MAGIC) {
+		fprintf(stderr, "trace: /proc/trace is not a trace\n");
+		fclose(f);
+		return 1;
+	}
+
+	struct trace_event * events = malloc(sizeof(struct trace_event) * (header.count + 1));
+	size_t count = fread(events, sizeof(struct trace_event), header.count, f);
+	fclose(f);
+
+	if (header.dropped) {
+		printf("(%d older events were overwritten)\n", header.dropped);
+	}
+	printf("%13s %3s %5s  %s\n", "TIME", "CPU", "PID", "EVENT");
+
+	int counts[TRACE_TYPES] = {0};
+	syscalls_pending = hashmap_create_int(64);
+	blocks_pending   = hashmap_create_int(64);
+	uint64_t start = count ? event_ns(&header, &events[0]) : 0;
+	for (size_t i = 0; i < count; ++i) {
+		struct trace_event * event = &events[i];
+		if (pid && event->pid != (uint32_t)pid &&
+				!(event->type == TRACE_SWITCH && (event->a == (uint32_t)pid || event->b == (uint32_t)pid)) &&
+				!(event->type == TRACE_WAKEUP && event->a == (uint32_t)pid)) {
+			continue;
+		}
+		if (event->type < TRACE_TYPES) counts[event->type]++;
+		print_event(&header, event, start);
+	}
+
+	printf("\n");
+	for (int i = 1; i < TRACE_TYPES; ++i) {
+		printf("%-9s %d\n", event_names[i], counts[i]);
+	}
+
+	hashmap_free(syscalls_pending);
+	free(syscalls_pending);
+	hashmap_free(blocks_pending);
+	free(blocks_pending);
+	free(events);
+	return 0;
+}
+
+void usage(char * argv[]) {
+	printf(
+			"trace - kernel event tracing\n"
+			"\n"
+			"usage: %s [-p pid] [on | off | run command...]\n"
+			"\n"
+			" on     \033[3mstart tracing from an empty buffer\033[0m\n"
+			" off    \033[3mstop tracing\033[0m\n"
+			" run    \033[3mtrace while a command runs, then show it\033[0m\n"
+			" -p     \033[3monly show events involving this process\033[0m\n"
+			" -?     \033[3mshow this help text\033[0m\n"
+			"\n"
+			"With no command, shows what has been traced so far.\n"
+			"\n", argv[0]);
+}
+
+int main(int argc, char * argv[]) {
+	int pid = 0;
+
+	int c;
+	while ((c = getopt(argc, argv, "p:?")) != -1) {
+		switch (c) {
+			case 'p':
+				pid = atoi(optarg);
+				break;
+			case '?':
+				usage(argv);
+				return 0;
+		}
+	}
+
+	if (optind >= argc) {
+		return show(pid);
+	}
+
+	if (!strcmp(argv[optind], "on")) {
+		return set_tracing(1);
+	} else if (!strcmp(argv[optind], "off")) {
+		return set_tracing(0);
+	} else if (!strcmp(argv[optind], "run") && optind + 1 < argc) {
+		if (set_tracing(1)) return 1;
+		pid_t child = fork();
+		if (!child) {
+			execvp(argv[optind + 1], &argv[optind + 1]);
+			fprintf(stderr, "trace: %s: command not found\n", argv[optind + 1]);
+			_exit(127);
+		}
+		waitpid(child, NULL, 0);
+		set_tracing(0);
+		return show(pid);
+	}
+
+	usage(argv);
+	return 1;
+}
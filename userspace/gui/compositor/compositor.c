@@ -27,7 +27,6 @@
 #include "lib/yutani.h"
 #include "lib/hashmap.h"
 #include "lib/list.h"
-#include "lib/spinlock.h"
 
 #include "yutani_int.h"
 
@@ -120,6 +119,18 @@ static int next_buf_id(void) {
 	return _next++;
 }
 
+/**
+ * Obtain a window buffer; large ones (eg. fullscreen windows)
+ * are worth backing with 4MB pages, which we stream through
+ * on every redraw.
+ */
+static uint8_t * obtain_buffer(char * key, size_t * size) {
+	if (*size >= 0x300000) {
+		return (uint8_t *)syscall_shm_obtain_large(key, size);
+	}
+	return (uint8_t *)syscall_shm_obtain(key, size);
+}
+
 static int next_wid(void) {
 	static int _next = 1;
 	return _next++;
@@ -202,24 +213,24 @@ static void reorder_window(yutani_globals_t * yg, yutani_server_window_t * windo
 	}
 
 	int z = window->z;
-	spin_lock(&yg->redraw_lock);
+	pthread_mutex_lock(&yg->redraw_lock);
 	unorder_window(yg, window);
-	spin_unlock(&yg->redraw_lock);
+	pthread_mutex_unlock(&yg->redraw_lock);
 
 	window->z = new_zed;
 
 	if (new_zed != YUTANI_ZORDER_TOP && new_zed != YUTANI_ZORDER_BOTTOM) {
-		spin_lock(&yg->redraw_lock);
+		pthread_mutex_lock(&yg->redraw_lock);
 		list_insert(yg->mid_zs, window);
-		spin_unlock(&yg->redraw_lock);
+		pthread_mutex_unlock(&yg->redraw_lock);
 		return;
 	}
 
 	if (new_zed == YUTANI_ZORDER_TOP) {
 		if (yg->top_z) {
-			spin_lock(&yg->redraw_lock);
+			pthread_mutex_lock(&yg->redraw_lock);
 			unorder_window(yg, yg->top_z);
-			spin_unlock(&yg->redraw_lock);
+			pthread_mutex_unlock(&yg->redraw_lock);
 		}
 		yg->top_z = window;
 		return;
@@ -227,9 +238,9 @@ static void reorder_window(yutani_globals_t * yg, yutani_server_window_t * windo
 
 	if (new_zed == YUTANI_ZORDER_BOTTOM) {
 		if (yg->bottom_z) {
-			spin_lock(&yg->redraw_lock);
+			pthread_mutex_lock(&yg->redraw_lock);
 			unorder_window(yg, yg->bottom_z);
-			spin_unlock(&yg->redraw_lock);
+			pthread_mutex_unlock(&yg->redraw_lock);
 		}
 		yg->bottom_z = window;
 		return;
@@ -345,7 +356,7 @@ static yutani_server_window_t * server_window_create(yutani_globals_t * yg, int
 	YUTANI_SHMKEY(yg->server_ident, key, 1024, win);
 
 	size_t size = (width * height * 4);
-	win->buffer = (uint8_t *)syscall_shm_obtain(key, &size);
+	win->buffer = obtain_buffer(key, &size);
 	memset(win->buffer, 0, size);
 
 	list_insert(yg->mid_zs, win);
@@ -391,7 +402,7 @@ static uint32_t server_window_resize(yutani_globals_t * yg, yutani_server_window
 		YUTANI_SHMKEY_EXP(yg->server_ident, key, 1024, win->newbufid);
 
 		size_t size = (width * height * 4);
-		win->newbuffer = (uint8_t *)syscall_shm_obtain(key, &size);
+		win->newbuffer = obtain_buffer(key, &size);
 	}
 
 	return win->newbufid;
@@ -421,9 +432,9 @@ static void server_window_resize_finish(yutani_globals_t * yg, yutani_server_win
 	{
 		char key[1024];
 		YUTANI_SHMKEY_EXP(yg->server_ident, key, 1024, oldbufid);
-		spin_lock(&yg->redraw_lock);
+		pthread_mutex_lock(&yg->redraw_lock);
 		syscall_shm_release(key);
-		spin_unlock(&yg->redraw_lock);
+		pthread_mutex_unlock(&yg->redraw_lock);
 	}
 
 	win->buffer = win->newbuffer;
@@ -983,7 +994,7 @@ static void redraw_windows(yutani_globals_t * yg) {
 	}
 
 	/* Calculate damage regions from currently queued updates */
-	spin_lock(&yg->update_list_lock);
+	pthread_mutex_lock(&yg->update_list_lock);
 	while (yg->update_list->length) {
 		node_t * win = list_dequeue(yg->update_list);
 		yutani_damage_rect_t * rect = (void *)win->value;
@@ -994,7 +1005,7 @@ static void redraw_windows(yutani_globals_t * yg) {
 		free(rect);
 		free(win);
 	}
-	spin_unlock(&yg->update_list_lock);
+	pthread_mutex_unlock(&yg->update_list_lock);
 
 	/* Render */
 	if (has_updates) {
@@ -1008,9 +1019,9 @@ static void redraw_windows(yutani_globals_t * yg) {
 		 * but calculating that may be more trouble than it's worth;
 		 * we also need to render windows in stacking order...
 		 */
-		spin_lock(&yg->redraw_lock);
+		pthread_mutex_lock(&yg->redraw_lock);
 		yutani_blit_windows(yg, yg->framebuffer_ctx);
-		spin_unlock(&yg->redraw_lock);
+		pthread_mutex_unlock(&yg->redraw_lock);
 
 		if (yg->resizing_window) {
 			/* Draw box */
@@ -1106,7 +1117,7 @@ void yutani_cairo_init(yutani_globals_t * yg) {
 	yg->real_ctx = cairo_create(yg->real_surface);
 
 	yg->update_list = list_create();
-	yg->update_list_lock = 0;
+	pthread_mutex_init(&yg->update_list_lock, NULL);
 }
 
 /**
@@ -1174,9 +1185,9 @@ static void mark_window_relative(yutani_globals_t * yg, yutani_server_window_t *
 		rect->height = bottom_bound - top_bound;
 	}
 
-	spin_lock(&yg->update_list_lock);
+	pthread_mutex_lock(&yg->update_list_lock);
 	list_insert(yg->update_list, rect);
-	spin_unlock(&yg->update_list_lock);
+	pthread_mutex_unlock(&yg->update_list_lock);
 }
 
 /**
@@ -7,6 +7,7 @@
 #include "lib/hashmap.h"
 #include "lib/graphics.h"
 #include "lib/kbd.h"
+#include "lib/pthread.h"
 
 #define MOUSE_SCALE 3
 #define MOUSE_OFFSET_X 26
@@ -92,7 +93,7 @@ typedef struct {
 	yutani_server_window_t * top_z;
 
 	list_t * update_list;
-	volatile int update_list_lock;
+	pthread_mutex_t update_list_lock;
 
 	sprite_t mouse_sprite;
 
@@ -125,7 +126,7 @@ typedef struct {
 
 	int tick_count;
 
-	volatile int redraw_lock;
+	pthread_mutex_t redraw_lock;
 
 	yutani_server_window_t * old_hover_window;
 
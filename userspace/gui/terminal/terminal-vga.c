@@ -334,7 +334,7 @@ void term_write(char c) {
 					cell_redraw_inverted(j, i);
 				}
 			}
-			syscall_nanosleep(0,10);
+			syscall_nanosleep(0,100000);
 			term_redraw_all();
 #endif
 		} else if (c == '\b') {
@@ -41,7 +41,6 @@
 #include "lib/decorations.h"
 #include "lib/pthread.h"
 #include "lib/kbd.h"
-#include "lib/spinlock.h"
 
 #include "terminal-palette.h"
 #include "terminal-font.h"
@@ -76,7 +75,7 @@ uint8_t  _force_kernel  = 0;
 uint8_t  _hold_out      = 0;    /* state indicator on last cell ignore \n */
 uint8_t  _free_size     = 1;    /* Disable rounding when resized */
 
-static volatile int display_lock = 0;
+static pthread_mutex_t display_lock = PTHREAD_MUTEX_INITIALIZER;
 
 yutani_window_t * window       = NULL; /* GUI window */
 yutani_t * yctx = NULL;
@@ -660,7 +659,7 @@ void term_write(char c) {
 					cell_redraw_inverted(j, i);
 				}
 			}
-			syscall_nanosleep(0,10);
+			syscall_nanosleep(0,100000);
 			term_redraw_all();
 #endif
 		} else if (c == '\b') {
@@ -811,17 +810,17 @@ void clear_input() {
 uint32_t child_pid = 0;
 
 void handle_input(char c) {
-	spin_lock(&display_lock);
+	pthread_mutex_lock(&display_lock);
 	write(fd_master, &c, 1);
 	display_flip();
-	spin_unlock(&display_lock);
+	pthread_mutex_unlock(&display_lock);
 }
 
 void handle_input_s(char * c) {
-	spin_lock(&display_lock);
+	pthread_mutex_lock(&display_lock);
 	write(fd_master, c, strlen(c));
 	display_flip();
-	spin_unlock(&display_lock);
+	pthread_mutex_unlock(&display_lock);
 }
 
 void key_event(int ret, key_event_t * event) {
@@ -869,12 +868,12 @@ void key_event(int ret, key_event_t * event) {
 			case KEY_F12:
 				/* Toggle decorations */
 				if (!_fullscreen) {
-					spin_lock(&display_lock);
+					pthread_mutex_lock(&display_lock);
 					_no_frame = !_no_frame;
 					window_width = window->width - decor_width() * (!_no_frame);
 					window_height = window->height - decor_height() * (!_no_frame);
 					reinit(1);
-					spin_unlock(&display_lock);
+					pthread_mutex_unlock(&display_lock);
 				}
 				break;
 			case KEY_ARROW_UP:
@@ -1078,10 +1077,10 @@ static void resize_finish(int width, int height) {
 	window_width  = window->width  - extra_x;
 	window_height = window->height - extra_y;
 
-	spin_lock(&display_lock);
+	pthread_mutex_lock(&display_lock);
 	reinit_graphics_yutani(ctx, window);
 	reinit(1);
-	spin_unlock(&display_lock);
+	pthread_mutex_unlock(&display_lock);
 
 	yutani_window_resize_done(yctx, window);
 	yutani_flip(yctx, window);
@@ -1146,9 +1145,9 @@ void * blink_cursor(void * garbage) {
 		timer_tick++;
 		if (timer_tick == 3) {
 			timer_tick = 0;
-			spin_lock(&display_lock);
+			pthread_mutex_lock(&display_lock);
 			flip_cursor();
-			spin_unlock(&display_lock);
+			pthread_mutex_unlock(&display_lock);
 		}
 		usleep(90000);
 	}
@@ -1346,12 +1345,12 @@ int main(int argc, char ** argv) {
 		unsigned char buf[1024];
 		while (!exit_application) {
 			int r = read(fd_master, buf, 1024);
-			spin_lock(&display_lock);
+			pthread_mutex_lock(&display_lock);
 			for (uint32_t i = 0; i < r; ++i) {
 				ansi_put(ansi_state, buf[i]);
 			}
 			display_flip();
-			spin_unlock(&display_lock);
+			pthread_mutex_unlock(&display_lock);
 		}
 
 	}
@@ -4,12 +4,31 @@
  */
 #include <stdlib.h>
 #include <stdint.h>
+#include <errno.h>
 #include <syscall.h>
 #include <signal.h>
+#include <sys/futex.h>
 #include "pthread.h"
 
 #define PTHREAD_STACK_SIZE 0x100000
 
+/*
+ * Kept at the bottom of each thread's stack allocation, so
+ * pthread_join() can find it from a copy of the pthread_t.
+ */
+struct pthread_control {
+	volatile int tid;   /* Non-zero until the kernel has finished with the thread */
+	uint32_t id;
+	void *(*start_routine)(void *);
+	void * arg;
+	void * ret_val;
+	struct pthread_control * next;
+};
+
+/* Running threads, so pthread_exit() can find where to leave its value */
+static struct pthread_control * threads = NULL;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+
 int clone(uintptr_t a,uintptr_t b,void* c) {
 	return syscall_clone(a,b,c);
 }
@@ -17,11 +36,43 @@ int gettid() {
 	return syscall_gettid();
 }
 
+static void * pthread_start(void * _control) {
+	struct pthread_control * control = _control;
+	syscall_set_tid_address((int *)&control->tid);
+	pthread_exit(control->start_routine(control->arg));
+	return NULL;
+}
+
 int pthread_create(pthread_t * thread, pthread_attr_t * attr, void *(*start_routine)(void *), void * arg) {
 	char * stack = malloc(PTHREAD_STACK_SIZE);
+	if (!stack) {
+		return EAGAIN;
+	}
 	uintptr_t stack_top = (uintptr_t)stack + PTHREAD_STACK_SIZE;
+
+	struct pthread_control * control = (struct pthread_control *)stack;
+	control->tid = -1;
+	control->start_routine = start_routine;
+	control->arg = arg;
+	control->ret_val = NULL;
+
+	/* Hold the list until the id is filled in, in case the thread exits right away */
+	pthread_mutex_lock(&threads_lock);
+	control->next = threads;
+	threads = control;
+
 	thread->stack = stack;
-	thread->id = clone(stack_top, (uintptr_t)start_routine, arg);
+	thread->ret_val = NULL;
+	int id = clone(stack_top, (uintptr_t)pthread_start, control);
+	if (id < 0) {
+		threads = control->next;
+		pthread_mutex_unlock(&threads_lock);
+		free(stack);
+		return EAGAIN;
+	}
+	thread->id = id;
+	control->id = id;
+	pthread_mutex_unlock(&threads_lock);
 	return 0;
 }
 
@@ -30,11 +81,127 @@ int pthread_kill(pthread_t thread, int sig) {
 }
 
 void pthread_exit(void * value) {
-	/* Perform nice cleanup */
-#if 0
-	/* XXX: LOCK */
-	free(stack);
-	/* XXX: Return value!? */
-#endif
+	uint32_t id = gettid();
+	pthread_mutex_lock(&threads_lock);
+	for (struct pthread_control * control = threads; control; control = control->next) {
+		if (control->id == id) {
+			control->ret_val = value;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&threads_lock);
 	__asm__ ("jmp 0xFFFFB00F"); /* Force thread exit */
 }
+
+/*
+ * Wait for a thread to exit, then free its stack.
+ */
+int pthread_join(pthread_t thread, void ** retval) {
+	struct pthread_control * control = (struct pthread_control *)thread.stack;
+	if (!control) {
+		return EINVAL;
+	}
+
+	int tid;
+	while ((tid = control->tid) != 0) {
+		syscall_futex((int *)&control->tid, FUTEX_WAIT, tid);
+	}
+
+	pthread_mutex_lock(&threads_lock);
+	for (struct pthread_control ** p = &threads; *p; p = &(*p)->next) {
+		if (*p == control) {
+			*p = control->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&threads_lock);
+
+	if (retval) {
+		*retval = control->ret_val;
+	}
+	free(thread.stack);
+	return 0;
+}
+
+/*
+ * Mutexes
+ *
+ * Uncontended locks and unlocks are a single atomic operation; only
+ * a thread which finds the lock taken goes to the kernel, after
+ * marking it as having waiters so the holder knows to wake one.
+ */
+int pthread_mutex_init(pthread_mutex_t * mutex, pthread_mutexattr_t * attr) {
+	mutex->state = 0;
+	return 0;
+}
+
+int pthread_mutex_destroy(pthread_mutex_t * mutex) {
+	return 0;
+}
+
+int pthread_mutex_lock(pthread_mutex_t * mutex) {
+	int c = __sync_val_compare_and_swap(&mutex->state, 0, 1);
+	if (c == 0) {
+		return 0;
+	}
+	if (c != 2) {
+		c = __sync_lock_test_and_set(&mutex->state, 2);
+	}
+	while (c != 0) {
+		syscall_futex((int *)&mutex->state, FUTEX_WAIT, 2);
+		c = __sync_lock_test_and_set(&mutex->state, 2);
+	}
+	return 0;
+}
+
+int pthread_mutex_trylock(pthread_mutex_t * mutex) {
+	if (__sync_val_compare_and_swap(&mutex->state, 0, 1) != 0) {
+		return EBUSY;
+	}
+	return 0;
+}
+
+int pthread_mutex_unlock(pthread_mutex_t * mutex) {
+	if (__sync_fetch_and_sub(&mutex->state, 1) != 1) {
+		/* There were waiters */
+		mutex->state = 0;
+		syscall_futex((int *)&mutex->state, FUTEX_WAKE, 1);
+	}
+	return 0;
+}
+
+/*
+ * Condition variables
+ */
+int pthread_cond_init(pthread_cond_t * cond, pthread_condattr_t * attr) {
+	cond->seq = 0;
+	return 0;
+}
+
+int pthread_cond_destroy(pthread_cond_t * cond) {
+	return 0;
+}
+
+int pthread_cond_wait(pthread_cond_t * cond, pthread_mutex_t * mutex) {
+	int seq = cond->seq;
+	pthread_mutex_unlock(mutex);
+	/* If anyone signalled since we read seq, this returns right away */
+	syscall_futex((int *)&cond->seq, FUTEX_WAIT, seq);
+	/* Others may be waiting on the mutex along with us, so take it as contended */
+	while (__sync_lock_test_and_set(&mutex->state, 2) != 0) {
+		syscall_futex((int *)&mutex->state, FUTEX_WAIT, 2);
+	}
+	return 0;
+}
+
+int pthread_cond_signal(pthread_cond_t * cond) {
+	__sync_fetch_and_add(&cond->seq, 1);
+	syscall_futex((int *)&cond->seq, FUTEX_WAKE, 1);
+	return 0;
+}
+
+int pthread_cond_broadcast(pthread_cond_t * cond) {
+	__sync_fetch_and_add(&cond->seq, 1);
+	syscall_futex((int *)&cond->seq, FUTEX_WAKE, 0x7FFFFFFF);
+	return 0;
+}
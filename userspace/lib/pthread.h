@@ -11,9 +11,39 @@ typedef struct {
 } pthread_t;
 typedef unsigned int pthread_attr_t;
 
+/*
+ * Mutexes and condition variables only enter the kernel
+ * (through the futex system call) when they are contended.
+ */
+typedef struct {
+	volatile int state; /* 0: unlocked, 1: locked, 2: locked with waiters */
+} pthread_mutex_t;
+typedef unsigned int pthread_mutexattr_t;
+
+typedef struct {
+	volatile int seq;   /* Bumped on every signal */
+} pthread_cond_t;
+typedef unsigned int pthread_condattr_t;
+
+#define PTHREAD_MUTEX_INITIALIZER { 0 }
+#define PTHREAD_COND_INITIALIZER  { 0 }
+
 int pthread_create(pthread_t * thread, pthread_attr_t * attr, void *(*start_routine)(void *), void * arg);
 void pthread_exit(void * value);
 int pthread_kill(pthread_t thread, int sig);
+int pthread_join(pthread_t thread, void ** retval);
+
+int pthread_mutex_init(pthread_mutex_t * mutex, pthread_mutexattr_t * attr);
+int pthread_mutex_destroy(pthread_mutex_t * mutex);
+int pthread_mutex_lock(pthread_mutex_t * mutex);
+int pthread_mutex_trylock(pthread_mutex_t * mutex);
+int pthread_mutex_unlock(pthread_mutex_t * mutex);
+
+int pthread_cond_init(pthread_cond_t * cond, pthread_condattr_t * attr);
+int pthread_cond_destroy(pthread_cond_t * cond);
+int pthread_cond_wait(pthread_cond_t * cond, pthread_mutex_t * mutex);
+int pthread_cond_signal(pthread_cond_t * cond);
+int pthread_cond_broadcast(pthread_cond_t * cond);
 
 int clone(uintptr_t,uintptr_t,void*);
 int gettid();
@@ -4,6 +4,8 @@
  */
 #include <stdlib.h>
 #include <stdio.h>
+#include <sys/time.h>
+#include <sys/time_page.h>
 
 #include "testing.h"
 
@@ -16,3 +18,16 @@ void notice(char * type, char * fmt, ...) {
 	vprintf(fmt, argp);
 	printf("\n");
 }
+
+unsigned long long bench_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void bench_report(char * what, int iterations, unsigned long long elapsed) {
+	if (iterations < 1) iterations = 1;
+	fprintf(stderr, "%s: %d in %d ms (%d ns each)\n",
+			what, iterations, (int)(elapsed / 1000000),
+			(int)(elapsed / iterations));
+}
@@ -12,4 +12,8 @@
 
 void notice(char * type, char * fmt, ...);
 
+/* Benchmarks: a monotonic clock, and a line saying how long each iteration took */
+unsigned long long bench_ns(void);
+void bench_report(char * what, int iterations, unsigned long long elapsed);
+
 #endif
@@ -0,0 +1,75 @@
+/* This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2014 Kevin Lange
+ */
+/*
+ * clockgettime
+ *
+ * Checks that clock_gettime(CLOCK_MONOTONIC) never goes backwards
+ * and that CLOCK_REALTIME agrees with the kernel's time of day,
+ * then times clock_gettime(), which reads the time page, against
+ * the gettimeofday system call.
+ *
+ *   test-clockgettime [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <sys/time_page.h>
+#include <syscall.h>
+
+#include "lib/testing.h"
+
+static unsigned long long ns_of(struct timespec * ts) {
+	return (unsigned long long)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+static unsigned long long monotonic_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ns_of(&ts);
+}
+
+int main(int argc, char * argv[]) {
+	int iterations = (argc > 1) ? atoi(argv[1]) : 1000000;
+
+	unsigned long long last = monotonic_ns();
+	unsigned long long smallest = 0;
+	for (int i = 0; i < iterations; ++i) {
+		unsigned long long now = monotonic_ns();
+		if (now < last) {
+			fprintf(stderr, "FAIL: CLOCK_MONOTONIC went back %d ns\n", (int)(last - now));
+			return 1;
+		}
+		if (now != last && (!smallest || now - last < smallest)) {
+			smallest = now - last;
+		}
+		last = now;
+	}
+	fprintf(stderr, "PASS: CLOCK_MONOTONIC never went backwards (smallest step %d ns)\n", (int)smallest);
+
+	struct timespec real;
+	struct timeval kernel;
+	clock_gettime(CLOCK_REALTIME, &real);
+	syscall_gettimeofday(&kernel, NULL);
+	long long skew = (long long)ns_of(&real) / 1000 - ((long long)kernel.tv_sec * 1000000 + kernel.tv_usec);
+	if (skew > 1000 || skew < -1000) {
+		fprintf(stderr, "FAIL: CLOCK_REALTIME is %d us from the kernel's time of day\n", (int)skew);
+		return 1;
+	}
+	fprintf(stderr, "PASS: CLOCK_REALTIME agrees with the kernel's time of day\n");
+
+	unsigned long long before = monotonic_ns();
+	for (int i = 0; i < iterations; ++i) {
+		monotonic_ns();
+	}
+	bench_report("clock_gettime()", iterations, monotonic_ns() - before);
+
+	before = monotonic_ns();
+	for (int i = 0; i < iterations; ++i) {
+		syscall_gettimeofday(&kernel, NULL);
+	}
+	bench_report("gettimeofday()", iterations, monotonic_ns() - before);
+
+	return 0;
+}
@@ -0,0 +1,69 @@
+/* This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2014 Kevin Lange
+ */
+/*
+ * fork-latency
+ *
+ * Measures how long fork() takes for a process with a large,
+ * fully touched heap. The child exits immediately (or, with -w,
+ * writes to a single page first), so with copy-on-write the cost
+ * should not grow with the size of the parent.
+ *
+ *   test-fork-latency [-w] [megabytes] [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "lib/testing.h"
+
+int main(int argc, char * argv[]) {
+	int touch = 0;
+	int arg = 1;
+
+	if (argc > arg && !strcmp(argv[arg], "-w")) {
+		touch = 1;
+		arg++;
+	}
+
+	int megs = (argc > arg) ? atoi(argv[arg]) : 16;
+	int iterations = (argc > arg + 1) ? atoi(argv[arg + 1]) : 100;
+
+	size_t size = megs * 1024 * 1024;
+	char * buf = malloc(size);
+	if (!buf) {
+		fprintf(stderr, "%s: could not allocate %d MB\n", argv[0], megs);
+		return 1;
+	}
+	/* Make sure every page is really backed by a frame */
+	memset(buf, 0xAA, size);
+
+	unsigned long long before = bench_ns();
+
+	for (int i = 0; i < iterations; ++i) {
+		pid_t pid = fork();
+		if (!pid) {
+			if (touch) {
+				buf[0] = 0x55;
+			}
+			_exit(0);
+		}
+		waitpid(pid, NULL, 0);
+	}
+
+	unsigned long long after = bench_ns();
+
+	if (buf[0] != (char)0xAA) {
+		fprintf(stderr, "%s: child write leaked into parent!\n", argv[0]);
+		return 1;
+	}
+
+	char what[64];
+	sprintf(what, "fork+exit+wait of a %d MB process", megs);
+	bench_report(what, iterations, after - before);
+
+	return 0;
+}
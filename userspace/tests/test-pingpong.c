@@ -0,0 +1,87 @@
+/* This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2014 Kevin Lange
+ */
+/*
+ * pingpong
+ *
+ * Bounces a byte between two processes over a pair of pipes,
+ * so every round trip is two context switches. With -f the
+ * parent does some floating point work between messages while
+ * the child does none, which is the case lazy FPU switching is
+ * for: the parent's FPU context should stay loaded throughout.
+ *
+ *   test-pingpong [-f] [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "lib/testing.h"
+
+static void show_fpu_stats(void) {
+	char line[256];
+	FILE * cpuinfo = fopen("/proc/cpuinfo", "r");
+	if (!cpuinfo) return;
+	while (fgets(line, sizeof(line), cpuinfo)) {
+		if (!strncmp(line, "processor", 9) || !strncmp(line, "fpu", 3)) {
+			fprintf(stderr, "  %s", line);
+		}
+	}
+	fclose(cpuinfo);
+}
+
+int main(int argc, char * argv[]) {
+	int use_fpu = 0;
+	int arg = 1;
+
+	if (argc > arg && !strcmp(argv[arg], "-f")) {
+		use_fpu = 1;
+		arg++;
+	}
+
+	int iterations = (argc > arg) ? atoi(argv[arg]) : 10000;
+
+	int ping[2], pong[2];
+	if (pipe(ping) < 0 || pipe(pong) < 0) {
+		fprintf(stderr, "%s: could not create pipes\n", argv[0]);
+		return 1;
+	}
+
+	pid_t pid = fork();
+	if (!pid) {
+		char c;
+		for (int i = 0; i < iterations; ++i) {
+			read(ping[0], &c, 1);
+			write(pong[1], &c, 1);
+		}
+		_exit(0);
+	}
+
+	fprintf(stderr, "Before:\n");
+	show_fpu_stats();
+
+	volatile double acc = 1.0;
+	unsigned long long before = bench_ns();
+
+	for (int i = 0; i < iterations; ++i) {
+		char c = 'x';
+		write(ping[1], &c, 1);
+		read(pong[0], &c, 1);
+		if (use_fpu) {
+			acc = acc * 1.0001 + 0.5;
+		}
+	}
+
+	unsigned long long after = bench_ns();
+	waitpid(pid, NULL, 0);
+
+	bench_report(use_fpu ? "round trips with FPU use" : "round trips", iterations, after - before);
+
+	fprintf(stderr, "After:\n");
+	show_fpu_stats();
+
+	return 0;
+}
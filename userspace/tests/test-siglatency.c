@@ -0,0 +1,109 @@
+/* This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2014 Kevin Lange
+ */
+/*
+ * siglatency
+ *
+ * Checks that sigprocmask() holds a signal back until it is
+ * unblocked, then bounces SIGUSR1 between two processes: each
+ * handler sends the next signal, so every round trip is two
+ * deliveries and two returns from a handler.
+ *
+ *   test-siglatency [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <syscall.h>
+#include <sys/wait.h>
+
+#include "lib/testing.h"
+
+static volatile int received = 0;
+static pid_t other;
+
+static void count(int signum) {
+	received++;
+}
+
+static void bounce(int signum) {
+	received++;
+	kill(other, SIGUSR1);
+}
+
+static int check_mask(void) {
+	struct sigaction act;
+	act.sa_handler = count;
+	act.sa_flags = 0;
+	sigemptyset(&act.sa_mask);
+	sigaction(SIGUSR2, &act, NULL);
+
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR2);
+	sigprocmask(SIG_BLOCK, &set, NULL);
+
+	kill(getpid(), SIGUSR2);
+	if (received) {
+		fprintf(stderr, "FAIL: blocked signal was delivered\n");
+		return 1;
+	}
+
+	sigprocmask(SIG_UNBLOCK, &set, NULL);
+	if (received != 1) {
+		fprintf(stderr, "FAIL: signal was not delivered when unblocked\n");
+		return 1;
+	}
+
+	fprintf(stderr, "PASS: sigprocmask holds signals until they are unblocked\n");
+	received = 0;
+	return 0;
+}
+
+int main(int argc, char * argv[]) {
+	int iterations = (argc > 1) ? atoi(argv[1]) : 10000;
+
+	if (check_mask()) {
+		return 1;
+	}
+
+	struct sigaction act;
+	act.sa_handler = bounce;
+	act.sa_flags = 0;
+	sigemptyset(&act.sa_mask);
+	sigaction(SIGUSR1, &act, NULL);
+
+	pid_t parent = getpid();
+	pid_t pid = fork();
+	if (!pid) {
+		other = parent;
+		kill(parent, SIGUSR2);
+		while (received < iterations) {
+			syscall_yield();
+		}
+		_exit(0);
+	}
+	other = pid;
+
+	/* Wait for the child to be ready */
+	while (!received) {
+		syscall_yield();
+	}
+	received = 0;
+
+	unsigned long long before = bench_ns();
+	kill(pid, SIGUSR1);
+	while (received < iterations) {
+		syscall_yield();
+	}
+	unsigned long long after = bench_ns();
+
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+
+	bench_report("signal round trips", iterations, after - before);
+
+	return 0;
+}
@@ -0,0 +1,68 @@
+/* This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2014 Kevin Lange
+ */
+/*
+ * spawn
+ *
+ * Times starting a program and waiting for it, as the shell does,
+ * with fork() and exec() and then with vfork() and exec(). The
+ * program started is this one, which exits right away when it is
+ * given "-x". A large heap makes the difference in what fork() has
+ * to copy easier to see; -m sets its size in megabytes.
+ *
+ *   test-spawn [-m megabytes] [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "lib/testing.h"
+
+int main(int argc, char * argv[]) {
+	if (argc > 1 && !strcmp(argv[1], "-x")) {
+		return 0;
+	}
+
+	int megabytes = 0;
+	int arg = 1;
+	if (argc > arg + 1 && !strcmp(argv[arg], "-m")) {
+		megabytes = atoi(argv[arg + 1]);
+		arg += 2;
+	}
+	int iterations = (argc > arg) ? atoi(argv[arg]) : 100;
+
+	if (megabytes) {
+		/* Touch it all, so fork() has real pages to share */
+		char * heap = malloc(megabytes * 1024 * 1024);
+		memset(heap, 1, megabytes * 1024 * 1024);
+	}
+
+	char * args[] = {argv[0], "-x", NULL};
+
+	unsigned long long before = bench_ns();
+	for (int i = 0; i < iterations; ++i) {
+		pid_t pid = fork();
+		if (!pid) {
+			execvp(args[0], args);
+			_exit(127);
+		}
+		waitpid(pid, NULL, 0);
+	}
+	bench_report("fork+exec+wait", iterations, bench_ns() - before);
+
+	before = bench_ns();
+	for (int i = 0; i < iterations; ++i) {
+		pid_t pid = vfork();
+		if (!pid) {
+			execvp(args[0], args);
+			_exit(127);
+		}
+		waitpid(pid, NULL, 0);
+	}
+	bench_report("vfork+exec+wait", iterations, bench_ns() - before);
+
+	return 0;
+}
@@ -0,0 +1,48 @@
+/* This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2014 Kevin Lange
+ */
+/*
+ * syscall
+ *
+ * Times a system call that does next to nothing (getpid), made
+ * through the C library, which uses SYSENTER where it can, and
+ * then made directly with int 0x7F.
+ *
+ *   test-syscall [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <syscall.h>
+#include <syscall_nums.h>
+
+#include "lib/testing.h"
+
+static int getpid_int(void) {
+	int a;
+	__asm__ __volatile__("int $0x7F" : "=a" (a) : "0" (SYS_GETPID));
+	return a;
+}
+
+int main(int argc, char * argv[]) {
+	int iterations = (argc > 1) ? atoi(argv[1]) : 1000000;
+
+	if (syscall_getpid() != getpid_int()) {
+		fprintf(stderr, "FAIL: the two entry paths disagree\n");
+		return 1;
+	}
+
+	unsigned long long before = bench_ns();
+	for (int i = 0; i < iterations; ++i) {
+		syscall_getpid();
+	}
+	bench_report("getpid() through libc", iterations, bench_ns() - before);
+
+	before = bench_ns();
+	for (int i = 0; i < iterations; ++i) {
+		getpid_int();
+	}
+	bench_report("getpid() with int 0x7F", iterations, bench_ns() - before);
+
+	return 0;
+}
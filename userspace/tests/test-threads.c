@@ -6,7 +6,7 @@
  * threadtest
  *
  * A class concurreny failure demonstration.
- * Append -l to use locks.
+ * Append -l to use spin locks, or -m to use mutexes.
  */
 #include <stdio.h>
 #include <unistd.h>
@@ -24,8 +24,10 @@
 
 volatile uint32_t result = 0;
 int8_t use_locks = 0;
+int8_t use_mutex = 0;
 
 volatile int the_lock = 0;
+pthread_mutex_t the_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 void *print_pid(void * garbage) {
 	int i;
@@ -34,6 +36,8 @@ void *print_pid(void * garbage) {
 	for (uint32_t i = 0; i < VALUE; ++i) {
 		if (use_locks) {
 			spin_lock(&the_lock);
+		} else if (use_mutex) {
+			pthread_mutex_lock(&the_mutex);
 		}
 		if (!(result & CHECKPOINT)) {
 			printf("[%d] Checkpoint: %x\n", gettid(), result);
@@ -41,6 +45,8 @@ void *print_pid(void * garbage) {
 		result++;
 		if (use_locks) {
 			spin_unlock(&the_lock);
+		} else if (use_mutex) {
+			pthread_mutex_unlock(&the_mutex);
 		}
 	}
 
@@ -51,13 +57,15 @@ int main(int argc, char * argv[]) {
 	if (argc > 1) {
 		if (!strcmp(argv[1], "-l")) {
 			use_locks = 1;
+		} else if (!strcmp(argv[1], "-m")) {
+			use_mutex = 1;
 		}
 	}
 	pthread_t thread[NUM_THREADS];
 	printf("I am the main process and my pid is %d and my tid is also %d\n", getpid(), gettid());
 
 	printf("Attempting to %s calculate %d!\n",
-			(use_locks) ? "(safely)" : "(unsafely)",
+			(use_locks || use_mutex) ? "(safely)" : "(unsafely)",
 			NUM_THREADS * VALUE);
 
 	for (int i = 0; i < NUM_THREADS; ++i) {
@@ -65,11 +73,11 @@ int main(int argc, char * argv[]) {
 	}
 
 	for (int i = 0; i < NUM_THREADS; ++i) {
-		waitpid(thread[i].id, NULL, 0);
+		pthread_join(thread[i], NULL);
 	}
 
 	printf("Done. Result of %scomputation was %d %s!!\n",
-			(use_locks) ? "" : "(definitely unsafe) ",
+			(use_locks || use_mutex) ? "" : "(definitely unsafe) ",
 			result,
 			(result == NUM_THREADS * VALUE) ? "(yay, that's right!)" : "(boo, that's wrong!)");
 